@@ -0,0 +1,111 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <stdlib.h>
+
+#include "alloc.h"
+
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+extern void *__libc_memalign(size_t alignment, size_t size);
+extern void __libc_free(void *ptr);
+
+static guint64 alloc_total = 0;
+static gint64 alloc_live = 0;
+
+static void
+alloc_count(void *ptr)
+{
+    if (ptr == NULL)
+        return;
+
+    __atomic_fetch_add(&alloc_total, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&alloc_live, 1, __ATOMIC_RELAXED);
+}
+
+guint64
+bench_alloc_total(void)
+{
+    return __atomic_load_n(&alloc_total, __ATOMIC_RELAXED);
+}
+
+gint64
+bench_alloc_live(void)
+{
+    return __atomic_load_n(&alloc_live, __ATOMIC_RELAXED);
+}
+
+void *
+malloc(size_t size)
+{
+    void *ptr = __libc_malloc(size);
+    alloc_count(ptr);
+
+    return ptr;
+}
+
+void *
+calloc(size_t nmemb, size_t size)
+{
+    void *ptr = __libc_calloc(nmemb, size);
+    alloc_count(ptr);
+
+    return ptr;
+}
+
+void *
+realloc(void *ptr, size_t size)
+{
+    // Growing a block in place or moving it counts as an allocation, but
+    // only a fresh block adds to the live ones
+    void *result = __libc_realloc(ptr, size);
+
+    if (ptr == NULL)
+        alloc_count(result);
+    else if (result != NULL)
+        __atomic_fetch_add(&alloc_total, 1, __ATOMIC_RELAXED);
+    else if (size == 0)
+        __atomic_fetch_sub(&alloc_live, 1, __ATOMIC_RELAXED);
+
+    return result;
+}
+
+void *
+memalign(size_t alignment, size_t size)
+{
+    void *ptr = __libc_memalign(alignment, size);
+    alloc_count(ptr);
+
+    return ptr;
+}
+
+void *
+aligned_alloc(size_t alignment, size_t size)
+{
+    return memalign(alignment, size);
+}
+
+int
+posix_memalign(void **memptr, size_t alignment, size_t size)
+{
+    if (alignment % sizeof(void*) != 0 || (alignment & (alignment - 1)) != 0)
+        return EINVAL;
+
+    void *ptr = memalign(alignment, size);
+    if (ptr == NULL)
+        return ENOMEM;
+
+    *memptr = ptr;
+    return 0;
+}
+
+void
+free(void *ptr)
+{
+    if (ptr == NULL)
+        return;
+
+    __atomic_fetch_sub(&alloc_live, 1, __ATOMIC_RELAXED);
+    __libc_free(ptr);
+}
@@ -0,0 +1,20 @@
+#ifndef BENCH_ALLOC_H_
+#define BENCH_ALLOC_H_
+
+#include <glib.h>
+
+/*
+ * Allocation counting for the benchmarks, glibc only.
+ *
+ * Linking alloc.c into a program replaces malloc and friends with wrappers
+ * around glibc's __libc_* entry points, everything GLib and the library
+ * allocate goes through them.
+ */
+
+// Allocations made since the program started
+guint64 bench_alloc_total(void);
+
+// Allocations that have not been freed yet
+gint64 bench_alloc_live(void);
+
+#endif // BENCH_ALLOC_H_
@@ -0,0 +1,636 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <glib.h>
+#include <glib/gstdio.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sooshi.h>
+
+#include "alloc.h"
+#include "fixtures.h"
+
+/*
+ * Microbenchmarks, run with "make bench".
+ *
+ * Every benchmark is calibrated to run for at least BENCH_MIN_TIME_US, then
+ * repeated BENCH_REPETITIONS times; the fastest repetition is reported.
+ * A human readable table goes to stderr, JSON to stdout:
+ *
+ *   ./bench/bench [filter] > results.json
+ *
+ * The codec benchmarks run on SOOSHI_BENCH_ARCHIVE, an archive directory
+ * recorded with sooshi_archiver_new(), if set. Otherwise the session in
+ * BENCH_CAPTURE is replayed into a temporary archive, and only if that
+ * fails they fall back to a synthetic recording.
+ */
+#define BENCH_MIN_TIME_US  50000
+#define BENCH_REPETITIONS  5
+
+// Two hours of CH1 and CH2 in the format of sooshi_capture_start(), set by the Makefile
+#ifndef BENCH_CAPTURE
+#define BENCH_CAPTURE "meter.cap"
+#endif
+
+/* Benchmark driver */
+typedef void (*bench_func_t)(gpointer data, guint64 iterations);
+
+typedef struct
+{
+    gchar *name;
+    guint64 iterations;
+    gdouble ns_per_op;
+    gdouble allocs_per_op;
+    gdouble mb_per_s;
+} BenchResult;
+
+typedef struct
+{
+    const gchar *source;
+    guint64 rows;
+    guint64 raw_bytes;
+    guint64 compressed_bytes;
+} BenchCompression;
+
+static GArray *bench_results = NULL;
+static BenchCompression bench_compression = { NULL };
+static const gchar *bench_filter = NULL;
+
+// Keeps the compiler from optimizing away results nobody looks at
+static volatile gconstpointer bench_sink;
+
+static gint64
+bench_now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (gint64)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// bytes is how much data one iteration processes, 0 if throughput doesn't matter
+static void
+bench_run_bytes(const gchar *name, bench_func_t func, gpointer data, gsize bytes)
+{
+    if (bench_filter && strstr(name, bench_filter) == NULL)
+        return;
+
+    // Warm up and find an iteration count worth measuring
+    guint64 iterations = 1;
+    for (;;)
+    {
+        gint64 started = bench_now_ns();
+        func(data, iterations);
+
+        if (bench_now_ns() - started >= BENCH_MIN_TIME_US * 1000)
+            break;
+
+        iterations *= 2;
+    }
+
+    BenchResult result = { g_strdup(name), iterations, G_MAXDOUBLE, G_MAXDOUBLE, 0 };
+
+    for (guint i = 0; i < BENCH_REPETITIONS; ++i)
+    {
+        guint64 allocations = bench_alloc_total();
+        gint64 started = bench_now_ns();
+
+        func(data, iterations);
+
+        gint64 elapsed = bench_now_ns() - started;
+        allocations = bench_alloc_total() - allocations;
+
+        result.ns_per_op = MIN(result.ns_per_op, (gdouble)elapsed / iterations);
+        result.allocs_per_op = MIN(result.allocs_per_op, (gdouble)allocations / iterations);
+    }
+
+    if (bytes > 0)
+        result.mb_per_s = bytes / result.ns_per_op * 1000;
+
+    fprintf(stderr, "%-44s %12.1f ns/op %8.2f allocs/op", result.name, result.ns_per_op, result.allocs_per_op);
+    fprintf(stderr, bytes > 0 ? " %8.1f MB/s\n" : "\n", result.mb_per_s);
+    g_array_append_val(bench_results, result);
+}
+
+static void
+bench_run(const gchar *name, bench_func_t func, gpointer data)
+{
+    bench_run_bytes(name, func, data, 0);
+}
+
+static void
+bench_print_json(void)
+{
+    printf("{\n  \"benchmarks\": [\n");
+
+    for (guint i = 0; i < bench_results->len; ++i)
+    {
+        BenchResult *result = &g_array_index(bench_results, BenchResult, i);
+
+        printf("    { \"name\": \"%s\", \"iterations\": %" G_GUINT64_FORMAT
+               ", \"ns_per_op\": %.2f, \"allocs_per_op\": %.2f, \"mb_per_s\": %.1f }%s\n",
+               result->name, result->iterations, result->ns_per_op, result->allocs_per_op, result->mb_per_s,
+               i + 1 < bench_results->len ? "," : "");
+
+        g_free(result->name);
+    }
+
+    printf("  ]");
+
+    if (bench_compression.source)
+        printf(",\n  \"compression\": { \"source\": \"%s\", \"rows\": %" G_GUINT64_FORMAT
+               ", \"raw_bytes\": %" G_GUINT64_FORMAT ", \"compressed_bytes\": %" G_GUINT64_FORMAT
+               ", \"ratio\": %.2f }",
+               bench_compression.source, bench_compression.rows, bench_compression.raw_bytes,
+               bench_compression.compressed_bytes, (gdouble)bench_compression.raw_bytes / bench_compression.compressed_bytes);
+
+    printf("\n}\n");
+}
+
+/* An offline state, sends are dropped since there is no serial in */
+static SooshiState *
+bench_state_new(gboolean with_tree)
+{
+    SooshiState *state = g_object_new(SOOSHI_TYPE_STATE, NULL);
+
+    if (with_tree)
+    {
+        state->buffer = g_byte_array_append(state->buffer, sooshi_fixture_tree, sizeof(sooshi_fixture_tree));
+        sooshi_parse_response(state);
+    }
+
+    return state;
+}
+
+static guchar
+bench_op_code(SooshiState *state, const gchar *path)
+{
+    SooshiNode *node = sooshi_node_find(state, (gchar*)path, NULL);
+    g_assert(node != NULL);
+
+    return node->op_code;
+}
+
+/* sooshi_node_bytes_to_value() */
+typedef struct
+{
+    const gchar *name;
+    SOOSHI_NODE_TYPE type;
+    guint8 frame[8];
+    gsize length;
+} BenchDecode;
+
+static void
+bench_decode(gpointer data, guint64 iterations)
+{
+    BenchDecode *decode = data;
+    SooshiNode node = { 0 };
+    node.type = decode->type;
+
+    GByteArray *buffer = g_byte_array_sized_new(64);
+
+    for (guint64 i = 0; i < iterations; ++i)
+    {
+        GVariant *value = NULL;
+
+        g_byte_array_append(buffer, decode->frame, decode->length);
+        buffer = sooshi_node_bytes_to_value(&node, buffer, &value);
+        g_variant_unref(value);
+    }
+
+    g_byte_array_unref(buffer);
+}
+
+/* sooshi_parse_response() on the tree */
+static void
+bench_parse_tree(gpointer data, guint64 iterations)
+{
+    SooshiState *state = data;
+
+    for (guint64 i = 0; i < iterations; ++i)
+    {
+        // What sooshi_reload_tree() does before the new tree arrives
+        sooshi_node_free_all(state, NULL);
+        g_ptr_array_set_size(state->op_code_map, 0);
+
+        state->buffer = g_byte_array_append(state->buffer, sooshi_fixture_tree, sizeof(sooshi_fixture_tree));
+        sooshi_parse_response(state);
+    }
+}
+
+/* sooshi_parse_response() on a stream of value frames */
+typedef struct
+{
+    SooshiState *state;
+    GByteArray *stream;
+} BenchStream;
+
+static void
+bench_stream_append_float(BenchStream *stream, const gchar *path, float value)
+{
+    guint8 op_code = bench_op_code(stream->state, path);
+
+    g_byte_array_append(stream->stream, &op_code, 1);
+    g_byte_array_append(stream->stream, (const guint8*)&value, sizeof(value));
+}
+
+static void
+bench_parse_stream(gpointer data, guint64 iterations)
+{
+    BenchStream *stream = data;
+
+    for (guint64 i = 0; i < iterations; ++i)
+    {
+        stream->state->buffer = g_byte_array_append(stream->state->buffer, stream->stream->data, stream->stream->len);
+        sooshi_parse_response(stream->state);
+    }
+}
+
+/* sooshi_node_find() */
+typedef struct
+{
+    SooshiState *state;
+    const gchar *path;
+} BenchFind;
+
+static void
+bench_find(gpointer data, guint64 iterations)
+{
+    BenchFind *find = data;
+
+    for (guint64 i = 0; i < iterations; ++i)
+        bench_sink = sooshi_node_find(find->state, (gchar*)find->path, NULL);
+}
+
+/* sooshi_crc32_calculate() */
+typedef struct
+{
+    SooshiState *state;
+    guint8 *data;
+    gint length;
+} BenchCrc;
+
+static void
+bench_crc(gpointer data, guint64 iterations)
+{
+    BenchCrc *crc = data;
+    crc32_t checksum = 0;
+
+    for (guint64 i = 0; i < iterations; ++i)
+        checksum ^= sooshi_crc32_calculate(crc->state, crc->data, crc->length);
+
+    bench_sink = GUINT_TO_POINTER(checksum);
+}
+
+/* sooshi_build_frame(), everything sooshi_send_bytes() does short of D-Bus */
+typedef struct
+{
+    SooshiState *state;
+    guchar frame[20];
+    gsize length;
+} BenchFrame;
+
+static void
+bench_frame(gpointer data, guint64 iterations)
+{
+    BenchFrame *frame = data;
+
+    for (guint64 i = 0; i < iterations; ++i)
+        g_variant_unref(g_variant_ref_sink(sooshi_build_frame(frame->state, frame->frame, frame->length)));
+}
+
+/* sooshi_codec_encode_block() and sooshi_codec_decode_block() */
+typedef struct
+{
+    SooshiArchive *archive;
+    SooshiArchive synthetic;
+    GByteArray *blocks;
+    GArray *offsets;
+    GByteArray *scratch;
+
+    gint64 *timestamps;
+    gdouble *values[2];
+} BenchCodec;
+
+// What CH1 and CH2 look like when logging a DC current and mains voltage
+// at 8 samples per second over BLE: jittery timestamps, float readings with
+// a few digits of noise
+static void
+bench_codec_synthesize(BenchCodec *codec, guint64 rows)
+{
+    static const gchar *names[] = { "CH1:VALUE", "CH2:VALUE", NULL };
+    SooshiArchive *archive = &codec->synthetic;
+    GRand *rand = g_rand_new_with_seed(42);
+
+    archive->columns = 2;
+    archive->names = (gchar**)names;
+    archive->rows = rows;
+
+    gint64 *timestamps = g_new(gint64, rows);
+    gdouble **values = g_new(gdouble*, 2);
+    values[0] = g_new(gdouble, rows);
+    values[1] = g_new(gdouble, rows);
+
+    gint64 timestamp = 1500000000000000;
+    for (guint64 i = 0; i < rows; ++i)
+    {
+        timestamp += 125000 + g_rand_int_range(rand, -1500, 1500);
+        timestamps[i] = timestamp;
+
+        values[0][i] = (float)(0.250 + g_rand_int_range(rand, -20, 20) * 1e-5);
+        values[1][i] = (float)(230.0 + 1.5 * sin(i / 5000.0) + g_rand_int_range(rand, -5, 5) * 1e-2);
+    }
+
+    archive->timestamps = timestamps;
+    archive->values = (const gdouble**)values;
+    codec->archive = archive;
+
+    g_rand_free(rand);
+}
+
+static void
+bench_codec_remove(const gchar *path)
+{
+    GDir *dir = g_dir_open(path, 0, NULL);
+    const gchar *name;
+
+    while (dir && (name = g_dir_read_name(dir)) != NULL)
+    {
+        gchar *file = g_build_filename(path, name, NULL);
+        g_remove(file);
+        g_free(file);
+    }
+
+    if (dir)
+        g_dir_close(dir);
+    g_rmdir(path);
+}
+
+// Archives CH1 and CH2 of a captured session the way a live one would be
+static SooshiArchive *
+bench_codec_replay(const gchar *capture, gchar **path)
+{
+    static const gchar *nodes[] = { "CH1:VALUE", "CH2:VALUE", NULL };
+
+    *path = g_dir_make_tmp("sooshi-bench-XXXXXX", NULL);
+    if (*path == NULL)
+        return NULL;
+
+    // The capture starts with the same tree, the archiver's subscriptions survive it
+    SooshiState *state = bench_state_new(TRUE);
+    SooshiArchiver *archiver = sooshi_archiver_new(state, *path, nodes, 0, 0, NULL);
+    sooshi_error_t error = SOOSHI_ERROR_CAPTURE_FAILED;
+
+    if (archiver)
+    {
+        error = sooshi_replay(state, capture, 0, NULL);
+        sooshi_archiver_free(archiver);
+    }
+
+    g_object_unref(state);
+
+    SooshiArchive *archive = error == SOOSHI_ERROR_SUCCESS ? sooshi_archive_open(*path, NULL) : NULL;
+    if (archive == NULL || archive->rows == 0)
+    {
+        if (archive)
+            sooshi_archive_close(archive);
+
+        bench_codec_remove(*path);
+        g_free(*path);
+        *path = NULL;
+        return NULL;
+    }
+
+    return archive;
+}
+
+static guint64
+bench_codec_raw_bytes(BenchCodec *codec, guint64 rows)
+{
+    return rows * sizeof(gint64) * (1 + codec->archive->columns);
+}
+
+static void
+bench_codec_encode(gpointer data, guint64 iterations)
+{
+    BenchCodec *codec = data;
+    SooshiArchive *archive = codec->archive;
+    const gdouble *values[2];
+
+    for (guint64 i = 0; i < iterations; ++i)
+    {
+        guint64 first = (i % (codec->offsets->len - 1)) * SOOSHI_CODEC_BLOCK_ROWS;
+        guint rows = MIN(SOOSHI_CODEC_BLOCK_ROWS, archive->rows - first);
+
+        for (guint c = 0; c < archive->columns; ++c)
+            values[c] = archive->values[c] + first;
+
+        g_byte_array_set_size(codec->scratch, 0);
+        sooshi_codec_encode_block(archive->timestamps + first, values, archive->columns, rows, codec->scratch);
+    }
+}
+
+static void
+bench_codec_decode(gpointer data, guint64 iterations)
+{
+    BenchCodec *codec = data;
+    const guint8 *blocks = codec->blocks->data;
+    guint count = codec->offsets->len - 1;
+
+    for (guint64 i = 0; i < iterations; ++i)
+    {
+        guint block = i % count;
+        guint offset = g_array_index(codec->offsets, guint, block);
+        guint length = g_array_index(codec->offsets, guint, block + 1) - offset;
+
+        sooshi_codec_decode_block(blocks + offset, length, codec->archive->columns, SOOSHI_CODEC_BLOCK_ROWS,
+                codec->timestamps, codec->values);
+    }
+}
+
+static void
+bench_codec(void)
+{
+    if (bench_filter && strstr("codec/decode_block", bench_filter) == NULL
+            && strstr("codec/encode_block", bench_filter) == NULL)
+        return;
+
+    BenchCodec codec = { 0 };
+    SooshiArchive *recorded = NULL;
+    gchar *replayed = NULL;
+    const gchar *path = g_getenv("SOOSHI_BENCH_ARCHIVE");
+
+    if (path && (recorded = sooshi_archive_open(path, NULL)) != NULL && recorded->columns <= 2 && recorded->rows > 0)
+        bench_compression.source = path;
+    else
+    {
+        if (recorded)
+            sooshi_archive_close(recorded);
+
+        if ((recorded = bench_codec_replay(BENCH_CAPTURE, &replayed)) != NULL)
+            bench_compression.source = BENCH_CAPTURE;
+    }
+
+    if (recorded)
+        codec.archive = recorded;
+    else
+    {
+        g_warning("No capture to replay at '%s', benchmarking the codec on synthetic data", BENCH_CAPTURE);
+        bench_codec_synthesize(&codec, 1 << 20);
+        bench_compression.source = "synthetic";
+    }
+
+    SooshiArchive *archive = codec.archive;
+    const gdouble *values[2];
+
+    // Compress everything once for the ratio and the blocks to decode
+    codec.blocks = g_byte_array_new();
+    codec.offsets = g_array_new(FALSE, FALSE, sizeof(guint));
+
+    for (guint64 first = 0; first < archive->rows; first += SOOSHI_CODEC_BLOCK_ROWS)
+    {
+        guint offset = codec.blocks->len;
+        g_array_append_val(codec.offsets, offset);
+
+        for (guint c = 0; c < archive->columns; ++c)
+            values[c] = archive->values[c] + first;
+
+        sooshi_codec_encode_block(archive->timestamps + first, values, archive->columns,
+                MIN(SOOSHI_CODEC_BLOCK_ROWS, archive->rows - first), codec.blocks);
+    }
+
+    guint end = codec.blocks->len;
+    g_array_append_val(codec.offsets, end);
+
+    bench_compression.rows = archive->rows;
+    bench_compression.raw_bytes = bench_codec_raw_bytes(&codec, archive->rows);
+    bench_compression.compressed_bytes = codec.blocks->len;
+
+    fprintf(stderr, "%-44s %12" G_GUINT64_FORMAT " rows %8.2f : 1\n", "codec/ratio", bench_compression.rows,
+            (gdouble)bench_compression.raw_bytes / bench_compression.compressed_bytes);
+
+    codec.timestamps = g_new(gint64, SOOSHI_CODEC_BLOCK_ROWS);
+    codec.values[0] = g_new(gdouble, SOOSHI_CODEC_BLOCK_ROWS);
+    codec.values[1] = g_new(gdouble, SOOSHI_CODEC_BLOCK_ROWS);
+
+    gsize block_bytes = bench_codec_raw_bytes(&codec, MIN(SOOSHI_CODEC_BLOCK_ROWS, archive->rows));
+    codec.scratch = g_byte_array_new();
+
+    bench_run_bytes("codec/encode_block", bench_codec_encode, &codec, block_bytes);
+    bench_run_bytes("codec/decode_block", bench_codec_decode, &codec, block_bytes);
+
+    g_free(codec.timestamps);
+    g_free(codec.values[0]);
+    g_free(codec.values[1]);
+    g_byte_array_unref(codec.blocks);
+    g_byte_array_unref(codec.scratch);
+    g_array_unref(codec.offsets);
+
+    if (recorded)
+        sooshi_archive_close(recorded);
+    else
+    {
+        g_free((gpointer)archive->timestamps);
+        g_free((gpointer)archive->values[0]);
+        g_free((gpointer)archive->values[1]);
+        g_free(archive->values);
+    }
+
+    if (replayed)
+    {
+        bench_codec_remove(replayed);
+        g_free(replayed);
+    }
+}
+
+int
+main(int argc, char *argv[])
+{
+    bench_filter = argc > 1 ? argv[1] : NULL;
+    bench_results = g_array_new(FALSE, FALSE, sizeof(BenchResult));
+
+    SooshiState *state = bench_state_new(TRUE);
+
+    float flt = 1.25f;
+    BenchDecode decodes[] = {
+        { "decode/CHOOSER", CHOOSER, { 0x00, 0x03 }, 2 },
+        { "decode/VAL_U8",  VAL_U8,  { 0x00, 0xab }, 2 },
+        { "decode/VAL_U16", VAL_U16, { 0x00, 0x34, 0x12 }, 3 },
+        { "decode/VAL_U32", VAL_U32, { 0x00, 0x78, 0x56, 0x34, 0x12 }, 5 },
+        { "decode/VAL_S8",  VAL_S8,  { 0x00, 0xfe }, 2 },
+        { "decode/VAL_S16", VAL_S16, { 0x00, 0xfe, 0xff }, 3 },
+        { "decode/VAL_S32", VAL_S32, { 0x00, 0xfe, 0xff, 0xff, 0xff }, 5 },
+        { "decode/VAL_STR", VAL_STR, { 0x00, 0x05, 0x00, 'h', 'e', 'l', 'l', 'o' }, 8 },
+        { "decode/VAL_BIN", VAL_BIN, { 0x00, 0x04, 0x00, 0x01, 0x02, 0x03, 0x04 }, 7 },
+        { "decode/VAL_FLT", VAL_FLT, { 0x00 }, 5 },
+    };
+    memcpy(decodes[G_N_ELEMENTS(decodes) - 1].frame + 1, &flt, sizeof(flt));
+
+    for (guint i = 0; i < G_N_ELEMENTS(decodes); ++i)
+        bench_run(decodes[i].name, bench_decode, &decodes[i]);
+
+    SooshiState *tree_state = bench_state_new(TRUE);
+    bench_run("parse/tree", bench_parse_tree, tree_state);
+    sooshi_state_delete(tree_state);
+
+    // What a streaming meter sends, plus some configuration traffic
+    BenchStream stream = { state, g_byte_array_new() };
+    bench_stream_append_float(&stream, "CH1:VALUE", 1.5f);
+    bench_stream_append_float(&stream, "CH2:VALUE", 230.0f);
+    bench_run("parse/stream_2_values", bench_parse_stream, &stream);
+
+    guint8 rate[] = { bench_op_code(state, "SAMPLING:RATE"), 0x03 };
+    guint8 interval[] = { bench_op_code(state, "LOG:INTERVAL"), 0x10, 0x00 };
+    guint8 name[] = { bench_op_code(state, "NAME"), 0x05, 0x00, 'b', 'e', 'n', 'c', 'h' };
+    g_byte_array_append(stream.stream, rate, sizeof(rate));
+    g_byte_array_append(stream.stream, interval, sizeof(interval));
+    g_byte_array_append(stream.stream, name, sizeof(name));
+    bench_stream_append_float(&stream, "BAT_V", 2.9f);
+    bench_run("parse/stream_6_mixed", bench_parse_stream, &stream);
+    g_byte_array_unref(stream.stream);
+
+    const gchar *paths[] = {
+        "BAT_V",
+        "SAMPLING:TRIGGER",
+        "CH1:MAPPING:CURRENT:10",
+        "SHARED:RESISTANCE:10000000.0",
+    };
+    for (guint i = 0; i < G_N_ELEMENTS(paths); ++i)
+    {
+        gchar *bench_name = g_strdup_printf("find/%s", paths[i]);
+        BenchFind find = { state, paths[i] };
+        bench_run(bench_name, bench_find, &find);
+        g_free(bench_name);
+    }
+
+    gint sizes[] = { 20, 372, 4096, 65536 };
+    for (guint i = 0; i < G_N_ELEMENTS(sizes); ++i)
+    {
+        gchar *bench_name = g_strdup_printf("crc32/%d", sizes[i]);
+        BenchCrc crc = { state, g_malloc(sizes[i]), sizes[i] };
+
+        for (gint j = 0; j < sizes[i]; ++j)
+            crc.data[j] = j * 31;
+
+        bench_run(bench_name, bench_crc, &crc);
+        g_free(crc.data);
+        g_free(bench_name);
+    }
+
+    BenchFrame read = { state, { bench_op_code(state, "CH1:VALUE") }, 1 };
+    bench_run("send/frame_1", bench_frame, &read);
+
+    BenchFrame write = { state, { bench_op_code(state, "NAME") | 0x80, 16, 0 }, 19 };
+    bench_run("send/frame_19", bench_frame, &write);
+
+    sooshi_state_delete(state);
+
+    bench_codec();
+
+    bench_print_json();
+    g_array_unref(bench_results);
+
+    return 0;
+}
@@ -0,0 +1,345 @@
+#define _XOPEN_SOURCE 700
+
+#include <glib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sooshi.h>
+
+#include "alloc.h"
+#include "fixtures.h"
+
+/*
+ * Soak and scale harness, run with "make soak".
+ *
+ * Drives a number of simulated meters through the real notification, parse
+ * and dispatch code: every meter gets the tree, the CRC echo and then a
+ * CH1:VALUE/CH2:VALUE notification per sample. Simulated time is compressed,
+ * by default the samples are pushed as fast as the CPU allows.
+ *
+ * Every --churn simulated seconds each meter drops and adds a subscriber,
+ * every --reload seconds it downloads its tree again. Every other reload
+ * pretends the tree changed, as after a firmware update, so it is parsed
+ * and merged into the current one; the others find it unchanged and keep
+ * what they have. Live allocations are sampled right after every reload,
+ * when all meters are in the same place, and must not grow between the
+ * first and the last reload. The exit status is 1 if they do.
+ *
+ * Progress goes to stderr, a JSON summary to stdout.
+ */
+static gint opt_meters = 8;
+static gint opt_rate = 125;
+static gint opt_duration = 3600;
+static gdouble opt_speed = 0;
+static gint opt_churn = 10;
+static gint opt_reload = 300;
+static gint opt_report = 600;
+static gint opt_leak_tolerance = 64;
+
+static GOptionEntry soak_options[] = {
+    { "meters", 'n', 0, G_OPTION_ARG_INT, &opt_meters, "Number of simulated meters (8)", "N" },
+    { "rate", 'r', 0, G_OPTION_ARG_INT, &opt_rate, "Samples per second and meter (125)", "HZ" },
+    { "duration", 'd', 0, G_OPTION_ARG_INT, &opt_duration, "Simulated seconds to run (3600)", "S" },
+    { "speed", 's', 0, G_OPTION_ARG_DOUBLE, &opt_speed, "Simulated seconds per real second, 0 for as fast as possible (0)", "X" },
+    { "churn", 'c', 0, G_OPTION_ARG_INT, &opt_churn, "Replace a subscriber every S simulated seconds (10)", "S" },
+    { "reload", 'l', 0, G_OPTION_ARG_INT, &opt_reload, "Reload the tree every S simulated seconds (300)", "S" },
+    { "report", 'p', 0, G_OPTION_ARG_INT, &opt_report, "Print progress every S simulated seconds (600)", "S" },
+    { "leak-tolerance", 0, 0, G_OPTION_ARG_INT, &opt_leak_tolerance, "Live allocations the run may gain (64)", "N" },
+    { NULL }
+};
+
+typedef struct
+{
+    SooshiState *state;
+    guint8 sequence;
+
+    SooshiNode *ch1;
+    SooshiNode *ch2;
+    guint churn_subscriber;
+
+    // When the notification being dispatched was handed over, in ns
+    gint64 received;
+    guint64 samples;
+} SoakMeter;
+
+typedef struct
+{
+    gint64 real_ns;
+    gint64 cpu_ns;
+    glong rss_kb;
+    gint64 live_allocations;
+    guint64 allocations;
+} SoakSnapshot;
+
+// Time from handing a notification to the library to the subscriber call, in ns
+static SooshiHistogram soak_latency;
+
+static gint64
+soak_now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (gint64)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static glong
+soak_rss_kb(void)
+{
+    glong size = 0, resident = 0;
+    FILE *statm = fopen("/proc/self/statm", "r");
+
+    if (statm == NULL)
+        return 0;
+
+    if (fscanf(statm, "%ld %ld", &size, &resident) != 2)
+        resident = 0;
+
+    fclose(statm);
+
+    return resident * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+static void
+soak_snapshot(SoakSnapshot *snapshot)
+{
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+
+    snapshot->real_ns = soak_now_ns();
+    snapshot->cpu_ns = ((gint64)usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * 1000000000
+        + ((gint64)usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) * 1000;
+    snapshot->rss_kb = soak_rss_kb();
+    snapshot->live_allocations = bench_alloc_live();
+    snapshot->allocations = bench_alloc_total();
+}
+
+static void
+soak_notify(SoakMeter *meter, const guint8 *data, gsize len)
+{
+    meter->received = soak_now_ns();
+    sooshi_receive_notification(meter->state, meter->sequence++, data, len);
+}
+
+static void
+soak_on_value(SooshiState *state, SooshiNode *node, gpointer user_data)
+{
+    SoakMeter *meter = user_data;
+
+    sooshi_histogram_record(&soak_latency, soak_now_ns() - meter->received);
+    meter->samples++;
+}
+
+static void
+soak_on_churn_value(SooshiState *state, SooshiNode *node, gpointer user_data)
+{
+}
+
+static void
+soak_on_initialized(SooshiState *state, gpointer user_data)
+{
+    SoakMeter *meter = user_data;
+
+    // Called again after every reload, node handles and subscriptions survive those
+    if (meter->ch1 != NULL)
+        return;
+
+    meter->ch1 = sooshi_node_find(state, "CH1:VALUE", NULL);
+    meter->ch2 = sooshi_node_find(state, "CH2:VALUE", NULL);
+    g_assert(meter->ch1 != NULL && meter->ch2 != NULL);
+
+    sooshi_node_subscribe(state, meter->ch1, soak_on_value, meter);
+    sooshi_node_subscribe(state, meter->ch2, soak_on_value, meter);
+    meter->churn_subscriber = 0;
+}
+
+// What the meter sends after being asked for its tree, ending with the CRC echo
+static void
+soak_send_tree(SoakMeter *meter)
+{
+    for (gsize offset = 0; offset < sizeof(sooshi_fixture_tree); offset += 19)
+        soak_notify(meter, sooshi_fixture_tree + offset, MIN(19, sizeof(sooshi_fixture_tree) - offset));
+
+    crc32_t crc = meter->state->tree_crc;
+    guint8 echo[] = { 0x00, crc, crc >> 8, crc >> 16, crc >> 24 };
+    soak_notify(meter, echo, sizeof(echo));
+
+    g_assert(meter->state->initialized);
+}
+
+static void
+soak_send_sample(SoakMeter *meter, guint64 tick)
+{
+    float ch1 = (tick % 1000) / 1000.0f;
+    float ch2 = 230.0f + (tick % 7);
+
+    guint8 frame[10] = { meter->ch1->op_code };
+    memcpy(frame + 1, &ch1, sizeof(ch1));
+    frame[5] = meter->ch2->op_code;
+    memcpy(frame + 6, &ch2, sizeof(ch2));
+
+    soak_notify(meter, frame, sizeof(frame));
+}
+
+static void
+soak_churn(SoakMeter *meter)
+{
+    if (meter->churn_subscriber > 0)
+        sooshi_node_unsubscribe(meter->state, meter->ch2, meter->churn_subscriber);
+
+    meter->churn_subscriber = sooshi_node_subscribe(meter->state, meter->ch2, soak_on_churn_value, meter);
+}
+
+static void
+soak_report(guint64 simulated, const SoakSnapshot *start, const SoakSnapshot *now)
+{
+    gdouble cpu_per_meter = (gdouble)(now->cpu_ns - start->cpu_ns) / (simulated * 1e9) / opt_meters * 100.0;
+
+    fprintf(stderr, "%6" G_GUINT64_FORMAT "s  cpu/meter %6.3f%%  rss %7ld kB (%+ld)  live allocs %8" G_GINT64_FORMAT
+            "  latency p50 %6" G_GUINT64_FORMAT " p99 %6" G_GUINT64_FORMAT " p99.9 %6" G_GUINT64_FORMAT " ns\n",
+            simulated, cpu_per_meter, now->rss_kb, now->rss_kb - start->rss_kb, now->live_allocations,
+            sooshi_histogram_percentile(&soak_latency, 50),
+            sooshi_histogram_percentile(&soak_latency, 99),
+            sooshi_histogram_percentile(&soak_latency, 99.9));
+}
+
+int
+main(int argc, char *argv[])
+{
+    GError *error = NULL;
+    GOptionContext *context = g_option_context_new("- soak test the parse and dispatch path");
+    g_option_context_add_main_entries(context, soak_options, NULL);
+
+    if (!g_option_context_parse(context, &argc, &argv, &error))
+    {
+        fprintf(stderr, "%s\n", error->message);
+        g_error_free(error);
+        return 2;
+    }
+
+    g_option_context_free(context);
+
+    if (opt_meters < 1 || opt_rate < 1 || opt_duration < 1 || opt_churn < 1 || opt_reload < 1 || opt_report < 1)
+    {
+        fprintf(stderr, "All counts and intervals must be positive\n");
+        return 2;
+    }
+
+    SoakMeter *meters = g_new0(SoakMeter, opt_meters);
+
+    for (gint i = 0; i < opt_meters; ++i)
+    {
+        // Offline states, everything they send is dropped
+        SoakMeter *meter = &meters[i];
+        meter->state = g_object_new(SOOSHI_TYPE_STATE, NULL);
+        meter->state->context = g_main_context_new();
+        meter->state->init_handler = soak_on_initialized;
+        meter->state->init_handler_data = meter;
+
+        soak_send_tree(meter);
+    }
+
+    SoakSnapshot start, now, baseline = { 0 };
+    soak_snapshot(&start);
+
+    guint reloads = 0;
+    guint64 tick = 0;
+
+    for (guint64 second = 1; second <= (guint64)opt_duration; ++second)
+    {
+        for (gint sample = 0; sample < opt_rate; ++sample, ++tick)
+        {
+            if (opt_speed > 0)
+            {
+                gint64 due = start.real_ns + (gint64)(tick * (1e9 / opt_rate) / opt_speed);
+                gint64 ahead = due - soak_now_ns();
+
+                if (ahead > 0)
+                    g_usleep(ahead / 1000);
+            }
+
+            for (gint i = 0; i < opt_meters; ++i)
+                soak_send_sample(&meters[i], tick);
+        }
+
+        if (second % opt_churn == 0)
+            for (gint i = 0; i < opt_meters; ++i)
+                soak_churn(&meters[i]);
+
+        if (second % opt_reload == 0)
+        {
+            // The fixture has only one tree, a CRC that no longer matches it makes it a new one
+            for (gint i = 0; i < opt_meters; ++i)
+            {
+                if (reloads % 2 == 0)
+                    meters[i].state->tree_crc ^= 1;
+
+                sooshi_reload_tree(meters[i].state);
+                soak_send_tree(&meters[i]);
+            }
+
+            // The first reload warms up GLib's caches, later ones must end up where it did
+            soak_snapshot(&now);
+            if (reloads++ == 0)
+                baseline = now;
+        }
+
+        if (second % opt_report == 0)
+        {
+            soak_snapshot(&now);
+            soak_report(second, &start, &now);
+        }
+    }
+
+    soak_snapshot(&now);
+
+    guint64 samples = 0;
+    for (gint i = 0; i < opt_meters; ++i)
+        samples += meters[i].samples;
+
+    gdouble real_s = (now.real_ns - start.real_ns) / 1e9;
+    gdouble cpu_per_meter = (gdouble)(now.cpu_ns - start.cpu_ns) / (opt_duration * 1e9) / opt_meters * 100.0;
+    guint64 notifications = (guint64)opt_duration * opt_rate * opt_meters;
+
+    gint64 leaked = 0;
+    gboolean leak_checked = reloads >= 2;
+    if (leak_checked)
+        leaked = now.live_allocations - baseline.live_allocations;
+
+    soak_report(opt_duration, &start, &now);
+
+    if (!leak_checked)
+        fprintf(stderr, "Not checking for leaks, the run needs at least two tree reloads\n");
+    else if (leaked > opt_leak_tolerance)
+        fprintf(stderr, "FAIL: %" G_GINT64_FORMAT " allocations leaked between the first and the last reload\n", leaked);
+
+    printf("{\n"
+           "  \"meters\": %d, \"rate_hz\": %d, \"simulated_s\": %d, \"real_s\": %.3f,\n"
+           "  \"samples\": %" G_GUINT64_FORMAT ", \"reloads\": %u,\n"
+           "  \"cpu_percent_per_meter\": %.4f, \"meters_per_core\": %.0f,\n"
+           "  \"rss_kb\": %ld, \"rss_growth_kb\": %ld,\n"
+           "  \"allocs_per_notification\": %.2f, \"allocs_per_s\": %.0f,\n"
+           "  \"live_allocations\": %" G_GINT64_FORMAT ", \"leaked_allocations\": %" G_GINT64_FORMAT ",\n"
+           "  \"latency_ns\": { \"p50\": %" G_GUINT64_FORMAT ", \"p99\": %" G_GUINT64_FORMAT
+           ", \"p99_9\": %" G_GUINT64_FORMAT ", \"max\": %" G_GUINT64_FORMAT " }\n"
+           "}\n",
+           opt_meters, opt_rate, opt_duration, real_s,
+           samples, reloads,
+           cpu_per_meter, cpu_per_meter > 0 ? 100.0 / cpu_per_meter : 0.0,
+           now.rss_kb, now.rss_kb - start.rss_kb,
+           (gdouble)(now.allocations - start.allocations) / notifications,
+           (now.allocations - start.allocations) / real_s,
+           now.live_allocations, leaked,
+           sooshi_histogram_percentile(&soak_latency, 50),
+           sooshi_histogram_percentile(&soak_latency, 99),
+           sooshi_histogram_percentile(&soak_latency, 99.9),
+           soak_latency.max);
+
+    for (gint i = 0; i < opt_meters; ++i)
+        sooshi_state_delete(meters[i].state);
+    g_free(meters);
+
+    return (leak_checked && leaked > opt_leak_tolerance) ? 1 : 0;
+}
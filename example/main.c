@@ -34,9 +34,11 @@ void mooshi_initialized(SooshiState *state, gpointer user_data)
     //sooshi_node_subscribe(state, sooshi_node_find(state, "CH1:VALUE", NULL), channel1_update, NULL);
     sooshi_node_subscribe(state, sooshi_node_find(state, "CH2:VALUE", NULL), channel2_update, NULL);
 
-    sooshi_node_choose(state, sooshi_node_find(state, "SAMPLING:TRIGGER:CONTINUOUS", NULL));
-    sooshi_node_choose(state, sooshi_node_find(state, "SAMPLING:RATE:1000", NULL));
-    //sooshi_node_choose(state, sooshi_node_find(state, "CH2:MAPPING:TEMP:350", NULL));
+    SooshiTransaction *transaction = sooshi_transaction_begin(state);
+    sooshi_transaction_choose(transaction, sooshi_node_find(state, "SAMPLING:TRIGGER:CONTINUOUS", NULL));
+    sooshi_transaction_choose(transaction, sooshi_node_find(state, "SAMPLING:RATE:1000", NULL));
+    //sooshi_transaction_choose(transaction, sooshi_node_find(state, "CH2:MAPPING:TEMP:350", NULL));
+    sooshi_transaction_commit(transaction, NULL, NULL);
 }
 
 void bt_scan_timeout(SooshiState *state, gpointer user_data)
@@ -58,6 +60,10 @@ int main()
         return -1;
     }
 
+    // Only fetch what we are actually going to look at during initialization
+    const gchar *interest[] = { "CH1", "CH2", "SAMPLING", "BAT_V", NULL };
+    sooshi_set_interest(state, interest);
+
     error = sooshi_setup(state, mooshi_initialized, NULL,
                                 bt_scan_timeout, NULL);
 
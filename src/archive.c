@@ -0,0 +1,795 @@
+#define _XOPEN_SOURCE 700
+
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <glib.h>
+#include <glib/gstdio.h>
+
+#include "sooshi.h"
+
+/*
+ * An archive is a directory of column files, all in native byte order:
+ *
+ *   meta      "SOOSHIAR", u32 version, u32 chunk rows, u32 columns,
+ *             u32 reserved, two commit slots of u64 sequence, u64 rows and
+ *             u64 check, then the node path of every column, NUL terminated
+ *   time      i64 real time (us) of every row, never decreasing
+ *   column-N  f64 value of column N for every row, NaN if it had none
+ *   index     i64 timestamp of the first row of every chunk
+ *   pyramid-N min/max/mean summaries, see pyramid.c
+ *
+ * Column files grow a chunk at a time and the writer only maps the chunk it
+ * is writing to. A commit flushes the mapped data and the index, then writes
+ * the row count into the older of the two commit slots. Readers use the slot
+ * with the highest valid sequence, so rows written after the last complete
+ * commit, or a torn commit record, are simply not there after a crash.
+ * Opening an archive syncs its files and directory, in case they were created.
+ */
+#define SOOSHI_ARCHIVE_MAGIC       "SOOSHIAR"
+#define SOOSHI_ARCHIVE_VERSION     1
+#define SOOSHI_ARCHIVE_SLOTS_AT    24
+#define SOOSHI_ARCHIVE_SLOT_SIZE   24
+#define SOOSHI_ARCHIVE_NAMES_AT    (SOOSHI_ARCHIVE_SLOTS_AT + 2 * SOOSHI_ARCHIVE_SLOT_SIZE)
+#define SOOSHI_ARCHIVE_CHECK       G_GUINT64_CONSTANT(0x534f4f5348494152)
+
+typedef struct
+{
+    guint64 sequence;
+    guint64 rows;
+    guint64 check;
+} SooshiArchiveCommit;
+
+static gchar *
+sooshi_archive_file(const gchar *path, const gchar *name)
+{
+    return g_build_filename(path, name, NULL);
+}
+
+static gchar *
+sooshi_archive_column_file(const gchar *path, guint column)
+{
+    gchar *name = g_strdup_printf("column-%u", column);
+    gchar *file = g_build_filename(path, name, NULL);
+    g_free(name);
+
+    return file;
+}
+
+// Parses the meta file, returns the committed row count or -1 if it isn't one
+static gint64
+sooshi_archive_parse_meta(const gchar *meta, gsize length, guint *chunk_rows, gchar ***names)
+{
+    guint32 header[4];
+
+    if (length < SOOSHI_ARCHIVE_NAMES_AT || memcmp(meta, SOOSHI_ARCHIVE_MAGIC, 8) != 0)
+        return -1;
+
+    memcpy(header, meta + 8, sizeof(header));
+    if (header[0] != SOOSHI_ARCHIVE_VERSION || header[1] == 0)
+        return -1;
+
+    // The newest intact commit wins
+    SooshiArchiveCommit best = { 0, 0, 0 };
+    for (guint slot = 0; slot < 2; ++slot)
+    {
+        SooshiArchiveCommit commit;
+        memcpy(&commit, meta + SOOSHI_ARCHIVE_SLOTS_AT + slot * SOOSHI_ARCHIVE_SLOT_SIZE, sizeof(commit));
+
+        if (commit.check == (commit.sequence ^ commit.rows ^ SOOSHI_ARCHIVE_CHECK) && commit.sequence > best.sequence)
+            best = commit;
+    }
+
+    GPtrArray *columns = g_ptr_array_new();
+    gsize offset = SOOSHI_ARCHIVE_NAMES_AT;
+
+    for (guint i = 0; i < header[2]; ++i)
+    {
+        const gchar *name = meta + offset;
+        const gchar *end = offset < length ? memchr(name, '\0', length - offset) : NULL;
+
+        if (end == NULL)
+        {
+            g_ptr_array_free(columns, TRUE);
+            return -1;
+        }
+
+        g_ptr_array_add(columns, g_strdup(name));
+        offset += end - name + 1;
+    }
+
+    g_ptr_array_add(columns, NULL);
+
+    *chunk_rows = header[1];
+    *names = (gchar**)g_ptr_array_free(columns, FALSE);
+
+    return best.rows;
+}
+
+static gboolean
+sooshi_archive_same_nodes(gchar **names, gchar **nodes)
+{
+    guint i = 0;
+
+    for (; names[i] && nodes[i]; ++i)
+        if (g_strcmp0(names[i], nodes[i]) != 0)
+            return FALSE;
+
+    return names[i] == NULL && nodes[i] == NULL;
+}
+
+/* Writing */
+static gboolean
+sooshi_archiver_write_commit(SooshiArchiver *archiver, guint64 rows)
+{
+    SooshiArchiveCommit commit;
+    commit.sequence = ++archiver->sequence;
+    commit.rows = rows;
+    commit.check = commit.sequence ^ commit.rows ^ SOOSHI_ARCHIVE_CHECK;
+
+    off_t slot = SOOSHI_ARCHIVE_SLOTS_AT + (commit.sequence % 2) * SOOSHI_ARCHIVE_SLOT_SIZE;
+
+    return pwrite(archiver->meta_fd, &commit, sizeof(commit), slot) == sizeof(commit)
+        && fdatasync(archiver->meta_fd) == 0;
+}
+
+static gsize
+sooshi_archiver_chunk_bytes(SooshiArchiver *archiver)
+{
+    return (gsize)archiver->chunk_rows * sizeof(gdouble);
+}
+
+static void
+sooshi_archiver_unmap(SooshiArchiver *archiver)
+{
+    gsize bytes = sooshi_archiver_chunk_bytes(archiver);
+
+    if (archiver->time_chunk)
+        munmap(archiver->time_chunk, bytes);
+    archiver->time_chunk = NULL;
+
+    for (guint i = 0; i < archiver->columns; ++i)
+    {
+        if (archiver->column_chunks[i])
+            munmap(archiver->column_chunks[i], bytes);
+        archiver->column_chunks[i] = NULL;
+    }
+}
+
+static gpointer
+sooshi_archiver_map(SooshiArchiver *archiver, gint fd, guint64 chunk)
+{
+    gsize bytes = sooshi_archiver_chunk_bytes(archiver);
+
+    if (ftruncate(fd, (off_t)(chunk + 1) * bytes) != 0)
+        return NULL;
+
+    gpointer map = mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, (off_t)chunk * bytes);
+
+    return map == MAP_FAILED ? NULL : map;
+}
+
+static gboolean
+sooshi_archiver_map_chunk(SooshiArchiver *archiver, guint64 chunk)
+{
+    sooshi_archiver_unmap(archiver);
+    archiver->chunk = chunk;
+
+    archiver->time_chunk = sooshi_archiver_map(archiver, archiver->time_fd, chunk);
+    if (archiver->time_chunk == NULL)
+        return FALSE;
+
+    for (guint i = 0; i < archiver->columns; ++i)
+    {
+        archiver->column_chunks[i] = sooshi_archiver_map(archiver, archiver->column_fds[i], chunk);
+        if (archiver->column_chunks[i] == NULL)
+            return FALSE;
+    }
+
+    return TRUE;
+}
+
+static void
+sooshi_archiver_fail(SooshiArchiver *archiver, const gchar *what)
+{
+    g_warning("Archive '%s': %s failed (%s), not archiving anymore!", archiver->path, what, g_strerror(errno));
+
+    archiver->failed = TRUE;
+    sooshi_archiver_unmap(archiver);
+}
+
+static void
+sooshi_archiver_write_row(SooshiArchiver *archiver)
+{
+    if (archiver->failed)
+        return;
+
+    guint64 chunk = archiver->rows / archiver->chunk_rows;
+    guint64 offset = archiver->rows % archiver->chunk_rows;
+    gint64 timestamp = MAX(archiver->row_timestamp, archiver->last_timestamp);
+
+    if (chunk != archiver->chunk)
+    {
+        // A full chunk is always committed before moving on
+        if (sooshi_archiver_commit(archiver) != SOOSHI_ERROR_SUCCESS)
+            return;
+
+        if (!sooshi_archiver_map_chunk(archiver, chunk))
+        {
+            sooshi_archiver_fail(archiver, "mapping a new chunk");
+            return;
+        }
+    }
+
+    if (offset == 0 && pwrite(archiver->index_fd, &timestamp, sizeof(timestamp), chunk * sizeof(timestamp)) != sizeof(timestamp))
+    {
+        sooshi_archiver_fail(archiver, "writing the index");
+        return;
+    }
+
+    archiver->time_chunk[offset] = timestamp;
+    for (guint i = 0; i < archiver->columns; ++i)
+        archiver->column_chunks[i][offset] = archiver->row_present[i] ? archiver->row[i] : NAN;
+
+    archiver->last_timestamp = timestamp;
+    archiver->rows++;
+
+    if (!sooshi_pyramid_on_row(archiver))
+        sooshi_archiver_fail(archiver, "writing the pyramid");
+}
+
+static void
+sooshi_archiver_flush_row(SooshiArchiver *archiver)
+{
+    if (archiver->row_values == 0)
+        return;
+
+    sooshi_archiver_write_row(archiver);
+
+    memset(archiver->row_present, 0, archiver->columns * sizeof(gboolean));
+    archiver->row_values = 0;
+}
+
+// A sample retained by a compressed archiver's door is a row of its own
+static void
+sooshi_archiver_write_point(SooshiArchiver *archiver, const SooshiSample *point)
+{
+    archiver->row_timestamp = point->timestamp + archiver->clock_offset;
+    archiver->row[0] = point->value;
+    archiver->row_present[0] = TRUE;
+    archiver->row_values = 1;
+
+    sooshi_archiver_flush_row(archiver);
+}
+
+static void
+sooshi_archiver_on_value(SooshiState *state, SooshiNode *node, gpointer user_data)
+{
+    SooshiArchiverColumn *column = user_data;
+    SooshiArchiver *archiver = column->archiver;
+    gdouble value;
+
+    if (!sooshi_node_value_as_double(node, &value))
+        return;
+
+    if (archiver->door)
+    {
+        SooshiSample sample = { node->last_update, value }, retained[2];
+        guint count = sooshi_swinging_door_add(archiver->door, &sample, retained);
+
+        for (guint i = 0; i < count; ++i)
+            sooshi_archiver_write_point(archiver, &retained[i]);
+
+        return;
+    }
+
+    if (archiver->row_present[column->index])
+        sooshi_archiver_flush_row(archiver);
+
+    if (archiver->row_values == 0)
+        archiver->row_timestamp = node->last_update + archiver->clock_offset;
+
+    archiver->row[column->index] = value;
+    archiver->row_present[column->index] = TRUE;
+
+    if (++archiver->row_values == archiver->columns)
+        sooshi_archiver_flush_row(archiver);
+}
+
+static gboolean
+sooshi_archiver_commit_timeout(gpointer user_data)
+{
+    sooshi_archiver_commit((SooshiArchiver*)user_data);
+
+    return G_SOURCE_CONTINUE;
+}
+
+// Creates the meta file of a new archive or checks an existing one matches
+static gboolean
+sooshi_archiver_open_meta(SooshiArchiver *archiver)
+{
+    gchar *meta_path = sooshi_archive_file(archiver->path, "meta");
+    gchar *meta = NULL;
+    gsize length = 0;
+    gboolean ok = FALSE;
+
+    if (g_file_get_contents(meta_path, &meta, &length, NULL))
+    {
+        gchar **names = NULL;
+        guint chunk_rows = 0;
+        gint64 rows = sooshi_archive_parse_meta(meta, length, &chunk_rows, &names);
+
+        if (rows < 0 || !sooshi_archive_same_nodes(names, archiver->nodes))
+            g_warning("'%s' is not an archive of the same nodes!", archiver->path);
+        else
+        {
+            // Keep the sequence growing so our next commit goes to the older slot
+            for (guint slot = 0; slot < 2; ++slot)
+            {
+                SooshiArchiveCommit commit;
+                memcpy(&commit, meta + SOOSHI_ARCHIVE_SLOTS_AT + slot * SOOSHI_ARCHIVE_SLOT_SIZE, sizeof(commit));
+
+                if (commit.check == (commit.sequence ^ commit.rows ^ SOOSHI_ARCHIVE_CHECK))
+                    archiver->sequence = MAX(archiver->sequence, commit.sequence);
+            }
+
+            archiver->chunk_rows = chunk_rows;
+            archiver->rows = rows;
+            archiver->committed = rows;
+            archiver->meta_fd = g_open(meta_path, O_RDWR, 0);
+            ok = archiver->meta_fd >= 0;
+        }
+
+        g_strfreev(names);
+        g_free(meta);
+    }
+    else
+    {
+        GByteArray *header = g_byte_array_new();
+        guint32 fields[4] = { SOOSHI_ARCHIVE_VERSION, archiver->chunk_rows, archiver->columns, 0 };
+        guint8 slots[2 * SOOSHI_ARCHIVE_SLOT_SIZE] = { 0 };
+
+        g_byte_array_append(header, (const guint8*)SOOSHI_ARCHIVE_MAGIC, 8);
+        g_byte_array_append(header, (const guint8*)fields, sizeof(fields));
+        g_byte_array_append(header, slots, sizeof(slots));
+
+        for (guint i = 0; i < archiver->columns; ++i)
+            g_byte_array_append(header, (const guint8*)archiver->nodes[i], strlen(archiver->nodes[i]) + 1);
+
+        archiver->meta_fd = g_open(meta_path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+        ok = archiver->meta_fd >= 0
+            && write(archiver->meta_fd, header->data, header->len) == (gssize)header->len
+            && fdatasync(archiver->meta_fd) == 0;
+
+        g_byte_array_unref(header);
+    }
+
+    g_free(meta_path);
+
+    return ok;
+}
+
+static gboolean
+sooshi_archive_sync_directory(const gchar *path)
+{
+    gint fd = g_open(path, O_RDONLY | O_DIRECTORY, 0);
+
+    if (fd < 0)
+        return FALSE;
+
+    gboolean ok = fsync(fd) == 0;
+    close(fd);
+
+    return ok;
+}
+
+// Files just created, and their entries in the directory, have to be on disk
+// before a commit can refer to what is in them
+static gboolean
+sooshi_archiver_sync_files(SooshiArchiver *archiver)
+{
+    gboolean ok = fsync(archiver->meta_fd) == 0
+        && fsync(archiver->index_fd) == 0
+        && fsync(archiver->time_fd) == 0;
+
+    for (guint i = 0; ok && i < archiver->columns; ++i)
+        ok = fsync(archiver->column_fds[i]) == 0;
+
+    for (guint i = 0; ok && i < SOOSHI_PYRAMID_LEVELS; ++i)
+        ok = fsync(archiver->pyramid_fds[i]) == 0;
+
+    gchar *parent = g_path_get_dirname(archiver->path);
+    ok = ok && sooshi_archive_sync_directory(archiver->path) && sooshi_archive_sync_directory(parent);
+    g_free(parent);
+
+    return ok;
+}
+
+static SooshiArchiver *
+sooshi_archiver_create(SooshiState *state, const gchar *path, const gchar * const *nodes,
+        const SooshiCompression *compression, guint chunk_rows, guint commit_interval_ms, sooshi_error_t *error)
+{
+    SooshiArchiver *archiver = g_new0(SooshiArchiver, 1);
+    archiver->state = state;
+    archiver->path = g_strdup(path);
+    archiver->nodes = g_strdupv((gchar**)nodes);
+    archiver->columns = g_strv_length(archiver->nodes);
+    archiver->meta_fd = archiver->index_fd = archiver->time_fd = -1;
+    archiver->column_fds = g_new(gint, archiver->columns);
+    archiver->column_chunks = g_new0(gdouble*, archiver->columns);
+    archiver->row = g_new0(gdouble, archiver->columns);
+    archiver->row_present = g_new0(gboolean, archiver->columns);
+    archiver->subscriptions = g_new0(SooshiArchiverColumn, archiver->columns);
+    archiver->clock_offset = g_get_real_time() - g_get_monotonic_time();
+
+    for (guint i = 0; i < archiver->columns; ++i)
+        archiver->column_fds[i] = -1;
+
+    for (guint i = 0; i < SOOSHI_PYRAMID_LEVELS; ++i)
+        archiver->pyramid_fds[i] = -1;
+
+    if (compression)
+    {
+        archiver->door = g_new(SooshiSwingingDoor, 1);
+        sooshi_swinging_door_init(archiver->door, compression);
+    }
+
+    // Chunks are mapped separately, so they have to start at page boundaries.
+    // Pages hold a multiple of the pyramid's fanout, so chunks do as well.
+    guint page_rows = sysconf(_SC_PAGESIZE) / sizeof(gdouble);
+    chunk_rows = chunk_rows ? chunk_rows : SOOSHI_ARCHIVE_CHUNK_ROWS;
+    archiver->chunk_rows = (chunk_rows + page_rows - 1) / page_rows * page_rows;
+
+    if (g_mkdir_with_parents(path, 0755) != 0 || !sooshi_archiver_open_meta(archiver))
+        goto failed;
+
+    gchar *file = sooshi_archive_file(path, "index");
+    archiver->index_fd = g_open(file, O_RDWR | O_CREAT, 0644);
+    g_free(file);
+
+    file = sooshi_archive_file(path, "time");
+    archiver->time_fd = g_open(file, O_RDWR | O_CREAT, 0644);
+    g_free(file);
+
+    if (archiver->index_fd < 0 || archiver->time_fd < 0)
+        goto failed;
+
+    for (guint i = 0; i < archiver->columns; ++i)
+    {
+        file = sooshi_archive_column_file(path, i);
+        archiver->column_fds[i] = g_open(file, O_RDWR | O_CREAT, 0644);
+        g_free(file);
+
+        if (archiver->column_fds[i] < 0)
+            goto failed;
+    }
+
+    // Appending to an existing archive continues after its last committed row
+    if (archiver->rows > 0)
+    {
+        gint64 last;
+        off_t at = (archiver->rows - 1) * sizeof(gint64);
+
+        if (pread(archiver->time_fd, &last, sizeof(last), at) == sizeof(last))
+            archiver->last_timestamp = last;
+    }
+
+    if (!sooshi_archiver_map_chunk(archiver, archiver->rows / archiver->chunk_rows)
+            || !sooshi_pyramid_open(archiver)
+            || !sooshi_archiver_sync_files(archiver))
+        goto failed;
+
+    for (guint i = 0; i < archiver->columns; ++i)
+    {
+        SooshiNode *node = sooshi_node_find(state, archiver->nodes[i], NULL);
+
+        if (node == NULL || !sooshi_node_is_numeric(node))
+        {
+            g_warning("Node '%s' has no numeric value to archive!", archiver->nodes[i]);
+            goto failed;
+        }
+
+        archiver->subscriptions[i].archiver = archiver;
+        archiver->subscriptions[i].index = i;
+        archiver->subscriptions[i].subscription =
+            sooshi_node_subscribe(state, node, sooshi_archiver_on_value, &archiver->subscriptions[i]);
+    }
+
+    if (commit_interval_ms > 0)
+        archiver->commit_source_id = sooshi_timeout_add(state, commit_interval_ms, sooshi_archiver_commit_timeout, archiver);
+
+    g_info("Archiving %u nodes to '%s', %" G_GUINT64_FORMAT " rows so far", archiver->columns, path, archiver->rows);
+
+    if (error) *error = SOOSHI_ERROR_SUCCESS;
+    return archiver;
+
+failed:
+    g_warning("Could not open archive '%s'!", path);
+    sooshi_archiver_free(archiver);
+
+    if (error) *error = SOOSHI_ERROR_ARCHIVE_FAILED;
+    return NULL;
+}
+
+SooshiArchiver *
+sooshi_archiver_new(SooshiState *state, const gchar *path, const gchar * const *nodes,
+        guint chunk_rows, guint commit_interval_ms, sooshi_error_t *error)
+{
+    g_return_val_if_fail(state != NULL, NULL);
+    g_return_val_if_fail(path != NULL, NULL);
+    g_return_val_if_fail(nodes != NULL && nodes[0] != NULL, NULL);
+
+    return sooshi_archiver_create(state, path, nodes, NULL, chunk_rows, commit_interval_ms, error);
+}
+
+SooshiArchiver *
+sooshi_archiver_new_compressed(SooshiState *state, const gchar *path, const gchar *node,
+        const SooshiCompression *compression, guint chunk_rows, guint commit_interval_ms, sooshi_error_t *error)
+{
+    g_return_val_if_fail(state != NULL, NULL);
+    g_return_val_if_fail(path != NULL, NULL);
+    g_return_val_if_fail(node != NULL, NULL);
+    g_return_val_if_fail(compression != NULL, NULL);
+
+    // Retained samples lag behind the node by one value, so they can only be
+    // written in order when there is nothing else to line them up with
+    const gchar *nodes[] = { node, NULL };
+
+    return sooshi_archiver_create(state, path, nodes, compression, chunk_rows, commit_interval_ms, error);
+}
+
+sooshi_error_t
+sooshi_archiver_commit(SooshiArchiver *archiver)
+{
+    g_return_val_if_fail(archiver != NULL, SOOSHI_ERROR_ARCHIVE_FAILED);
+
+    if (archiver->failed)
+        return SOOSHI_ERROR_ARCHIVE_FAILED;
+
+    if (archiver->rows == archiver->committed)
+        return SOOSHI_ERROR_SUCCESS;
+
+    // Data and index have to be on disk before the commit record says they are
+    gsize bytes = sooshi_archiver_chunk_bytes(archiver);
+    gboolean ok = msync(archiver->time_chunk, bytes, MS_SYNC) == 0;
+
+    for (guint i = 0; ok && i < archiver->columns; ++i)
+        ok = msync(archiver->column_chunks[i], bytes, MS_SYNC) == 0;
+
+    ok = ok && fdatasync(archiver->index_fd) == 0
+        && sooshi_pyramid_sync(archiver)
+        && sooshi_archiver_write_commit(archiver, archiver->rows);
+
+    if (!ok)
+    {
+        sooshi_archiver_fail(archiver, "committing");
+        return SOOSHI_ERROR_ARCHIVE_FAILED;
+    }
+
+    archiver->committed = archiver->rows;
+
+    return SOOSHI_ERROR_SUCCESS;
+}
+
+// The tree may have been reloaded since we subscribed, only unsubscribe what's still there
+static void
+sooshi_archiver_unsubscribe(SooshiArchiver *archiver, guint column)
+{
+    guint id = archiver->subscriptions[column].subscription;
+    SooshiNode *node = id ? sooshi_node_find(archiver->state, archiver->nodes[column], NULL) : NULL;
+
+    if (node == NULL)
+        return;
+
+    for (GList *elem = node->subscriber; elem; elem = elem->next)
+    {
+        SooshiNodeSubscriber *sub = elem->data;
+
+        if (sub->id == id && sub->removed == FALSE)
+        {
+            sooshi_node_unsubscribe(archiver->state, node, id);
+            return;
+        }
+    }
+}
+
+void
+sooshi_archiver_free(SooshiArchiver *archiver)
+{
+    if (archiver == NULL)
+        return;
+
+    if (archiver->commit_source_id > 0)
+        sooshi_source_remove(archiver->state, archiver->commit_source_id);
+
+    for (guint i = 0; i < archiver->columns; ++i)
+        sooshi_archiver_unsubscribe(archiver, i);
+
+    // A half finished row is better than none, as is the door's last sample
+    if (archiver->time_chunk)
+    {
+        SooshiSample last;
+
+        if (archiver->door && sooshi_swinging_door_flush(archiver->door, &last))
+            sooshi_archiver_write_point(archiver, &last);
+
+        sooshi_archiver_flush_row(archiver);
+        sooshi_archiver_commit(archiver);
+    }
+
+    sooshi_archiver_unmap(archiver);
+    sooshi_pyramid_close(archiver);
+
+    if (archiver->meta_fd >= 0) close(archiver->meta_fd);
+    if (archiver->index_fd >= 0) close(archiver->index_fd);
+    if (archiver->time_fd >= 0) close(archiver->time_fd);
+
+    for (guint i = 0; i < archiver->columns; ++i)
+        if (archiver->column_fds[i] >= 0)
+            close(archiver->column_fds[i]);
+
+    g_free(archiver->path);
+    g_strfreev(archiver->nodes);
+    g_free(archiver->column_fds);
+    g_free(archiver->column_chunks);
+    g_free(archiver->row);
+    g_free(archiver->row_present);
+    g_free(archiver->subscriptions);
+    g_free(archiver->door);
+    g_free(archiver);
+}
+
+/* Reading */
+static GMappedFile *
+sooshi_archive_map(const gchar *path, const gchar *name, gsize needed)
+{
+    gchar *file = sooshi_archive_file(path, name);
+    GMappedFile *mapped = g_mapped_file_new(file, FALSE, NULL);
+    g_free(file);
+
+    if (mapped && g_mapped_file_get_length(mapped) < needed)
+    {
+        g_mapped_file_unref(mapped);
+        return NULL;
+    }
+
+    return mapped;
+}
+
+SooshiArchive *
+sooshi_archive_open(const gchar *path, sooshi_error_t *error)
+{
+    g_return_val_if_fail(path != NULL, NULL);
+
+    SooshiArchive *archive = g_new0(SooshiArchive, 1);
+    gchar *meta_path = sooshi_archive_file(path, "meta");
+    gchar *meta = NULL;
+    gsize length = 0;
+    gint64 rows = -1;
+
+    if (g_file_get_contents(meta_path, &meta, &length, NULL))
+        rows = sooshi_archive_parse_meta(meta, length, &archive->chunk_rows, &archive->names);
+
+    g_free(meta_path);
+    g_free(meta);
+
+    if (rows < 0)
+        goto failed;
+
+    // Nothing is read here, pages are only faulted in once a range is accessed
+    archive->rows = rows;
+    archive->columns = g_strv_length(archive->names);
+    archive->chunks = (archive->rows + archive->chunk_rows - 1) / archive->chunk_rows;
+    archive->values = g_new0(const gdouble*, archive->columns);
+    archive->column_files = g_new0(GMappedFile*, archive->columns);
+
+    archive->time_file = sooshi_archive_map(path, "time", archive->rows * sizeof(gint64));
+    archive->index_file = sooshi_archive_map(path, "index", archive->chunks * sizeof(gint64));
+
+    if (archive->time_file == NULL || archive->index_file == NULL)
+        goto failed;
+
+    archive->timestamps = (const gint64*)g_mapped_file_get_contents(archive->time_file);
+    archive->index = (const gint64*)g_mapped_file_get_contents(archive->index_file);
+
+    for (guint i = 0; i < archive->columns; ++i)
+    {
+        gchar *name = g_strdup_printf("column-%u", i);
+        archive->column_files[i] = sooshi_archive_map(path, name, archive->rows * sizeof(gdouble));
+        g_free(name);
+
+        if (archive->column_files[i] == NULL)
+            goto failed;
+
+        archive->values[i] = (const gdouble*)g_mapped_file_get_contents(archive->column_files[i]);
+    }
+
+    sooshi_pyramid_map(archive, path);
+
+    if (error) *error = SOOSHI_ERROR_SUCCESS;
+    return archive;
+
+failed:
+    g_warning("Could not open archive '%s'!", path);
+    sooshi_archive_close(archive);
+
+    if (error) *error = SOOSHI_ERROR_ARCHIVE_FAILED;
+    return NULL;
+}
+
+void
+sooshi_archive_close(SooshiArchive *archive)
+{
+    if (archive == NULL)
+        return;
+
+    for (guint i = 0; archive->column_files && i < archive->columns; ++i)
+        if (archive->column_files[i])
+            g_mapped_file_unref(archive->column_files[i]);
+
+    if (archive->time_file) g_mapped_file_unref(archive->time_file);
+    if (archive->index_file) g_mapped_file_unref(archive->index_file);
+
+    sooshi_pyramid_unmap(archive);
+
+    g_strfreev(archive->names);
+    g_free(archive->values);
+    g_free(archive->column_files);
+    g_free(archive);
+}
+
+guint64
+sooshi_archive_find(const SooshiArchive *archive, gint64 timestamp)
+{
+    g_return_val_if_fail(archive != NULL, 0);
+
+    // The sparse index narrows it down to a chunk without touching the time column
+    guint64 low = 0, high = archive->chunks;
+    while (low < high)
+    {
+        guint64 middle = low + (high - low) / 2;
+
+        if (archive->index[middle] < timestamp)
+            low = middle + 1;
+        else
+            high = middle;
+    }
+
+    // Rows of the timestamp may start in the chunk before the first one indexed at it
+    guint64 chunk = low > 0 ? low - 1 : 0;
+
+    // First row at or after timestamp within the chunk, or the next chunk's first
+    low = chunk * archive->chunk_rows;
+    high = MIN(archive->rows, low + archive->chunk_rows);
+
+    while (low < high)
+    {
+        guint64 middle = low + (high - low) / 2;
+
+        if (archive->timestamps[middle] < timestamp)
+            low = middle + 1;
+        else
+            high = middle;
+    }
+
+    return low;
+}
+
+guint64
+sooshi_archive_range(const SooshiArchive *archive, gint64 from, gint64 to, guint64 *first_row)
+{
+    g_return_val_if_fail(archive != NULL, 0);
+
+    // Both ends are inclusive
+    guint64 first = sooshi_archive_find(archive, from);
+    guint64 end = to < G_MAXINT64 ? sooshi_archive_find(archive, to + 1) : archive->rows;
+
+    if (first_row)
+        *first_row = first;
+
+    return end > first ? end - first : 0;
+}
@@ -0,0 +1,330 @@
+#include <stdio.h>
+#include <string.h>
+#include <glib.h>
+
+#include "sooshi.h"
+
+/*
+ * Capture file layout, all integers little endian:
+ *
+ *   header  "SOOSHICP", u32 version, u32 reserved,
+ *           i64 real time and i64 monotonic time the capture started at
+ *   record  i64 monotonic timestamp (us), u8 direction, u8 sequence,
+ *           u16 length, payload
+ *
+ * The payload is the stream data without the sequence byte, exactly what
+ * was appended to the receive buffer or handed to sooshi_send_bytes().
+ */
+#define SOOSHI_CAPTURE_MAGIC       "SOOSHICP"
+#define SOOSHI_CAPTURE_VERSION     1
+#define SOOSHI_CAPTURE_HEADER_SIZE 32
+#define SOOSHI_CAPTURE_RECORD_SIZE 12
+
+// btsnoop timestamps count microseconds since midnight, January 1st 0 AD
+#define BTSNOOP_EPOCH_DELTA G_GINT64_CONSTANT(0x00dcddb30f2f8000)
+
+// Made up ACL connection and attribute handles for the btsnoop export
+#define BTSNOOP_CONNECTION_HANDLE 0x0040
+#define BTSNOOP_SERIAL_IN_HANDLE  0x0012
+#define BTSNOOP_SERIAL_OUT_HANDLE 0x0015
+
+typedef struct
+{
+    gint64 timestamp;
+    SOOSHI_CAPTURE_DIRECTION direction;
+    guint8 sequence;
+    guint16 length;
+    const guint8 *payload;
+} SooshiCaptureRecord;
+
+static void
+sooshi_capture_put_u16(guint8 *out, guint16 value)
+{
+    out[0] = value;
+    out[1] = value >> 8;
+}
+
+static void
+sooshi_capture_put_u64(guint8 *out, guint64 value)
+{
+    for (guint i = 0; i < 8; ++i)
+        out[i] = value >> (8 * i);
+}
+
+static guint16
+sooshi_capture_get_u16(const guint8 *in)
+{
+    return in[0] | (guint16)in[1] << 8;
+}
+
+static guint64
+sooshi_capture_get_u64(const guint8 *in)
+{
+    guint64 value = 0;
+
+    for (guint i = 0; i < 8; ++i)
+        value |= (guint64)in[i] << (8 * i);
+
+    return value;
+}
+
+sooshi_error_t
+sooshi_capture_start(SooshiState *state, const gchar *path)
+{
+    g_return_val_if_fail(state != NULL, SOOSHI_ERROR_CAPTURE_FAILED);
+    g_return_val_if_fail(path != NULL, SOOSHI_ERROR_CAPTURE_FAILED);
+
+    sooshi_capture_stop(state);
+
+    state->capture = fopen(path, "wb");
+    if (state->capture == NULL)
+    {
+        g_warning("Could not open capture file '%s'!", path);
+        return SOOSHI_ERROR_CAPTURE_FAILED;
+    }
+
+    guint8 header[SOOSHI_CAPTURE_HEADER_SIZE] = { 0 };
+    memcpy(header, SOOSHI_CAPTURE_MAGIC, 8);
+    header[8] = SOOSHI_CAPTURE_VERSION;
+    sooshi_capture_put_u64(header + 16, g_get_real_time());
+    sooshi_capture_put_u64(header + 24, g_get_monotonic_time());
+
+    if (fwrite(header, sizeof(header), 1, state->capture) != 1)
+    {
+        g_warning("Could not write capture file '%s'!", path);
+        sooshi_capture_stop(state);
+        return SOOSHI_ERROR_CAPTURE_FAILED;
+    }
+
+    g_info("Capturing to '%s'", path);
+
+    return SOOSHI_ERROR_SUCCESS;
+}
+
+void
+sooshi_capture_stop(SooshiState *state)
+{
+    g_return_if_fail(state != NULL);
+
+    if (state->capture == NULL)
+        return;
+
+    fclose(state->capture);
+    state->capture = NULL;
+}
+
+void
+sooshi_capture_record(SooshiState *state, SOOSHI_CAPTURE_DIRECTION direction,
+        guint8 sequence, const guint8 *data, gsize len)
+{
+    if (state->capture == NULL || state->replaying)
+        return;
+
+    guint8 header[SOOSHI_CAPTURE_RECORD_SIZE];
+    sooshi_capture_put_u64(header, g_get_monotonic_time());
+    header[8] = direction;
+    header[9] = sequence;
+    sooshi_capture_put_u16(header + 10, len);
+
+    // Stdio buffers for us, this is called for every single notification
+    if (fwrite(header, sizeof(header), 1, state->capture) != 1
+            || (len > 0 && fwrite(data, len, 1, state->capture) != 1))
+    {
+        g_warning("Error writing capture, stopping it");
+        sooshi_capture_stop(state);
+    }
+}
+
+static guint8 *
+sooshi_capture_load(const gchar *path, gsize *length)
+{
+    gchar *contents = NULL;
+
+    if (!g_file_get_contents(path, &contents, length, NULL))
+    {
+        g_warning("Could not read capture file '%s'!", path);
+        return NULL;
+    }
+
+    if (*length < SOOSHI_CAPTURE_HEADER_SIZE || memcmp(contents, SOOSHI_CAPTURE_MAGIC, 8) != 0
+            || (guint8)contents[8] != SOOSHI_CAPTURE_VERSION)
+    {
+        g_warning("'%s' is not a capture file!", path);
+        g_free(contents);
+        return NULL;
+    }
+
+    return (guint8*)contents;
+}
+
+// Returns the offset of the record after this one, 0 at the end or on truncation
+static gsize
+sooshi_capture_next(const guint8 *capture, gsize length, gsize offset, SooshiCaptureRecord *record)
+{
+    if (offset + SOOSHI_CAPTURE_RECORD_SIZE > length)
+        return 0;
+
+    const guint8 *in = capture + offset;
+    record->timestamp = sooshi_capture_get_u64(in);
+    record->direction = in[8];
+    record->sequence = in[9];
+    record->length = sooshi_capture_get_u16(in + 10);
+    record->payload = in + SOOSHI_CAPTURE_RECORD_SIZE;
+
+    offset += SOOSHI_CAPTURE_RECORD_SIZE + record->length;
+
+    if (offset > length)
+    {
+        g_warning("Capture is truncated!");
+        return 0;
+    }
+
+    return offset;
+}
+
+sooshi_error_t
+sooshi_replay(SooshiState *state, const gchar *path, gdouble speed, guint *records)
+{
+    g_return_val_if_fail(state != NULL, SOOSHI_ERROR_CAPTURE_FAILED);
+    g_return_val_if_fail(path != NULL, SOOSHI_ERROR_CAPTURE_FAILED);
+
+    gsize length;
+    guint8 *capture = sooshi_capture_load(path, &length);
+    if (capture == NULL)
+        return SOOSHI_ERROR_CAPTURE_FAILED;
+
+    SooshiCaptureRecord record;
+    gsize offset = SOOSHI_CAPTURE_HEADER_SIZE;
+    gint64 first = 0;
+    gint64 started = g_get_monotonic_time();
+    guint replayed = 0;
+
+    state->replaying = TRUE;
+
+    while ((offset = sooshi_capture_next(capture, length, offset, &record)) > 0)
+    {
+        // What we sent only matters for the btsnoop export
+        if (record.direction != SOOSHI_CAPTURE_RX)
+            continue;
+
+        if (first == 0)
+            first = record.timestamp;
+
+        if (speed > 0)
+        {
+            gint64 due = started + (record.timestamp - first) / speed;
+            gint64 now = g_get_monotonic_time();
+
+            if (due > now)
+                g_usleep(due - now);
+        }
+
+        // Values keep the spacing they were recorded with, even when replayed at full speed
+        state->replay_time = started + (record.timestamp - first);
+
+        sooshi_receive_notification(state, record.sequence, record.payload, record.length);
+        replayed++;
+    }
+
+    state->replaying = FALSE;
+    g_free(capture);
+
+    if (records)
+        *records = replayed;
+
+    return SOOSHI_ERROR_SUCCESS;
+}
+
+static gboolean
+sooshi_capture_write_btsnoop(FILE *out, const SooshiCaptureRecord *record, gint64 real_offset)
+{
+    guint8 packet[13 + G_MAXUINT16];
+    guint16 att_length = 3 + 1 + record->length;
+
+    // H4 packet type, ACL header, L2CAP header on the ATT channel
+    packet[0] = 0x02;
+    sooshi_capture_put_u16(packet + 1, BTSNOOP_CONNECTION_HANDLE | 0x2000);
+    sooshi_capture_put_u16(packet + 3, att_length + 4);
+    sooshi_capture_put_u16(packet + 5, att_length);
+    sooshi_capture_put_u16(packet + 7, 0x0004);
+
+    // Write Command to serial in, Handle Value Notification from serial out
+    if (record->direction == SOOSHI_CAPTURE_TX)
+    {
+        packet[9] = 0x52;
+        sooshi_capture_put_u16(packet + 10, BTSNOOP_SERIAL_IN_HANDLE);
+    }
+    else
+    {
+        packet[9] = 0x1b;
+        sooshi_capture_put_u16(packet + 10, BTSNOOP_SERIAL_OUT_HANDLE);
+    }
+
+    packet[12] = record->sequence;
+    memcpy(packet + 13, record->payload, record->length);
+
+    guint32 packet_length = 13 + record->length;
+
+    // btsnoop is big endian
+    guint8 header[24];
+    guint32 be32 = GUINT32_TO_BE(packet_length);
+    memcpy(header, &be32, 4);
+    memcpy(header + 4, &be32, 4);
+    be32 = GUINT32_TO_BE(record->direction == SOOSHI_CAPTURE_RX ? 1 : 0);
+    memcpy(header + 8, &be32, 4);
+    be32 = 0;
+    memcpy(header + 12, &be32, 4);
+    guint64 be64 = GUINT64_TO_BE(record->timestamp + real_offset + BTSNOOP_EPOCH_DELTA);
+    memcpy(header + 16, &be64, 8);
+
+    return fwrite(header, sizeof(header), 1, out) == 1
+        && fwrite(packet, packet_length, 1, out) == 1;
+}
+
+sooshi_error_t
+sooshi_capture_export_btsnoop(const gchar *capture_path, const gchar *btsnoop_path)
+{
+    g_return_val_if_fail(capture_path != NULL, SOOSHI_ERROR_CAPTURE_FAILED);
+    g_return_val_if_fail(btsnoop_path != NULL, SOOSHI_ERROR_CAPTURE_FAILED);
+
+    gsize length;
+    guint8 *capture = sooshi_capture_load(capture_path, &length);
+    if (capture == NULL)
+        return SOOSHI_ERROR_CAPTURE_FAILED;
+
+    FILE *out = fopen(btsnoop_path, "wb");
+    if (out == NULL)
+    {
+        g_warning("Could not open '%s'!", btsnoop_path);
+        g_free(capture);
+        return SOOSHI_ERROR_CAPTURE_FAILED;
+    }
+
+    // Version 1, datalink 1002 (HCI UART/H4)
+    static const guint8 btsnoop_header[16] = {
+        'b', 't', 's', 'n', 'o', 'o', 'p', '\0',
+        0x00, 0x00, 0x00, 0x01,
+        0x00, 0x00, 0x03, 0xea
+    };
+
+    // Map monotonic timestamps to wall clock time
+    gint64 real_offset = sooshi_capture_get_u64(capture + 16) - sooshi_capture_get_u64(capture + 24);
+
+    gboolean ok = fwrite(btsnoop_header, sizeof(btsnoop_header), 1, out) == 1;
+
+    SooshiCaptureRecord record;
+    gsize offset = SOOSHI_CAPTURE_HEADER_SIZE;
+    while (ok && (offset = sooshi_capture_next(capture, length, offset, &record)) > 0)
+        ok = sooshi_capture_write_btsnoop(out, &record, real_offset);
+
+    ok = (fclose(out) == 0) && ok;
+    g_free(capture);
+
+    if (!ok)
+    {
+        g_warning("Error writing '%s'!", btsnoop_path);
+        return SOOSHI_ERROR_CAPTURE_FAILED;
+    }
+
+    return SOOSHI_ERROR_SUCCESS;
+}
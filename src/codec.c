@@ -0,0 +1,509 @@
+#include <stdio.h>
+#include <string.h>
+#include <glib.h>
+
+#include "sooshi.h"
+
+/*
+ * Lossless block codec for archived samples. Every block stands on its own,
+ * so blocks can be decoded in any order and on any number of threads:
+ *
+ *   varint     rows
+ *   varint     zigzag first timestamp, then zigzag delta of delta for
+ *              every following row (0 for a steady sample rate)
+ *   per column varint length, then a bit stream of XOR encoded values
+ *
+ * Values are encoded like in Facebook's Gorilla: the first one verbatim,
+ * then '0' if it equals the previous one, '10' plus the meaningful bits of
+ * the XOR if they fit the previous leading/trailing zero window, or '11',
+ * 5 bits leading zeros, 6 bits length and the meaningful bits otherwise.
+ *
+ * A compressed archive file (native byte order) holds a header, the column
+ * names, the blocks and, at the end, a table of SooshiCompressedBlock:
+ *
+ *   "SOOSHICZ", u32 version, u32 columns, u32 block rows, u32 reserved,
+ *   u64 rows, u64 blocks, u64 table offset, NUL terminated names
+ */
+#define SOOSHI_COMPRESSED_MAGIC        "SOOSHICZ"
+#define SOOSHI_COMPRESSED_VERSION      1
+#define SOOSHI_COMPRESSED_HEADER_SIZE  48
+
+/* Varints */
+static void
+sooshi_codec_put_varint(GByteArray *out, guint64 value)
+{
+    guint8 bytes[10];
+    guint length = 0;
+
+    while (value >= 0x80)
+    {
+        bytes[length++] = (value & 0x7f) | 0x80;
+        value >>= 7;
+    }
+
+    bytes[length++] = value;
+    g_byte_array_append(out, bytes, length);
+}
+
+static gboolean
+sooshi_codec_get_varint(const guint8 *data, gsize length, gsize *offset, guint64 *value)
+{
+    *value = 0;
+
+    for (guint shift = 0; shift < 64 && *offset < length; shift += 7)
+    {
+        guint8 byte = data[(*offset)++];
+        *value |= (guint64)(byte & 0x7f) << shift;
+
+        if ((byte & 0x80) == 0)
+            return TRUE;
+    }
+
+    return FALSE;
+}
+
+static guint64
+sooshi_codec_zigzag(gint64 value)
+{
+    return ((guint64)value << 1) ^ (guint64)(value >> 63);
+}
+
+static gint64
+sooshi_codec_unzigzag(guint64 value)
+{
+    return (gint64)(value >> 1) ^ -(gint64)(value & 1);
+}
+
+/* Bit streams, most significant bit first */
+typedef struct
+{
+    GByteArray *out;
+    guint64 bits;
+    guint count;
+} SooshiBitWriter;
+
+static void
+sooshi_bit_write(SooshiBitWriter *writer, guint64 value, guint count)
+{
+    // At most 32 bits at a time, so the accumulator never overflows
+    if (count > 32)
+    {
+        sooshi_bit_write(writer, value >> 32, count - 32);
+        value &= G_MAXUINT32;
+        count = 32;
+    }
+
+    writer->bits = (writer->bits << count) | value;
+    writer->count += count;
+
+    while (writer->count >= 8)
+    {
+        guint8 byte = writer->bits >> (writer->count - 8);
+        g_byte_array_append(writer->out, &byte, 1);
+        writer->count -= 8;
+    }
+}
+
+static void
+sooshi_bit_flush(SooshiBitWriter *writer)
+{
+    if (writer->count > 0)
+        sooshi_bit_write(writer, 0, 8 - writer->count);
+}
+
+typedef struct
+{
+    const guint8 *data;
+    gsize length;
+    gsize offset;
+    guint64 bits;
+    guint count;
+    gboolean overrun;
+} SooshiBitReader;
+
+static guint64
+sooshi_bit_read(SooshiBitReader *reader, guint count)
+{
+    if (count > 32)
+    {
+        guint64 high = sooshi_bit_read(reader, count - 32);
+        return (high << 32) | sooshi_bit_read(reader, 32);
+    }
+
+    while (reader->count < count)
+    {
+        reader->bits <<= 8;
+
+        if (reader->offset < reader->length)
+            reader->bits |= reader->data[reader->offset++];
+        else
+            reader->overrun = TRUE;
+
+        reader->count += 8;
+    }
+
+    reader->count -= count;
+
+    return (reader->bits >> reader->count) & (G_MAXUINT64 >> (64 - count));
+}
+
+/* Values */
+static guint64
+sooshi_codec_double_bits(gdouble value)
+{
+    guint64 bits;
+    memcpy(&bits, &value, sizeof(bits));
+
+    return bits;
+}
+
+static void
+sooshi_codec_encode_values(const gdouble *values, guint rows, GByteArray *out)
+{
+    SooshiBitWriter writer = { out, 0, 0 };
+    guint64 previous = sooshi_codec_double_bits(values[0]);
+    guint leading = G_MAXUINT, trailing = 0;
+
+    sooshi_bit_write(&writer, previous, 64);
+
+    for (guint i = 1; i < rows; ++i)
+    {
+        guint64 current = sooshi_codec_double_bits(values[i]);
+        guint64 xor = current ^ previous;
+        previous = current;
+
+        if (xor == 0)
+        {
+            sooshi_bit_write(&writer, 0, 1);
+            continue;
+        }
+
+        guint xor_leading = MIN(__builtin_clzll(xor), 31);
+        guint xor_trailing = __builtin_ctzll(xor);
+
+        if (xor_leading >= leading && xor_trailing >= trailing)
+        {
+            sooshi_bit_write(&writer, 0x2, 2);
+            sooshi_bit_write(&writer, xor >> trailing, 64 - leading - trailing);
+        }
+        else
+        {
+            guint meaningful = 64 - xor_leading - xor_trailing;
+
+            sooshi_bit_write(&writer, 0x3, 2);
+            sooshi_bit_write(&writer, xor_leading, 5);
+            sooshi_bit_write(&writer, meaningful & 0x3f, 6);
+            sooshi_bit_write(&writer, xor >> xor_trailing, meaningful);
+
+            leading = xor_leading;
+            trailing = xor_trailing;
+        }
+    }
+
+    sooshi_bit_flush(&writer);
+}
+
+static gboolean
+sooshi_codec_decode_values(const guint8 *data, gsize length, guint rows, gdouble *values)
+{
+    SooshiBitReader reader = { data, length, 0, 0, 0, FALSE };
+    guint64 previous = sooshi_bit_read(&reader, 64);
+    guint leading = 0, meaningful = 0;
+
+    memcpy(&values[0], &previous, sizeof(previous));
+
+    for (guint i = 1; i < rows && !reader.overrun; ++i)
+    {
+        if (sooshi_bit_read(&reader, 1) == 1)
+        {
+            if (sooshi_bit_read(&reader, 1) == 1)
+            {
+                leading = sooshi_bit_read(&reader, 5);
+                meaningful = sooshi_bit_read(&reader, 6);
+
+                if (meaningful == 0)
+                    meaningful = 64;
+
+                if (leading + meaningful > 64)
+                    return FALSE;
+            }
+            else if (meaningful == 0)
+                return FALSE;
+
+            previous ^= sooshi_bit_read(&reader, meaningful) << (64 - leading - meaningful);
+        }
+
+        memcpy(&values[i], &previous, sizeof(previous));
+    }
+
+    return !reader.overrun;
+}
+
+/* Blocks */
+gsize
+sooshi_codec_encode_block(const gint64 *timestamps, const gdouble * const *values,
+        guint columns, guint rows, GByteArray *out)
+{
+    g_return_val_if_fail(timestamps != NULL, 0);
+    g_return_val_if_fail(values != NULL || columns == 0, 0);
+    g_return_val_if_fail(rows > 0, 0);
+    g_return_val_if_fail(out != NULL, 0);
+
+    guint start = out->len;
+
+    sooshi_codec_put_varint(out, rows);
+    sooshi_codec_put_varint(out, sooshi_codec_zigzag(timestamps[0]));
+
+    // Unsigned arithmetic, timestamps are allowed to be anything
+    guint64 previous_delta = 0;
+    for (guint i = 1; i < rows; ++i)
+    {
+        guint64 delta = (guint64)timestamps[i] - (guint64)timestamps[i - 1];
+        sooshi_codec_put_varint(out, sooshi_codec_zigzag((gint64)(delta - previous_delta)));
+        previous_delta = delta;
+    }
+
+    GByteArray *column = g_byte_array_new();
+    for (guint c = 0; c < columns; ++c)
+    {
+        g_byte_array_set_size(column, 0);
+        sooshi_codec_encode_values(values[c], rows, column);
+
+        sooshi_codec_put_varint(out, column->len);
+        g_byte_array_append(out, column->data, column->len);
+    }
+    g_byte_array_unref(column);
+
+    return out->len - start;
+}
+
+guint
+sooshi_codec_decode_block(const guint8 *data, gsize length, guint columns, guint capacity,
+        gint64 *timestamps, gdouble **values)
+{
+    g_return_val_if_fail(data != NULL, 0);
+    g_return_val_if_fail(timestamps != NULL, 0);
+    g_return_val_if_fail(values != NULL || columns == 0, 0);
+
+    gsize offset = 0;
+    guint64 rows, value;
+
+    if (!sooshi_codec_get_varint(data, length, &offset, &rows) || rows == 0 || rows > capacity
+            || !sooshi_codec_get_varint(data, length, &offset, &value))
+        return 0;
+
+    timestamps[0] = sooshi_codec_unzigzag(value);
+
+    guint64 delta = 0;
+    for (guint i = 1; i < rows; ++i)
+    {
+        if (!sooshi_codec_get_varint(data, length, &offset, &value))
+            return 0;
+
+        delta += (guint64)sooshi_codec_unzigzag(value);
+        timestamps[i] = (gint64)((guint64)timestamps[i - 1] + delta);
+    }
+
+    for (guint c = 0; c < columns; ++c)
+    {
+        guint64 column_length;
+
+        if (!sooshi_codec_get_varint(data, length, &offset, &column_length) || column_length > length - offset
+                || !sooshi_codec_decode_values(data + offset, column_length, rows, values[c]))
+            return 0;
+
+        offset += column_length;
+    }
+
+    return rows;
+}
+
+/* Compressed archives */
+sooshi_error_t
+sooshi_archive_compress(const SooshiArchive *archive, const gchar *path, guint block_rows)
+{
+    g_return_val_if_fail(archive != NULL, SOOSHI_ERROR_ARCHIVE_FAILED);
+    g_return_val_if_fail(path != NULL, SOOSHI_ERROR_ARCHIVE_FAILED);
+
+    block_rows = block_rows ? block_rows : SOOSHI_CODEC_BLOCK_ROWS;
+
+    FILE *out = fopen(path, "wb");
+    if (out == NULL)
+    {
+        g_warning("Could not open '%s'!", path);
+        return SOOSHI_ERROR_ARCHIVE_FAILED;
+    }
+
+    // The header is written again once the table offset is known
+    guint8 header[SOOSHI_COMPRESSED_HEADER_SIZE] = { 0 };
+    gboolean ok = fwrite(header, sizeof(header), 1, out) == 1;
+
+    for (guint c = 0; ok && c < archive->columns; ++c)
+        ok = fwrite(archive->names[c], strlen(archive->names[c]) + 1, 1, out) == 1;
+
+    GArray *table = g_array_new(FALSE, FALSE, sizeof(SooshiCompressedBlock));
+    GByteArray *block = g_byte_array_new();
+    const gdouble **values = g_new(const gdouble*, MAX(archive->columns, 1));
+    guint64 offset = ftell(out);
+
+    for (guint64 first = 0; ok && first < archive->rows; first += block_rows)
+    {
+        SooshiCompressedBlock entry;
+        entry.rows = MIN(block_rows, archive->rows - first);
+        entry.first_timestamp = archive->timestamps[first];
+        entry.last_timestamp = archive->timestamps[first + entry.rows - 1];
+        entry.offset = offset;
+
+        for (guint c = 0; c < archive->columns; ++c)
+            values[c] = archive->values[c] + first;
+
+        g_byte_array_set_size(block, 0);
+        entry.length = sooshi_codec_encode_block(archive->timestamps + first, values, archive->columns, entry.rows, block);
+
+        ok = fwrite(block->data, block->len, 1, out) == 1;
+        offset += block->len;
+
+        g_array_append_val(table, entry);
+    }
+
+    // Keep the table aligned so it can be used straight from the mapping
+    guint8 padding[8] = { 0 };
+    guint64 table_offset = (offset + 7) & ~G_GUINT64_CONSTANT(7);
+
+    ok = ok && (table_offset == offset || fwrite(padding, table_offset - offset, 1, out) == 1)
+        && (table->len == 0 || fwrite(table->data, sizeof(SooshiCompressedBlock), table->len, out) == table->len);
+
+    guint32 fields[4] = { SOOSHI_COMPRESSED_VERSION, archive->columns, block_rows, 0 };
+    guint64 sizes[3] = { archive->rows, table->len, table_offset };
+
+    memcpy(header, SOOSHI_COMPRESSED_MAGIC, 8);
+    memcpy(header + 8, fields, sizeof(fields));
+    memcpy(header + 24, sizes, sizeof(sizes));
+
+    ok = ok && fseek(out, 0, SEEK_SET) == 0 && fwrite(header, sizeof(header), 1, out) == 1;
+    ok = (fclose(out) == 0) && ok;
+
+    g_free(values);
+    g_byte_array_unref(block);
+    g_array_unref(table);
+
+    if (!ok)
+    {
+        g_warning("Error writing '%s'!", path);
+        return SOOSHI_ERROR_ARCHIVE_FAILED;
+    }
+
+    return SOOSHI_ERROR_SUCCESS;
+}
+
+SooshiCompressedArchive *
+sooshi_compressed_archive_open(const gchar *path, sooshi_error_t *error)
+{
+    g_return_val_if_fail(path != NULL, NULL);
+
+    SooshiCompressedArchive *archive = g_new0(SooshiCompressedArchive, 1);
+    archive->file = g_mapped_file_new(path, FALSE, NULL);
+
+    if (archive->file == NULL)
+        goto failed;
+
+    archive->data = (const guint8*)g_mapped_file_get_contents(archive->file);
+    archive->length = g_mapped_file_get_length(archive->file);
+
+    if (archive->length < SOOSHI_COMPRESSED_HEADER_SIZE || memcmp(archive->data, SOOSHI_COMPRESSED_MAGIC, 8) != 0)
+        goto failed;
+
+    guint32 fields[4];
+    guint64 sizes[3];
+    memcpy(fields, archive->data + 8, sizeof(fields));
+    memcpy(sizes, archive->data + 24, sizeof(sizes));
+
+    if (fields[0] != SOOSHI_COMPRESSED_VERSION || fields[2] == 0 || sizes[2] % 8 != 0
+            || sizes[2] > archive->length
+            || sizes[1] > (archive->length - sizes[2]) / sizeof(SooshiCompressedBlock))
+        goto failed;
+
+    archive->columns = fields[1];
+    archive->block_rows = fields[2];
+    archive->rows = sizes[0];
+    archive->blocks = sizes[1];
+    archive->index = (const SooshiCompressedBlock*)(archive->data + sizes[2]);
+
+    // Only the names are copied, blocks are decoded on demand
+    archive->names = g_new0(gchar*, archive->columns + 1);
+    gsize offset = SOOSHI_COMPRESSED_HEADER_SIZE;
+
+    for (guint c = 0; c < archive->columns; ++c)
+    {
+        const gchar *name = (const gchar*)archive->data + offset;
+        const gchar *end = offset < sizes[2] ? memchr(name, '\0', sizes[2] - offset) : NULL;
+
+        if (end == NULL)
+            goto failed;
+
+        archive->names[c] = g_strdup(name);
+        offset += end - name + 1;
+    }
+
+    if (error) *error = SOOSHI_ERROR_SUCCESS;
+    return archive;
+
+failed:
+    g_warning("Could not open compressed archive '%s'!", path);
+    sooshi_compressed_archive_close(archive);
+
+    if (error) *error = SOOSHI_ERROR_ARCHIVE_FAILED;
+    return NULL;
+}
+
+void
+sooshi_compressed_archive_close(SooshiCompressedArchive *archive)
+{
+    if (archive == NULL)
+        return;
+
+    if (archive->file)
+        g_mapped_file_unref(archive->file);
+
+    g_strfreev(archive->names);
+    g_free(archive);
+}
+
+guint64
+sooshi_compressed_archive_find(const SooshiCompressedArchive *archive, gint64 timestamp)
+{
+    g_return_val_if_fail(archive != NULL, 0);
+
+    // First block with a row at or after timestamp
+    guint64 low = 0, high = archive->blocks;
+    while (low < high)
+    {
+        guint64 middle = low + (high - low) / 2;
+
+        if (archive->index[middle].last_timestamp < timestamp)
+            low = middle + 1;
+        else
+            high = middle;
+    }
+
+    return low;
+}
+
+guint
+sooshi_compressed_archive_decode(const SooshiCompressedArchive *archive, guint64 block,
+        gint64 *timestamps, gdouble **values)
+{
+    g_return_val_if_fail(archive != NULL, 0);
+    g_return_val_if_fail(block < archive->blocks, 0);
+
+    // Doesn't touch the archive, any number of threads may decode at once
+    const SooshiCompressedBlock *entry = &archive->index[block];
+
+    if (entry->offset > archive->length || entry->length > archive->length - entry->offset)
+        return 0;
+
+    guint rows = sooshi_codec_decode_block(archive->data + entry->offset, entry->length,
+            archive->columns, archive->block_rows, timestamps, values);
+
+    return rows == entry->rows ? rows : 0;
+}
@@ -0,0 +1,148 @@
+#include <math.h>
+#include <glib.h>
+
+#include "sooshi.h"
+
+/*
+ * Swinging door compression. From the last retained sample (the pivot) every
+ * dropped sample narrows the range of slopes a line may take while staying
+ * within the tolerance of it. A sample whose own slope from the pivot is still
+ * in that range could be retained without breaking the bound, so it is kept
+ * as a candidate. Once a sample falls outside, the previous candidate is
+ * retained and becomes the new pivot. Linear interpolation between retained
+ * samples reproduces every dropped one within the tolerance.
+ */
+
+static void
+sooshi_swinging_door_pivot(SooshiSwingingDoor *door, const SooshiSample *sample)
+{
+    door->retained = *sample;
+    door->last = *sample;
+    door->last_retained = TRUE;
+    door->tolerance = door->options.absolute + door->options.relative * fabs(sample->value);
+    door->lower = -INFINITY;
+    door->upper = INFINITY;
+}
+
+// Narrows the door by a sample that is not retained (yet)
+static void
+sooshi_swinging_door_narrow(SooshiSwingingDoor *door, const SooshiSample *sample)
+{
+    gdouble elapsed = sample->timestamp - door->retained.timestamp;
+
+    door->lower = MAX(door->lower, (sample->value - door->tolerance - door->retained.value) / elapsed);
+    door->upper = MIN(door->upper, (sample->value + door->tolerance - door->retained.value) / elapsed);
+    door->last = *sample;
+    door->last_retained = FALSE;
+}
+
+void
+sooshi_swinging_door_init(SooshiSwingingDoor *door, const SooshiCompression *compression)
+{
+    g_return_if_fail(door != NULL);
+    g_return_if_fail(compression != NULL);
+
+    door->options = *compression;
+    door->started = FALSE;
+}
+
+guint
+sooshi_swinging_door_add(SooshiSwingingDoor *door, const SooshiSample *sample, SooshiSample *retained)
+{
+    g_return_val_if_fail(door != NULL, 0);
+    g_return_val_if_fail(sample != NULL, 0);
+    g_return_val_if_fail(retained != NULL, 0);
+
+    guint count = 0;
+
+    if (!door->started)
+    {
+        door->started = TRUE;
+        sooshi_swinging_door_pivot(door, sample);
+        retained[count++] = *sample;
+        return count;
+    }
+
+    gint64 elapsed = sample->timestamp - door->retained.timestamp;
+    gint64 max_interval = (gint64)door->options.max_interval_ms * 1000;
+
+    // Gaps in the signal and samples at the pivot's time can't be interpolated
+    // over, they end the segment and are retained right away
+    if (elapsed <= 0 || !isfinite(sample->value) || !isfinite(door->retained.value)
+            || (max_interval > 0 && elapsed >= max_interval))
+    {
+        if (!door->last_retained)
+            retained[count++] = door->last;
+
+        sooshi_swinging_door_pivot(door, sample);
+        retained[count++] = *sample;
+        return count;
+    }
+
+    gdouble slope = (sample->value - door->retained.value) / elapsed;
+
+    if (slope >= door->lower && slope <= door->upper)
+    {
+        sooshi_swinging_door_narrow(door, sample);
+        return count;
+    }
+
+    // The door is shut: the previous sample was the last one the line could
+    // reach, it's never the pivot itself since the door starts wide open
+    retained[count++] = door->last;
+    sooshi_swinging_door_pivot(door, &door->last);
+
+    if (sample->timestamp > door->retained.timestamp)
+        sooshi_swinging_door_narrow(door, sample);
+    else
+    {
+        sooshi_swinging_door_pivot(door, sample);
+        retained[count++] = *sample;
+    }
+
+    return count;
+}
+
+guint
+sooshi_swinging_door_flush(SooshiSwingingDoor *door, SooshiSample *retained)
+{
+    g_return_val_if_fail(door != NULL, 0);
+    g_return_val_if_fail(retained != NULL, 0);
+
+    if (!door->started || door->last_retained)
+        return 0;
+
+    *retained = door->last;
+    sooshi_swinging_door_pivot(door, &door->last);
+
+    return 1;
+}
+
+gdouble
+sooshi_compression_interpolate(const gint64 *timestamps, const gdouble *values, guint64 count, gint64 timestamp)
+{
+    g_return_val_if_fail(timestamps != NULL || count == 0, NAN);
+    g_return_val_if_fail(values != NULL || count == 0, NAN);
+
+    // First retained sample at or after timestamp
+    guint64 low = 0, high = count;
+    while (low < high)
+    {
+        guint64 middle = low + (high - low) / 2;
+
+        if (timestamps[middle] < timestamp)
+            low = middle + 1;
+        else
+            high = middle;
+    }
+
+    if (low == count || (low == 0 && timestamps[0] != timestamp))
+        return NAN;
+
+    if (timestamps[low] == timestamp)
+        return values[low];
+
+    gdouble fraction = (gdouble)(timestamp - timestamps[low - 1]) / (timestamps[low] - timestamps[low - 1]);
+
+    return values[low - 1] + fraction * (values[low] - values[low - 1]);
+}
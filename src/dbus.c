@@ -0,0 +1,263 @@
+#include <glib.h>
+#include <string.h>
+
+#include "sooshi.h"
+
+static gchar *
+sooshi_dbus_index_key(const gchar *interface_name, const gchar *uuid)
+{
+    if (uuid == NULL)
+        return g_strdup(interface_name);
+
+    gchar *upper = g_ascii_strup(uuid, -1);
+    gchar *key = g_strconcat(interface_name, ":", upper, NULL);
+    g_free(upper);
+
+    return key;
+}
+
+static void
+sooshi_dbus_index_insert(SooshiDBusIndex *index, const gchar *interface_name, const gchar *uuid, GDBusInterface *interface)
+{
+    gchar *key = sooshi_dbus_index_key(interface_name, uuid);
+    GHashTable *entries = g_hash_table_lookup(index->entries, key);
+
+    if (entries == NULL)
+    {
+        entries = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_object_unref);
+        g_hash_table_insert(index->entries, key, entries);
+    }
+    else
+        g_free(key);
+
+    const gchar *path = g_dbus_proxy_get_object_path(G_DBUS_PROXY(interface));
+    g_hash_table_replace(entries, g_strdup(path), g_object_ref(interface));
+}
+
+static void
+sooshi_dbus_index_remove_path(SooshiDBusIndex *index, const gchar *path, const gchar *interface_name)
+{
+    GHashTableIter iter;
+    gpointer key, entries;
+
+    g_hash_table_iter_init(&iter, index->entries);
+    while (g_hash_table_iter_next(&iter, &key, &entries))
+    {
+        if (interface_name && !g_str_has_prefix((const gchar*)key, interface_name))
+            continue;
+
+        g_hash_table_remove((GHashTable*)entries, path);
+    }
+}
+
+static void
+sooshi_dbus_index_add_interface(SooshiDBusIndex *index, GDBusInterface *interface)
+{
+    GDBusProxy *proxy = G_DBUS_PROXY(interface);
+    const gchar *interface_name = g_dbus_proxy_get_interface_name(proxy);
+
+    sooshi_dbus_index_insert(index, interface_name, NULL, interface);
+
+    // Devices and characteristics are additionally indexed by their UUIDs
+    if (g_strcmp0(interface_name, BLUEZ_DEVICE_INTERFACE) == 0)
+    {
+        GVariant *v_uuids = g_dbus_proxy_get_cached_property(proxy, "UUIDs");
+
+        if (v_uuids == NULL)
+            return;
+
+        GVariantIter *iter = g_variant_iter_new(v_uuids);
+        gchar *uuid;
+        while (g_variant_iter_loop(iter, "s", &uuid))
+            sooshi_dbus_index_insert(index, interface_name, uuid, interface);
+
+        g_variant_iter_free(iter);
+        g_variant_unref(v_uuids);
+    }
+    else if (g_strcmp0(interface_name, BLUEZ_GATT_CHARACTERISTIC_INTERFACE) == 0)
+    {
+        GVariant *v_uuid = g_dbus_proxy_get_cached_property(proxy, "UUID");
+
+        if (v_uuid == NULL)
+            return;
+
+        sooshi_dbus_index_insert(index, interface_name, g_variant_get_string(v_uuid, NULL), interface);
+        g_variant_unref(v_uuid);
+    }
+}
+
+static void
+sooshi_dbus_index_add_object(SooshiDBusIndex *index, GDBusObject *obj)
+{
+    GList *interfaces = g_dbus_object_get_interfaces(obj);
+
+    GList *elem;
+    for (elem = interfaces; elem; elem = elem->next)
+        sooshi_dbus_index_add_interface(index, G_DBUS_INTERFACE(elem->data));
+
+    g_list_free_full(interfaces, g_object_unref);
+}
+
+static void
+sooshi_dbus_on_object_added(GDBusObjectManager *objman, GDBusObject *obj, gpointer user_data)
+{
+    sooshi_dbus_index_add_object((SooshiDBusIndex*)user_data, obj);
+}
+
+static void
+sooshi_dbus_on_object_removed(GDBusObjectManager *objman, GDBusObject *obj, gpointer user_data)
+{
+    sooshi_dbus_index_remove_path((SooshiDBusIndex*)user_data, g_dbus_object_get_object_path(obj), NULL);
+}
+
+static void
+sooshi_dbus_on_interface_added(GDBusObjectManager *objman, GDBusObject *obj, GDBusInterface *interface, gpointer user_data)
+{
+    sooshi_dbus_index_add_interface((SooshiDBusIndex*)user_data, interface);
+}
+
+static void
+sooshi_dbus_on_interface_removed(GDBusObjectManager *objman, GDBusObject *obj, GDBusInterface *interface, gpointer user_data)
+{
+    sooshi_dbus_index_remove_path((SooshiDBusIndex*)user_data,
+            g_dbus_object_get_object_path(obj),
+            g_dbus_proxy_get_interface_name(G_DBUS_PROXY(interface)));
+}
+
+static void
+sooshi_dbus_on_properties_changed(GDBusObjectManagerClient *objman, GDBusObjectProxy *obj, GDBusProxy *proxy,
+        GVariant *changed_properties, GStrv invalidated_properties, gpointer user_data)
+{
+    SooshiDBusIndex *index = (SooshiDBusIndex*)user_data;
+
+    // BlueZ fills in a device's UUIDs only once its services are resolved
+    if (g_strcmp0(g_dbus_proxy_get_interface_name(proxy), BLUEZ_DEVICE_INTERFACE) != 0)
+        return;
+
+    GVariantDict *dict = g_variant_dict_new(changed_properties);
+
+    if (g_variant_dict_contains(dict, "UUIDs"))
+    {
+        const gchar *path = g_dbus_proxy_get_object_path(proxy);
+        sooshi_dbus_index_remove_path(index, path, BLUEZ_DEVICE_INTERFACE);
+        sooshi_dbus_index_add_interface(index, G_DBUS_INTERFACE(proxy));
+    }
+
+    g_variant_dict_unref(dict);
+}
+
+SooshiDBusIndex *
+sooshi_dbus_index_new(GDBusObjectManager *object_manager)
+{
+    g_return_val_if_fail(object_manager != NULL, NULL);
+
+    SooshiDBusIndex *index = g_new0(SooshiDBusIndex, 1);
+    index->ref_count = 1;
+    index->object_manager = g_object_ref(object_manager);
+    index->entries = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, (GDestroyNotify)g_hash_table_unref);
+
+    GList *objects = g_dbus_object_manager_get_objects(object_manager);
+
+    GList *elem;
+    for (elem = objects; elem; elem = elem->next)
+        sooshi_dbus_index_add_object(index, G_DBUS_OBJECT(elem->data));
+
+    g_list_free_full(objects, g_object_unref);
+
+    index->signal_ids[0] = g_signal_connect(object_manager,
+        "object-added", G_CALLBACK(sooshi_dbus_on_object_added), index);
+    index->signal_ids[1] = g_signal_connect(object_manager,
+        "object-removed", G_CALLBACK(sooshi_dbus_on_object_removed), index);
+    index->signal_ids[2] = g_signal_connect(object_manager,
+        "interface-added", G_CALLBACK(sooshi_dbus_on_interface_added), index);
+    index->signal_ids[3] = g_signal_connect(object_manager,
+        "interface-removed", G_CALLBACK(sooshi_dbus_on_interface_removed), index);
+    index->signal_ids[4] = g_signal_connect(object_manager,
+        "interface-proxy-properties-changed", G_CALLBACK(sooshi_dbus_on_properties_changed), index);
+
+    return index;
+}
+
+SooshiDBusIndex *
+sooshi_dbus_index_ref(SooshiDBusIndex *index)
+{
+    g_return_val_if_fail(index != NULL, NULL);
+
+    index->ref_count++;
+    return index;
+}
+
+void
+sooshi_dbus_index_unref(SooshiDBusIndex *index)
+{
+    g_return_if_fail(index != NULL);
+
+    if (--index->ref_count > 0)
+        return;
+
+    for (guint i = 0; i < G_N_ELEMENTS(index->signal_ids); ++i)
+    {
+        if (index->signal_ids[i] > 0)
+            g_signal_handler_disconnect(index->object_manager, index->signal_ids[i]);
+    }
+
+    g_hash_table_unref(index->entries);
+    g_object_unref(index->object_manager);
+    g_free(index);
+}
+
+GDBusProxy *
+sooshi_dbus_find_interface_proxy_if(SooshiState *state, const gchar* interface_name, dbus_conditional_func_t cond_func, gpointer user_data)
+{
+    g_return_val_if_fail(state != NULL, NULL);
+    g_return_val_if_fail(state->dbus_index != NULL, NULL);
+
+    GHashTable *entries = g_hash_table_lookup(state->dbus_index->entries, interface_name);
+
+    if (!entries)
+        return NULL;
+
+    GHashTableIter iter;
+    gpointer interface;
+
+    g_hash_table_iter_init(&iter, entries);
+    while (g_hash_table_iter_next(&iter, NULL, &interface))
+    {
+        if (!cond_func || cond_func(G_DBUS_INTERFACE(interface), user_data) == TRUE)
+        {
+            g_info("Found interface %s!", interface_name);
+            return G_DBUS_PROXY(g_object_ref(interface));
+        }
+    }
+
+    return NULL;
+}
+
+GDBusProxy *
+sooshi_dbus_find_proxy_by_uuid(SooshiState *state, const gchar *interface_name, const gchar *uuid, const gchar *path_prefix)
+{
+    g_return_val_if_fail(state != NULL, NULL);
+    g_return_val_if_fail(state->dbus_index != NULL, NULL);
+
+    gchar *key = sooshi_dbus_index_key(interface_name, uuid);
+    GHashTable *entries = g_hash_table_lookup(state->dbus_index->entries, key);
+    g_free(key);
+
+    if (!entries)
+        return NULL;
+
+    GHashTableIter iter;
+    gpointer path, interface;
+
+    g_hash_table_iter_init(&iter, entries);
+    while (g_hash_table_iter_next(&iter, &path, &interface))
+    {
+        if (path_prefix == NULL || g_str_has_prefix((const gchar*)path, path_prefix))
+        {
+            g_info("Found %s with UUID %s!", interface_name, uuid);
+            return G_DBUS_PROXY(g_object_ref(interface));
+        }
+    }
+
+    return NULL;
+}
@@ -25,6 +25,15 @@ sooshi_node_value_as_string(SooshiNode *node)
     return g_strdup("");
 }
 
+gboolean
+sooshi_debug_enabled(void)
+{
+    // Same rules as GLib's default handler uses for our g_debug() messages
+    const gchar *domains = g_getenv("G_MESSAGES_DEBUG");
+
+    return domains && (strstr(domains, "all") || strstr(domains, "sooshi"));
+}
+
 void
 sooshi_debug_dump_tree(SooshiNode *node, gint indent)
 {
@@ -48,3 +57,17 @@ sooshi_debug_dump_tree(SooshiNode *node, gint indent)
     }
 }
 
+
+void
+sooshi_debug_dump_timeline(const SooshiTimeline *timeline)
+{
+    for (guint i = 0; i < SOOSHI_PHASE_COUNT; ++i)
+    {
+        gint64 elapsed = sooshi_timeline_elapsed(timeline, i);
+
+        if (elapsed < 0)
+            printf("%-26s -\n", SOOSHI_PHASE_TO_STR(i));
+        else
+            printf("%-26s %10.1fms\n", SOOSHI_PHASE_TO_STR(i), elapsed / 1000.0);
+    }
+}
@@ -6,4 +6,6 @@ const gchar *const __SOOSHI_ERROR_STR[] =
     "No powered up Bluetooth adapter found!",
     "Error starting Bluetooth scan!",
     "Error communicating with DBus!",
+    "Error accessing capture file!",
+    "Error accessing archive!",
 };
@@ -0,0 +1,70 @@
+#include <glib.h>
+#include <string.h>
+
+#include "sooshi.h"
+
+// Every field is accessed atomically so readers never see torn values,
+// without taking a lock on the hot path.
+void
+sooshi_histogram_record(SooshiHistogram *histogram, guint64 value)
+{
+    guint bucket = 0;
+
+    // Bucket n holds values in [2^n, 2^(n+1)), bucket 0 also takes 0
+    while (bucket < SOOSHI_HISTOGRAM_BUCKETS - 1 && (value >> (bucket + 1)) > 0)
+        bucket++;
+
+    if (__atomic_load_n(&histogram->count, __ATOMIC_RELAXED) == 0
+            || value < __atomic_load_n(&histogram->min, __ATOMIC_RELAXED))
+        __atomic_store_n(&histogram->min, value, __ATOMIC_RELAXED);
+
+    if (value > __atomic_load_n(&histogram->max, __ATOMIC_RELAXED))
+        __atomic_store_n(&histogram->max, value, __ATOMIC_RELAXED);
+
+    __atomic_fetch_add(&histogram->sum, value, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&histogram->buckets[bucket], 1, __ATOMIC_RELAXED);
+
+    // Published last, a reader seeing the count also sees the value's bucket
+    __atomic_fetch_add(&histogram->count, 1, __ATOMIC_RELEASE);
+}
+
+void
+sooshi_histogram_load(SooshiHistogram *dest, const SooshiHistogram *src)
+{
+    dest->count = __atomic_load_n(&src->count, __ATOMIC_ACQUIRE);
+    dest->sum = __atomic_load_n(&src->sum, __ATOMIC_RELAXED);
+    dest->min = __atomic_load_n(&src->min, __ATOMIC_RELAXED);
+    dest->max = __atomic_load_n(&src->max, __ATOMIC_RELAXED);
+
+    for (guint i = 0; i < SOOSHI_HISTOGRAM_BUCKETS; ++i)
+        dest->buckets[i] = __atomic_load_n(&src->buckets[i], __ATOMIC_RELAXED);
+}
+
+void
+sooshi_histogram_reset(SooshiHistogram *histogram)
+{
+    memset(histogram, 0, sizeof(SooshiHistogram));
+}
+
+guint64
+sooshi_histogram_percentile(const SooshiHistogram *histogram, gdouble percentile)
+{
+    g_return_val_if_fail(histogram != NULL, 0);
+
+    if (histogram->count == 0)
+        return 0;
+
+    guint64 rank = (guint64)(percentile / 100.0 * histogram->count);
+    guint64 seen = 0;
+
+    for (guint i = 0; i < SOOSHI_HISTOGRAM_BUCKETS; ++i)
+    {
+        seen += histogram->buckets[i];
+
+        // Report the upper bound of the bucket, but never more than we have actually seen
+        if (seen > rank)
+            return MIN(((guint64)2 << i) - 1, histogram->max);
+    }
+
+    return histogram->max;
+}
@@ -0,0 +1,162 @@
+#include <glib.h>
+
+#include "sooshi.h"
+
+// Views point right into the ring, so they are only valid until the next
+// value arrives, e.g. for the duration of a subscriber callback.
+
+void
+sooshi_history_free(SooshiHistory *history)
+{
+    if (history == NULL)
+        return;
+
+    g_free(history->samples);
+    g_free(history);
+}
+
+// Ring position of the index-th oldest sample
+static guint
+sooshi_history_position(const SooshiHistory *history, guint index)
+{
+    return (history->head + history->capacity - history->length + index) % history->capacity;
+}
+
+// Describes the count samples starting at the index-th oldest one
+static guint
+sooshi_history_view(const SooshiHistory *history, guint index, guint count, SooshiHistoryView *view)
+{
+    view->first = NULL;
+    view->first_length = 0;
+    view->second = NULL;
+    view->second_length = 0;
+
+    if (count == 0)
+        return 0;
+
+    guint start = sooshi_history_position(history, index);
+
+    view->first = history->samples + start;
+    view->first_length = MIN(count, history->capacity - start);
+
+    if (view->first_length < count)
+    {
+        view->second = history->samples;
+        view->second_length = count - view->first_length;
+    }
+
+    return count;
+}
+
+// Index of the oldest sample at or after timestamp, length if there is none.
+// Timestamps are monotonic, so the ring is sorted by them.
+static guint
+sooshi_history_find(const SooshiHistory *history, gint64 timestamp)
+{
+    guint low = 0, high = history->length;
+
+    while (low < high)
+    {
+        guint middle = low + (high - low) / 2;
+
+        if (history->samples[sooshi_history_position(history, middle)].timestamp < timestamp)
+            low = middle + 1;
+        else
+            high = middle;
+    }
+
+    return low;
+}
+
+void
+sooshi_history_on_value(SooshiState *state, SooshiNode *node)
+{
+    SooshiHistory *history = node->history;
+    gdouble value;
+
+    if (history == NULL || !sooshi_node_value_as_double(node, &value))
+        return;
+
+    history->samples[history->head].timestamp = node->last_update;
+    history->samples[history->head].value = value;
+
+    history->head = (history->head + 1) % history->capacity;
+
+    if (history->length < history->capacity)
+        history->length++;
+}
+
+gboolean
+sooshi_node_history_enable(SooshiState *state, SooshiNode *node, guint capacity)
+{
+    g_return_val_if_fail(state != NULL, FALSE);
+    g_return_val_if_fail(node != NULL, FALSE);
+    g_return_val_if_fail(capacity > 0, FALSE);
+
+    if (!sooshi_node_is_numeric(node))
+    {
+        g_warning("Node '%s' has no numeric value to keep a history of!", node->name);
+        return FALSE;
+    }
+
+    sooshi_history_free(node->history);
+
+    node->history = g_new0(SooshiHistory, 1);
+    node->history->samples = g_new(SooshiSample, capacity);
+    node->history->capacity = capacity;
+
+    return TRUE;
+}
+
+void
+sooshi_node_history_disable(SooshiState *state, SooshiNode *node)
+{
+    g_return_if_fail(state != NULL);
+    g_return_if_fail(node != NULL);
+
+    sooshi_history_free(node->history);
+    node->history = NULL;
+}
+
+guint
+sooshi_node_history_last(SooshiState *state, SooshiNode *node, guint count, SooshiHistoryView *view)
+{
+    g_return_val_if_fail(state != NULL, 0);
+    g_return_val_if_fail(node != NULL, 0);
+    g_return_val_if_fail(node->history != NULL, 0);
+    g_return_val_if_fail(view != NULL, 0);
+
+    SooshiHistory *history = node->history;
+    count = MIN(count, history->length);
+
+    return sooshi_history_view(history, history->length - count, count, view);
+}
+
+guint
+sooshi_node_history_between(SooshiState *state, SooshiNode *node, gint64 from, gint64 to, SooshiHistoryView *view)
+{
+    g_return_val_if_fail(state != NULL, 0);
+    g_return_val_if_fail(node != NULL, 0);
+    g_return_val_if_fail(node->history != NULL, 0);
+    g_return_val_if_fail(view != NULL, 0);
+
+    // Both ends are inclusive
+    SooshiHistory *history = node->history;
+    guint first = sooshi_history_find(history, from);
+    guint end = to < G_MAXINT64 ? sooshi_history_find(history, to + 1) : history->length;
+
+    return sooshi_history_view(history, first, end > first ? end - first : 0, view);
+}
+
+const SooshiSample *
+sooshi_history_view_get(const SooshiHistoryView *view, guint index)
+{
+    g_return_val_if_fail(view != NULL, NULL);
+
+    if (index < view->first_length)
+        return view->first + index;
+
+    index -= view->first_length;
+
+    return index < view->second_length ? view->second + index : NULL;
+}
@@ -0,0 +1,155 @@
+#include <glib.h>
+
+#include "sooshi.h"
+
+// Only the reply to the probe itself is a round trip, not a late answer to an
+// earlier one or a read of the same node by the application
+static void
+sooshi_link_on_probe_done(SooshiState *state, SooshiRequest *request, gpointer user_data)
+{
+    if (request->status == SOOSHI_REQUEST_DONE && state->link_probe_lost == FALSE)
+        sooshi_histogram_record(&state->link_rtt, request->completed - request->issued);
+
+    state->link_probe = NULL;
+    sooshi_request_unref(request);
+}
+
+static gboolean
+sooshi_link_monitor_tick(gpointer user_data)
+{
+    SooshiState *state = SOOSHI_STATE(user_data);
+    gint64 now = g_get_monotonic_time();
+    gint64 rx_quiet = now - state->link_last_rx;
+    gint64 tx_quiet = now - state->link_last_tx;
+
+    if (rx_quiet >= (gint64)state->link_stall_ms * 1000)
+    {
+        if (state->link_stalled == FALSE)
+        {
+            g_warning("Link stalled, nothing received for %" G_GINT64_FORMAT "ms", rx_quiet / 1000);
+            state->link_stalled = TRUE;
+
+            if (state->link_stalled_handler)
+                state->link_stalled_handler(state, state->link_stalled_data);
+        }
+    }
+
+    // Finished without telling us, e.g. by the tree being downloaded again
+    if (state->link_probe && state->link_probe->status != SOOSHI_REQUEST_PENDING)
+    {
+        sooshi_request_unref(state->link_probe);
+        state->link_probe = NULL;
+    }
+
+    if (state->link_probe)
+    {
+        gint64 age = now - state->link_probe->issued;
+
+        // A probe that has been unanswered for a full idle period is considered lost
+        if (state->link_probe_lost == FALSE && age >= (gint64)state->link_idle_ms * 1000)
+        {
+            state->link_probes_lost++;
+            state->link_probe_lost = TRUE;
+        }
+
+        // Its reply stays in line a while longer, so a late answer to it isn't
+        // taken for the answer to the next probe
+        if (age >= (gint64)MAX(state->link_idle_ms, SOOSHI_REQUEST_REPLY_LOST_MS) * 1000)
+            sooshi_request_cancel(state->link_probe);
+    }
+
+    // Anything coming in proves the link is alive, so only probe once it goes
+    // quiet. The meter still expects to hear from us every now and then, so
+    // probe anyway if we have not written anything for a while.
+    if (state->link_probe == NULL &&
+        (rx_quiet >= (gint64)state->link_idle_ms * 1000 || tx_quiet >= SOOSHI_LINK_KEEPALIVE_MS * 1000))
+    {
+        if (state->link_probe_node == NULL)
+            state->link_probe_node = sooshi_node_find(state, "PCB_VERSION", NULL);
+
+        if (state->link_probe_node)
+        {
+            state->link_probes_sent++;
+            state->link_probe_lost = FALSE;
+            state->link_probe = sooshi_node_read_async(state, state->link_probe_node, 0,
+                    sooshi_link_on_probe_done, NULL);
+        }
+    }
+
+    return TRUE;
+}
+
+void
+sooshi_link_monitor_start(SooshiState *state)
+{
+    if (state->heartbeat_source_id > 0)
+        return;
+
+    guint interval = MIN(state->link_idle_ms, state->link_stall_ms) / 4;
+
+    state->link_last_rx = g_get_monotonic_time();
+    state->link_last_tx = state->link_last_rx;
+    state->heartbeat_source_id = sooshi_timeout_add(state, MAX(interval, 50), sooshi_link_monitor_tick, (gpointer) state);
+}
+
+void
+sooshi_link_monitor_stop(SooshiState *state)
+{
+    if (state->heartbeat_source_id > 0)
+        sooshi_source_remove(state, state->heartbeat_source_id);
+
+    state->heartbeat_source_id = 0;
+
+    if (state->link_probe)
+        sooshi_request_cancel(state->link_probe);
+
+    // It already was finished without telling us
+    if (state->link_probe)
+        sooshi_request_unref(state->link_probe);
+    state->link_probe = NULL;
+}
+
+void
+sooshi_link_on_receive(SooshiState *state)
+{
+    state->link_last_rx = g_get_monotonic_time();
+
+    if (state->link_stalled == TRUE)
+    {
+        g_info("Link recovered");
+        state->link_stalled = FALSE;
+    }
+}
+
+void
+sooshi_link_monitor_configure(SooshiState *state, guint idle_ms, guint stall_ms,
+        sooshi_callback_t stalled_handler, gpointer stalled_data)
+{
+    g_return_if_fail(state != NULL);
+    g_return_if_fail(idle_ms > 0 && stall_ms > 0);
+
+    state->link_idle_ms = idle_ms;
+    state->link_stall_ms = stall_ms;
+    state->link_stalled_handler = stalled_handler;
+    state->link_stalled_data = stalled_data;
+
+    // Pick up the new intervals if we are already running
+    if (state->heartbeat_source_id > 0)
+    {
+        sooshi_link_monitor_stop(state);
+        sooshi_link_monitor_start(state);
+    }
+}
+
+void
+sooshi_link_get_stats(SooshiState *state, SooshiLinkStats *stats)
+{
+    g_return_if_fail(state != NULL);
+    g_return_if_fail(stats != NULL);
+
+    stats->rx_quiet_ms = (g_get_monotonic_time() - state->link_last_rx) / 1000;
+    stats->stalled = state->link_stalled;
+    stats->probes_sent = state->link_probes_sent;
+    stats->probes_lost = state->link_probes_lost;
+    sooshi_histogram_load(&stats->rtt, &state->link_rtt);
+}
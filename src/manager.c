@@ -0,0 +1,661 @@
+#include <glib.h>
+
+#include "sooshi.h"
+
+typedef struct _SooshiManagerSubscription SooshiManagerSubscription;
+struct _SooshiManagerSubscription
+{
+    gchar *path;
+    sooshi_node_subscriber_handler_t handler;
+    gpointer user_data;
+};
+
+static void
+sooshi_manager_subscription_free(gpointer data)
+{
+    SooshiManagerSubscription *sub = (SooshiManagerSubscription*)data;
+
+    g_free(sub->path);
+    g_free(sub);
+}
+
+static void
+sooshi_manager_adapter_free(gpointer data)
+{
+    SooshiAdapter *adapter = (SooshiAdapter*)data;
+
+    g_object_unref(adapter->proxy);
+    g_free(adapter->path);
+    g_free(adapter);
+}
+
+static void
+sooshi_manager_meter_free(gpointer data)
+{
+    SooshiManagerMeter *meter = (SooshiManagerMeter*)data;
+
+    if (meter->state) g_object_unref(meter->state);
+    g_hash_table_unref(meter->candidates);
+    g_hash_table_unref(meter->applied);
+    g_free(meter);
+}
+
+static SooshiAdapter *
+sooshi_manager_find_adapter(SooshiManager *manager, const gchar *path)
+{
+    for (guint i = 0; i < manager->adapters->len; ++i)
+    {
+        SooshiAdapter *adapter = g_ptr_array_index(manager->adapters, i);
+
+        if (g_strcmp0(adapter->path, path) == 0)
+            return adapter;
+    }
+
+    return NULL;
+}
+
+static SooshiAdapter *
+sooshi_manager_adapter_of(SooshiManager *manager, SooshiState *state)
+{
+    if (state->mooshimeter == NULL)
+        return NULL;
+
+    GVariant *v_adapter = g_dbus_proxy_get_cached_property(state->mooshimeter, "Adapter");
+
+    if (v_adapter == NULL)
+        return NULL;
+
+    SooshiAdapter *adapter = sooshi_manager_find_adapter(manager, g_variant_get_string(v_adapter, NULL));
+    g_variant_unref(v_adapter);
+
+    return adapter;
+}
+
+static gboolean
+sooshi_manager_adapter_saturated(SooshiManager *manager, SooshiAdapter *adapter, guint extra_connections)
+{
+    if (adapter->connections + extra_connections > manager->max_connections)
+        return TRUE;
+
+    return (manager->max_throughput > 0 && adapter->throughput > manager->max_throughput);
+}
+
+// Least loaded adapter the meter can be reached through, NULL if all of them are saturated
+static SooshiAdapter *
+sooshi_manager_pick_adapter(SooshiManager *manager, SooshiManagerMeter *meter, SooshiAdapter *exclude)
+{
+    SooshiAdapter *best = NULL;
+
+    GHashTableIter iter;
+    gpointer path;
+
+    g_hash_table_iter_init(&iter, meter->candidates);
+    while (g_hash_table_iter_next(&iter, &path, NULL))
+    {
+        SooshiAdapter *adapter = sooshi_manager_find_adapter(manager, path);
+
+        if (adapter == NULL || adapter == exclude || sooshi_manager_adapter_saturated(manager, adapter, 1))
+            continue;
+
+        if (best == NULL || adapter->connections < best->connections ||
+            (adapter->connections == best->connections && adapter->throughput < best->throughput))
+            best = adapter;
+    }
+
+    return best;
+}
+
+static SooshiManagerMeter *
+sooshi_manager_meter_of(SooshiManager *manager, SooshiState *state)
+{
+    GHashTableIter iter;
+    gpointer value;
+
+    g_hash_table_iter_init(&iter, manager->meters);
+    while (g_hash_table_iter_next(&iter, NULL, &value))
+        if (((SooshiManagerMeter*)value)->state == state)
+            return value;
+
+    return NULL;
+}
+
+static gboolean
+sooshi_manager_node_has_subscriber(SooshiNode *node, guint id)
+{
+    GList *elem;
+    for (elem = node->subscriber; elem; elem = elem->next)
+    {
+        SooshiNodeSubscriber *sub = elem->data;
+
+        if (sub->id == id && sub->removed == FALSE)
+            return TRUE;
+    }
+
+    return FALSE;
+}
+
+static void
+sooshi_manager_apply_subscription(SooshiManagerMeter *meter, SooshiManagerSubscription *sub)
+{
+    SooshiNode *node = sooshi_node_find(meter->state, sub->path, NULL);
+
+    if (node == NULL)
+    {
+        g_warning("Meter %s has no node '%s'!", meter->state->mooshimeter_dbus_path, sub->path);
+        g_hash_table_remove(meter->applied, sub);
+        return;
+    }
+
+    // A reloaded tree keeps the subscribers of the nodes it still has, only
+    // those that went away with their node are subscribed again
+    guint id = GPOINTER_TO_UINT(g_hash_table_lookup(meter->applied, sub));
+    if (id != 0 && sooshi_manager_node_has_subscriber(node, id))
+        return;
+
+    id = sooshi_node_subscribe(meter->state, node, sub->handler, sub->user_data);
+    g_hash_table_insert(meter->applied, sub, GUINT_TO_POINTER(id));
+}
+
+static void
+sooshi_manager_on_meter_initialized(SooshiState *state, gpointer user_data)
+{
+    SooshiManager *manager = (SooshiManager*)user_data;
+    SooshiManagerMeter *meter = sooshi_manager_meter_of(manager, state);
+
+    g_info("Meter %s initialized", state->mooshimeter_dbus_path);
+
+    // Runs again after each reconnect or tree reload
+    GList *elem;
+    for (elem = manager->subscriptions; meter && elem; elem = elem->next)
+        sooshi_manager_apply_subscription(meter, elem->data);
+
+    if (manager->meter_handler)
+        manager->meter_handler(manager, state, manager->meter_data);
+}
+
+static void
+sooshi_manager_connect_meter(SooshiManager *manager, SooshiManagerMeter *meter)
+{
+    SooshiAdapter *adapter = sooshi_manager_pick_adapter(manager, meter, NULL);
+
+    if (adapter == NULL)
+    {
+        g_warning("All adapters that can reach %s are saturated, not connecting (yet)", meter->address);
+        return;
+    }
+
+    GDBusProxy *device = g_hash_table_lookup(meter->candidates, adapter->path);
+    g_info("Connecting %s through adapter %s", meter->address, adapter->path);
+
+    meter->state = sooshi_state_new_shared(manager->context, manager->dbus_index, adapter->proxy);
+    adapter->connections++;
+
+    // Keep meters around even if they drop or never answer the first time
+    sooshi_set_auto_reconnect(meter->state, TRUE, NULL, NULL);
+
+    // Doesn't wait for the connection, the other meters are connected meanwhile
+    if (!sooshi_attach_mooshi(meter->state, device, sooshi_manager_on_meter_initialized, manager))
+        g_warning("Could not connect to Mooshimeter %s", meter->address);
+}
+
+static void
+sooshi_manager_consider_device(SooshiManager *manager, GDBusInterface *device)
+{
+    if (!sooshi_cond_is_mooshimeter(device, (gpointer)METER_SERVICE_UUID))
+        return;
+
+    GVariant *v_address = g_dbus_proxy_get_cached_property(G_DBUS_PROXY(device), "Address");
+    GVariant *v_adapter = g_dbus_proxy_get_cached_property(G_DBUS_PROXY(device), "Adapter");
+
+    if (v_address == NULL || v_adapter == NULL)
+    {
+        if (v_address) g_variant_unref(v_address);
+        if (v_adapter) g_variant_unref(v_adapter);
+        return;
+    }
+
+    const gchar *address = g_variant_get_string(v_address, NULL);
+    const gchar *adapter_path = g_variant_get_string(v_adapter, NULL);
+
+    // Every adapter that sees the meter has its own device object for it
+    SooshiManagerMeter *meter = g_hash_table_lookup(manager->meters, address);
+    if (meter == NULL)
+    {
+        g_info("Found Mooshimeter %s", address);
+
+        meter = g_new0(SooshiManagerMeter, 1);
+        meter->address = g_strdup(address);
+        meter->candidates = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_object_unref);
+        meter->applied = g_hash_table_new(NULL, NULL);
+        g_hash_table_insert(manager->meters, meter->address, meter);
+    }
+
+    if (!g_hash_table_contains(meter->candidates, adapter_path))
+    {
+        g_debug("Mooshimeter %s is reachable through %s", address, adapter_path);
+        g_hash_table_insert(meter->candidates, g_strdup(adapter_path), g_object_ref(device));
+    }
+
+    if (meter->state == NULL && sooshi_manager_find_adapter(manager, adapter_path))
+        sooshi_manager_connect_meter(manager, meter);
+
+    g_variant_unref(v_address);
+    g_variant_unref(v_adapter);
+}
+
+static gboolean
+sooshi_manager_rebalance(gpointer user_data)
+{
+    SooshiManager *manager = (SooshiManager*)user_data;
+    gint64 now = g_get_monotonic_time();
+    gdouble elapsed = (now - manager->last_rebalance) / (gdouble)G_USEC_PER_SEC;
+    manager->last_rebalance = now;
+
+    for (guint i = 0; i < manager->adapters->len; ++i)
+    {
+        SooshiAdapter *adapter = g_ptr_array_index(manager->adapters, i);
+        adapter->connections = 0;
+        adapter->throughput = 0.0;
+    }
+
+    // Measure what every adapter is carrying right now
+    GHashTableIter iter;
+    gpointer value;
+
+    g_hash_table_iter_init(&iter, manager->meters);
+    while (g_hash_table_iter_next(&iter, NULL, &value))
+    {
+        SooshiManagerMeter *meter = value;
+        SooshiAdapter *adapter;
+
+        if (meter->state == NULL || (adapter = sooshi_manager_adapter_of(manager, meter->state)) == NULL)
+            continue;
+
+        guint64 rx_bytes = __atomic_load_n(&meter->state->metrics.rx_bytes, __ATOMIC_RELAXED);
+        meter->throughput = (rx_bytes - meter->last_rx_bytes) / elapsed;
+        meter->last_rx_bytes = rx_bytes;
+
+        adapter->connections++;
+        adapter->throughput += meter->throughput;
+    }
+
+    // Move at most one meter per round, the numbers are stale after that
+    g_hash_table_iter_init(&iter, manager->meters);
+    while (g_hash_table_iter_next(&iter, NULL, &value))
+    {
+        SooshiManagerMeter *meter = value;
+
+        if (meter->state == NULL)
+        {
+            sooshi_manager_connect_meter(manager, meter);
+            continue;
+        }
+
+        SooshiAdapter *current = sooshi_manager_adapter_of(manager, meter->state);
+
+        if (current == NULL || !sooshi_manager_adapter_saturated(manager, current, 0))
+            continue;
+
+        SooshiAdapter *target = sooshi_manager_pick_adapter(manager, meter, current);
+
+        if (target == NULL)
+            continue;
+
+        g_info("Adapter %s is saturated (%u connections, %.0f B/s), moving %s to %s",
+                current->path, current->connections, current->throughput, meter->address, target->path);
+
+        sooshi_retarget_mooshi(meter->state, g_hash_table_lookup(meter->candidates, target->path), target->proxy);
+
+        current->connections--;
+        current->throughput -= meter->throughput;
+        target->connections++;
+        target->throughput += meter->throughput;
+        break;
+    }
+
+    return TRUE;
+}
+
+static void
+sooshi_manager_on_object_added(GDBusObjectManager *objman, GDBusObject *obj, gpointer user_data)
+{
+    GDBusInterface *device = g_dbus_object_get_interface(obj, BLUEZ_DEVICE_INTERFACE);
+
+    if (!device)
+        return;
+
+    sooshi_manager_consider_device((SooshiManager*)user_data, device);
+    g_object_unref(device);
+}
+
+static void
+sooshi_manager_on_properties_changed(GDBusObjectManagerClient *objman, GDBusObjectProxy *obj, GDBusProxy *proxy,
+        GVariant *changed_properties, GStrv invalidated_properties, gpointer user_data)
+{
+    // Meters whose advertised services show up late
+    if (g_strcmp0(g_dbus_proxy_get_interface_name(proxy), BLUEZ_DEVICE_INTERFACE) != 0)
+        return;
+
+    GVariant *v_uuids = g_variant_lookup_value(changed_properties, "UUIDs", NULL);
+
+    if (v_uuids == NULL)
+        return;
+
+    g_variant_unref(v_uuids);
+    sooshi_manager_consider_device((SooshiManager*)user_data, G_DBUS_INTERFACE(proxy));
+}
+
+static void
+sooshi_manager_remove_source(SooshiManager *manager, guint *source_id)
+{
+    if (*source_id > 0)
+    {
+        GSource *source = g_main_context_find_source_by_id(manager->context, *source_id);
+        if (source)
+            g_source_destroy(source);
+    }
+
+    *source_id = 0;
+}
+
+static void
+sooshi_manager_stop_scan(SooshiManager *manager)
+{
+    sooshi_manager_remove_source(manager, &manager->scan_timeout_source_id);
+
+    for (guint i = 0; i < manager->adapters->len; ++i)
+    {
+        SooshiAdapter *adapter = g_ptr_array_index(manager->adapters, i);
+
+        if (adapter->scanning == FALSE)
+            continue;
+
+        g_info("Stopping Bluetooth scan on %s!", adapter->path);
+
+        GError *error = NULL;
+        g_dbus_proxy_call_sync(adapter->proxy,
+            "StopDiscovery",
+            g_variant_new("()"),
+            G_DBUS_CALL_FLAGS_NONE,
+            -1,
+            NULL,
+            &error);
+
+        if (error != NULL)
+        {
+            g_warning("Error stopping bluetooth device discovery: %s", error->message);
+            g_error_free(error);
+        }
+
+        adapter->scanning = FALSE;
+    }
+}
+
+static gboolean
+sooshi_manager_scan_timed_out(gpointer user_data)
+{
+    SooshiManager *manager = (SooshiManager*)user_data;
+
+    manager->scan_timeout_source_id = 0;
+    sooshi_manager_stop_scan(manager);
+
+    return FALSE;
+}
+
+static gboolean
+sooshi_manager_start_scan(SooshiManager *manager, SooshiAdapter *adapter)
+{
+    GVariantBuilder filter;
+    const gchar *uuids[] = { METER_SERVICE_UUID, NULL };
+    g_variant_builder_init(&filter, G_VARIANT_TYPE("a{sv}"));
+    g_variant_builder_add(&filter, "{sv}", "UUIDs", g_variant_new_strv(uuids, -1));
+    g_variant_builder_add(&filter, "{sv}", "Transport", g_variant_new_string("le"));
+
+    GError *error = NULL;
+    g_dbus_proxy_call_sync(adapter->proxy,
+        "SetDiscoveryFilter",
+        g_variant_new("(a{sv})", &filter),
+        G_DBUS_CALL_FLAGS_NONE,
+        -1,
+        NULL,
+        &error);
+
+    if (error != NULL)
+    {
+        g_warning("Error setting discovery filter on %s, scanning for all devices: %s", adapter->path, error->message);
+        g_clear_error(&error);
+    }
+
+    g_dbus_proxy_call_sync(adapter->proxy,
+        "StartDiscovery",
+        g_variant_new("()"),
+        G_DBUS_CALL_FLAGS_NONE,
+        -1,
+        NULL,
+        &error);
+
+    if (error != NULL)
+    {
+        g_warning("Error starting bluetooth device discovery on %s: %s", adapter->path, error->message);
+        g_error_free(error);
+        return FALSE;
+    }
+
+    adapter->scanning = TRUE;
+    g_info("Started bluetooth scan on %s ...", adapter->path);
+
+    return TRUE;
+}
+
+SooshiManager *
+sooshi_manager_new(sooshi_error_t *error)
+{
+    SooshiManager *manager = g_new0(SooshiManager, 1);
+    manager->context = g_main_context_new();
+    manager->adapters = g_ptr_array_new_with_free_func(sooshi_manager_adapter_free);
+    manager->meters = g_hash_table_new_full(g_str_hash, g_str_equal, NULL, sooshi_manager_meter_free);
+    manager->max_connections = SOOSHI_ADAPTER_MAX_CONNECTIONS;
+
+    g_main_context_push_thread_default(manager->context);
+
+    GError *err = NULL;
+    manager->object_manager = g_dbus_object_manager_client_new_for_bus_sync(
+            G_BUS_TYPE_SYSTEM,
+            G_DBUS_OBJECT_MANAGER_CLIENT_FLAGS_DO_NOT_AUTO_START,
+            BLUEZ_NAME,
+            "/",
+            NULL,
+            NULL,
+            NULL,
+            NULL,
+            &err);
+
+    g_main_context_pop_thread_default(manager->context);
+
+    if (err != NULL)
+    {
+        if (error)
+            *error = SOOSHI_ERROR_DBUS_CONNECTION_FAILED;
+
+        g_error_free(err);
+        sooshi_manager_delete(manager);
+        return NULL;
+    }
+
+    // One index for all meters instead of one per meter, each walking all objects
+    manager->dbus_index = sooshi_dbus_index_new(manager->object_manager);
+
+    if (error)
+        *error = SOOSHI_ERROR_SUCCESS;
+
+    return manager;
+}
+
+void
+sooshi_manager_delete(SooshiManager *manager)
+{
+    g_return_if_fail(manager != NULL);
+
+    if (manager->object_manager)
+    {
+        if (manager->object_added_id > 0)
+            g_signal_handler_disconnect(manager->object_manager, manager->object_added_id);
+
+        if (manager->properties_changed_id > 0)
+            g_signal_handler_disconnect(manager->object_manager, manager->properties_changed_id);
+    }
+
+    sooshi_manager_remove_source(manager, &manager->rebalance_source_id);
+    sooshi_manager_stop_scan(manager);
+
+    // Meters have to go before the object manager they share
+    g_hash_table_unref(manager->meters);
+    g_ptr_array_unref(manager->adapters);
+    g_list_free_full(manager->subscriptions, sooshi_manager_subscription_free);
+
+    if (manager->dbus_index) sooshi_dbus_index_unref(manager->dbus_index);
+    g_clear_object(&manager->object_manager);
+
+    if (manager->loop) g_main_loop_unref(manager->loop);
+    g_main_context_unref(manager->context);
+
+    g_free(manager);
+}
+
+void
+sooshi_manager_set_adapter_limits(SooshiManager *manager, guint max_connections, gdouble max_throughput)
+{
+    g_return_if_fail(manager != NULL);
+    g_return_if_fail(max_connections > 0);
+
+    manager->max_connections = max_connections;
+    manager->max_throughput = max_throughput;
+}
+
+sooshi_error_t
+sooshi_manager_start(SooshiManager *manager, guint scan_seconds,
+        sooshi_manager_handler_t meter_handler, gpointer meter_data)
+{
+    g_return_val_if_fail(manager != NULL, SOOSHI_ERROR_DBUS_CONNECTION_FAILED);
+
+    manager->meter_handler = meter_handler;
+    manager->meter_data = meter_data;
+
+    // This only happens once, so a plain walk over all objects is fine
+    GList *objects = g_dbus_object_manager_get_objects(manager->object_manager);
+    GList *devices = NULL;
+
+    GList *elem;
+    for (elem = objects; elem; elem = elem->next)
+    {
+        GDBusObject *obj = G_DBUS_OBJECT(elem->data);
+        GDBusInterface *interface;
+
+        if ((interface = g_dbus_object_get_interface(obj, BLUEZ_ADAPTER_INTERFACE)))
+        {
+            if (sooshi_cond_adapter_is_powered(interface, NULL))
+            {
+                SooshiAdapter *adapter = g_new0(SooshiAdapter, 1);
+                adapter->proxy = G_DBUS_PROXY(interface);
+                adapter->path = g_strdup(g_dbus_object_get_object_path(obj));
+                g_ptr_array_add(manager->adapters, adapter);
+
+                g_info("Using adapter %s", adapter->path);
+            }
+            else
+                g_object_unref(interface);
+        }
+
+        if ((interface = g_dbus_object_get_interface(obj, BLUEZ_DEVICE_INTERFACE)))
+            devices = g_list_prepend(devices, interface);
+    }
+    g_list_free_full(objects, g_object_unref);
+
+    if (manager->adapters->len == 0)
+    {
+        g_warning("Could not find bluetooth adapter!");
+        g_list_free_full(devices, g_object_unref);
+        return SOOSHI_ERROR_NO_ADAPTER_FOUND;
+    }
+
+    manager->object_added_id = g_signal_connect(manager->object_manager,
+        "object-added", G_CALLBACK(sooshi_manager_on_object_added), manager);
+    manager->properties_changed_id = g_signal_connect(manager->object_manager,
+        "interface-proxy-properties-changed", G_CALLBACK(sooshi_manager_on_properties_changed), manager);
+
+    // Meters BlueZ already knows about don't need to be scanned for
+    for (elem = devices; elem; elem = elem->next)
+        sooshi_manager_consider_device(manager, elem->data);
+    g_list_free_full(devices, g_object_unref);
+
+    // Scan on every adapter, so we learn which ones can reach which meter
+    gboolean scanning = FALSE;
+    for (guint i = 0; i < manager->adapters->len; ++i)
+        scanning |= sooshi_manager_start_scan(manager, g_ptr_array_index(manager->adapters, i));
+
+    if (!scanning)
+        return SOOSHI_ERROR_SCAN_FAILED;
+
+    if (scan_seconds > 0)
+    {
+        GSource *source = g_timeout_source_new_seconds(scan_seconds);
+        g_source_set_callback(source, sooshi_manager_scan_timed_out, manager, NULL);
+        manager->scan_timeout_source_id = g_source_attach(source, manager->context);
+        g_source_unref(source);
+    }
+
+    GSource *source = g_timeout_source_new_seconds(SOOSHI_ADAPTER_REBALANCE_SECONDS);
+    g_source_set_callback(source, sooshi_manager_rebalance, manager, NULL);
+    manager->rebalance_source_id = g_source_attach(source, manager->context);
+    g_source_unref(source);
+    manager->last_rebalance = g_get_monotonic_time();
+
+    return SOOSHI_ERROR_SUCCESS;
+}
+
+void
+sooshi_manager_subscribe(SooshiManager *manager, const gchar *path,
+        sooshi_node_subscriber_handler_t func, gpointer user_data)
+{
+    g_return_if_fail(manager != NULL);
+    g_return_if_fail(path != NULL);
+
+    SooshiManagerSubscription *sub = g_new0(SooshiManagerSubscription, 1);
+    sub->path = g_strdup(path);
+    sub->handler = func;
+    sub->user_data = user_data;
+    manager->subscriptions = g_list_append(manager->subscriptions, sub);
+
+    // Meters that are already up get it right away, all others once they are initialized
+    GHashTableIter iter;
+    gpointer value;
+
+    g_hash_table_iter_init(&iter, manager->meters);
+    while (g_hash_table_iter_next(&iter, NULL, &value))
+    {
+        SooshiManagerMeter *meter = value;
+
+        if (meter->state && meter->state->initialized)
+            sooshi_manager_apply_subscription(meter, sub);
+    }
+}
+
+void
+sooshi_manager_run(SooshiManager *manager)
+{
+    g_debug("Starting manager main loop ...");
+
+    if (manager->loop == NULL)
+        manager->loop = g_main_loop_new(manager->context, FALSE);
+
+    g_main_context_push_thread_default(manager->context);
+    g_main_loop_run(manager->loop);
+    g_main_context_pop_thread_default(manager->context);
+}
+
+void
+sooshi_manager_stop(SooshiManager *manager)
+{
+    g_debug("Stopping manager main loop ...");
+    g_main_loop_quit(manager->loop);
+}
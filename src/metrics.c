@@ -0,0 +1,48 @@
+#include <glib.h>
+
+#include "sooshi.h"
+
+// Recording must never lock or allocate, so every field is a plain 64 bit
+// integer updated with atomic builtins.
+void
+sooshi_metrics_add(guint64 *counter, guint64 value)
+{
+    __atomic_fetch_add(counter, value, __ATOMIC_RELAXED);
+}
+
+void
+sooshi_metrics_high_water(guint64 *mark, guint64 value)
+{
+    guint64 current = __atomic_load_n(mark, __ATOMIC_RELAXED);
+
+    while (value > current)
+    {
+        if (__atomic_compare_exchange_n(mark, &current, value, FALSE, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+            break;
+    }
+}
+
+void
+sooshi_get_metrics(SooshiState *state, SooshiMetrics *metrics)
+{
+    g_return_if_fail(state != NULL);
+    g_return_if_fail(metrics != NULL);
+
+    const SooshiMetrics *m = &state->metrics;
+
+    metrics->notifications = __atomic_load_n(&m->notifications, __ATOMIC_RELAXED);
+    metrics->rx_bytes = __atomic_load_n(&m->rx_bytes, __ATOMIC_RELAXED);
+    metrics->tx_bytes = __atomic_load_n(&m->tx_bytes, __ATOMIC_RELAXED);
+
+    for (guint i = 0; i < SOOSHI_METRICS_OP_CODES; ++i)
+        metrics->frames[i] = __atomic_load_n(&m->frames[i], __ATOMIC_RELAXED);
+    metrics->unknown_frames = __atomic_load_n(&m->unknown_frames, __ATOMIC_RELAXED);
+
+    metrics->writes = __atomic_load_n(&m->writes, __ATOMIC_RELAXED);
+    metrics->write_errors = __atomic_load_n(&m->write_errors, __ATOMIC_RELAXED);
+    metrics->buffer_high_water = __atomic_load_n(&m->buffer_high_water, __ATOMIC_RELAXED);
+
+    sooshi_histogram_load(&metrics->parse_time, &m->parse_time);
+    sooshi_histogram_load(&metrics->subscriber_time, &m->subscriber_time);
+    sooshi_histogram_load(&metrics->write_latency, &m->write_latency);
+}
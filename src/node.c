@@ -2,6 +2,7 @@
 #include <string.h>
 
 #include "sooshi.h"
+#include "probes.h"
 
 SooshiNode *
 sooshi_node_find(SooshiState *state, gchar *path, SooshiNode *start)
@@ -298,7 +299,33 @@ sooshi_node_bytes_to_value(SooshiNode *node, GByteArray *buffer, GVariant **resu
 void
 sooshi_node_request_value(SooshiState *state, SooshiNode *node)
 {
+    node->value_requested = TRUE;
+    node->value_requested_at = g_get_monotonic_time();
     sooshi_send_bytes(state, &node->op_code, 1, TRUE);
+    sooshi_request_expect_reply(node, FALSE);
+}
+
+GVariant *
+sooshi_node_get_value(SooshiState *state, SooshiNode *node)
+{
+    g_return_val_if_fail(state != NULL, NULL);
+    g_return_val_if_fail(node != NULL, NULL);
+
+    // Values outside of the interest set are fetched on first access, the
+    // result will be delivered to the node's subscribers. Replies can get
+    // lost, so a request that went unanswered for too long is sent again.
+    gint64 now = g_get_monotonic_time();
+    if (node->has_value && node->value == NULL && (node->value_requested == FALSE ||
+            now - node->value_requested_at >= (gint64)SOOSHI_NODE_FETCH_RETRY_MS * 1000))
+    {
+        g_debug("Lazily fetching value of node '%s'", node->name);
+        node->value_requested = TRUE;
+        node->value_requested_at = now;
+        sooshi_send_bytes(state, &node->op_code, 1, FALSE);
+        sooshi_request_expect_reply(node, FALSE);
+    }
+
+    return node->value;
 }
 
 void
@@ -323,18 +350,253 @@ sooshi_node_choose_by_index(SooshiState *state, SooshiNode *node, guchar index)
     sooshi_node_set_value(state, node, g_variant_new_byte(index), TRUE);
 }
 
+gboolean
+sooshi_node_value_as_double(SooshiNode *node, gdouble *result)
+{
+    if (node->value == NULL)
+        return FALSE;
+
+    switch (node->type)
+    {
+        case VAL_U8:
+        case CHOOSER: *result = g_variant_get_byte(node->value); return TRUE;
+        case VAL_U16: *result = g_variant_get_uint16(node->value); return TRUE;
+        case VAL_U32: *result = g_variant_get_uint32(node->value); return TRUE;
+        case VAL_S8:  *result = (gint8)g_variant_get_byte(node->value); return TRUE;
+        case VAL_S16: *result = g_variant_get_int16(node->value); return TRUE;
+        case VAL_S32: *result = g_variant_get_int32(node->value); return TRUE;
+        case VAL_FLT: *result = g_variant_get_double(node->value); return TRUE;
+        default: return FALSE;
+    }
+}
+
+gboolean
+sooshi_node_is_numeric(SooshiNode *node)
+{
+    return node->type >= CHOOSER && node->type != VAL_STR && node->type != VAL_BIN;
+}
+
+static guint
+sooshi_node_add_subscriber(SooshiState *state, SooshiNode *node, SooshiNodeSubscriber *sub)
+{
+    g_info("Subscribing to node '%s'", node->name);
+
+    // Ids are never reused within a state, 0 means no subscription
+    sub->id = ++state->next_subscriber_id;
+    node->subscriber = g_list_append(node->subscriber, (gpointer)sub);
+
+    return sub->id;
+}
+
 guint
 sooshi_node_subscribe(SooshiState *state, SooshiNode *node, sooshi_node_subscriber_handler_t func, gpointer user_data)
 {
-    g_info("Subscribing to node '%s'", node->name);
+    return sooshi_node_subscribe_full(state, node, NULL, func, user_data);
+}
+
+guint
+sooshi_node_subscribe_full(SooshiState *state, SooshiNode *node, const SooshiSubscribeOptions *options,
+        sooshi_node_subscriber_handler_t func, gpointer user_data)
+{
+    g_return_val_if_fail(state != NULL, 0);
+    g_return_val_if_fail(node != NULL, 0);
+    g_return_val_if_fail(func != NULL, 0);
 
     SooshiNodeSubscriber *sub = g_new0(SooshiNodeSubscriber, 1);
-    sub->id = g_list_length(node->subscriber) + 1;
     sub->handler = func;
     sub->user_data = user_data;
-    node->subscriber = g_list_append(node->subscriber, (gpointer)sub);
 
-    return sub->id;
+    if (options)
+    {
+        sub->every = options->every;
+        sub->interval = (gint64)options->interval_ms * 1000;
+    }
+
+    return sooshi_node_add_subscriber(state, node, sub);
+}
+
+guint
+sooshi_node_subscribe_aggregate(SooshiState *state, SooshiNode *node, guint window_ms,
+        sooshi_node_aggregate_handler_t func, gpointer user_data)
+{
+    g_return_val_if_fail(state != NULL, 0);
+    g_return_val_if_fail(node != NULL, 0);
+    g_return_val_if_fail(func != NULL, 0);
+    g_return_val_if_fail(window_ms > 0, 0);
+
+    if (!sooshi_node_is_numeric(node))
+    {
+        g_warning("Node '%s' has no numeric value to aggregate!", node->name);
+        return 0;
+    }
+
+    SooshiNodeSubscriber *sub = g_new0(SooshiNodeSubscriber, 1);
+    sub->aggregate_handler = func;
+    sub->user_data = user_data;
+    sub->window = (gint64)window_ms * 1000;
+
+    return sooshi_node_add_subscriber(state, node, sub);
+}
+
+guint
+sooshi_node_subscribe_compressed(SooshiState *state, SooshiNode *node, const SooshiCompression *compression,
+        sooshi_node_point_handler_t func, gpointer user_data)
+{
+    g_return_val_if_fail(state != NULL, 0);
+    g_return_val_if_fail(node != NULL, 0);
+    g_return_val_if_fail(compression != NULL, 0);
+    g_return_val_if_fail(func != NULL, 0);
+
+    if (!sooshi_node_is_numeric(node))
+    {
+        g_warning("Node '%s' has no numeric value to compress!", node->name);
+        return 0;
+    }
+
+    SooshiNodeSubscriber *sub = g_new0(SooshiNodeSubscriber, 1);
+    sub->point_handler = func;
+    sub->user_data = user_data;
+    sooshi_swinging_door_init(&sub->door, compression);
+
+    return sooshi_node_add_subscriber(state, node, sub);
+}
+
+void
+sooshi_node_unsubscribe(SooshiState *state, SooshiNode *node, guint id)
+{
+    g_return_if_fail(state != NULL);
+    g_return_if_fail(node != NULL);
+
+    GList *elem;
+    for(elem = node->subscriber; elem; elem = elem->next)
+    {
+        SooshiNodeSubscriber *sub = (SooshiNodeSubscriber*)elem->data;
+
+        if (sub->id == id && sub->removed == FALSE)
+        {
+            // Handlers may unsubscribe anyone, the notification loop is still walking the list
+            if (node->notifying > 0)
+            {
+                sub->removed = TRUE;
+                return;
+            }
+
+            node->subscriber = g_list_delete_link(node->subscriber, elem);
+            g_free(sub);
+            return;
+        }
+    }
+
+    g_warning("Node '%s' has no subscriber %u!", node->name, id);
+}
+
+// Decimation and throttling, whether sub wants to see the node's current value
+static gboolean
+sooshi_node_subscriber_due(SooshiNode *node, SooshiNodeSubscriber *sub)
+{
+    if (sub->every > 1 && sub->seen++ % sub->every != 0)
+        return FALSE;
+
+    if (sub->interval > 0)
+    {
+        if (sub->last_call > 0 && node->last_update - sub->last_call < sub->interval)
+            return FALSE;
+
+        sub->last_call = node->last_update;
+    }
+
+    return TRUE;
+}
+
+// Adds the node's current value to sub's window. Returns TRUE if the value
+// closed the previous window, which is then ready to be delivered; the value
+// itself starts the next one in that case.
+static gboolean
+sooshi_node_subscriber_aggregate(SooshiNode *node, SooshiNodeSubscriber *sub, SooshiAggregate *closed)
+{
+    SooshiAggregate *aggregate = &sub->aggregate;
+    gboolean window_closed = FALSE;
+    gdouble value;
+
+    if (!sooshi_node_value_as_double(node, &value))
+        return FALSE;
+
+    if (aggregate->count > 0 && node->last_update - aggregate->first_update >= sub->window)
+    {
+        *closed = *aggregate;
+        closed->mean = sub->sum / aggregate->count;
+
+        aggregate->count = 0;
+        window_closed = TRUE;
+    }
+
+    if (aggregate->count == 0)
+    {
+        aggregate->first_update = node->last_update;
+        aggregate->min = value;
+        aggregate->max = value;
+        sub->sum = 0;
+    }
+
+    aggregate->min = MIN(aggregate->min, value);
+    aggregate->max = MAX(aggregate->max, value);
+    aggregate->last = value;
+    aggregate->last_update = node->last_update;
+    aggregate->count++;
+    sub->sum += value;
+
+    return window_closed;
+}
+
+// Feeds the node's current value through sub's swinging door, returns how
+// many samples (up to 2) it retained
+static guint
+sooshi_node_subscriber_compress(SooshiNode *node, SooshiNodeSubscriber *sub, SooshiSample *retained)
+{
+    SooshiSample sample = { node->last_update, 0 };
+
+    if (!sooshi_node_value_as_double(node, &sample.value))
+        return 0;
+
+    return sooshi_swinging_door_add(&sub->door, &sample, retained);
+}
+
+static void
+sooshi_node_call_subscriber(SooshiState *state, SooshiNode *node, SooshiNodeSubscriber *sub,
+        const SooshiAggregate *closed, const SooshiSample *point)
+{
+    gpointer handler = sub->aggregate_handler ? (gpointer)sub->aggregate_handler
+        : sub->point_handler ? (gpointer)sub->point_handler : (gpointer)sub->handler;
+    gint64 called = g_get_monotonic_time();
+    SOOSHI_PROBE(subscriber_enter, state, node->op_code, handler);
+
+    if (sub->aggregate_handler)
+        sub->aggregate_handler(state, node, closed, sub->user_data);
+    else if (sub->point_handler)
+        sub->point_handler(state, node, point, sub->user_data);
+    else
+        sub->handler(state, node, sub->user_data);
+
+    SOOSHI_PROBE(subscriber_exit, state, node->op_code, handler);
+    sooshi_histogram_record(&state->metrics.subscriber_time, g_get_monotonic_time() - called);
+}
+
+// Frees the subscribers unsubscribed during a notification
+static void
+sooshi_node_remove_unsubscribed(SooshiNode *node)
+{
+    GList *elem, *next;
+    for(elem = node->subscriber; elem; elem = next)
+    {
+        SooshiNodeSubscriber *sub = (SooshiNodeSubscriber*)elem->data;
+        next = elem->next;
+
+        if (sub->removed)
+        {
+            node->subscriber = g_list_delete_link(node->subscriber, elem);
+            g_free(sub);
+        }
+    }
 }
 
 void
@@ -343,12 +605,45 @@ sooshi_node_notify_subscribers(SooshiState *state, SooshiNode *node)
     if (node->subscriber == NULL)
         return;
 
+    // Handlers may unsubscribe themselves or others, those are only marked
+    // as removed until the outermost notification is done
+    node->notifying++;
+
     GList *elem;
     for(elem = node->subscriber; elem; elem = elem->next)
     {
         SooshiNodeSubscriber *sub = (SooshiNodeSubscriber*)elem->data;
-        ((sooshi_node_subscriber_handler_t)sub->handler)(state, node, sub->user_data);
+        SooshiAggregate closed;
+        SooshiSample retained[2];
+
+        if (sub->removed)
+            continue;
+
+        if (sub->point_handler)
+        {
+            guint count = sooshi_node_subscriber_compress(node, sub, retained);
+
+            // Stop early if the first point made it unsubscribe
+            for (guint i = 0; i < count && sub->removed == FALSE; ++i)
+                sooshi_node_call_subscriber(state, node, sub, NULL, &retained[i]);
+
+            continue;
+        }
+
+        if (sub->aggregate_handler)
+        {
+            // Windows are delivered when the first value after them arrives
+            if (!sooshi_node_subscriber_aggregate(node, sub, &closed))
+                continue;
+        }
+        else if (!sooshi_node_subscriber_due(node, sub))
+            continue;
+
+        sooshi_node_call_subscriber(state, node, sub, &closed, NULL);
     }
+
+    if (--node->notifying == 0)
+        sooshi_node_remove_unsubscribed(node);
 }
 
 void
@@ -359,7 +654,13 @@ sooshi_request_all_node_values(SooshiState *state, SooshiNode *start)
 
     // Only request nodes that can have a value and don't request the ADMIN nodes again
     if (start->has_value == TRUE && start->op_code >= 3)
+    {
+        // A node asked for twice is still only answered once
+        if (start->value_requested == FALSE)
+            state->fetches_pending++;
+
         sooshi_node_request_value(state, start);
+    }
 
     GList *elem;
     SooshiNode *item;
@@ -370,20 +671,44 @@ sooshi_request_all_node_values(SooshiState *state, SooshiNode *start)
     }
 }
 
+void
+sooshi_request_interesting_node_values(SooshiState *state)
+{
+    if (state->interest == NULL)
+    {
+        sooshi_request_all_node_values(state, NULL);
+        return;
+    }
+
+    for (gchar **path = state->interest; *path; ++path)
+    {
+        SooshiNode *node = sooshi_node_find(state, *path, NULL);
+
+        if (node)
+            sooshi_request_all_node_values(state, node);
+        else
+            g_warning("Node '%s' of interest set not found!", *path);
+    }
+}
+
 void
 sooshi_node_free_all(SooshiState *state, SooshiNode *start_node)
 {
     if (start_node == NULL)
     {
-	if (state->root_node == NULL)
-	    return;
+        if (state->root_node == NULL)
+            return;
 
         start_node = state->root_node;
     }
 
+    // Not in the new tree, nobody will answer what was asked of it
+    sooshi_request_cancel_node(state, start_node);
+
     if (start_node->value) g_variant_unref(start_node->value);
     g_free(start_node->name);
 
+    // Every node frees itself, including the root
     GList *elem;
     SooshiNode *item;
     for(elem = start_node->children; elem; elem = elem->next)
@@ -392,9 +717,72 @@ sooshi_node_free_all(SooshiState *state, SooshiNode *start_node)
         sooshi_node_free_all(state, item);
     }
 
-    g_list_free_full(start_node->children, g_free);
+    g_list_free(start_node->children);
     g_list_free_full(start_node->subscriber, g_free);
-    start_node->subscriber = NULL;
+    sooshi_stats_free(start_node->stats);
+    sooshi_history_free(start_node->history);
+
+    if (start_node == state->root_node)
+        state->root_node = NULL;
+
+    g_free(start_node);
+}
+
+// Puts old in the place of new_node, which is part of a freshly parsed tree, and
+// does the same for their children. Subscribers, statistics and history stay with
+// the nodes. Children of old that the new tree doesn't have any more are freed.
+SooshiNode *
+sooshi_node_adopt(SooshiState *state, SooshiNode *old, SooshiNode *new_node)
+{
+    if (old->type != new_node->type)
+    {
+        sooshi_node_free_all(state, old);
+        return new_node;
+    }
+
+    GList *elem;
+    for (elem = new_node->children; elem; elem = elem->next)
+    {
+        SooshiNode *child = elem->data;
+
+        GList *match;
+        for (match = old->children; match; match = match->next)
+            if (g_strcmp0(((SooshiNode*)match->data)->name, child->name) == 0)
+                break;
+
+        if (match)
+        {
+            SooshiNode *previous = match->data;
+            old->children = g_list_delete_link(old->children, match);
+            elem->data = sooshi_node_adopt(state, previous, child);
+        }
+    }
+
+    for (elem = old->children; elem; elem = elem->next)
+        sooshi_node_free_all(state, elem->data);
+    g_list_free(old->children);
+
+    old->children = new_node->children;
+    for (elem = old->children; elem; elem = elem->next)
+        ((SooshiNode*)elem->data)->parent = old;
+
+    old->parent = new_node->parent;
+    old->op_code = new_node->op_code;
+    old->has_value = new_node->has_value;
+
+    if (old->has_value)
+        g_ptr_array_index(state->op_code_map, old->op_code) = old;
+
+    // The value and what we wrote to it belong to the previous tree
+    if (old->value) g_variant_unref(old->value);
+    old->value = NULL;
+    old->value_requested = FALSE;
+    old->value_requested_at = 0;
+    old->last_update = 0;
+    old->host_written = FALSE;
+
+    g_free(new_node->name);
+    g_free(new_node);
 
-    state->root_node = NULL;
+    return old;
 }
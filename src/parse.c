@@ -1,10 +1,9 @@
 #include "sooshi.h"
+#include "probes.h"
 
 static SooshiNode *
 sooshi_parse_node(SooshiState *state, SooshiNode *parent, const guint8 *buffer, gulong *bytes_read)
 {
-    static guchar opcode  = 0;
-
     SooshiNode *node = g_new0(SooshiNode, 1);
     
     node->parent = parent;
@@ -15,7 +14,7 @@ sooshi_parse_node(SooshiState *state, SooshiNode *parent, const guint8 *buffer,
     node->has_value = FALSE;
     if (node->type >= CHOOSER)
     {
-        node->op_code = opcode++;
+        node->op_code = state->next_op_code++;
         g_ptr_array_add(state->op_code_map, (gpointer)node);
         node->has_value = TRUE;
     }
@@ -71,9 +70,37 @@ sooshi_parse_admin_tree(SooshiState *state, gulong compressed_size, const guint8
     // Calculate CRC32 checksum of zipped payload
     crc32_t checksum = sooshi_crc32_calculate(state, buffer, compressed_size);
     g_info("Tree-CRC: %x", checksum);
-    state->root_node = sooshi_parse_node(state, NULL, result, NULL);
+    sooshi_timeline_mark(state, SOOSHI_PHASE_TREE_RECEIVED);
+
+    // A tree we did not ask for replaces the current one, see sooshi_reload_tree()
+    if (state->root_node && checksum == state->tree_crc)
+        g_info("Tree did not change, keeping it");
+    else
+    {
+        SooshiNode *previous = state->root_node;
 
-    sooshi_debug_dump_tree(state->root_node, (guint)0);
+        // Op codes may mean something else now, nothing in flight will be answered
+        if (previous)
+        {
+            sooshi_transaction_cancel_all(state);
+            sooshi_request_cancel_all(state, TRUE);
+        }
+
+        g_ptr_array_set_size(state->op_code_map, 0);
+        state->link_probe_node = NULL;
+        state->next_op_code = 0;
+        state->root_node = sooshi_parse_node(state, NULL, result, NULL);
+
+        // Nodes the application holds on to stay valid as long as the new tree has them
+        if (previous)
+            state->root_node = sooshi_node_adopt(state, previous, state->root_node);
+    }
+
+    state->tree_crc = checksum;
+
+    // Printing ~100 lines on every connect is only wanted while debugging
+    if (sooshi_debug_enabled())
+        sooshi_debug_dump_tree(state->root_node, (guint)0);
 
     SooshiNode *crc_node = sooshi_node_find(state, "ADMIN:CRC32", NULL);
 
@@ -84,7 +111,17 @@ sooshi_parse_admin_tree(SooshiState *state, gulong compressed_size, const guint8
 
     // Initialize the mooshimeter's time for logging
     guint time_utc = g_get_real_time() / 1000;
-    sooshi_node_set_value(state, sooshi_node_find(state, "TIME_UTC", NULL), g_variant_new_uint32(time_utc), TRUE);
+    SooshiNode *time_node = sooshi_node_find(state, "TIME_UTC", NULL);
+
+    if (time_node)
+    {
+        sooshi_node_set_value(state, time_node, g_variant_new_uint32(time_utc), TRUE);
+
+        // That's not configuration, it must not be replayed after a reconnect
+        time_node->host_written = FALSE;
+    }
+    else
+        g_warning("Error finding node TIME_UTC!");
 
     g_output_stream_close(out, NULL, NULL);
     g_output_stream_close(z_out, NULL, NULL);
@@ -113,13 +150,16 @@ sooshi_parse_response(SooshiState *state)
                 return;
 
             g_debug("Size of tree: %d", length);
+            SOOSHI_PROBE(frame, state, op_code, length + 3);
             sooshi_parse_admin_tree(state, length, state->buffer->data + 3);
             state->buffer = g_byte_array_remove_range(state->buffer, 0, length + 3);
+            sooshi_metrics_add(&state->metrics.frames[op_code], 1);
         }
         else
         {
             if (op_code >= state->op_code_map->len)
             {
+                sooshi_metrics_add(&state->metrics.unknown_frames, 1);
                 g_warning("Unknown opcode: %u", op_code);
                 return;
             }
@@ -127,6 +167,7 @@ sooshi_parse_response(SooshiState *state)
             SooshiNode *node = (SooshiNode*)g_ptr_array_index(state->op_code_map, op_code);
 
             GVariant *v = NULL;
+            guint buffered = state->buffer->len;
             state->buffer = sooshi_node_bytes_to_value(node, state->buffer, &v);
 
             // bytes_to_value might return null if there's not enough data here
@@ -134,21 +175,57 @@ sooshi_parse_response(SooshiState *state)
             if (v == NULL)
                 return;
 
+            SOOSHI_PROBE(frame, state, op_code, buffered - state->buffer->len);
+
+            if (op_code < SOOSHI_METRICS_OP_CODES)
+                sooshi_metrics_add(&state->metrics.frames[op_code], 1);
+
+            // Only values received count as fresh, not the ones we wrote ourselves
             sooshi_node_set_value(state, node, v, FALSE);
+            node->last_update = state->replaying ? state->replay_time : g_get_monotonic_time();
 
-            gchar *strval = sooshi_node_value_as_string(node);
-            g_info("Value for node '%s' (%d) updated: [%s]", node->name, node->op_code, strval);
-            g_free(strval);
+            // Formatting the value costs more than decoding it, don't do it for nothing
+            if (sooshi_debug_enabled())
+            {
+                gchar *strval = sooshi_node_value_as_string(node);
+                g_info("Value for node '%s' (%d) updated: [%s]", node->name, node->op_code, strval);
+                g_free(strval);
+            }
 
+            // Subscribers may want to look at the statistics and history including this value
+            sooshi_stats_on_value(state, node);
+            sooshi_history_on_value(state, node);
             sooshi_node_notify_subscribers(state, node);
+            sooshi_request_on_value(state, node);
+            sooshi_transaction_on_value(state, node);
+
+            if (node->value_requested)
+            {
+                node->value_requested = FALSE;
+
+                if (state->fetches_pending > 0 && --state->fetches_pending == 0)
+                    sooshi_timeline_mark(state, SOOSHI_PHASE_VALUES_FETCHED);
+            }
+
+            if (node->op_code == 0)
+                sooshi_timeline_mark(state, SOOSHI_PHASE_CRC_ACKNOWLEDGED);
 
             // We have set and received back the CRC32 checksum of the tree - setup is finished
             if (node->op_code == 0 && state->initialized == FALSE)
             {
-                sooshi_request_all_node_values(state, NULL);
+                sooshi_request_interesting_node_values(state);
+
+                if (state->fetches_pending == 0)
+                    sooshi_timeline_mark(state, SOOSHI_PHASE_VALUES_FETCHED);
+
                 sooshi_on_mooshi_initialized(state);
                 state->initialized = TRUE;
             }
+            else if (node->op_code == 0 && state->reconnecting == TRUE)
+            {
+                // Meter acknowledged the CRC of our cached tree
+                sooshi_on_mooshi_reconnected(state, g_variant_get_uint32(node->value));
+            }
         }
     }
 }
@@ -0,0 +1,32 @@
+#ifndef SOOSHI_PROBES_H_
+#define SOOSHI_PROBES_H_
+
+/*
+ * USDT (SystemTap/DTrace style) static tracepoints, provider "sooshi".
+ *
+ * Built in when the Makefile finds sys/sdt.h and defines SOOSHI_HAVE_SDT.
+ * A detached probe is a single nop in the instruction stream, arguments are
+ * only read from registers/stack by an attached tracer, e.g.:
+ *
+ *   bpftrace -e 'usdt:./libsooshi.so:sooshi:frame { @[arg1] = count(); }'
+ *
+ * Every probe gets the SooshiState pointer, an op code and a length:
+ *
+ *   notification       (state, first payload byte, payload length)
+ *   frame              (state, op code, frame length including the op code)
+ *   subscriber_enter   (state, op code, subscriber handler)
+ *   subscriber_exit    (state, op code, subscriber handler)
+ *   write_submit       (state, op code, frame length including the sequence)
+ *   write_complete     (state, op code, frame length, or -1 on error)
+ */
+#ifdef SOOSHI_HAVE_SDT
+    #include <sys/sdt.h>
+    #define SOOSHI_PROBE(name, state, op_code, length) \
+        DTRACE_PROBE3(sooshi, name, (state), (op_code), (length))
+#else
+    // Arguments are side effect free, this only keeps -Wunused quiet
+    #define SOOSHI_PROBE(name, state, op_code, length) \
+        do { (void)(state); (void)(op_code); (void)(length); } while (0)
+#endif
+
+#endif // SOOSHI_PROBES_H_
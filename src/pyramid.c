@@ -0,0 +1,438 @@
+#define _XOPEN_SOURCE 700
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <math.h>
+#include <unistd.h>
+#include <glib.h>
+#include <glib/gstdio.h>
+
+#include "sooshi.h"
+#include "vector.h"
+
+/*
+ * Next to its columns an archive keeps a min/max/mean pyramid, one file per
+ * level: "pyramid-1" summarizes every SOOSHI_PYRAMID_FANOUT rows, each level
+ * above that many buckets of the one below. A bucket is written once it is
+ * complete and covered by the archive's commits like everything else.
+ *
+ * An envelope query walks up the pyramid from the start of a pixel and back
+ * down towards its end, so a pixel costs at most about 2 * FANOUT entries per
+ * level, no matter how many rows it covers.
+ */
+
+static guint64
+sooshi_pyramid_bucket_rows(guint level)
+{
+    guint64 rows = SOOSHI_PYRAMID_FANOUT;
+
+    for (guint i = 0; i < level; ++i)
+        rows *= SOOSHI_PYRAMID_FANOUT;
+
+    return rows;
+}
+
+static gchar *
+sooshi_pyramid_file(const gchar *path, guint level)
+{
+    gchar *name = g_strdup_printf("pyramid-%u", level + 1);
+    gchar *file = g_build_filename(path, name, NULL);
+    g_free(name);
+
+    return file;
+}
+
+static void
+sooshi_pyramid_clear(SooshiPyramidEntry *entry)
+{
+    entry->min = NAN;
+    entry->max = NAN;
+    entry->sum = 0;
+    entry->count = 0;
+}
+
+static void
+sooshi_pyramid_merge(SooshiPyramidEntry *into, const SooshiPyramidEntry *entry)
+{
+    if (entry->count == 0)
+        return;
+
+    if (into->count == 0)
+    {
+        *into = *entry;
+        return;
+    }
+
+    into->min = MIN(into->min, entry->min);
+    into->max = MAX(into->max, entry->max);
+    into->sum += entry->sum;
+    into->count += entry->count;
+}
+
+// Summarizes count raw values. NaN compares false, so it never becomes the
+// min or max and is masked out of the sum and count.
+static void
+sooshi_pyramid_summarize(const gdouble *values, gsize count, SooshiPyramidEntry *entry)
+{
+    gsize vectors = count / 4 * 4;
+
+    sooshi_v2d zero = { 0, 0 };
+    sooshi_v2d min_a = { INFINITY, INFINITY }, min_b = min_a;
+    sooshi_v2d max_a = -min_a, max_b = max_a;
+    sooshi_v2d sum_a = zero, sum_b = zero;
+    sooshi_v2i count_a = { 0, 0 }, count_b = count_a;
+
+    for (gsize i = 0; i < vectors; i += 4)
+    {
+        sooshi_v2d a = sooshi_load2(values + i);
+        sooshi_v2d b = sooshi_load2(values + i + 2);
+        sooshi_v2i valid_a = a == a;
+        sooshi_v2i valid_b = b == b;
+
+        min_a = sooshi_select2(a < min_a, a, min_a);
+        min_b = sooshi_select2(b < min_b, b, min_b);
+        max_a = sooshi_select2(a > max_a, a, max_a);
+        max_b = sooshi_select2(b > max_b, b, max_b);
+        sum_a += sooshi_select2(valid_a, a, zero);
+        sum_b += sooshi_select2(valid_b, b, zero);
+
+        // Comparisons yield -1 for true
+        count_a -= valid_a;
+        count_b -= valid_b;
+    }
+
+    sooshi_v2d min = sooshi_select2(min_a < min_b, min_a, min_b);
+    sooshi_v2d max = sooshi_select2(max_a > max_b, max_a, max_b);
+    sooshi_v2d sum = sum_a + sum_b;
+    sooshi_v2i valid = count_a + count_b;
+
+    entry->min = MIN(min[0], min[1]);
+    entry->max = MAX(max[0], max[1]);
+    entry->sum = sum[0] + sum[1];
+    entry->count = valid[0] + valid[1];
+
+    for (gsize i = vectors; i < count; ++i)
+    {
+        if (isnan(values[i]))
+            continue;
+
+        entry->min = MIN(entry->min, values[i]);
+        entry->max = MAX(entry->max, values[i]);
+        entry->sum += values[i];
+        entry->count++;
+    }
+
+    if (entry->count == 0)
+        sooshi_pyramid_clear(entry);
+}
+
+/* Writing */
+static SooshiPyramidEntry *
+sooshi_pyramid_pending(SooshiArchiver *archiver, guint level)
+{
+    return archiver->pyramid_pending + level * archiver->columns;
+}
+
+static gboolean
+sooshi_pyramid_write(SooshiArchiver *archiver, guint level, guint64 bucket, const SooshiPyramidEntry *entries)
+{
+    gsize bytes = archiver->columns * sizeof(SooshiPyramidEntry);
+
+    return pwrite(archiver->pyramid_fds[level], entries, bytes, bucket * bytes) == (gssize)bytes;
+}
+
+static guint64
+sooshi_pyramid_stored(SooshiArchiver *archiver, guint level)
+{
+    struct stat info;
+    gsize bytes = archiver->columns * sizeof(SooshiPyramidEntry);
+
+    return fstat(archiver->pyramid_fds[level], &info) == 0 ? info.st_size / bytes : 0;
+}
+
+// Archives written before they had a pyramid, or whose pyramid files were
+// deleted, have rows without buckets. Those are built again, level 0 from
+// the raw columns and every level above from the one below.
+static gboolean
+sooshi_pyramid_backfill(SooshiArchiver *archiver)
+{
+    gsize bytes = archiver->columns * sizeof(SooshiPyramidEntry);
+    SooshiPyramidEntry *entries = g_new(SooshiPyramidEntry, SOOSHI_PYRAMID_FANOUT * archiver->columns);
+    SooshiPyramidEntry *complete = g_new(SooshiPyramidEntry, archiver->columns);
+    gdouble *values = g_new(gdouble, SOOSHI_PYRAMID_FANOUT);
+    gboolean ok = TRUE;
+
+    for (guint level = 0; ok && level < SOOSHI_PYRAMID_LEVELS; ++level)
+    {
+        guint64 needed = archiver->rows / sooshi_pyramid_bucket_rows(level);
+        guint64 bucket = sooshi_pyramid_stored(archiver, level);
+
+        if (bucket < needed)
+            g_info("Archive '%s': building pyramid level %u from bucket %" G_GUINT64_FORMAT,
+                    archiver->path, level + 1, bucket);
+
+        for (; ok && bucket < needed; ++bucket)
+        {
+            if (level == 0)
+            {
+                gsize length = SOOSHI_PYRAMID_FANOUT * sizeof(gdouble);
+
+                for (guint c = 0; ok && c < archiver->columns; ++c)
+                {
+                    ok = pread(archiver->column_fds[c], values, length, bucket * length) == (gssize)length;
+
+                    if (ok)
+                        sooshi_pyramid_summarize(values, SOOSHI_PYRAMID_FANOUT, &complete[c]);
+                }
+            }
+            else
+            {
+                // The level below is complete up to here already
+                gsize length = SOOSHI_PYRAMID_FANOUT * bytes;
+                ok = pread(archiver->pyramid_fds[level - 1], entries, length, bucket * length) == (gssize)length;
+
+                for (guint c = 0; c < archiver->columns; ++c)
+                    sooshi_pyramid_clear(&complete[c]);
+
+                for (guint i = 0; ok && i < SOOSHI_PYRAMID_FANOUT; ++i)
+                    for (guint c = 0; c < archiver->columns; ++c)
+                        sooshi_pyramid_merge(&complete[c], &entries[i * archiver->columns + c]);
+            }
+
+            ok = ok && sooshi_pyramid_write(archiver, level, bucket, complete);
+        }
+    }
+
+    g_free(values);
+    g_free(complete);
+    g_free(entries);
+
+    return ok;
+}
+
+gboolean
+sooshi_pyramid_open(SooshiArchiver *archiver)
+{
+    // Level 0 of pending is where a complete bucket is put together
+    archiver->pyramid_pending = g_new(SooshiPyramidEntry, SOOSHI_PYRAMID_LEVELS * archiver->columns);
+
+    for (guint i = 0; i < SOOSHI_PYRAMID_LEVELS * archiver->columns; ++i)
+        sooshi_pyramid_clear(&archiver->pyramid_pending[i]);
+
+    for (guint level = 0; level < SOOSHI_PYRAMID_LEVELS; ++level)
+    {
+        gchar *file = sooshi_pyramid_file(archiver->path, level);
+        archiver->pyramid_fds[level] = g_open(file, O_RDWR | O_CREAT, 0644);
+        g_free(file);
+
+        if (archiver->pyramid_fds[level] < 0)
+            return FALSE;
+    }
+
+    if (!sooshi_pyramid_backfill(archiver))
+        return FALSE;
+
+    // When appending, the incomplete buckets are made up again from the
+    // complete ones of the level below
+    gsize bytes = archiver->columns * sizeof(SooshiPyramidEntry);
+    SooshiPyramidEntry *entries = g_new(SooshiPyramidEntry, archiver->columns);
+    gboolean ok = TRUE;
+
+    for (guint level = 1; ok && level < SOOSHI_PYRAMID_LEVELS; ++level)
+    {
+        guint64 below = archiver->rows / sooshi_pyramid_bucket_rows(level - 1);
+        guint64 first = below / SOOSHI_PYRAMID_FANOUT * SOOSHI_PYRAMID_FANOUT;
+
+        for (guint64 bucket = first; ok && bucket < below; ++bucket)
+        {
+            ok = pread(archiver->pyramid_fds[level - 1], entries, bytes, bucket * bytes) == (gssize)bytes;
+
+            for (guint c = 0; ok && c < archiver->columns; ++c)
+                sooshi_pyramid_merge(&sooshi_pyramid_pending(archiver, level)[c], &entries[c]);
+        }
+    }
+
+    g_free(entries);
+
+    return ok;
+}
+
+gboolean
+sooshi_pyramid_on_row(SooshiArchiver *archiver)
+{
+    if (archiver->rows % SOOSHI_PYRAMID_FANOUT != 0)
+        return TRUE;
+
+    // Chunks are a multiple of the fanout, so the rows are all in the mapped one
+    guint64 offset = (archiver->rows - SOOSHI_PYRAMID_FANOUT) % archiver->chunk_rows;
+    SooshiPyramidEntry *complete = sooshi_pyramid_pending(archiver, 0);
+
+    for (guint c = 0; c < archiver->columns; ++c)
+        sooshi_pyramid_summarize(archiver->column_chunks[c] + offset, SOOSHI_PYRAMID_FANOUT, &complete[c]);
+
+    for (guint level = 0; level < SOOSHI_PYRAMID_LEVELS; ++level)
+    {
+        guint64 bucket = archiver->rows / sooshi_pyramid_bucket_rows(level) - 1;
+
+        if (!sooshi_pyramid_write(archiver, level, bucket, complete))
+            return FALSE;
+
+        if (level + 1 == SOOSHI_PYRAMID_LEVELS)
+            break;
+
+        SooshiPyramidEntry *pending = sooshi_pyramid_pending(archiver, level + 1);
+        for (guint c = 0; c < archiver->columns; ++c)
+            sooshi_pyramid_merge(&pending[c], &complete[c]);
+
+        if (archiver->rows % sooshi_pyramid_bucket_rows(level + 1) != 0)
+            break;
+
+        // The bucket above is complete too
+        for (guint c = 0; c < archiver->columns; ++c)
+        {
+            complete[c] = pending[c];
+            sooshi_pyramid_clear(&pending[c]);
+        }
+    }
+
+    return TRUE;
+}
+
+gboolean
+sooshi_pyramid_sync(SooshiArchiver *archiver)
+{
+    for (guint level = 0; level < SOOSHI_PYRAMID_LEVELS; ++level)
+        if (fdatasync(archiver->pyramid_fds[level]) != 0)
+            return FALSE;
+
+    return TRUE;
+}
+
+void
+sooshi_pyramid_close(SooshiArchiver *archiver)
+{
+    for (guint level = 0; level < SOOSHI_PYRAMID_LEVELS; ++level)
+    {
+        if (archiver->pyramid_fds[level] >= 0)
+            close(archiver->pyramid_fds[level]);
+
+        archiver->pyramid_fds[level] = -1;
+    }
+
+    g_free(archiver->pyramid_pending);
+    archiver->pyramid_pending = NULL;
+}
+
+/* Reading */
+void
+sooshi_pyramid_map(SooshiArchive *archive, const gchar *path)
+{
+    gsize bytes = archive->columns * sizeof(SooshiPyramidEntry);
+
+    // Archives without a pyramid still work, just slower
+    for (guint level = 0; level < SOOSHI_PYRAMID_LEVELS && bytes > 0; ++level)
+    {
+        gchar *file = sooshi_pyramid_file(path, level);
+        archive->pyramid_files[level] = g_mapped_file_new(file, FALSE, NULL);
+        g_free(file);
+
+        if (archive->pyramid_files[level] == NULL)
+            break;
+
+        archive->pyramid[level] = (const SooshiPyramidEntry*)g_mapped_file_get_contents(archive->pyramid_files[level]);
+        archive->pyramid_buckets[level] = MIN(archive->rows / sooshi_pyramid_bucket_rows(level),
+                g_mapped_file_get_length(archive->pyramid_files[level]) / bytes);
+    }
+}
+
+void
+sooshi_pyramid_unmap(SooshiArchive *archive)
+{
+    for (guint level = 0; level < SOOSHI_PYRAMID_LEVELS; ++level)
+    {
+        if (archive->pyramid_files[level])
+            g_mapped_file_unref(archive->pyramid_files[level]);
+
+        archive->pyramid_files[level] = NULL;
+        archive->pyramid[level] = NULL;
+        archive->pyramid_buckets[level] = 0;
+    }
+}
+
+// Summarizes rows [first, end) of a column with as few entries as possible
+static void
+sooshi_pyramid_query(const SooshiArchive *archive, guint column, guint64 first, guint64 end, SooshiPyramidEntry *result)
+{
+    sooshi_pyramid_clear(result);
+
+    guint64 row = first;
+    while (row < end)
+    {
+        // The biggest bucket starting here that fits
+        gint level = -1;
+        guint64 bucket_rows = SOOSHI_PYRAMID_FANOUT;
+
+        for (guint i = 0; i < SOOSHI_PYRAMID_LEVELS; ++i, bucket_rows *= SOOSHI_PYRAMID_FANOUT)
+        {
+            if (row % bucket_rows != 0 || end - row < bucket_rows || row / bucket_rows >= archive->pyramid_buckets[i])
+                break;
+
+            level = i;
+        }
+
+        SooshiPyramidEntry entry;
+
+        if (level < 0)
+        {
+            // Raw rows up to the next bucket boundary
+            guint64 stop = MIN(end, (row / SOOSHI_PYRAMID_FANOUT + 1) * SOOSHI_PYRAMID_FANOUT);
+
+            if (archive->pyramid_buckets[0] == 0 || row >= archive->pyramid_buckets[0] * SOOSHI_PYRAMID_FANOUT)
+                stop = end;
+
+            sooshi_pyramid_summarize(archive->values[column] + row, stop - row, &entry);
+            row = stop;
+        }
+        else
+        {
+            bucket_rows = sooshi_pyramid_bucket_rows(level);
+            entry = archive->pyramid[level][row / bucket_rows * archive->columns + column];
+            row += bucket_rows;
+        }
+
+        sooshi_pyramid_merge(result, &entry);
+    }
+}
+
+guint
+sooshi_archive_envelope(const SooshiArchive *archive, guint column, gint64 from, gint64 to,
+        guint width, SooshiEnvelope *envelope)
+{
+    g_return_val_if_fail(archive != NULL, 0);
+    g_return_val_if_fail(column < archive->columns, 0);
+    g_return_val_if_fail(from <= to, 0);
+    g_return_val_if_fail(width > 0, 0);
+    g_return_val_if_fail(envelope != NULL, 0);
+
+    // Pixels split the time range evenly, both ends are inclusive
+    gdouble span = (gdouble)to - from + 1;
+    guint64 first = sooshi_archive_find(archive, from);
+
+    for (guint pixel = 0; pixel < width; ++pixel)
+    {
+        gint64 last = pixel + 1 == width ? to : from + (gint64)(span * (pixel + 1) / width) - 1;
+        guint64 end = last < G_MAXINT64 ? sooshi_archive_find(archive, last + 1) : archive->rows;
+        SooshiPyramidEntry entry;
+
+        sooshi_pyramid_query(archive, column, first, MAX(first, end), &entry);
+
+        envelope[pixel].min = entry.min;
+        envelope[pixel].max = entry.max;
+        envelope[pixel].mean = entry.count > 0 ? entry.sum / entry.count : NAN;
+        envelope[pixel].count = entry.count;
+
+        first = MAX(first, end);
+    }
+
+    return width;
+}
@@ -0,0 +1,425 @@
+#include <string.h>
+#include <glib.h>
+
+#include "sooshi.h"
+
+// The meter answers every frame sent for a node exactly once and in order:
+// reads with the node's value, writes with an echo of the value written.
+// Each node keeps one of these per frame whose answer is still due.
+typedef struct
+{
+    // Requests completed by this reply, several reads can share one frame
+    GList *requests;
+
+    // Monotonic time the frame was sent
+    gint64 sent;
+
+    // Bytes written, the echo has to match them
+    gboolean write;
+    guchar written[20];
+    gint written_len;
+} SooshiReply;
+
+static void
+sooshi_reply_free(SooshiReply *reply)
+{
+    g_list_free(reply->requests);
+    g_free(reply);
+}
+
+static void sooshi_reply_complete(SooshiReply *reply, SOOSHI_REQUEST_STATUS status);
+
+static gboolean
+sooshi_reply_is_lost(SooshiReply *reply, gint64 now)
+{
+    return now - reply->sent >= (gint64)SOOSHI_REQUEST_REPLY_LOST_MS * 1000;
+}
+
+void
+sooshi_request_expect_reply(SooshiNode *node, gboolean write)
+{
+    SooshiReply *reply = g_new0(SooshiReply, 1);
+    reply->sent = g_get_monotonic_time();
+    reply->write = write;
+
+    if (write)
+        reply->written_len = sooshi_node_value_to_bytes(node, reply->written);
+
+    // Replies nobody heard of for too long are given up on, or a node that
+    // isn't streamed would collect one for every probe or retry that got lost
+    GList *lost = NULL;
+    while (node->replies_due && sooshi_reply_is_lost(node->replies_due->data, reply->sent))
+    {
+        lost = g_list_append(lost, node->replies_due->data);
+        node->replies_due = g_list_delete_link(node->replies_due, node->replies_due);
+    }
+
+    // Before any handler gets to send the next frame
+    node->replies_due = g_list_append(node->replies_due, reply);
+
+    if (lost)
+        g_info("Giving up on %u reply(ies) for node '%s'", g_list_length(lost), node->name);
+
+    GList *elem;
+    for (elem = lost; elem; elem = elem->next)
+        sooshi_reply_complete(elem->data, SOOSHI_REQUEST_TIMED_OUT);
+    g_list_free(lost);
+}
+
+// Makes request wait for the reply to the last frame sent for its node
+static void
+sooshi_request_attach(SooshiRequest *request)
+{
+    SooshiReply *reply = g_list_last(request->node->replies_due)->data;
+    reply->requests = g_list_append(reply->requests, request);
+}
+
+static SooshiRequest *
+sooshi_request_new(SooshiState *state, SooshiNode *node, SOOSHI_REQUEST_KIND kind,
+        sooshi_request_handler_t func, gpointer user_data)
+{
+    SooshiRequest *request = g_new0(SooshiRequest, 1);
+
+    // One reference for the caller, one for the node's list of requests in flight
+    request->ref_count = 2;
+    request->state = state;
+    request->node = node;
+    request->kind = kind;
+    request->status = SOOSHI_REQUEST_PENDING;
+    request->handler = func;
+    request->user_data = user_data;
+    request->issued = g_get_monotonic_time();
+
+    node->requests = g_list_append(node->requests, request);
+
+    return request;
+}
+
+static void
+sooshi_request_finish(SooshiRequest *request, SOOSHI_REQUEST_STATUS status, gboolean notify)
+{
+    SooshiNode *node = request->node;
+
+    if (request->timeout_source_id > 0)
+    {
+        sooshi_source_remove(request->state, request->timeout_source_id);
+        request->timeout_source_id = 0;
+    }
+
+    node->requests = g_list_remove(node->requests, request);
+
+    GList *elem = node->replies_due;
+    while (elem)
+    {
+        GList *next = elem->next;
+        SooshiReply *reply = elem->data;
+
+        if (g_list_find(reply->requests, request))
+        {
+            reply->requests = g_list_remove(reply->requests, request);
+
+            // Nobody is waiting for it anymore, a read merged later must not
+            // wait for a reply that is probably lost
+            if (reply->requests == NULL && status != SOOSHI_REQUEST_DONE)
+            {
+                node->replies_due = g_list_delete_link(node->replies_due, elem);
+                sooshi_reply_free(reply);
+            }
+        }
+
+        elem = next;
+    }
+
+    request->status = status;
+    request->completed = g_get_monotonic_time();
+
+    if (status == SOOSHI_REQUEST_DONE && node->value)
+        request->value = g_variant_ref(node->value);
+
+    if (notify && request->handler)
+        request->handler(request->state, request, request->user_data);
+
+    sooshi_request_unref(request);
+}
+
+static gboolean
+sooshi_request_timed_out(gpointer user_data)
+{
+    SooshiRequest *request = (SooshiRequest*)user_data;
+
+    g_info("Request for node '%s' timed out after %" G_GINT64_FORMAT "ms", request->node->name,
+            (g_get_monotonic_time() - request->issued) / 1000);
+
+    request->timeout_source_id = 0;
+    sooshi_request_finish(request, SOOSHI_REQUEST_TIMED_OUT, TRUE);
+
+    return FALSE;
+}
+
+static void
+sooshi_request_start_timeout(SooshiRequest *request, guint timeout_ms)
+{
+    if (timeout_ms > 0)
+        request->timeout_source_id = sooshi_timeout_add(request->state, timeout_ms, sooshi_request_timed_out, (gpointer)request);
+}
+
+SooshiRequest *
+sooshi_node_read_async(SooshiState *state, SooshiNode *node, guint timeout_ms,
+        sooshi_request_handler_t func, gpointer user_data)
+{
+    g_return_val_if_fail(state != NULL, NULL);
+    g_return_val_if_fail(node != NULL, NULL);
+    g_return_val_if_fail(node->has_value == TRUE, NULL);
+
+    SooshiRequest *request = sooshi_request_new(state, node, SOOSHI_REQUEST_READ, func, user_data);
+    sooshi_request_start_timeout(request, timeout_ms);
+
+    node->value_requested = TRUE;
+    node->value_requested_at = g_get_monotonic_time();
+    sooshi_send_bytes(state, &node->op_code, 1, FALSE);
+    sooshi_request_expect_reply(node, FALSE);
+    sooshi_request_attach(request);
+
+    return request;
+}
+
+SooshiRequest *
+sooshi_node_read_cached(SooshiState *state, SooshiNode *node, guint max_age_ms, guint timeout_ms,
+        sooshi_request_handler_t func, gpointer user_data)
+{
+    g_return_val_if_fail(state != NULL, NULL);
+    g_return_val_if_fail(node != NULL, NULL);
+    g_return_val_if_fail(node->has_value == TRUE, NULL);
+
+    gint64 now = g_get_monotonic_time();
+
+    // Fresh enough, answer right away without touching the radio
+    if (node->value && now - node->last_update <= (gint64)max_age_ms * 1000)
+    {
+        SooshiRequest *request = g_new0(SooshiRequest, 1);
+        request->ref_count = 1;
+        request->state = state;
+        request->node = node;
+        request->kind = SOOSHI_REQUEST_READ;
+        request->status = SOOSHI_REQUEST_DONE;
+        request->value = g_variant_ref(node->value);
+        request->issued = now;
+        request->completed = now;
+        request->handler = func;
+        request->user_data = user_data;
+
+        if (func)
+            func(state, request, user_data);
+
+        return request;
+    }
+
+    // A read is already on its way, piggyback on its reply instead of sending
+    // another one. Only if it was sent recently, an old one is likely lost.
+    GList *last = g_list_last(node->replies_due);
+    if (last && ((SooshiReply*)last->data)->write == FALSE
+            && now - ((SooshiReply*)last->data)->sent < (gint64)SOOSHI_REQUEST_MERGE_MS * 1000)
+    {
+        g_debug("Merging read of node '%s' with the one in flight", node->name);
+
+        SooshiRequest *request = sooshi_request_new(state, node, SOOSHI_REQUEST_READ, func, user_data);
+        sooshi_request_start_timeout(request, timeout_ms);
+        sooshi_request_attach(request);
+
+        return request;
+    }
+
+    return sooshi_node_read_async(state, node, timeout_ms, func, user_data);
+}
+
+SooshiRequest *
+sooshi_node_write_async(SooshiState *state, SooshiNode *node, GVariant *value, guint timeout_ms,
+        sooshi_request_handler_t func, gpointer user_data)
+{
+    g_return_val_if_fail(state != NULL, NULL);
+    g_return_val_if_fail(node != NULL, NULL);
+    g_return_val_if_fail(value != NULL, NULL);
+
+    SooshiRequest *request = sooshi_request_new(state, node, SOOSHI_REQUEST_WRITE, func, user_data);
+    sooshi_request_start_timeout(request, timeout_ms);
+
+    // Sending the value expects its echo
+    sooshi_node_set_value(state, node, value, TRUE);
+    sooshi_request_attach(request);
+
+    return request;
+}
+
+void
+sooshi_request_cancel(SooshiRequest *request)
+{
+    g_return_if_fail(request != NULL);
+
+    if (request->status != SOOSHI_REQUEST_PENDING)
+        return;
+
+    sooshi_request_finish(request, SOOSHI_REQUEST_CANCELLED, TRUE);
+}
+
+gboolean
+sooshi_request_wait(SooshiRequest *request)
+{
+    g_return_val_if_fail(request != NULL, FALSE);
+
+    while (request->status == SOOSHI_REQUEST_PENDING)
+        g_main_context_iteration(request->state->context, TRUE);
+
+    return (request->status == SOOSHI_REQUEST_DONE);
+}
+
+SooshiRequest *
+sooshi_request_ref(SooshiRequest *request)
+{
+    g_return_val_if_fail(request != NULL, NULL);
+
+    request->ref_count++;
+    return request;
+}
+
+void
+sooshi_request_unref(SooshiRequest *request)
+{
+    g_return_if_fail(request != NULL);
+
+    if (--request->ref_count > 0)
+        return;
+
+    if (request->value)
+        g_variant_unref(request->value);
+
+    g_free(request);
+}
+
+// Finishes the requests of a reply that is no longer due and frees it
+static void
+sooshi_reply_complete(SooshiReply *reply, SOOSHI_REQUEST_STATUS status)
+{
+    GList *requests = reply->requests;
+    reply->requests = NULL;
+    sooshi_reply_free(reply);
+
+    // A handler may cancel any of the others
+    g_list_foreach(requests, (GFunc)sooshi_request_ref, NULL);
+
+    GList *elem;
+    for (elem = requests; elem; elem = elem->next)
+    {
+        SooshiRequest *request = elem->data;
+
+        if (request->status == SOOSHI_REQUEST_PENDING)
+            sooshi_request_finish(request, status, TRUE);
+    }
+
+    g_list_free_full(requests, (GDestroyNotify)sooshi_request_unref);
+}
+
+void
+sooshi_request_on_value(SooshiState *state, SooshiNode *node)
+{
+    // Nothing was asked for, e.g. a streamed sample
+    while (node->replies_due)
+    {
+        SooshiReply *reply = node->replies_due->data;
+
+        // Any other value arriving before the echo was sent by the meter on its
+        // own. Reads can't tell, they take the first value after they were sent.
+        if (reply->write)
+        {
+            guchar buffer[20];
+            gint len = sooshi_node_value_to_bytes(node, buffer);
+
+            if (len != reply->written_len || memcmp(buffer, reply->written, len) != 0)
+            {
+                // Don't let a lost echo hold up the replies behind it forever
+                if (!sooshi_reply_is_lost(reply, g_get_monotonic_time()))
+                    return;
+
+                g_info("Echo for node '%s' got lost", node->name);
+
+                node->replies_due = g_list_delete_link(node->replies_due, node->replies_due);
+                sooshi_reply_complete(reply, SOOSHI_REQUEST_TIMED_OUT);
+                continue;
+            }
+        }
+
+        node->replies_due = g_list_delete_link(node->replies_due, node->replies_due);
+        sooshi_reply_complete(reply, SOOSHI_REQUEST_DONE);
+        return;
+    }
+}
+
+void
+sooshi_request_drop_replies(SooshiState *state)
+{
+    if (state->op_code_map == NULL)
+        return;
+
+    for (guint i = 0; i < state->op_code_map->len; ++i)
+    {
+        SooshiNode *node = g_ptr_array_index(state->op_code_map, i);
+
+        // Requests waiting for them won't hear back, new ones may be sent from the handlers
+        GList *replies = node->replies_due;
+        node->replies_due = NULL;
+
+        GList *elem;
+        for (elem = replies; elem; elem = elem->next)
+            sooshi_reply_complete(elem->data, SOOSHI_REQUEST_CANCELLED);
+        g_list_free(replies);
+    }
+}
+
+// Requests sent from the handlers are not cancelled as well
+static void
+sooshi_request_cancel_list(GList *requests, gboolean notify)
+{
+    // A handler may cancel any of the others
+    g_list_foreach(requests, (GFunc)sooshi_request_ref, NULL);
+
+    GList *elem;
+    for (elem = requests; elem; elem = elem->next)
+    {
+        SooshiRequest *request = elem->data;
+
+        if (request->status == SOOSHI_REQUEST_PENDING)
+            sooshi_request_finish(request, SOOSHI_REQUEST_CANCELLED, notify);
+    }
+
+    g_list_free_full(requests, (GDestroyNotify)sooshi_request_unref);
+}
+
+static GList *
+sooshi_request_detach(SooshiNode *node)
+{
+    GList *requests = node->requests;
+    node->requests = NULL;
+
+    g_list_free_full(node->replies_due, (GDestroyNotify)sooshi_reply_free);
+    node->replies_due = NULL;
+
+    return requests;
+}
+
+void
+sooshi_request_cancel_node(SooshiState *state, SooshiNode *node)
+{
+    sooshi_request_cancel_list(sooshi_request_detach(node), TRUE);
+}
+
+void
+sooshi_request_cancel_all(SooshiState *state, gboolean notify)
+{
+    if (state->op_code_map == NULL)
+        return;
+
+    GList *requests = NULL;
+    for (guint i = 0; i < state->op_code_map->len; ++i)
+        requests = g_list_concat(requests, sooshi_request_detach(g_ptr_array_index(state->op_code_map, i)));
+
+    sooshi_request_cancel_list(requests, notify);
+}
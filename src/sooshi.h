@@ -1,6 +1,7 @@
 #ifndef SOOSHI_H_
 #define SOOSHI_H_
 
+#include <stdio.h>
 #include <gio/gio.h>
 #include <glib-object.h>
 
@@ -48,6 +49,21 @@
 #define METER_SERIAL_IN    "1BC5FFA1-0200-62AB-E411-F254E005DBD4"
 #define METER_SERIAL_OUT   "1BC5FFA2-0200-62AB-E411-F254E005DBD4"
 
+// Maximum time without writing anything to the meter, see sooshi_link_monitor_configure()
+#define SOOSHI_LINK_KEEPALIVE_MS   10000
+#define SOOSHI_LINK_IDLE_MS        2000
+#define SOOSHI_LINK_STALL_MS       15000
+
+// A lazily fetched value that did not arrive within this time is asked for again
+#define SOOSHI_NODE_FETCH_RETRY_MS 2000
+
+// A reply still missing after this time is given up on: an echo once other
+// values arrived, any reply once the next frame for its node is sent
+#define SOOSHI_REQUEST_REPLY_LOST_MS 5000
+
+// A cached read only shares the frame of a read sent less than this time ago
+#define SOOSHI_REQUEST_MERGE_MS 1000
+
 typedef guint32 crc32_t;
 #define CRC32_POLYNOMIAL          0x04C11DB7
 #define CRC32_INITIAL_REMAINDER   0xFFFFFFFF
@@ -62,7 +78,9 @@ typedef enum
   SOOSHI_ERROR_SUCCESS,
   SOOSHI_ERROR_NO_ADAPTER_FOUND,
   SOOSHI_ERROR_SCAN_FAILED,
-  SOOSHI_ERROR_DBUS_CONNECTION_FAILED
+  SOOSHI_ERROR_DBUS_CONNECTION_FAILED,
+  SOOSHI_ERROR_CAPTURE_FAILED,
+  SOOSHI_ERROR_ARCHIVE_FAILED
 } sooshi_error_t;
 
 SOOSHI_API extern const gchar* const __SOOSHI_ERROR_STR[];
@@ -89,6 +107,301 @@ typedef enum
 extern const gchar* const __SOOSHI_NODE_TYPE_STR[];
 #define SOOSHI_NODE_TYPE_TO_STR(x) (__SOOSHI_NODE_TYPE_STR[(x)+1])
 
+/* Latency Histogram */
+#define SOOSHI_HISTOGRAM_BUCKETS 32
+
+typedef struct _SooshiHistogram SooshiHistogram;
+struct _SooshiHistogram
+{
+    guint64 count;
+    guint64 sum;
+    guint64 min;
+    guint64 max;
+
+    // Bucket n counts values in [2^n, 2^(n+1)), values are in microseconds
+    guint64 buckets[SOOSHI_HISTOGRAM_BUCKETS];
+};
+
+/* Runtime Metrics */
+#define SOOSHI_METRICS_OP_CODES 128
+
+// Counters only ever grow, sooshi_get_metrics() takes a snapshot from any thread
+typedef struct _SooshiMetrics SooshiMetrics;
+struct _SooshiMetrics
+{
+    guint64 notifications;
+    guint64 rx_bytes;
+    guint64 tx_bytes;
+
+    // Complete frames parsed, per op code, and frames with an op code not in the tree
+    guint64 frames[SOOSHI_METRICS_OP_CODES];
+    guint64 unknown_frames;
+
+    guint64 writes;
+    guint64 write_errors;
+
+    // Largest number of bytes waiting in the receive buffer
+    guint64 buffer_high_water;
+
+    // Time spent parsing a notification, in a subscriber callback,
+    // and from issuing WriteValue until BlueZ replied
+    SooshiHistogram parse_time;
+    SooshiHistogram subscriber_time;
+    SooshiHistogram write_latency;
+};
+
+/* Connection Timeline */
+typedef enum
+{
+    SOOSHI_PHASE_ADAPTER_FOUND,
+    SOOSHI_PHASE_SCAN_STARTED,
+    SOOSHI_PHASE_SCAN_HIT,
+    SOOSHI_PHASE_CONNECTED,
+    SOOSHI_PHASE_CHARACTERISTICS_RESOLVED,
+    SOOSHI_PHASE_NOTIFY_STARTED,
+    SOOSHI_PHASE_TREE_REQUESTED,
+    SOOSHI_PHASE_TREE_RECEIVED,
+    SOOSHI_PHASE_CRC_ACKNOWLEDGED,
+    SOOSHI_PHASE_VALUES_FETCHED,
+    SOOSHI_PHASE_INITIALIZED,
+    SOOSHI_PHASE_COUNT
+} SOOSHI_PHASE;
+
+SOOSHI_API extern const gchar* const __SOOSHI_PHASE_STR[];
+#define SOOSHI_PHASE_TO_STR(x) (__SOOSHI_PHASE_STR[(x)])
+
+typedef struct _SooshiTimeline SooshiTimeline;
+struct _SooshiTimeline
+{
+    // Monotonic timestamp (in microseconds) the connection attempt started at
+    gint64 started;
+
+    // Monotonic timestamp each phase was first reached at, 0 if it wasn't (yet)
+    gint64 phases[SOOSHI_PHASE_COUNT];
+};
+
+/* Session Capture */
+typedef enum
+{
+    SOOSHI_CAPTURE_RX,
+    SOOSHI_CAPTURE_TX
+} SOOSHI_CAPTURE_DIRECTION;
+
+/* Running Statistics */
+typedef struct _SooshiStats SooshiStats;
+struct _SooshiStats
+{
+    // Number of values in the window
+    guint64 count;
+
+    gdouble mean;
+    // Population variance
+    gdouble variance;
+    gdouble rms;
+    gdouble min;
+    gdouble max;
+    gdouble peak_to_peak;
+};
+
+// Attached to a node by sooshi_node_stats_enable(), updated by the thread
+// running the state's context only
+typedef struct _SooshiStatsAccumulator SooshiStatsAccumulator;
+struct _SooshiStatsAccumulator
+{
+    // Length of the sliding window in values, 0 to accumulate until reset
+    guint window;
+
+    // Welford's running mean and sum of squared deviations
+    guint64 count;
+    gdouble mean;
+    gdouble m2;
+    gdouble min;
+    gdouble max;
+
+    // Sliding windows only: the last window values, indexed by value number
+    // modulo window, and monotonic wedges of the value numbers that may
+    // still become the window's minimum or maximum, oldest first
+    gdouble *values;
+    guint64 *min_wedge;
+    guint64 *max_wedge;
+    guint min_head, min_length;
+    guint max_head, max_length;
+    guint64 total;
+    guint since_recompute;
+};
+
+// The part of a node's statistics other threads touch. It is part of the node,
+// so it stays valid while the state's thread replaces or frees the accumulator.
+typedef struct _SooshiStatsSnapshot SooshiStatsSnapshot;
+struct _SooshiStatsSnapshot
+{
+    // Whether statistics are enabled at all
+    gint enabled;
+
+    // Set by sooshi_node_stats_reset() from any thread
+    gint reset_requested;
+
+    // What readers get, sequence is odd while it is being written
+    guint sequence;
+    SooshiStats published;
+};
+
+/* Value History */
+typedef struct _SooshiSample SooshiSample;
+struct _SooshiSample
+{
+    // Monotonic timestamp (in microseconds) the value was received at
+    gint64 timestamp;
+    gdouble value;
+};
+
+// A preallocated ring of a node's last capacity values
+typedef struct _SooshiHistory SooshiHistory;
+struct _SooshiHistory
+{
+    SooshiSample *samples;
+    guint capacity;
+
+    // Where the next sample goes and how many samples the ring holds
+    guint head;
+    guint length;
+};
+
+// Samples of a history, oldest first, pointing into the ring. A range that
+// wraps around the end of the ring continues in the second span.
+typedef struct _SooshiHistoryView SooshiHistoryView;
+struct _SooshiHistoryView
+{
+    const SooshiSample *first;
+    guint first_length;
+    const SooshiSample *second;
+    guint second_length;
+};
+
+/* Lossy Compression */
+// Error bound of a compressed signal: no dropped sample is further than
+// absolute + relative * |v| from the line between the retained points around
+// it, v being the value of the earlier one
+typedef struct _SooshiCompression SooshiCompression;
+struct _SooshiCompression
+{
+    gdouble absolute;
+    gdouble relative;
+
+    // Retain a sample at least this often, 0 for no limit
+    guint max_interval_ms;
+};
+
+// Swinging door compressor, see sooshi_swinging_door_add()
+typedef struct _SooshiSwingingDoor SooshiSwingingDoor;
+struct _SooshiSwingingDoor
+{
+    SooshiCompression options;
+    gboolean started;
+
+    // Last retained sample, the door pivot
+    SooshiSample retained;
+    gdouble tolerance;
+
+    // Latest sample, retained if the next one doesn't fit through the door
+    SooshiSample last;
+    gboolean last_retained;
+
+    // Slopes from the pivot every sample since it still allows
+    gdouble lower;
+    gdouble upper;
+};
+
+/* Sample Archive */
+#define SOOSHI_ARCHIVE_CHUNK_ROWS 65536
+
+// Every pyramid level summarizes FANOUT buckets of the level below, the
+// first one FANOUT rows
+#define SOOSHI_PYRAMID_FANOUT 16
+#define SOOSHI_PYRAMID_LEVELS 6
+
+// Summary of a column over a pyramid bucket, NaN values are left out
+typedef struct _SooshiPyramidEntry SooshiPyramidEntry;
+struct _SooshiPyramidEntry
+{
+    gdouble min;
+    gdouble max;
+    gdouble sum;
+    guint64 count;
+};
+
+// One pixel of sooshi_archive_envelope(), NaN if it has no values
+typedef struct _SooshiEnvelope SooshiEnvelope;
+struct _SooshiEnvelope
+{
+    gdouble min;
+    gdouble max;
+    gdouble mean;
+    guint64 count;
+};
+
+// A read-only view of an archive directory, see sooshi_archive_open()
+typedef struct _SooshiArchive SooshiArchive;
+struct _SooshiArchive
+{
+    guint columns;
+    gchar **names;
+    guint chunk_rows;
+
+    // Committed rows, anything written after the last commit is ignored
+    guint64 rows;
+
+    // Row timestamps (real time in microseconds, never decreasing) and one
+    // array of values per column, mapped straight from the files
+    const gint64 *timestamps;
+    const gdouble **values;
+
+    // Sparse index: timestamp of the first row of each chunk
+    const gint64 *index;
+    guint64 chunks;
+
+    // Per level, the entries of every complete bucket, columns interleaved
+    const SooshiPyramidEntry *pyramid[SOOSHI_PYRAMID_LEVELS];
+    guint64 pyramid_buckets[SOOSHI_PYRAMID_LEVELS];
+
+    GMappedFile *time_file;
+    GMappedFile **column_files;
+    GMappedFile *index_file;
+    GMappedFile *pyramid_files[SOOSHI_PYRAMID_LEVELS];
+};
+
+/* Compressed Archive */
+#define SOOSHI_CODEC_BLOCK_ROWS 1024
+
+// Where a block of rows lives in a compressed archive and what it covers
+typedef struct _SooshiCompressedBlock SooshiCompressedBlock;
+struct _SooshiCompressedBlock
+{
+    gint64 first_timestamp;
+    gint64 last_timestamp;
+    guint64 offset;
+    guint32 rows;
+    guint32 length;
+};
+
+// A read-only view of a file written by sooshi_archive_compress()
+typedef struct _SooshiCompressedArchive SooshiCompressedArchive;
+struct _SooshiCompressedArchive
+{
+    guint columns;
+    gchar **names;
+    guint block_rows;
+    guint64 rows;
+
+    // One entry per block, sorted by time
+    const SooshiCompressedBlock *index;
+    guint64 blocks;
+
+    const guint8 *data;
+    gsize length;
+    GMappedFile *file;
+};
+
 /* Mooshi Tree Node */
 typedef struct _SooshiNode SooshiNode;
 struct _SooshiNode
@@ -101,8 +414,47 @@ struct _SooshiNode
     gboolean has_value;
 
     GVariant *value;
+    gboolean value_requested;
+
+    // Monotonic timestamp (in microseconds) of the last request for value
+    gint64 value_requested_at;
+
+    // Monotonic timestamp (in microseconds) of the last value received from the meter
+    gint64 last_update;
 
     GList *subscriber;
+
+    // Nesting depth of sooshi_node_notify_subscribers() for this node
+    guint notifying;
+
+    // Whether the host has written this node, those are replayed after a reconnect
+    gboolean host_written;
+
+    // Asynchronous requests waiting for a reply, oldest first
+    GList *requests;
+
+    // One entry per frame sent for this node that has not been answered yet,
+    // oldest first, see request.c
+    GList *replies_due;
+
+    // Running statistics, NULL unless enabled
+    SooshiStatsAccumulator *stats;
+    SooshiStatsSnapshot stats_snapshot;
+
+    // Recent values, NULL unless enabled
+    SooshiHistory *history;
+};
+
+/* Index of BlueZ objects, see dbus.c */
+typedef struct _SooshiDBusIndex SooshiDBusIndex;
+struct _SooshiDBusIndex
+{
+    gint ref_count;
+    GDBusObjectManager *object_manager;
+
+    // Proxies of all BlueZ objects, keyed by interface name and by "interface:UUID"
+    GHashTable *entries;
+    gulong signal_ids[5];
 };
 
 /* Sooshi State */
@@ -118,6 +470,9 @@ struct _SooshiState
     // org.Bluez Object Manager
     GDBusObjectManager *object_manager;
 
+    // BlueZ objects by interface and UUID, shared by all meters of a SooshiManager
+    SooshiDBusIndex *dbus_index;
+
     // Bluetooth Adapter
     GDBusProxy* adapter;
 
@@ -131,21 +486,66 @@ struct _SooshiState
 
     // Signals
     gulong properties_changed_id;
+    gulong device_properties_id;
     gulong scan_signal_id;
 
-    // Heartbeat Timer
+    // Heartbeat Timer, drives the link monitor
     guint heartbeat_source_id;
 
+    // Link monitor, timestamps are monotonic in microseconds
+    gint64 link_last_rx;
+    gint64 link_last_tx;
+    struct _SooshiRequest *link_probe;
+    gboolean link_probe_lost;
+    guint link_idle_ms;
+    guint link_stall_ms;
+    gboolean link_stalled;
+    guint64 link_probes_sent;
+    guint64 link_probes_lost;
+    SooshiNode *link_probe_node;
+    SooshiHistogram link_rtt;
+
+    // Phases of the current connection attempt
+    SooshiTimeline timeline;
+
+    // Node values requested during initialization that haven't arrived yet
+    guint fetches_pending;
+
     // Scan Timeout Timer
     guint scan_timeout_source_id;
 
+    // Reconnect handling
+    gboolean auto_reconnect;
+    gboolean reconnecting;
+    guint reconnect_attempts;
+    guint reconnect_source_id;
+    guint crc_timeout_source_id;
+
     gboolean scanning;
     gboolean listening;
     gboolean connected;
     gboolean initialized;
 
+    // A Connect call is on its way, see sooshi_connect_mooshi()
+    gboolean connecting;
+
+    // Every source of this state is attached here, see sooshi_state_new_with_context()
+    GMainContext *context;
     GMainLoop *loop;
 
+    // Updated with atomics, see sooshi_get_metrics()
+    SooshiMetrics metrics;
+
+    // Cancels the replies of asynchronous writes when the state goes away
+    GCancellable *writes_cancellable;
+
+    // Every notification and write is recorded here, see sooshi_capture_start()
+    FILE *capture;
+    gboolean replaying;
+
+    // When the record being replayed was received, on the replay's clock
+    gint64 replay_time;
+
     // Message parsing & sending
     GByteArray *buffer;
     guint send_sequence;
@@ -154,6 +554,17 @@ struct _SooshiState
     // Config tree root
     SooshiNode *root_node;
     GPtrArray *op_code_map;
+    guchar next_op_code;
+    crc32_t tree_crc;
+
+    // Last id handed out by sooshi_node_subscribe()
+    guint next_subscriber_id;
+
+    // Committed transactions still waiting for their echoes
+    GList *transactions;
+
+    // Paths of the subtrees fetched during initialization, NULL for all
+    gchar **interest;
 
     // CRC32 Helper
     crc32_t crc_table[256];
@@ -165,11 +576,50 @@ struct _SooshiState
     // This will be called once scanning times out
     sooshi_callback_t scan_timeout_handler;
     gpointer scan_timeout_data;
+
+    // This will be called once streaming has resumed after a reconnect
+    sooshi_callback_t reconnect_handler;
+    gpointer reconnect_data;
+
+    // This will be called once nothing has been received for link_stall_ms
+    sooshi_callback_t link_stalled_handler;
+    gpointer link_stalled_data;
 };
 
 typedef gboolean (*dbus_conditional_func_t)(GDBusInterface* interface, gpointer user_data);
 typedef void (*sooshi_node_subscriber_handler_t)(SooshiState *state, SooshiNode *node, gpointer user_data);
 
+/* Subscription Options, see sooshi_node_subscribe_full() */
+typedef struct _SooshiSubscribeOptions SooshiSubscribeOptions;
+struct _SooshiSubscribeOptions
+{
+    // Only call the handler for every nth value, starting with the first. 0 or 1 for all of them
+    guint every;
+
+    // Call the handler at most once per interval, 0 for no limit
+    guint interval_ms;
+};
+
+/* Aggregated values of a window, see sooshi_node_subscribe_aggregate() */
+typedef struct _SooshiAggregate SooshiAggregate;
+struct _SooshiAggregate
+{
+    // Monotonic timestamps (in microseconds) of the first and the last value in the window
+    gint64 first_update;
+    gint64 last_update;
+
+    guint count;
+    gdouble min;
+    gdouble max;
+    gdouble mean;
+    gdouble last;
+};
+
+typedef void (*sooshi_node_aggregate_handler_t)(SooshiState *state, SooshiNode *node, const SooshiAggregate *aggregate, gpointer user_data);
+
+// Called with each sample a compressing subscriber retains, see sooshi_node_subscribe_compressed()
+typedef void (*sooshi_node_point_handler_t)(SooshiState *state, SooshiNode *node, const SooshiSample *point, gpointer user_data);
+
 /* Subscriber Info */
 typedef struct _SooshiNodeSubscriber SooshiNodeSubscriber;
 struct _SooshiNodeSubscriber
@@ -177,6 +627,233 @@ struct _SooshiNodeSubscriber
     guint id;
     sooshi_node_subscriber_handler_t handler;
     gpointer user_data;
+
+    // Decimation and throttling
+    guint every;
+    guint seen;
+    gint64 interval;
+    gint64 last_call;
+
+    // Aggregating subscribers have this called instead of handler
+    sooshi_node_aggregate_handler_t aggregate_handler;
+    gint64 window;
+    SooshiAggregate aggregate;
+    gdouble sum;
+
+    // Compressing subscribers have this called instead of handler
+    sooshi_node_point_handler_t point_handler;
+    SooshiSwingingDoor door;
+
+    // Unsubscribed while its node was notifying, freed once that is done
+    gboolean removed;
+};
+
+/* Configuration Transaction */
+#define SOOSHI_TRANSACTION_TIMEOUT_MS 5000
+
+typedef struct _SooshiTransaction SooshiTransaction;
+typedef void (*sooshi_transaction_handler_t)(SooshiState *state, SooshiTransaction *transaction, gpointer user_data);
+
+// The caller owns a transaction until it is committed, after that the library
+// does: it is freed right after the handler was called or by
+// sooshi_transaction_abort(), whichever comes first. A commit with nothing to
+// write calls the handler and frees the transaction before returning 0, it
+// must not be aborted after that.
+struct _SooshiTransaction
+{
+    SooshiState *state;
+
+    // Queued writes, see sooshi_transaction_set_value()
+    GList *writes;
+
+    // Nodes whose echo, a value matching the one written, has not been received yet
+    GList *pending;
+
+    // This will be called once all writes have been echoed by the meter,
+    // or once the timeout expired with timed_out set
+    sooshi_transaction_handler_t handler;
+    gpointer user_data;
+
+    // How long to wait for the echoes, 0 waits forever
+    guint timeout_ms;
+    guint timeout_source_id;
+    gboolean timed_out;
+};
+
+/* Asynchronous Request */
+typedef enum
+{
+    SOOSHI_REQUEST_READ,
+    SOOSHI_REQUEST_WRITE
+} SOOSHI_REQUEST_KIND;
+
+typedef enum
+{
+    SOOSHI_REQUEST_PENDING,
+    SOOSHI_REQUEST_DONE,
+    SOOSHI_REQUEST_TIMED_OUT,
+    // Also set when the connection dropped before the reply arrived
+    SOOSHI_REQUEST_CANCELLED
+} SOOSHI_REQUEST_STATUS;
+
+typedef struct _SooshiRequest SooshiRequest;
+typedef void (*sooshi_request_handler_t)(SooshiState *state, SooshiRequest *request, gpointer user_data);
+
+struct _SooshiRequest
+{
+    gint ref_count;
+
+    SooshiState *state;
+    SooshiNode *node;
+    SOOSHI_REQUEST_KIND kind;
+    SOOSHI_REQUEST_STATUS status;
+
+    // Value of the node when the reply arrived, only set if status is SOOSHI_REQUEST_DONE
+    GVariant *value;
+
+    // Monotonic timestamps in microseconds
+    gint64 issued;
+    gint64 completed;
+
+    guint timeout_source_id;
+
+    // This will be called once the request is done, timed out or cancelled
+    sooshi_request_handler_t handler;
+    gpointer user_data;
+};
+
+/* Multi-Meter Manager */
+#define SOOSHI_ADAPTER_MAX_CONNECTIONS   5
+#define SOOSHI_ADAPTER_REBALANCE_SECONDS 5
+
+typedef struct _SooshiAdapter SooshiAdapter;
+struct _SooshiAdapter
+{
+    GDBusProxy *proxy;
+    gchar *path;
+    gboolean scanning;
+
+    // Load as of the last rebalancing round, throughput in bytes per second
+    guint connections;
+    gdouble throughput;
+};
+
+typedef struct _SooshiManagerMeter SooshiManagerMeter;
+struct _SooshiManagerMeter
+{
+    gchar *address;
+    SooshiState *state;
+
+    // Adapter path -> org.bluez.Device1 proxy, for every adapter that has seen this meter
+    GHashTable *candidates;
+
+    // Manager subscription -> id of its subscriber on this meter, see sooshi_manager_subscribe()
+    GHashTable *applied;
+
+    guint64 last_rx_bytes;
+    gdouble throughput;
+};
+
+typedef struct _SooshiManager SooshiManager;
+typedef void (*sooshi_manager_handler_t)(SooshiManager *manager, SooshiState *state, gpointer user_data);
+
+struct _SooshiManager
+{
+    // Shared by all meters of this manager
+    GMainContext *context;
+    GMainLoop *loop;
+    GDBusObjectManager *object_manager;
+    SooshiDBusIndex *dbus_index;
+
+    // All powered adapters, see sooshi_manager_set_adapter_limits()
+    GPtrArray *adapters;
+    guint max_connections;
+    gdouble max_throughput;
+    guint rebalance_source_id;
+    gint64 last_rebalance;
+
+    // Bluetooth address -> SooshiManagerMeter of every meter we know about
+    GHashTable *meters;
+
+    // Node subscriptions applied to every meter, see sooshi_manager_subscribe()
+    GList *subscriptions;
+
+    gulong object_added_id;
+    gulong properties_changed_id;
+
+    guint scan_timeout_source_id;
+
+    // This will be called once a meter is initialized
+    sooshi_manager_handler_t meter_handler;
+    gpointer meter_data;
+};
+
+/* Sample Archiver, see sooshi_archiver_new() */
+typedef struct _SooshiArchiver SooshiArchiver;
+
+typedef struct _SooshiArchiverColumn SooshiArchiverColumn;
+struct _SooshiArchiverColumn
+{
+    SooshiArchiver *archiver;
+    guint index;
+    guint subscription;
+};
+
+struct _SooshiArchiver
+{
+    SooshiState *state;
+    gchar *path;
+    gchar **nodes;
+    guint columns;
+    guint chunk_rows;
+    SooshiArchiverColumn *subscriptions;
+
+    gint meta_fd;
+    gint index_fd;
+    gint time_fd;
+    gint *column_fds;
+
+    // Mappings of the chunk currently written to
+    guint64 chunk;
+    gint64 *time_chunk;
+    gdouble **column_chunks;
+
+    guint64 rows;
+    guint64 committed;
+    guint64 sequence;
+    gint64 last_timestamp;
+    gboolean failed;
+
+    // The row being put together. It is written once every column has a new
+    // value or as soon as a column gets a second one, missing values are NaN.
+    gint64 row_timestamp;
+    gdouble *row;
+    gboolean *row_present;
+    guint row_values;
+
+    // Node timestamps are monotonic, the archive stores real time
+    gint64 clock_offset;
+
+    // Only set for archivers of a single compressed node
+    SooshiSwingingDoor *door;
+
+    // Pyramid levels and, per level and column, the incomplete bucket
+    gint pyramid_fds[SOOSHI_PYRAMID_LEVELS];
+    SooshiPyramidEntry *pyramid_pending;
+    guint commit_source_id;
+};
+
+/* Link Statistics */
+typedef struct _SooshiLinkStats SooshiLinkStats;
+struct _SooshiLinkStats
+{
+    gint64 rx_quiet_ms;
+    gboolean stalled;
+    guint64 probes_sent;
+    guint64 probes_lost;
+
+    // Round trip times of answered probes
+    SooshiHistogram rtt;
 };
 
 struct _SooshiStateClass
@@ -197,40 +874,223 @@ GType sooshi_state_get_type();
 /* API functions */
 /*****************/
 SOOSHI_API SooshiState *sooshi_state_new(sooshi_error_t *error);
+SOOSHI_API SooshiState *sooshi_state_new_with_context(GMainContext *context, sooshi_error_t *error);
+SOOSHI_API GMainContext *sooshi_get_context(SooshiState *state);
 SOOSHI_API void sooshi_state_delete(SooshiState *state);
 SOOSHI_API sooshi_error_t sooshi_setup(SooshiState *state, sooshi_callback_t init_handler, gpointer init_data,
     sooshi_callback_t scan_timeout_handler, gpointer scan_timeout_data);
 SOOSHI_API void sooshi_run(SooshiState *state);
 SOOSHI_API void sooshi_stop(SooshiState *state);
+SOOSHI_API gint sooshi_prepare(SooshiState *state, GPollFD *fds, gint n_fds, gint *timeout_ms);
+SOOSHI_API void sooshi_dispatch(SooshiState *state, GPollFD *fds, gint n_fds);
+SOOSHI_API void sooshi_set_interest(SooshiState *state, const gchar *const *paths);
+SOOSHI_API void sooshi_set_auto_reconnect(SooshiState *state, gboolean enabled,
+    sooshi_callback_t reconnect_handler, gpointer reconnect_data);
+SOOSHI_API void sooshi_reconnect(SooshiState *state);
+
+// Multi-meter manager
+SOOSHI_API SooshiManager *sooshi_manager_new(sooshi_error_t *error);
+SOOSHI_API void sooshi_manager_delete(SooshiManager *manager);
+SOOSHI_API sooshi_error_t sooshi_manager_start(SooshiManager *manager, guint scan_seconds,
+    sooshi_manager_handler_t meter_handler, gpointer meter_data);
+SOOSHI_API void sooshi_manager_set_adapter_limits(SooshiManager *manager, guint max_connections, gdouble max_throughput);
+SOOSHI_API void sooshi_manager_subscribe(SooshiManager *manager, const gchar *path,
+    sooshi_node_subscriber_handler_t func, gpointer user_data);
+SOOSHI_API void sooshi_manager_run(SooshiManager *manager);
+SOOSHI_API void sooshi_manager_stop(SooshiManager *manager);
+
+// Link monitor
+SOOSHI_API void sooshi_link_monitor_configure(SooshiState *state, guint idle_ms, guint stall_ms,
+    sooshi_callback_t stalled_handler, gpointer stalled_data);
+SOOSHI_API void sooshi_link_get_stats(SooshiState *state, SooshiLinkStats *stats);
+SOOSHI_API guint64 sooshi_histogram_percentile(const SooshiHistogram *histogram, gdouble percentile);
+
+// Runtime metrics
+SOOSHI_API void sooshi_get_metrics(SooshiState *state, SooshiMetrics *metrics);
+
+// Session capture & replay
+SOOSHI_API sooshi_error_t sooshi_capture_start(SooshiState *state, const gchar *path);
+SOOSHI_API void sooshi_capture_stop(SooshiState *state);
+SOOSHI_API sooshi_error_t sooshi_capture_export_btsnoop(const gchar *capture_path, const gchar *btsnoop_path);
+SOOSHI_API sooshi_error_t sooshi_replay(SooshiState *state, const gchar *path, gdouble speed, guint *records);
+
+// Sample archive
+SOOSHI_API SooshiArchiver *sooshi_archiver_new(SooshiState *state, const gchar *path, const gchar * const *nodes,
+    guint chunk_rows, guint commit_interval_ms, sooshi_error_t *error);
+SOOSHI_API SooshiArchiver *sooshi_archiver_new_compressed(SooshiState *state, const gchar *path, const gchar *node,
+    const SooshiCompression *compression, guint chunk_rows, guint commit_interval_ms, sooshi_error_t *error);
+SOOSHI_API sooshi_error_t sooshi_archiver_commit(SooshiArchiver *archiver);
+SOOSHI_API void sooshi_archiver_free(SooshiArchiver *archiver);
+SOOSHI_API SooshiArchive *sooshi_archive_open(const gchar *path, sooshi_error_t *error);
+SOOSHI_API void sooshi_archive_close(SooshiArchive *archive);
+SOOSHI_API guint64 sooshi_archive_find(const SooshiArchive *archive, gint64 timestamp);
+SOOSHI_API guint64 sooshi_archive_range(const SooshiArchive *archive, gint64 from, gint64 to, guint64 *first_row);
+SOOSHI_API guint sooshi_archive_envelope(const SooshiArchive *archive, guint column, gint64 from, gint64 to,
+    guint width, SooshiEnvelope *envelope);
+SOOSHI_API sooshi_error_t sooshi_archive_compress(const SooshiArchive *archive, const gchar *path, guint block_rows);
+
+// Compressed archive
+SOOSHI_API gsize sooshi_codec_encode_block(const gint64 *timestamps, const gdouble * const *values,
+    guint columns, guint rows, GByteArray *out);
+SOOSHI_API guint sooshi_codec_decode_block(const guint8 *data, gsize length, guint columns, guint capacity,
+    gint64 *timestamps, gdouble **values);
+SOOSHI_API SooshiCompressedArchive *sooshi_compressed_archive_open(const gchar *path, sooshi_error_t *error);
+SOOSHI_API void sooshi_compressed_archive_close(SooshiCompressedArchive *archive);
+SOOSHI_API guint64 sooshi_compressed_archive_find(const SooshiCompressedArchive *archive, gint64 timestamp);
+SOOSHI_API guint sooshi_compressed_archive_decode(const SooshiCompressedArchive *archive, guint64 block,
+    gint64 *timestamps, gdouble **values);
+
+// Connection timeline
+SOOSHI_API void sooshi_get_timeline(SooshiState *state, SooshiTimeline *timeline);
+SOOSHI_API gint64 sooshi_timeline_elapsed(const SooshiTimeline *timeline, SOOSHI_PHASE phase);
 
 // Debugging
 SOOSHI_API void sooshi_debug_dump_tree(SooshiNode *node, gint indent);
+SOOSHI_API void sooshi_debug_dump_timeline(const SooshiTimeline *timeline);
 
 // Node methods
 SOOSHI_API SooshiNode *sooshi_node_find(SooshiState *state, gchar *path, SooshiNode *start);
 SOOSHI_API void sooshi_node_set_value(SooshiState *state, SooshiNode *node, GVariant *value, gboolean send_update);
 SOOSHI_API void sooshi_node_request_value(SooshiState *state, SooshiNode *node);
+SOOSHI_API GVariant *sooshi_node_get_value(SooshiState *state, SooshiNode *node);
 SOOSHI_API void sooshi_node_choose(SooshiState *state, SooshiNode *node);
 SOOSHI_API void sooshi_node_choose_by_index(SooshiState *state, SooshiNode *node, guchar index);
 SOOSHI_API guint sooshi_node_subscribe(SooshiState *state, SooshiNode *node, sooshi_node_subscriber_handler_t func, gpointer user_data);
+SOOSHI_API guint sooshi_node_subscribe_full(SooshiState *state, SooshiNode *node, const SooshiSubscribeOptions *options,
+    sooshi_node_subscriber_handler_t func, gpointer user_data);
+SOOSHI_API guint sooshi_node_subscribe_aggregate(SooshiState *state, SooshiNode *node, guint window_ms,
+    sooshi_node_aggregate_handler_t func, gpointer user_data);
+SOOSHI_API guint sooshi_node_subscribe_compressed(SooshiState *state, SooshiNode *node, const SooshiCompression *compression,
+    sooshi_node_point_handler_t func, gpointer user_data);
+SOOSHI_API void sooshi_node_unsubscribe(SooshiState *state, SooshiNode *node, guint id);
 SOOSHI_API void sooshi_node_notify_subscribers(SooshiState *state, SooshiNode *node);
 
+// Running statistics
+SOOSHI_API gboolean sooshi_node_stats_enable(SooshiState *state, SooshiNode *node, guint window);
+SOOSHI_API void sooshi_node_stats_disable(SooshiState *state, SooshiNode *node);
+SOOSHI_API void sooshi_node_stats_reset(SooshiState *state, SooshiNode *node);
+SOOSHI_API gboolean sooshi_node_stats_get(SooshiState *state, SooshiNode *node, SooshiStats *stats);
+SOOSHI_API void sooshi_node_stats_add_block(SooshiState *state, SooshiNode *node, const gdouble *values, gsize count);
+
+// Value history
+SOOSHI_API gboolean sooshi_node_history_enable(SooshiState *state, SooshiNode *node, guint capacity);
+SOOSHI_API void sooshi_node_history_disable(SooshiState *state, SooshiNode *node);
+SOOSHI_API guint sooshi_node_history_last(SooshiState *state, SooshiNode *node, guint count, SooshiHistoryView *view);
+SOOSHI_API guint sooshi_node_history_between(SooshiState *state, SooshiNode *node, gint64 from, gint64 to, SooshiHistoryView *view);
+SOOSHI_API const SooshiSample *sooshi_history_view_get(const SooshiHistoryView *view, guint index);
+
+// Lossy compression
+SOOSHI_API void sooshi_swinging_door_init(SooshiSwingingDoor *door, const SooshiCompression *compression);
+SOOSHI_API guint sooshi_swinging_door_add(SooshiSwingingDoor *door, const SooshiSample *sample, SooshiSample *retained);
+SOOSHI_API guint sooshi_swinging_door_flush(SooshiSwingingDoor *door, SooshiSample *retained);
+SOOSHI_API gdouble sooshi_compression_interpolate(const gint64 *timestamps, const gdouble *values, guint64 count, gint64 timestamp);
+
+// Asynchronous requests
+SOOSHI_API SooshiRequest *sooshi_node_read_async(SooshiState *state, SooshiNode *node, guint timeout_ms,
+    sooshi_request_handler_t func, gpointer user_data);
+SOOSHI_API SooshiRequest *sooshi_node_read_cached(SooshiState *state, SooshiNode *node, guint max_age_ms, guint timeout_ms,
+    sooshi_request_handler_t func, gpointer user_data);
+SOOSHI_API SooshiRequest *sooshi_node_write_async(SooshiState *state, SooshiNode *node, GVariant *value, guint timeout_ms,
+    sooshi_request_handler_t func, gpointer user_data);
+SOOSHI_API void sooshi_request_cancel(SooshiRequest *request);
+SOOSHI_API gboolean sooshi_request_wait(SooshiRequest *request);
+SOOSHI_API SooshiRequest *sooshi_request_ref(SooshiRequest *request);
+SOOSHI_API void sooshi_request_unref(SooshiRequest *request);
+
+// Transactions
+SOOSHI_API SooshiTransaction *sooshi_transaction_begin(SooshiState *state);
+SOOSHI_API void sooshi_transaction_set_value(SooshiTransaction *transaction, SooshiNode *node, GVariant *value);
+SOOSHI_API void sooshi_transaction_choose(SooshiTransaction *transaction, SooshiNode *node);
+SOOSHI_API void sooshi_transaction_choose_by_index(SooshiTransaction *transaction, SooshiNode *node, guchar index);
+SOOSHI_API void sooshi_transaction_set_timeout(SooshiTransaction *transaction, guint timeout_ms);
+SOOSHI_API guint sooshi_transaction_commit(SooshiTransaction *transaction, sooshi_transaction_handler_t func, gpointer user_data);
+SOOSHI_API void sooshi_transaction_abort(SooshiTransaction *transaction);
+
 /*******************/
 /* Local functions */
 /*******************/
+SOOSHI_LOCAL SooshiDBusIndex *sooshi_dbus_index_new(GDBusObjectManager *object_manager);
+SOOSHI_LOCAL SooshiDBusIndex *sooshi_dbus_index_ref(SooshiDBusIndex *index);
+SOOSHI_LOCAL void sooshi_dbus_index_unref(SooshiDBusIndex *index);
 SOOSHI_LOCAL GDBusProxy *sooshi_dbus_find_interface_proxy_if(SooshiState *state, const gchar* interface_name, dbus_conditional_func_t cond_func, gpointer user_data);
+SOOSHI_LOCAL gboolean sooshi_cond_is_mooshimeter(GDBusInterface *interface, gpointer user_data);
+SOOSHI_LOCAL gboolean sooshi_cond_adapter_is_powered(GDBusInterface *interface, gpointer user_data);
+SOOSHI_LOCAL GDBusProxy *sooshi_dbus_find_proxy_by_uuid(SooshiState *state, const gchar *interface_name, const gchar *uuid, const gchar *path_prefix);
+SOOSHI_LOCAL SooshiState *sooshi_state_new_shared(GMainContext *context, SooshiDBusIndex *dbus_index, GDBusProxy *adapter);
+SOOSHI_LOCAL void sooshi_retarget_mooshi(SooshiState *state, GDBusProxy *meter, GDBusProxy *adapter);
+SOOSHI_LOCAL gboolean sooshi_attach_mooshi(SooshiState *state, GDBusProxy *meter, sooshi_callback_t init_handler, gpointer init_data);
 SOOSHI_LOCAL void sooshi_on_mooshi_initialized(SooshiState *state);
+SOOSHI_LOCAL guint sooshi_timeout_add(SooshiState *state, guint interval_ms, GSourceFunc func, gpointer user_data);
+SOOSHI_LOCAL void sooshi_source_remove(SooshiState *state, guint source_id);
+SOOSHI_LOCAL void sooshi_on_mooshi_reconnected(SooshiState *state, crc32_t crc);
+SOOSHI_LOCAL void sooshi_reload_tree(SooshiState *state);
 SOOSHI_LOCAL void sooshi_parse_response(SooshiState *state);
 SOOSHI_LOCAL void sooshi_enable_notify(SooshiState *state);
+SOOSHI_LOCAL GVariant *sooshi_build_frame(SooshiState *state, const guchar *buffer, gsize len);
 SOOSHI_LOCAL void sooshi_send_bytes(SooshiState *state, guchar *buffer, gsize len, gboolean block);
+SOOSHI_LOCAL void sooshi_receive_notification(SooshiState *state, guint8 sequence, const guint8 *data, gsize len);
 SOOSHI_LOCAL void sooshi_request_all_node_values(SooshiState *state, SooshiNode *start);
+SOOSHI_LOCAL void sooshi_request_interesting_node_values(SooshiState *state);
 
 // Debugging
 SOOSHI_LOCAL gchar* sooshi_node_value_as_string(SooshiNode *node);
+SOOSHI_LOCAL gboolean sooshi_debug_enabled(void);
 
 // Node methods
 SOOSHI_LOCAL void sooshi_node_send_value(SooshiState *state, SooshiNode *node);
+SOOSHI_LOCAL gboolean sooshi_node_value_as_double(SooshiNode *node, gdouble *result);
+SOOSHI_LOCAL gboolean sooshi_node_is_numeric(SooshiNode *node);
 void sooshi_node_free_all(SooshiState *state, SooshiNode *start_node);
+SOOSHI_LOCAL SooshiNode *sooshi_node_adopt(SooshiState *state, SooshiNode *old, SooshiNode *new_node);
+
+// Link monitor
+SOOSHI_LOCAL void sooshi_link_monitor_start(SooshiState *state);
+SOOSHI_LOCAL void sooshi_link_monitor_stop(SooshiState *state);
+SOOSHI_LOCAL void sooshi_link_on_receive(SooshiState *state);
+SOOSHI_LOCAL void sooshi_histogram_record(SooshiHistogram *histogram, guint64 value);
+SOOSHI_LOCAL void sooshi_histogram_reset(SooshiHistogram *histogram);
+SOOSHI_LOCAL void sooshi_histogram_load(SooshiHistogram *dest, const SooshiHistogram *src);
+
+// Runtime metrics
+SOOSHI_LOCAL void sooshi_metrics_add(guint64 *counter, guint64 value);
+SOOSHI_LOCAL void sooshi_metrics_high_water(guint64 *mark, guint64 value);
+
+// Session capture
+SOOSHI_LOCAL void sooshi_capture_record(SooshiState *state, SOOSHI_CAPTURE_DIRECTION direction,
+    guint8 sequence, const guint8 *data, gsize len);
+
+// Running statistics
+SOOSHI_LOCAL void sooshi_stats_on_value(SooshiState *state, SooshiNode *node);
+SOOSHI_LOCAL void sooshi_stats_free(SooshiStatsAccumulator *stats);
+
+// Archive pyramid
+SOOSHI_LOCAL gboolean sooshi_pyramid_open(SooshiArchiver *archiver);
+SOOSHI_LOCAL gboolean sooshi_pyramid_on_row(SooshiArchiver *archiver);
+SOOSHI_LOCAL gboolean sooshi_pyramid_sync(SooshiArchiver *archiver);
+SOOSHI_LOCAL void sooshi_pyramid_close(SooshiArchiver *archiver);
+SOOSHI_LOCAL void sooshi_pyramid_map(SooshiArchive *archive, const gchar *path);
+SOOSHI_LOCAL void sooshi_pyramid_unmap(SooshiArchive *archive);
+
+// Value history
+SOOSHI_LOCAL void sooshi_history_on_value(SooshiState *state, SooshiNode *node);
+SOOSHI_LOCAL void sooshi_history_free(SooshiHistory *history);
+
+// Connection timeline
+SOOSHI_LOCAL void sooshi_timeline_reset(SooshiState *state);
+SOOSHI_LOCAL void sooshi_timeline_mark(SooshiState *state, SOOSHI_PHASE phase);
+
+// Asynchronous requests
+SOOSHI_LOCAL void sooshi_request_expect_reply(SooshiNode *node, gboolean write);
+SOOSHI_LOCAL void sooshi_request_on_value(SooshiState *state, SooshiNode *node);
+SOOSHI_LOCAL void sooshi_request_drop_replies(SooshiState *state);
+SOOSHI_LOCAL void sooshi_request_cancel_node(SooshiState *state, SooshiNode *node);
+SOOSHI_LOCAL void sooshi_request_cancel_all(SooshiState *state, gboolean notify);
+
+// Transactions
+SOOSHI_LOCAL void sooshi_transaction_on_value(SooshiState *state, SooshiNode *node);
+SOOSHI_LOCAL void sooshi_transaction_free_all(SooshiState *state);
+SOOSHI_LOCAL void sooshi_transaction_cancel_all(SooshiState *state);
+SOOSHI_LOCAL void sooshi_replay_configuration(SooshiState *state);
 
 // Transfer helper functions
 SOOSHI_LOCAL GByteArray *sooshi_node_bytes_to_value(SooshiNode *node, GByteArray *buffer, GVariant **result);
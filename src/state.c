@@ -5,6 +5,7 @@
 #include <glib/gprintf.h>
 
 #include "sooshi.h"
+#include "probes.h"
 
 G_DEFINE_TYPE(SooshiState, sooshi_state, G_TYPE_OBJECT)
 
@@ -31,14 +32,16 @@ static void sooshi_state_init(SooshiState *state);
 static void sooshi_state_finalize(GObject *object);
 static void sooshi_state_dispose(GObject *object);
 
-static gboolean sooshi_cond_is_mooshimeter(GDBusInterface *interface, gpointer user_data);
-static gboolean sooshi_cond_has_uuid(GDBusInterface *interface, gpointer user_data);
-static gboolean sooshi_cond_adapter_is_powered(GDBusInterface *interface, gpointer user_data);
 
 // Mooshimeter functions
 static void sooshi_add_mooshi(SooshiState *state, GDBusProxy *meter);
 static void sooshi_initialize_mooshi(SooshiState *state);
+static void sooshi_prepare_connect(SooshiState *state);
+static void sooshi_on_mooshi_connected(SooshiState *state);
 static gboolean sooshi_connect_mooshi(SooshiState *state);
+static void sooshi_on_mooshi_lost(SooshiState *state);
+static void sooshi_drop_mooshi(SooshiState *state);
+static void sooshi_schedule_reconnect(SooshiState *state);
 static gboolean sooshi_disconnect_mooshi(SooshiState *state);
 static gboolean sooshi_start_listening_to_mooshi(SooshiState *state);
 static gboolean sooshi_stop_listening_to_mooshi(SooshiState *state);
@@ -46,48 +49,116 @@ static gboolean sooshi_stop_listening_to_mooshi(SooshiState *state);
 // DBus functions
 static void sooshi_on_object_added(GDBusObjectManager *objman, GDBusObject *obj, gpointer user_data);
 static void sooshi_on_object_added_connected(GDBusObjectManager *objman, GDBusObject *obj, gpointer user_data);
+static void sooshi_on_mooshi_properties_changed(GDBusProxy *proxy, GVariant *changed_properties, GStrv invalidated_properties, gpointer user_data);
 static void sooshi_on_serial_out_ready(GDBusProxy *proxy, GVariant *changed_properties, GStrv invalidated_properties, gpointer user_data);
 static gboolean sooshi_find_adapter(SooshiState *state);
 static gboolean sooshi_find_mooshi(SooshiState *state);
 static gboolean sooshi_start_scan(SooshiState *state);
 static gboolean sooshi_stop_scan(SooshiState *state, gboolean stop_timeout);
-static gboolean sooshi_heartbeat(gpointer user_data);
 
 void
 sooshi_on_mooshi_initialized(SooshiState *state)
 {
-    state->heartbeat_source_id = g_timeout_add_seconds(10, sooshi_heartbeat, (gpointer) state);
-    state->init_handler(state, state->init_handler_data);
+    sooshi_timeline_mark(state, SOOSHI_PHASE_INITIALIZED);
+    sooshi_link_monitor_start(state);
+
+    // There is none when replaying a capture
+    if (state->init_handler)
+        state->init_handler(state, state->init_handler_data);
 }
 
-void
-sooshi_send_bytes(SooshiState *state, guchar *buffer, gsize len, gboolean block)
+typedef struct
+{
+    SooshiState *state;
+    gint64 issued;
+    guchar op_code;
+    gsize length;
+} SooshiWrite;
+
+static void
+sooshi_on_write_done(GObject *source, GAsyncResult *res, gpointer user_data)
+{
+    SooshiWrite *write = user_data;
+    SooshiState *state = write->state;
+
+    GError *error = NULL;
+    GVariant *result = g_dbus_proxy_call_finish(G_DBUS_PROXY(source), res, &error);
+
+    // The state is gone already
+    if (g_error_matches(error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+    {
+        g_error_free(error);
+        g_free(write);
+        return;
+    }
+
+    sooshi_histogram_record(&state->metrics.write_latency, g_get_monotonic_time() - write->issued);
+    SOOSHI_PROBE(write_complete, state, write->op_code, error ? -1 : (gssize)write->length);
+
+    if (error != NULL)
+    {
+        g_debug("Error calling WriteValue: %s", error->message);
+        sooshi_metrics_add(&state->metrics.write_errors, 1);
+        g_error_free(error);
+    }
+    else
+        g_variant_unref(result);
+
+    g_free(write);
+}
+
+GVariant *
+sooshi_build_frame(SooshiState *state, const guchar *buffer, gsize len)
 {
-    GVariantBuilder *b;
-    GVariant *final;
+    GVariantBuilder b;
 
-    b = g_variant_builder_new(G_VARIANT_TYPE("(aya{sv})"));
-    g_variant_builder_open(b, G_VARIANT_TYPE("ay"));
+    g_variant_builder_init(&b, G_VARIANT_TYPE("(aya{sv})"));
+    g_variant_builder_open(&b, G_VARIANT_TYPE("ay"));
 
     g_debug("Sending message #%d to Mooshimeter:", state->send_sequence);
-    g_variant_builder_add(b, "y", (guchar)state->send_sequence++);
+    g_variant_builder_add(&b, "y", (guchar)state->send_sequence++);
     for (guint i = 0; i < len; ++i)
     {
         g_debug("    [%d] %x (%c %d)", i, buffer[i], buffer[i], buffer[i]);
-        g_variant_builder_add(b, "y", buffer[i]);
+        g_variant_builder_add(&b, "y", buffer[i]);
+    }
+
+    g_variant_builder_close(&b);
+
+    g_variant_builder_open(&b, G_VARIANT_TYPE("a{sv}"));
+    g_variant_builder_add(&b, "{sv}", "offset", g_variant_new_int16(0));
+    g_variant_builder_close(&b);
+
+    return g_variant_builder_end(&b);
+}
+
+void
+sooshi_send_bytes(SooshiState *state, guchar *buffer, gsize len, gboolean block)
+{
+    // Nobody to talk to, e.g. while replaying a capture
+    if (state->serial_in == NULL)
+    {
+        g_debug("Not connected to a Mooshimeter, dropping %" G_GSIZE_FORMAT " bytes", len);
+        return;
     }
 
-    g_variant_builder_close(b);
+    sooshi_capture_record(state, SOOSHI_CAPTURE_TX, state->send_sequence, buffer, len);
 
-    g_variant_builder_open(b, G_VARIANT_TYPE("a{sv}"));
-    g_variant_builder_add(b, "{sv}", "offset", g_variant_new_int16(0));
-    g_variant_builder_close(b);
-    final = g_variant_builder_end(b);
+    state->link_last_tx = g_get_monotonic_time();
+    GVariant *final = sooshi_build_frame(state, buffer, len);
+
+    sooshi_metrics_add(&state->metrics.writes, 1);
+    sooshi_metrics_add(&state->metrics.tx_bytes, len + 1);
+
+    guchar op_code = len > 0 ? buffer[0] : 0;
+    SOOSHI_PROBE(write_submit, state, op_code, len + 1);
 
     if (block == TRUE)
     {
+        gint64 issued = g_get_monotonic_time();
+
         GError *error = NULL;
-        g_dbus_proxy_call_sync(state->serial_in,
+        GVariant *result = g_dbus_proxy_call_sync(state->serial_in,
             "WriteValue",
             final,
             G_DBUS_CALL_FLAGS_NONE,
@@ -95,32 +166,52 @@ sooshi_send_bytes(SooshiState *state, guchar *buffer, gsize len, gboolean block)
             NULL,
             &error);
 
+        sooshi_histogram_record(&state->metrics.write_latency, g_get_monotonic_time() - issued);
+        SOOSHI_PROBE(write_complete, state, op_code, error ? -1 : (gssize)len + 1);
+
+        // The link is gone, leave it to the reconnect logic instead of taking
+        // down every meter of the process
         if (error != NULL)
         {
-            g_error("Error calling WriteValue: %s", error->message);
+            sooshi_metrics_add(&state->metrics.write_errors, 1);
+            g_warning("Error calling WriteValue: %s", error->message);
             g_error_free(error);
+
+            sooshi_drop_mooshi(state);
             return;
         }
+
+        g_variant_unref(result);
     }
     else
     {
+        SooshiWrite *write = g_new(SooshiWrite, 1);
+        write->state = state;
+        write->issued = g_get_monotonic_time();
+        write->op_code = op_code;
+        write->length = len + 1;
+
         g_dbus_proxy_call(state->serial_in,
             "WriteValue",
             final,
             G_DBUS_CALL_FLAGS_NONE,
             -1,
-            NULL,
-            NULL,
-            NULL);
+            state->writes_cancellable,
+            sooshi_on_write_done,
+            write);
     }
-
-    g_variant_builder_unref(b);
 }
 
 void
 sooshi_node_send_value(SooshiState *state, SooshiNode *node)
 {
-    static guchar buffer[20] = {0};
+    // Not static, several states may be sending from different threads
+    guchar buffer[20] = {0};
+
+    // Keep track of the configuration we applied, ADMIN nodes are handled by the handshake
+    if (node->op_code >= 3)
+        node->host_written = TRUE;
+
     buffer[0] = node->op_code | 0x80;
     gint len = 1;
     len += sooshi_node_value_to_bytes(node, buffer + 1);
@@ -132,13 +223,28 @@ sooshi_node_send_value(SooshiState *state, SooshiNode *node)
     }
 
     sooshi_send_bytes(state, buffer, len, FALSE);
+    sooshi_request_expect_reply(node, TRUE);
 }
 
 SooshiState *
 sooshi_state_new(sooshi_error_t *error)
+{
+    return sooshi_state_new_with_context(NULL, error);
+}
+
+SooshiState *
+sooshi_state_new_with_context(GMainContext *context, sooshi_error_t *error)
 {
     SooshiState *state = g_object_new(SOOSHI_TYPE_STATE, 0);
 
+    // Every source of this state is attached to its own context, unless
+    // the caller wants several states to share one
+    state->context = context ? g_main_context_ref(context) : g_main_context_new();
+
+    // The object manager delivers its signals to the thread-default context
+    // it was created in, and so do all the proxies it creates
+    g_main_context_push_thread_default(state->context);
+
     GError *err = NULL;
     state->object_manager = g_dbus_object_manager_client_new_for_bus_sync(
             /* connection */
@@ -160,6 +266,8 @@ sooshi_state_new(sooshi_error_t *error)
             /* error */
             &err);
 
+    g_main_context_pop_thread_default(state->context);
+
     if (err != NULL)
     {
         if (error)
@@ -170,51 +278,73 @@ sooshi_state_new(sooshi_error_t *error)
         return NULL;
     }
 
+    state->dbus_index = sooshi_dbus_index_new(state->object_manager);
+
     if (error)
         *error = SOOSHI_ERROR_SUCCESS;
 
     return state;
 }
 
-void
-sooshi_state_delete(SooshiState *state)
+SooshiState *
+sooshi_state_new_shared(GMainContext *context, SooshiDBusIndex *dbus_index, GDBusProxy *adapter)
 {
-    g_object_unref(state);
+    SooshiState *state = g_object_new(SOOSHI_TYPE_STATE, 0);
+
+    state->context = g_main_context_ref(context);
+    state->object_manager = g_object_ref(dbus_index->object_manager);
+    state->dbus_index = sooshi_dbus_index_ref(dbus_index);
+    state->adapter = adapter ? g_object_ref(adapter) : NULL;
+
+    return state;
 }
 
-GDBusProxy *
-sooshi_dbus_find_interface_proxy_if(SooshiState *state, const gchar* interface_name, dbus_conditional_func_t cond_func, gpointer user_data)
+gboolean
+sooshi_attach_mooshi(SooshiState *state, GDBusProxy *meter, sooshi_callback_t init_handler, gpointer init_data)
 {
-    g_return_val_if_fail(state != NULL, FALSE);
-    g_return_val_if_fail(state->object_manager != NULL, FALSE);
+    g_return_val_if_fail(state->mooshimeter == NULL, FALSE);
 
-    GDBusInterface *found = NULL;
-    GList *objects = g_dbus_object_manager_get_objects(state->object_manager);
+    state->init_handler = init_handler;
+    state->init_handler_data = init_data;
 
-    if (!objects)
-        return NULL;
+    // The manager found the meter, this connection starts here
+    sooshi_timeline_reset(state);
+    sooshi_timeline_mark(state, SOOSHI_PHASE_SCAN_HIT);
 
-    GList *l = objects;
-    while(l->next)
-    {
-        GDBusObject *obj = G_DBUS_OBJECT(l->data); 
-        GDBusInterface *interface = g_dbus_object_get_interface(obj, interface_name);
+    sooshi_add_mooshi(state, g_object_ref(meter));
+    return sooshi_connect_mooshi(state);
+}
 
-        if (interface)
-        {
-            if (!cond_func || cond_func(interface, user_data) == TRUE)
-            {
-                g_info("Found interface %s!", interface_name);
-                found = interface;
-                break;
-            }
-        }
+void
+sooshi_retarget_mooshi(SooshiState *state, GDBusProxy *meter, GDBusProxy *adapter)
+{
+    g_return_if_fail(meter != NULL);
+
+    sooshi_drop_mooshi(state);
 
-        l = l->next;
+    if (state->device_properties_id > 0)
+        g_signal_handler_disconnect(state->mooshimeter, state->device_properties_id);
+    state->device_properties_id = 0;
+
+    g_clear_object(&state->mooshimeter);
+    g_free(state->mooshimeter_dbus_path);
+    state->connecting = FALSE;
+
+    if (adapter)
+    {
+        g_clear_object(&state->adapter);
+        state->adapter = g_object_ref(adapter);
     }
-    g_list_free_full(objects, g_object_unref);
 
-    return found ? G_DBUS_PROXY(found) : NULL;
+    // Same meter, same tree - the reconnect will only replay the configuration
+    sooshi_add_mooshi(state, g_object_ref(meter));
+    sooshi_schedule_reconnect(state);
+}
+
+void
+sooshi_state_delete(SooshiState *state)
+{
+    g_object_unref(state);
 }
 
 sooshi_error_t
@@ -227,6 +357,8 @@ sooshi_setup(SooshiState *state, sooshi_callback_t init_handler, gpointer init_d
     state->scan_timeout_handler = scan_timeout_handler;
     state->scan_timeout_data = scan_timeout_data;
 
+    sooshi_timeline_reset(state);
+
     // We couldn't find it, let's scan
     if (!sooshi_find_adapter(state))
     {
@@ -234,6 +366,8 @@ sooshi_setup(SooshiState *state, sooshi_callback_t init_handler, gpointer init_d
         return SOOSHI_ERROR_NO_ADAPTER_FOUND;
     }
 
+    sooshi_timeline_mark(state, SOOSHI_PHASE_ADAPTER_FOUND);
+
     if (!sooshi_find_mooshi(state))
     {
         g_warning("Could not find Mooshimeter!");
@@ -245,7 +379,11 @@ sooshi_setup(SooshiState *state, sooshi_callback_t init_handler, gpointer init_d
         }
     }
     else
+    {
+        // BlueZ still knows the meter, no need to scan
+        sooshi_timeline_mark(state, SOOSHI_PHASE_SCAN_HIT);
         sooshi_connect_mooshi(state);
+    }
 
     return SOOSHI_ERROR_SUCCESS;
 }
@@ -254,8 +392,14 @@ void
 sooshi_run(SooshiState *state)
 {
     g_debug("Starting main loop ...");
-    state->loop = g_main_loop_new(NULL, FALSE);
+
+    if (state->loop == NULL)
+        state->loop = g_main_loop_new(state->context, FALSE);
+
+    // Async D-Bus replies are delivered to the thread-default context of the caller
+    g_main_context_push_thread_default(state->context);
     g_main_loop_run(state->loop);
+    g_main_context_pop_thread_default(state->context);
 }
 
 SOOSHI_API void sooshi_stop(SooshiState *state)
@@ -264,6 +408,123 @@ SOOSHI_API void sooshi_stop(SooshiState *state)
     g_main_loop_quit(state->loop);
 }
 
+// States may share a context, e.g. those of a manager. The iteration prepared
+// by one of them is the one of its context, keyed by the context here, so it
+// is only prepared and dispatched once no matter how many states drive it.
+typedef struct
+{
+    GMainContext *context;
+    gint priority;
+} SooshiIteration;
+
+static GMutex sooshi_iterations_lock;
+static GHashTable *sooshi_iterations;
+
+gint
+sooshi_prepare(SooshiState *state, GPollFD *fds, gint n_fds, gint *timeout_ms)
+{
+    g_return_val_if_fail(state != NULL, -1);
+    g_return_val_if_fail(timeout_ms != NULL, -1);
+
+    GMainContext *context = state->context;
+
+    g_mutex_lock(&sooshi_iterations_lock);
+
+    if (sooshi_iterations == NULL)
+        sooshi_iterations = g_hash_table_new(NULL, NULL);
+
+    SooshiIteration *iteration = g_hash_table_lookup(sooshi_iterations, context);
+
+    if (iteration == NULL)
+    {
+        if (!g_main_context_acquire(context))
+        {
+            g_mutex_unlock(&sooshi_iterations_lock);
+            g_warning("Main context is owned by another thread!");
+            return -1;
+        }
+
+        iteration = g_new0(SooshiIteration, 1);
+        iteration->context = g_main_context_ref(context);
+        g_main_context_prepare(context, &iteration->priority);
+        g_hash_table_insert(sooshi_iterations, context, iteration);
+    }
+
+    gint priority = iteration->priority;
+    g_mutex_unlock(&sooshi_iterations_lock);
+
+    // The caller is expected to enlarge fds and call us again if this returns more than n_fds
+    return g_main_context_query(context, priority, timeout_ms, fds, n_fds);
+}
+
+void
+sooshi_dispatch(SooshiState *state, GPollFD *fds, gint n_fds)
+{
+    g_return_if_fail(state != NULL);
+
+    GMainContext *context = state->context;
+
+    // Another state of the same context dispatched it already
+    g_mutex_lock(&sooshi_iterations_lock);
+    SooshiIteration *iteration = sooshi_iterations ? g_hash_table_lookup(sooshi_iterations, context) : NULL;
+    if (iteration)
+        g_hash_table_remove(sooshi_iterations, context);
+    g_mutex_unlock(&sooshi_iterations_lock);
+
+    if (iteration == NULL)
+        return;
+
+    if (g_main_context_check(context, iteration->priority, fds, n_fds))
+    {
+        g_main_context_push_thread_default(context);
+        g_main_context_dispatch(context);
+        g_main_context_pop_thread_default(context);
+    }
+
+    g_main_context_release(context);
+    g_main_context_unref(iteration->context);
+    g_free(iteration);
+}
+
+GMainContext *
+sooshi_get_context(SooshiState *state)
+{
+    g_return_val_if_fail(state != NULL, NULL);
+
+    return state->context;
+}
+
+guint
+sooshi_timeout_add(SooshiState *state, guint interval_ms, GSourceFunc func, gpointer user_data)
+{
+    GSource *source = g_timeout_source_new(interval_ms);
+    g_source_set_callback(source, func, user_data, NULL);
+
+    guint id = g_source_attach(source, state->context);
+    g_source_unref(source);
+
+    return id;
+}
+
+void
+sooshi_source_remove(SooshiState *state, guint source_id)
+{
+    // g_source_remove() only looks at the default context
+    GSource *source = g_main_context_find_source_by_id(state->context, source_id);
+
+    if (source)
+        g_source_destroy(source);
+}
+
+void
+sooshi_set_interest(SooshiState *state, const gchar *const *paths)
+{
+    g_return_if_fail(state != NULL);
+
+    g_strfreev(state->interest);
+    state->interest = g_strdupv((gchar**)paths);
+}
+
 /* Static function definitions */
 
 static void
@@ -281,8 +542,19 @@ sooshi_state_dispose(GObject *object)
     SooshiState *state = SOOSHI_STATE(object);
 
     // Stop heartbeat source
-    if (state->heartbeat_source_id > 0)
-        g_source_remove(state->heartbeat_source_id);
+    sooshi_link_monitor_stop(state);
+
+    if (state->reconnect_source_id > 0)
+        sooshi_source_remove(state, state->reconnect_source_id);
+    state->reconnect_source_id = 0;
+
+    if (state->crc_timeout_source_id > 0)
+        sooshi_source_remove(state, state->crc_timeout_source_id);
+    state->crc_timeout_source_id = 0;
+
+    if (state->device_properties_id > 0)
+        g_signal_handler_disconnect(state->mooshimeter, state->device_properties_id);
+    state->device_properties_id = 0;
 
     if (state->listening == TRUE)
         sooshi_stop_listening_to_mooshi(state);
@@ -293,6 +565,20 @@ sooshi_state_dispose(GObject *object)
     if (state->scanning == TRUE)
         sooshi_stop_scan(state, TRUE);
 
+    sooshi_capture_stop(state);
+
+    // Writes still in flight must not report back to a dead state
+    if (state->writes_cancellable)
+        g_cancellable_cancel(state->writes_cancellable);
+    g_clear_object(&state->writes_cancellable);
+
+    // Their timeouts are attached to the context released below
+    sooshi_transaction_free_all(state);
+    sooshi_request_cancel_all(state, FALSE);
+
+    if (state->dbus_index) sooshi_dbus_index_unref(state->dbus_index);
+    state->dbus_index = NULL;
+
     g_clear_object(&state->object_manager);
     g_clear_object(&state->adapter);
     g_clear_object(&state->mooshimeter);
@@ -301,6 +587,9 @@ sooshi_state_dispose(GObject *object)
 
     if (state->loop) g_main_loop_unref(state->loop);
     state->loop = NULL;
+
+    if (state->context) g_main_context_unref(state->context);
+    state->context = NULL;
  
     G_OBJECT_CLASS(sooshi_state_parent_class)->dispose(object);
 }
@@ -311,6 +600,7 @@ sooshi_state_finalize(GObject *object)
     SooshiState *state = SOOSHI_STATE(object);
 
     g_free(state->mooshimeter_dbus_path);
+    g_strfreev(state->interest);
     sooshi_node_free_all(state, NULL);
 
     if (state->buffer) g_byte_array_unref(state->buffer);
@@ -330,16 +620,23 @@ sooshi_state_init(SooshiState *state)
     state->recv_sequence = 0;
 
     state->op_code_map = g_ptr_array_new();
+    state->writes_cancellable = g_cancellable_new();
+
+    state->link_idle_ms = SOOSHI_LINK_IDLE_MS;
+    state->link_stall_ms = SOOSHI_LINK_STALL_MS;
 
     sooshi_crc32_init(state);
 }
 
 /* DBus interface finding predicates */
-static gboolean
+gboolean
 sooshi_cond_is_mooshimeter(GDBusInterface *interface, gpointer user_data)
 {
     GVariant *v_uuids = g_dbus_proxy_get_cached_property(G_DBUS_PROXY(interface), "UUIDs");
-    
+
+    if (v_uuids == NULL)
+        return FALSE;
+
     GVariantIter *iter = g_variant_iter_new(v_uuids);
     gchar* uuid;
     gboolean found = FALSE;
@@ -358,16 +655,7 @@ sooshi_cond_is_mooshimeter(GDBusInterface *interface, gpointer user_data)
     return found;
 }
 
-static gboolean
-sooshi_cond_has_uuid(GDBusInterface *interface, gpointer user_data)
-{
-    GVariant *v_uuid = g_dbus_proxy_get_cached_property(G_DBUS_PROXY(interface), "UUID");
-    const gchar *uuid = g_variant_get_string(v_uuid, NULL);
-
-    return (g_ascii_strcasecmp(uuid, (gchar*)user_data) == 0);
-}
-
-static gboolean
+gboolean
 sooshi_cond_adapter_is_powered(GDBusInterface *interface, gpointer user_data)
 {
     GVariant *v_powered = g_dbus_proxy_get_cached_property(G_DBUS_PROXY(interface), "Powered");
@@ -383,71 +671,306 @@ sooshi_add_mooshi(SooshiState *state, GDBusProxy *meter)
     state->mooshimeter_dbus_path = g_strdup(g_dbus_proxy_get_object_path(meter));
     state->mooshimeter = meter;
     g_info("Added Mooshimeter (Path: %s)", state->mooshimeter_dbus_path);
+
+    state->device_properties_id = g_signal_connect(
+        state->mooshimeter,
+        "g-properties-changed",
+        G_CALLBACK(sooshi_on_mooshi_properties_changed),
+        state);
+}
+
+static gboolean
+sooshi_crc_timed_out(gpointer user_data)
+{
+    SooshiState *state = SOOSHI_STATE(user_data);
+
+    g_warning("Mooshimeter did not acknowledge the cached tree, downloading it again");
+    state->crc_timeout_source_id = 0;
+    sooshi_reload_tree(state);
+
+    return FALSE;
 }
 
 static void
 sooshi_initialize_mooshi(SooshiState *state)
 {
+    sooshi_timeline_mark(state, SOOSHI_PHASE_CHARACTERISTICS_RESOLVED);
     sooshi_start_listening_to_mooshi(state);
 
+    // Lost the connection already, the reconnect logic takes it from here
+    if (state->connected == FALSE)
+        return;
+
+    // We have been connected before, try to get away with the tree we already know
+    SooshiNode *crc_node = state->initialized ? sooshi_node_find(state, "ADMIN:CRC32", NULL) : NULL;
+    if (crc_node)
+    {
+        g_info("Reusing cached tree (CRC %x)", state->tree_crc);
+        state->reconnecting = TRUE;
+        state->crc_timeout_source_id = sooshi_timeout_add(state, 5000, sooshi_crc_timed_out, (gpointer) state);
+        sooshi_node_set_value(state, crc_node, g_variant_new_uint32(state->tree_crc), TRUE);
+        return;
+    }
+
+    sooshi_timeline_mark(state, SOOSHI_PHASE_TREE_REQUESTED);
     guchar op_code = 1;
     sooshi_send_bytes(state, &op_code, 1, TRUE);
 }
 
-static gboolean
-sooshi_connect_mooshi(SooshiState *state)
+void
+sooshi_reload_tree(SooshiState *state)
 {
-    if (state->connected == TRUE)
-        return FALSE;
+    if (state->crc_timeout_source_id > 0)
+        sooshi_source_remove(state, state->crc_timeout_source_id);
+    state->crc_timeout_source_id = 0;
 
-    g_debug("Connecting to Mooshimeter ...");
+    state->reconnecting = FALSE;
+    state->initialized = FALSE;
+
+    // The current tree stays until the new one arrived, see sooshi_parse_admin_tree()
+
+    sooshi_timeline_mark(state, SOOSHI_PHASE_TREE_REQUESTED);
+    guchar op_code = 1;
+    sooshi_send_bytes(state, &op_code, 1, TRUE);
+}
+
+void
+sooshi_on_mooshi_reconnected(SooshiState *state, crc32_t crc)
+{
+    if (state->crc_timeout_source_id > 0)
+        sooshi_source_remove(state, state->crc_timeout_source_id);
+    state->crc_timeout_source_id = 0;
 
+    if (crc != state->tree_crc)
+    {
+        g_warning("Mooshimeter acknowledged CRC %x, expected %x, downloading tree again", crc, state->tree_crc);
+        sooshi_reload_tree(state);
+        return;
+    }
+
+    g_info("Reconnected to Mooshimeter, replaying configuration");
+    sooshi_timeline_mark(state, SOOSHI_PHASE_INITIALIZED);
+    state->reconnecting = FALSE;
+    state->reconnect_attempts = 0;
+
+    sooshi_replay_configuration(state);
+    sooshi_link_monitor_start(state);
+
+    if (state->reconnect_handler)
+        state->reconnect_handler(state, state->reconnect_data);
+}
+
+static void
+sooshi_prepare_connect(SooshiState *state)
+{
     // Try to find serial_in/serial_out before connecting ...
-    gchar *uuid_serial_in = METER_SERIAL_IN;
-    state->serial_in = sooshi_dbus_find_interface_proxy_if(
+    state->serial_in = sooshi_dbus_find_proxy_by_uuid(
             state,
             BLUEZ_GATT_CHARACTERISTIC_INTERFACE,
-            sooshi_cond_has_uuid,
-            (gpointer)uuid_serial_in);
+            METER_SERIAL_IN,
+            state->mooshimeter_dbus_path);
 
-    gchar *uuid_serial_out = METER_SERIAL_OUT;
-    state->serial_out = sooshi_dbus_find_interface_proxy_if(
+    state->serial_out = sooshi_dbus_find_proxy_by_uuid(
             state,
             BLUEZ_GATT_CHARACTERISTIC_INTERFACE,
-            sooshi_cond_has_uuid,
-            (gpointer)uuid_serial_out);
+            METER_SERIAL_OUT,
+            state->mooshimeter_dbus_path);
 
     state->scan_signal_id = g_signal_connect(state->object_manager, 
         "object-added",
         G_CALLBACK(sooshi_on_object_added_connected),
         state);
+}
+
+static void
+sooshi_on_mooshi_connected(SooshiState *state)
+{
+    state->connected = TRUE;
+
+    // Whatever was sent while we were disconnected went nowhere
+    sooshi_request_drop_replies(state);
+    sooshi_timeline_mark(state, SOOSHI_PHASE_CONNECTED);
+
+    if (state->serial_in && state->serial_out)
+    {
+        g_info("Serial In & Serial Out already available!");
+        sooshi_initialize_mooshi(state);
+    }
+}
+
+static void
+sooshi_on_connect_done(GObject *source, GAsyncResult *res, gpointer user_data)
+{
+    SooshiState *state = SOOSHI_STATE(user_data);
 
     GError *error = NULL;
-    g_dbus_proxy_call_sync(state->mooshimeter,
+    GVariant *result = g_dbus_proxy_call_finish(G_DBUS_PROXY(source), res, &error);
+
+    // We moved on to another device meanwhile, see sooshi_retarget_mooshi()
+    if (G_DBUS_PROXY(source) != state->mooshimeter)
+    {
+        if (result) g_variant_unref(result);
+        if (error) g_error_free(error);
+        g_object_unref(state);
+        return;
+    }
+
+    state->connecting = FALSE;
+
+    if (error != NULL)
+    {
+        g_warning("Connecting to Mooshimeter failed: %s", error->message);
+        g_error_free(error);
+
+        if (state->scan_signal_id > 0)
+            g_signal_handler_disconnect(state->object_manager, state->scan_signal_id);
+        state->scan_signal_id = 0;
+
+        // Once reconnecting keep trying, the first attempt only if asked to
+        if (state->auto_reconnect || state->reconnect_attempts > 0)
+            sooshi_schedule_reconnect(state);
+    }
+    else
+    {
+        g_variant_unref(result);
+        sooshi_on_mooshi_connected(state);
+    }
+
+    g_object_unref(state);
+}
+
+static gboolean
+sooshi_connect_mooshi(SooshiState *state)
+{
+    if (state->connected == TRUE || state->connecting == TRUE)
+        return FALSE;
+
+    g_debug("Connecting to Mooshimeter ...");
+
+    sooshi_prepare_connect(state);
+
+    // Connect can take a long time if the meter is out of range, don't block on it.
+    // A manager starts connecting all of its meters at once this way.
+    state->connecting = TRUE;
+    g_dbus_proxy_call(state->mooshimeter,
         "Connect",
         g_variant_new("()"),
         G_DBUS_CALL_FLAGS_NONE,
         -1,
         NULL,
-        &error);
+        sooshi_on_connect_done,
+        g_object_ref(state));
 
-    if (error != NULL)
-    {
-        g_error("Error connecting to Mooshimeter: %s", error->message);
-        g_error_free(error);
-        g_signal_handler_disconnect(state->object_manager, state->scan_signal_id);
+    return TRUE;
+}
+
+static gboolean
+sooshi_reconnect_attempt(gpointer user_data)
+{
+    SooshiState *state = SOOSHI_STATE(user_data);
+    state->reconnect_source_id = 0;
+
+    if (state->connected == TRUE || state->connecting == TRUE)
         return FALSE;
-    }
 
-    state->connected = TRUE;
+    g_info("Reconnecting to Mooshimeter (attempt %u) ...", ++state->reconnect_attempts);
 
-    if (state->serial_in && state->serial_out)
+    sooshi_timeline_reset(state);
+    sooshi_connect_mooshi(state);
+
+    return FALSE;
+}
+
+static void
+sooshi_schedule_reconnect(SooshiState *state)
+{
+    if (state->reconnect_source_id > 0)
+        return;
+
+    // Back off exponentially, starting at 250ms and going up to 8s
+    guint delay = 250 << MIN(state->reconnect_attempts, 5);
+    state->reconnect_source_id = sooshi_timeout_add(state, delay, sooshi_reconnect_attempt, (gpointer) state);
+}
+
+static void
+sooshi_on_mooshi_lost(SooshiState *state)
+{
+    g_warning("Lost connection to Mooshimeter!");
+
+    sooshi_link_monitor_stop(state);
+
+    if (state->crc_timeout_source_id > 0)
+        sooshi_source_remove(state, state->crc_timeout_source_id);
+    state->crc_timeout_source_id = 0;
+    state->reconnecting = FALSE;
+
+    if (state->listening == TRUE)
     {
-        g_info("Serial In & Serial Out already available!");
-        sooshi_initialize_mooshi(state);
+        g_signal_handler_disconnect(state->serial_out, state->properties_changed_id);
+        state->properties_changed_id = 0;
+        state->listening = FALSE;
     }
 
-    return TRUE;
+    if (state->scan_signal_id > 0)
+        g_signal_handler_disconnect(state->object_manager, state->scan_signal_id);
+    state->scan_signal_id = 0;
+
+    // BlueZ drops the GATT objects together with the connection
+    g_clear_object(&state->serial_in);
+    g_clear_object(&state->serial_out);
+
+    g_byte_array_set_size(state->buffer, 0);
+    state->send_sequence = 0;
+    state->recv_sequence = 0;
+    state->connected = FALSE;
+
+    // Frames in flight are gone with the connection
+    sooshi_request_drop_replies(state);
+
+    if (state->auto_reconnect)
+        sooshi_schedule_reconnect(state);
+}
+
+// Gives up on a connection BlueZ may still consider up, e.g. after a failed write
+static void
+sooshi_drop_mooshi(SooshiState *state)
+{
+    if (state->connected == FALSE)
+        return;
+
+    sooshi_on_mooshi_lost(state);
+
+    // We do not care whether this works, the link is considered dead anyway
+    g_dbus_proxy_call(state->mooshimeter,
+        "Disconnect",
+        g_variant_new("()"),
+        G_DBUS_CALL_FLAGS_NONE,
+        -1,
+        NULL,
+        NULL,
+        NULL);
+}
+
+void
+sooshi_set_auto_reconnect(SooshiState *state, gboolean enabled,
+        sooshi_callback_t reconnect_handler, gpointer reconnect_data)
+{
+    g_return_if_fail(state != NULL);
+
+    state->auto_reconnect = enabled;
+    state->reconnect_handler = reconnect_handler;
+    state->reconnect_data = reconnect_data;
+}
+
+void
+sooshi_reconnect(SooshiState *state)
+{
+    g_return_if_fail(state != NULL);
+    g_return_if_fail(state->mooshimeter != NULL);
+
+    sooshi_drop_mooshi(state);
+
+    sooshi_schedule_reconnect(state);
 }
 
 static gboolean
@@ -504,13 +1027,17 @@ sooshi_start_listening_to_mooshi(SooshiState *state)
 
     if (error != NULL)
     {
-        g_error("Error starting read routine: %s", error->message);
+        g_warning("Error starting read routine: %s", error->message);
         g_signal_handler_disconnect(state->serial_out, state->properties_changed_id);
+        state->properties_changed_id = 0;
         g_error_free(error);
+
+        sooshi_drop_mooshi(state);
         return FALSE;
     }
 
     state->listening = TRUE;
+    sooshi_timeline_mark(state, SOOSHI_PHASE_NOTIFY_STARTED);
 
     return TRUE;
 }
@@ -557,11 +1084,12 @@ sooshi_on_object_added(GDBusObjectManager *objman, GDBusObject *obj, gpointer us
         return;
 
     GVariant *v_name = g_dbus_proxy_get_cached_property(G_DBUS_PROXY(inter), "Name");
-    const gchar *name = g_variant_get_string(v_name, NULL);
+    const gchar *name = v_name ? g_variant_get_string(v_name, NULL) : "(unnamed)";
 
     const gchar *uuid = METER_SERVICE_UUID;
     if (sooshi_cond_is_mooshimeter(inter, (gpointer)uuid))
     {
+        sooshi_timeline_mark(state, SOOSHI_PHASE_SCAN_HIT);
         sooshi_add_mooshi(state, G_DBUS_PROXY(inter));
         g_info("Found device '%s', looks like a Mooshimeter!", name);
         sooshi_stop_scan(state, TRUE);
@@ -572,7 +1100,7 @@ sooshi_on_object_added(GDBusObjectManager *objman, GDBusObject *obj, gpointer us
         g_info("Found device '%s', but it's not the droid we are looking for ...", name);
     }
 
-    g_variant_unref(v_name);
+    if (v_name) g_variant_unref(v_name);
 }
 
 static void
@@ -585,6 +1113,13 @@ sooshi_on_object_added_connected(GDBusObjectManager *objman, GDBusObject *obj, g
     if (!inter)
         return;
 
+    // Only look at characteristics of our own meter
+    if (!g_str_has_prefix(g_dbus_object_get_object_path(obj), state->mooshimeter_dbus_path))
+    {
+        g_object_unref(inter);
+        return;
+    }
+
     GVariant *v_uuid = g_dbus_proxy_get_cached_property(G_DBUS_PROXY(inter), "UUID");
     const gchar *uuid = g_variant_get_string(v_uuid, NULL);
 
@@ -605,10 +1140,23 @@ sooshi_on_object_added_connected(GDBusObjectManager *objman, GDBusObject *obj, g
 
     g_variant_unref(v_uuid);
 
-    if (state->serial_in && state->serial_out)
+    if (state->serial_in && state->serial_out && state->listening == FALSE)
         sooshi_initialize_mooshi(state);
 }
 
+static void
+sooshi_on_mooshi_properties_changed(GDBusProxy *proxy, GVariant *changed_properties, GStrv invalidated_properties, gpointer user_data)
+{
+    SooshiState *state = (SooshiState*)user_data;
+    gboolean connected;
+
+    if (g_variant_lookup(changed_properties, "Connected", "b", &connected) == FALSE)
+        return;
+
+    if (connected == FALSE && state->connected == TRUE)
+        sooshi_on_mooshi_lost(state);
+}
+
 static void
 sooshi_on_serial_out_ready(GDBusProxy *proxy, GVariant *changed_properties, GStrv invalidated_properties, gpointer user_data)
 {
@@ -626,31 +1174,37 @@ sooshi_on_serial_out_ready(GDBusProxy *proxy, GVariant *changed_properties, GStr
 
     if (value)
     {
-        GVariantIter *iter = g_variant_iter_new(value);
-        guint8 buf[20];
-        gchar tmp;
-        gint i = 0;
-        while (g_variant_iter_loop(iter, "y", &tmp))
-        {
-            // Don't add recv sequence to result buffer
-            if (i == 0)
-            {
-                i++;
-                continue;
-            }
-
-            buf[i-1] = tmp;
-            i++;
-        }
-        g_variant_unref(value);
+        gsize len;
+        const guint8 *data = g_variant_get_fixed_array(value, &len, 1);
+
+        // Don't add recv sequence to result buffer
+        if (len > 0)
+            sooshi_receive_notification(state, data[0], data + 1, len - 1);
 
-        state->buffer = g_byte_array_append(state->buffer, buf, i - 1);
-        sooshi_parse_response(state);
+        g_variant_unref(value);
     }
 
     g_variant_dict_unref(dict);
 }
 
+void
+sooshi_receive_notification(SooshiState *state, guint8 sequence, const guint8 *data, gsize len)
+{
+    gint64 received = g_get_monotonic_time();
+    SOOSHI_PROBE(notification, state, len > 0 ? data[0] : 0, len);
+
+    sooshi_capture_record(state, SOOSHI_CAPTURE_RX, sequence, data, len);
+
+    sooshi_link_on_receive(state);
+    sooshi_metrics_add(&state->metrics.notifications, 1);
+    sooshi_metrics_add(&state->metrics.rx_bytes, len);
+    state->buffer = g_byte_array_append(state->buffer, data, len);
+    sooshi_metrics_high_water(&state->metrics.buffer_high_water, state->buffer->len);
+    sooshi_parse_response(state);
+
+    sooshi_histogram_record(&state->metrics.parse_time, g_get_monotonic_time() - received);
+}
+
 
 static gboolean
 sooshi_find_adapter(SooshiState *state)
@@ -668,8 +1222,7 @@ sooshi_find_mooshi(SooshiState *state)
     g_return_val_if_fail(state != NULL, FALSE);
     g_return_val_if_fail(state->object_manager != NULL, FALSE);
 
-    const gchar* uuid = METER_SERVICE_UUID;
-    GDBusProxy *meter = sooshi_dbus_find_interface_proxy_if(state, BLUEZ_DEVICE_INTERFACE, sooshi_cond_is_mooshimeter, (gpointer)uuid);
+    GDBusProxy *meter = sooshi_dbus_find_proxy_by_uuid(state, BLUEZ_DEVICE_INTERFACE, METER_SERVICE_UUID, NULL);
 
     if (meter)
         sooshi_add_mooshi(state, meter);
@@ -706,9 +1259,31 @@ sooshi_start_scan(SooshiState *state)
         G_CALLBACK(sooshi_on_object_added),
         state);
 
-    state->scan_timeout_source_id = g_timeout_add_seconds(10, sooshi_scan_timed_out, (gpointer) state);
+    state->scan_timeout_source_id = sooshi_timeout_add(state, 10000, sooshi_scan_timed_out, (gpointer) state);
+
+    // Only report LE devices advertising the meter service, every other
+    // advertiser would just wake us up for nothing
+    GVariantBuilder filter;
+    const gchar *uuids[] = { METER_SERVICE_UUID, NULL };
+    g_variant_builder_init(&filter, G_VARIANT_TYPE("a{sv}"));
+    g_variant_builder_add(&filter, "{sv}", "UUIDs", g_variant_new_strv(uuids, -1));
+    g_variant_builder_add(&filter, "{sv}", "Transport", g_variant_new_string("le"));
 
     GError *error = NULL;
+    g_dbus_proxy_call_sync(state->adapter,
+        "SetDiscoveryFilter",
+        g_variant_new("(a{sv})", &filter),
+        G_DBUS_CALL_FLAGS_NONE,
+        -1,
+        NULL,
+        &error);
+
+    if (error != NULL)
+    {
+        g_warning("Error setting discovery filter, scanning for all devices: %s", error->message);
+        g_clear_error(&error);
+    }
+
     g_dbus_proxy_call_sync(state->adapter,
         "StartDiscovery",
         g_variant_new("()"),
@@ -725,6 +1300,7 @@ sooshi_start_scan(SooshiState *state)
     }
 
     state->scanning = TRUE;
+    sooshi_timeline_mark(state, SOOSHI_PHASE_SCAN_STARTED);
 
     g_info("Started bluetooth scan ...");
 
@@ -742,7 +1318,7 @@ sooshi_stop_scan(SooshiState *state, gboolean stop_timeout)
     {
         if (state->scan_timeout_source_id > 0)
         {
-            g_source_remove(state->scan_timeout_source_id);
+            sooshi_source_remove(state, state->scan_timeout_source_id);
             state->scan_timeout_source_id = 0;
         }
     }
@@ -772,14 +1348,3 @@ sooshi_stop_scan(SooshiState *state, gboolean stop_timeout)
 
     return TRUE;
 }
-
-static gboolean
-sooshi_heartbeat(gpointer user_data)
-{
-    SooshiState *state = SOOSHI_STATE(user_data);
-    SooshiNode *node = sooshi_node_find(state, "PCB_VERSION", NULL);
-    sooshi_node_request_value(state, node);
-
-    return TRUE;
-}
-
@@ -0,0 +1,387 @@
+#include <glib.h>
+#include <math.h>
+
+#include "sooshi.h"
+#include "vector.h"
+
+// Recompute a sliding window from scratch after this many windows, removing
+// values from Welford's sums slowly accumulates rounding errors
+#define SOOSHI_STATS_RECOMPUTE_WINDOWS 16
+
+// Readers never block the writer: the snapshot is published under a
+// sequence lock and readers retry if it changed under them.
+static void
+sooshi_stats_publish(SooshiStatsAccumulator *stats, SooshiStatsSnapshot *target)
+{
+    SooshiStats snapshot = { 0 };
+
+    snapshot.count = stats->count;
+
+    if (stats->count > 0)
+    {
+        snapshot.mean = stats->mean;
+        snapshot.variance = MAX(stats->m2, 0.0) / stats->count;
+        snapshot.rms = sqrt(snapshot.variance + stats->mean * stats->mean);
+        snapshot.min = stats->min;
+        snapshot.max = stats->max;
+        snapshot.peak_to_peak = stats->max - stats->min;
+    }
+
+    guint sequence = target->sequence;
+    __atomic_store_n(&target->sequence, sequence + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    __atomic_store(&target->published.count, &snapshot.count, __ATOMIC_RELAXED);
+    __atomic_store(&target->published.mean, &snapshot.mean, __ATOMIC_RELAXED);
+    __atomic_store(&target->published.variance, &snapshot.variance, __ATOMIC_RELAXED);
+    __atomic_store(&target->published.rms, &snapshot.rms, __ATOMIC_RELAXED);
+    __atomic_store(&target->published.min, &snapshot.min, __ATOMIC_RELAXED);
+    __atomic_store(&target->published.max, &snapshot.max, __ATOMIC_RELAXED);
+    __atomic_store(&target->published.peak_to_peak, &snapshot.peak_to_peak, __ATOMIC_RELAXED);
+
+    __atomic_store_n(&target->sequence, sequence + 2, __ATOMIC_RELEASE);
+}
+
+static void
+sooshi_stats_clear(SooshiStatsAccumulator *stats)
+{
+    stats->count = 0;
+    stats->mean = 0;
+    stats->m2 = 0;
+    stats->min = 0;
+    stats->max = 0;
+
+    stats->min_head = stats->min_length = 0;
+    stats->max_head = stats->max_length = 0;
+    stats->total = 0;
+    stats->since_recompute = 0;
+}
+
+void
+sooshi_stats_free(SooshiStatsAccumulator *stats)
+{
+    if (stats == NULL)
+        return;
+
+    g_free(stats->values);
+    g_free(stats->min_wedge);
+    g_free(stats->max_wedge);
+    g_free(stats);
+}
+
+/* Accumulating until reset */
+static void
+sooshi_stats_add(SooshiStatsAccumulator *stats, gdouble value)
+{
+    stats->count++;
+
+    gdouble delta = value - stats->mean;
+    stats->mean += delta / stats->count;
+    stats->m2 += delta * (value - stats->mean);
+
+    if (stats->count == 1 || value < stats->min)
+        stats->min = value;
+    if (stats->count == 1 || value > stats->max)
+        stats->max = value;
+}
+
+/* Sliding windows */
+// Keeps the wedge's values monotonic: a new value makes every older one it
+// beats irrelevant, the oldest entry is the window's extreme
+static void
+sooshi_stats_wedge_push(SooshiStatsAccumulator *stats, guint64 *wedge, guint *head, guint *length,
+        guint64 number, gdouble value, gboolean is_min)
+{
+    guint window = stats->window;
+
+    // Drop what just left the window
+    if (*length > 0 && wedge[*head] + window <= number)
+    {
+        *head = (*head + 1) % window;
+        (*length)--;
+    }
+
+    while (*length > 0)
+    {
+        gdouble last = stats->values[wedge[(*head + *length - 1) % window] % window];
+
+        if (is_min ? last < value : last > value)
+            break;
+
+        (*length)--;
+    }
+
+    wedge[(*head + *length) % window] = number;
+    (*length)++;
+}
+
+static void
+sooshi_stats_recompute(SooshiStatsAccumulator *stats)
+{
+    gdouble sum = 0;
+    for (guint64 i = 0; i < stats->count; ++i)
+        sum += stats->values[i];
+
+    gdouble mean = sum / stats->count;
+    gdouble m2 = 0;
+    for (guint64 i = 0; i < stats->count; ++i)
+        m2 += (stats->values[i] - mean) * (stats->values[i] - mean);
+
+    stats->mean = mean;
+    stats->m2 = m2;
+    stats->since_recompute = 0;
+}
+
+static void
+sooshi_stats_slide(SooshiStatsAccumulator *stats, gdouble value)
+{
+    guint64 number = stats->total++;
+    guint slot = number % stats->window;
+
+    // Both wedges look at values[], update them before the slot is reused
+    sooshi_stats_wedge_push(stats, stats->min_wedge, &stats->min_head, &stats->min_length, number, value, TRUE);
+    sooshi_stats_wedge_push(stats, stats->max_wedge, &stats->max_head, &stats->max_length, number, value, FALSE);
+
+    if (stats->count < stats->window)
+    {
+        stats->values[slot] = value;
+        sooshi_stats_add(stats, value);
+    }
+    else
+    {
+        // Replace the oldest value, Welford's update for a window of fixed size
+        gdouble old = stats->values[slot];
+        gdouble old_mean = stats->mean;
+        stats->values[slot] = value;
+
+        stats->mean += (value - old) / stats->window;
+        stats->m2 += (value - old) * (value - stats->mean + old - old_mean);
+
+        if (++stats->since_recompute >= stats->window * SOOSHI_STATS_RECOMPUTE_WINDOWS)
+            sooshi_stats_recompute(stats);
+    }
+
+    stats->min = stats->values[stats->min_wedge[stats->min_head] % stats->window];
+    stats->max = stats->values[stats->max_wedge[stats->max_head] % stats->window];
+}
+
+static void
+sooshi_stats_update(SooshiStatsAccumulator *stats, gdouble value)
+{
+    if (stats->window > 0)
+        sooshi_stats_slide(stats, value);
+    else
+        sooshi_stats_add(stats, value);
+}
+
+static void
+sooshi_stats_apply_reset(SooshiNode *node)
+{
+    SooshiStatsSnapshot *snapshot = &node->stats_snapshot;
+
+    if (__atomic_load_n(&snapshot->reset_requested, __ATOMIC_RELAXED)
+            && __atomic_exchange_n(&snapshot->reset_requested, FALSE, __ATOMIC_ACQUIRE))
+        sooshi_stats_clear(node->stats);
+}
+
+/* Blocks of values */
+// Adds a block in two passes, the mean first and then the squared deviations
+// from it, and merges it into the running values (Chan et al.)
+static void
+sooshi_stats_add_block(SooshiStatsAccumulator *stats, const gdouble *values, gsize count)
+{
+    gsize vectors = count / 4 * 4;
+
+    sooshi_v2d sum_a = { 0, 0 }, sum_b = { 0, 0 };
+    for (gsize i = 0; i < vectors; i += 4)
+    {
+        sum_a += sooshi_load2(values + i);
+        sum_b += sooshi_load2(values + i + 2);
+    }
+
+    sooshi_v2d sum = sum_a + sum_b;
+    gdouble block_sum = sum[0] + sum[1];
+    for (gsize i = vectors; i < count; ++i)
+        block_sum += values[i];
+
+    gdouble block_mean = block_sum / count;
+    sooshi_v2d mean = { block_mean, block_mean };
+    sooshi_v2d m2_a = { 0, 0 }, m2_b = { 0, 0 };
+    sooshi_v2d min = { values[0], values[0] };
+    sooshi_v2d max = min;
+
+    for (gsize i = 0; i < vectors; i += 4)
+    {
+        sooshi_v2d a = sooshi_load2(values + i);
+        sooshi_v2d b = sooshi_load2(values + i + 2);
+        sooshi_v2d da = a - mean;
+        sooshi_v2d db = b - mean;
+
+        m2_a += da * da;
+        m2_b += db * db;
+        min = sooshi_select2(a < min, a, min);
+        min = sooshi_select2(b < min, b, min);
+        max = sooshi_select2(a > max, a, max);
+        max = sooshi_select2(b > max, b, max);
+    }
+
+    sooshi_v2d m2 = m2_a + m2_b;
+    gdouble block_m2 = m2[0] + m2[1];
+    gdouble block_min = MIN(min[0], min[1]);
+    gdouble block_max = MAX(max[0], max[1]);
+
+    for (gsize i = vectors; i < count; ++i)
+    {
+        block_m2 += (values[i] - block_mean) * (values[i] - block_mean);
+        block_min = MIN(block_min, values[i]);
+        block_max = MAX(block_max, values[i]);
+    }
+
+    if (stats->count == 0)
+    {
+        stats->min = block_min;
+        stats->max = block_max;
+    }
+    else
+    {
+        stats->min = MIN(stats->min, block_min);
+        stats->max = MAX(stats->max, block_max);
+    }
+
+    guint64 total = stats->count + count;
+    gdouble delta = block_mean - stats->mean;
+
+    stats->m2 += block_m2 + delta * delta * ((gdouble)stats->count * count / total);
+    stats->mean += delta * count / total;
+    stats->count = total;
+}
+
+/* Public API */
+gboolean
+sooshi_node_stats_enable(SooshiState *state, SooshiNode *node, guint window)
+{
+    g_return_val_if_fail(state != NULL, FALSE);
+    g_return_val_if_fail(node != NULL, FALSE);
+
+    if (!sooshi_node_is_numeric(node))
+    {
+        g_warning("Node '%s' has no numeric value to collect statistics on!", node->name);
+        return FALSE;
+    }
+
+    sooshi_node_stats_disable(state, node);
+
+    SooshiStatsAccumulator *stats = g_new0(SooshiStatsAccumulator, 1);
+    stats->window = window;
+
+    if (window > 0)
+    {
+        stats->values = g_new(gdouble, window);
+        stats->min_wedge = g_new(guint64, window);
+        stats->max_wedge = g_new(guint64, window);
+    }
+
+    node->stats = stats;
+
+    // Readers see empty statistics until the first value arrives
+    __atomic_store_n(&node->stats_snapshot.reset_requested, FALSE, __ATOMIC_RELAXED);
+    sooshi_stats_publish(stats, &node->stats_snapshot);
+    __atomic_store_n(&node->stats_snapshot.enabled, TRUE, __ATOMIC_RELEASE);
+
+    return TRUE;
+}
+
+void
+sooshi_node_stats_disable(SooshiState *state, SooshiNode *node)
+{
+    g_return_if_fail(state != NULL);
+    g_return_if_fail(node != NULL);
+
+    // Readers only look at the snapshot, the accumulator can go right away
+    __atomic_store_n(&node->stats_snapshot.enabled, FALSE, __ATOMIC_RELEASE);
+
+    sooshi_stats_free(node->stats);
+    node->stats = NULL;
+}
+
+void
+sooshi_node_stats_reset(SooshiState *state, SooshiNode *node)
+{
+    g_return_if_fail(state != NULL);
+    g_return_if_fail(node != NULL);
+    g_return_if_fail(__atomic_load_n(&node->stats_snapshot.enabled, __ATOMIC_ACQUIRE));
+
+    // The accumulator belongs to the state's thread, it clears itself before the next value
+    __atomic_store_n(&node->stats_snapshot.reset_requested, TRUE, __ATOMIC_RELEASE);
+}
+
+gboolean
+sooshi_node_stats_get(SooshiState *state, SooshiNode *node, SooshiStats *result)
+{
+    g_return_val_if_fail(state != NULL, FALSE);
+    g_return_val_if_fail(node != NULL, FALSE);
+    g_return_val_if_fail(result != NULL, FALSE);
+
+    SooshiStatsSnapshot *snapshot = &node->stats_snapshot;
+    if (!__atomic_load_n(&snapshot->enabled, __ATOMIC_ACQUIRE))
+        return FALSE;
+
+    for (;;)
+    {
+        guint sequence = __atomic_load_n(&snapshot->sequence, __ATOMIC_ACQUIRE);
+
+        if (sequence & 1)
+            continue;
+
+        __atomic_load(&snapshot->published.count, &result->count, __ATOMIC_RELAXED);
+        __atomic_load(&snapshot->published.mean, &result->mean, __ATOMIC_RELAXED);
+        __atomic_load(&snapshot->published.variance, &result->variance, __ATOMIC_RELAXED);
+        __atomic_load(&snapshot->published.rms, &result->rms, __ATOMIC_RELAXED);
+        __atomic_load(&snapshot->published.min, &result->min, __ATOMIC_RELAXED);
+        __atomic_load(&snapshot->published.max, &result->max, __ATOMIC_RELAXED);
+        __atomic_load(&snapshot->published.peak_to_peak, &result->peak_to_peak, __ATOMIC_RELAXED);
+
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+        if (__atomic_load_n(&snapshot->sequence, __ATOMIC_RELAXED) == sequence)
+            return TRUE;
+    }
+}
+
+void
+sooshi_node_stats_add_block(SooshiState *state, SooshiNode *node, const gdouble *values, gsize count)
+{
+    g_return_if_fail(state != NULL);
+    g_return_if_fail(node != NULL);
+    g_return_if_fail(node->stats != NULL);
+
+    if (count == 0)
+        return;
+
+    SooshiStatsAccumulator *stats = node->stats;
+    sooshi_stats_apply_reset(node);
+
+    // Sliding windows have to see every value go by
+    if (stats->window > 0)
+    {
+        for (gsize i = 0; i < count; ++i)
+            sooshi_stats_slide(stats, values[i]);
+    }
+    else
+        sooshi_stats_add_block(stats, values, count);
+
+    sooshi_stats_publish(stats, &node->stats_snapshot);
+}
+
+void
+sooshi_stats_on_value(SooshiState *state, SooshiNode *node)
+{
+    gdouble value;
+
+    if (node->stats == NULL || !sooshi_node_value_as_double(node, &value))
+        return;
+
+    sooshi_stats_apply_reset(node);
+    sooshi_stats_update(node->stats, value);
+    sooshi_stats_publish(node->stats, &node->stats_snapshot);
+}
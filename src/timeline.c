@@ -0,0 +1,60 @@
+#include <string.h>
+#include <glib.h>
+
+#include "sooshi.h"
+
+const gchar *const __SOOSHI_PHASE_STR[] =
+{
+    "ADAPTER_FOUND",
+    "SCAN_STARTED",
+    "SCAN_HIT",
+    "CONNECTED",
+    "CHARACTERISTICS_RESOLVED",
+    "NOTIFY_STARTED",
+    "TREE_REQUESTED",
+    "TREE_RECEIVED",
+    "CRC_ACKNOWLEDGED",
+    "VALUES_FETCHED",
+    "INITIALIZED",
+};
+
+void
+sooshi_timeline_reset(SooshiState *state)
+{
+    memset(&state->timeline, 0, sizeof(state->timeline));
+    state->timeline.started = g_get_monotonic_time();
+    state->fetches_pending = 0;
+}
+
+void
+sooshi_timeline_mark(SooshiState *state, SOOSHI_PHASE phase)
+{
+    // Only the first time counts, e.g. the tree is requested again if the CRC check fails
+    if (state->timeline.phases[phase] != 0)
+        return;
+
+    state->timeline.phases[phase] = g_get_monotonic_time();
+    g_debug("Phase %s reached after %.1fms", SOOSHI_PHASE_TO_STR(phase),
+            (state->timeline.phases[phase] - state->timeline.started) / 1000.0);
+}
+
+void
+sooshi_get_timeline(SooshiState *state, SooshiTimeline *timeline)
+{
+    g_return_if_fail(state != NULL);
+    g_return_if_fail(timeline != NULL);
+
+    *timeline = state->timeline;
+}
+
+gint64
+sooshi_timeline_elapsed(const SooshiTimeline *timeline, SOOSHI_PHASE phase)
+{
+    g_return_val_if_fail(timeline != NULL, -1);
+    g_return_val_if_fail(phase < SOOSHI_PHASE_COUNT, -1);
+
+    if (timeline->phases[phase] == 0)
+        return -1;
+
+    return timeline->phases[phase] - timeline->started;
+}
@@ -0,0 +1,333 @@
+#include <string.h>
+#include <glib.h>
+
+#include "sooshi.h"
+
+typedef struct _SooshiTransactionWrite SooshiTransactionWrite;
+struct _SooshiTransactionWrite
+{
+    SooshiNode *node;
+    GVariant *value;
+
+    // Bytes sent once committed, only a value matching them is the echo
+    guchar written[20];
+    gint written_len;
+};
+
+static void
+sooshi_transaction_write_free(gpointer data)
+{
+    SooshiTransactionWrite *write = (SooshiTransactionWrite*)data;
+
+    g_variant_unref(write->value);
+    g_free(write);
+}
+
+static gint
+sooshi_transaction_write_compare(gconstpointer a, gconstpointer b)
+{
+    const SooshiTransactionWrite *wa = a;
+    const SooshiTransactionWrite *wb = b;
+
+    // Op codes are assigned in tree pre-order, so this sends choosers before
+    // the nodes below them
+    return (gint)wa->node->op_code - (gint)wb->node->op_code;
+}
+
+static void
+sooshi_transaction_free(SooshiTransaction *transaction)
+{
+    if (transaction->timeout_source_id > 0)
+        sooshi_source_remove(transaction->state, transaction->timeout_source_id);
+
+    g_list_free_full(transaction->writes, sooshi_transaction_write_free);
+    g_list_free(transaction->pending);
+    g_free(transaction);
+}
+
+SooshiTransaction *
+sooshi_transaction_begin(SooshiState *state)
+{
+    g_return_val_if_fail(state != NULL, NULL);
+
+    SooshiTransaction *transaction = g_new0(SooshiTransaction, 1);
+    transaction->state = state;
+    transaction->timeout_ms = SOOSHI_TRANSACTION_TIMEOUT_MS;
+
+    return transaction;
+}
+
+void
+sooshi_transaction_set_timeout(SooshiTransaction *transaction, guint timeout_ms)
+{
+    g_return_if_fail(transaction != NULL);
+
+    transaction->timeout_ms = timeout_ms;
+}
+
+static gboolean
+sooshi_transaction_timed_out(gpointer user_data)
+{
+    SooshiTransaction *transaction = (SooshiTransaction*)user_data;
+    SooshiState *state = transaction->state;
+
+    g_warning("Transaction timed out, %u echo(es) missing", g_list_length(transaction->pending));
+
+    transaction->timeout_source_id = 0;
+    transaction->timed_out = TRUE;
+    state->transactions = g_list_remove(state->transactions, transaction);
+
+    if (transaction->handler)
+        transaction->handler(state, transaction, transaction->user_data);
+
+    sooshi_transaction_free(transaction);
+
+    return FALSE;
+}
+
+void
+sooshi_transaction_set_value(SooshiTransaction *transaction, SooshiNode *node, GVariant *value)
+{
+    g_return_if_fail(transaction != NULL);
+    g_return_if_fail(node != NULL);
+    g_return_if_fail(value != NULL);
+
+    value = g_variant_ref_sink(value);
+
+    // Writing the same node twice within a transaction only keeps the last value
+    GList *elem;
+    for (elem = transaction->writes; elem; elem = elem->next)
+    {
+        SooshiTransactionWrite *write = elem->data;
+
+        if (write->node == node)
+        {
+            g_variant_unref(write->value);
+            write->value = value;
+            return;
+        }
+    }
+
+    SooshiTransactionWrite *write = g_new0(SooshiTransactionWrite, 1);
+    write->node = node;
+    write->value = value;
+    transaction->writes = g_list_prepend(transaction->writes, write);
+}
+
+void
+sooshi_transaction_choose(SooshiTransaction *transaction, SooshiNode *node)
+{
+    g_return_if_fail(transaction != NULL);
+    g_return_if_fail(node != NULL);
+    g_return_if_fail(node->parent != NULL);
+
+    gint index = g_list_index(node->parent->children, node);
+
+    sooshi_transaction_set_value(transaction, node->parent, g_variant_new_byte((guchar)index));
+}
+
+void
+sooshi_transaction_choose_by_index(SooshiTransaction *transaction, SooshiNode *node, guchar index)
+{
+    g_return_if_fail(transaction != NULL);
+    g_return_if_fail(node != NULL);
+
+    if (index >= g_list_length(node->children))
+        return;
+
+    sooshi_transaction_set_value(transaction, node, g_variant_new_byte(index));
+}
+
+guint
+sooshi_transaction_commit(SooshiTransaction *transaction, sooshi_transaction_handler_t func, gpointer user_data)
+{
+    g_return_val_if_fail(transaction != NULL, 0);
+
+    SooshiState *state = transaction->state;
+    transaction->handler = func;
+    transaction->user_data = user_data;
+
+    // Drop every write that would not change the value we already know about
+    GList *elem = transaction->writes;
+    while (elem)
+    {
+        GList *next = elem->next;
+        SooshiTransactionWrite *write = elem->data;
+
+        if (write->node->value && g_variant_equal(write->node->value, write->value))
+        {
+            g_debug("Skipping redundant write to node '%s'", write->node->name);
+            sooshi_transaction_write_free(write);
+            transaction->writes = g_list_delete_link(transaction->writes, elem);
+        }
+
+        elem = next;
+    }
+
+    transaction->writes = g_list_sort(transaction->writes, sooshi_transaction_write_compare);
+
+    guint count = 0;
+    for (elem = transaction->writes; elem; elem = elem->next)
+    {
+        SooshiTransactionWrite *write = elem->data;
+
+        sooshi_node_set_value(state, write->node, g_variant_ref(write->value), FALSE);
+        write->written_len = sooshi_node_value_to_bytes(write->node, write->written);
+        transaction->pending = g_list_prepend(transaction->pending, write->node);
+        count++;
+    }
+
+    // Nothing to wait for, the transaction is gone once this returns 0
+    if (count == 0)
+    {
+        if (transaction->handler)
+            transaction->handler(state, transaction, transaction->user_data);
+
+        sooshi_transaction_free(transaction);
+        return 0;
+    }
+
+    g_info("Committing transaction with %u write(s)", count);
+    state->transactions = g_list_append(state->transactions, transaction);
+
+    // A lost echo must not leave the transaction pending forever
+    if (transaction->timeout_ms > 0)
+        transaction->timeout_source_id = sooshi_timeout_add(state, transaction->timeout_ms,
+                sooshi_transaction_timed_out, (gpointer)transaction);
+
+    // Send everything back to back, without waiting for the echoes in between
+    for (elem = transaction->writes; elem; elem = elem->next)
+    {
+        SooshiTransactionWrite *write = elem->data;
+        sooshi_node_send_value(state, write->node);
+    }
+
+    return count;
+}
+
+void
+sooshi_transaction_abort(SooshiTransaction *transaction)
+{
+    g_return_if_fail(transaction != NULL);
+
+    // Committed ones are still waiting for their echoes, the handler is not called
+    SooshiState *state = transaction->state;
+    state->transactions = g_list_remove(state->transactions, transaction);
+
+    sooshi_transaction_free(transaction);
+}
+
+// Read replies and values the meter sends on its own don't acknowledge a write
+static gboolean
+sooshi_transaction_is_echo(SooshiTransaction *transaction, SooshiNode *node)
+{
+    if (g_list_find(transaction->pending, node) == NULL)
+        return FALSE;
+
+    guchar buffer[20];
+    gint len = sooshi_node_value_to_bytes(node, buffer);
+
+    GList *elem;
+    for (elem = transaction->writes; elem; elem = elem->next)
+    {
+        SooshiTransactionWrite *write = elem->data;
+
+        if (write->node == node)
+            return len == write->written_len && memcmp(buffer, write->written, len) == 0;
+    }
+
+    return FALSE;
+}
+
+void
+sooshi_transaction_on_value(SooshiState *state, SooshiNode *node)
+{
+    GList *completed = NULL;
+    GList *elem = state->transactions;
+    while (elem)
+    {
+        GList *next = elem->next;
+        SooshiTransaction *transaction = elem->data;
+
+        if (!sooshi_transaction_is_echo(transaction, node))
+        {
+            elem = next;
+            continue;
+        }
+
+        transaction->pending = g_list_remove(transaction->pending, node);
+
+        if (transaction->pending == NULL)
+        {
+            state->transactions = g_list_delete_link(state->transactions, elem);
+            completed = g_list_append(completed, transaction);
+        }
+
+        elem = next;
+    }
+
+    // Handlers are called last, they might very well commit the next transaction
+    for (elem = completed; elem; elem = elem->next)
+    {
+        SooshiTransaction *transaction = elem->data;
+        g_debug("Transaction completed");
+
+        if (transaction->handler)
+            transaction->handler(state, transaction, transaction->user_data);
+
+        sooshi_transaction_free(transaction);
+    }
+    g_list_free(completed);
+}
+
+void
+sooshi_transaction_free_all(SooshiState *state)
+{
+    g_list_free_full(state->transactions, (GDestroyNotify)sooshi_transaction_free);
+    state->transactions = NULL;
+}
+
+// Their echoes won't come any more, the handlers are told the transactions timed out
+void
+sooshi_transaction_cancel_all(SooshiState *state)
+{
+    GList *transactions = state->transactions;
+    state->transactions = NULL;
+
+    GList *elem;
+    for (elem = transactions; elem; elem = elem->next)
+    {
+        SooshiTransaction *transaction = elem->data;
+
+        if (transaction->timeout_source_id > 0)
+            sooshi_source_remove(state, transaction->timeout_source_id);
+        transaction->timeout_source_id = 0;
+        transaction->timed_out = TRUE;
+
+        if (transaction->handler)
+            transaction->handler(state, transaction, transaction->user_data);
+
+        sooshi_transaction_free(transaction);
+    }
+    g_list_free(transactions);
+}
+
+void
+sooshi_replay_configuration(SooshiState *state)
+{
+    guint count = 0;
+
+    // The op code map is in tree pre-order already, so choosers go out first
+    for (guint i = 0; i < state->op_code_map->len; ++i)
+    {
+        SooshiNode *node = g_ptr_array_index(state->op_code_map, i);
+
+        if (node->host_written && node->value)
+        {
+            sooshi_node_send_value(state, node);
+            count++;
+        }
+    }
+
+    g_info("Replayed %u configuration value(s)", count);
+}
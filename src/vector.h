@@ -0,0 +1,33 @@
+#ifndef SOOSHI_VECTOR_H_
+#define SOOSHI_VECTOR_H_
+
+#include <string.h>
+#include <glib.h>
+
+/*
+ * Two doubles, one SSE2 register on x86-64, using GCC's vector extensions so
+ * other targets get whatever they have. Loops over values walk them with two
+ * vectors at a time so the additions of neighbouring iterations don't wait on
+ * each other. Comparisons of vectors yield a sooshi_v2i mask, -1 for true.
+ */
+typedef gdouble sooshi_v2d __attribute__((vector_size(16)));
+typedef gint64 sooshi_v2i __attribute__((vector_size(16)));
+
+// Values need not be aligned
+static inline sooshi_v2d
+sooshi_load2(const gdouble *values)
+{
+    sooshi_v2d v;
+    memcpy(&v, values, sizeof(v));
+
+    return v;
+}
+
+// a where mask is set, b elsewhere
+static inline sooshi_v2d
+sooshi_select2(sooshi_v2i mask, sooshi_v2d a, sooshi_v2d b)
+{
+    return (sooshi_v2d)((mask & (sooshi_v2i)a) | (~mask & (sooshi_v2i)b));
+}
+
+#endif
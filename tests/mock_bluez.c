@@ -0,0 +1,986 @@
+#include <gio/gio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <sooshi.h>
+
+#include "fixtures.h"
+#include "mock_bluez.h"
+
+// Adapter n is hci<n>, meter n has the address 00:11:22:33:44:<0x55 + n>
+#define MOCK_ADAPTER_PATH    "/org/bluez/hci%u"
+#define MOCK_DEVICE_NAME     "dev_00_11_22_33_44_%02X"
+#define MOCK_DEVICE_ADDRESS  "00:11:22:33:44:%02X"
+#define MOCK_SERIAL_IN_NAME  "service0010/char0011"
+#define MOCK_SERIAL_OUT_NAME "service0010/char0013"
+
+#define OBJECT_MANAGER_INTERFACE "org.freedesktop.DBus.ObjectManager"
+
+static const gchar mock_bluez_xml[] =
+    "<node>"
+    "  <interface name='org.freedesktop.DBus.ObjectManager'>"
+    "    <method name='GetManagedObjects'>"
+    "      <arg type='a{oa{sa{sv}}}' name='objects' direction='out'/>"
+    "    </method>"
+    "    <signal name='InterfacesAdded'>"
+    "      <arg type='o' name='object'/>"
+    "      <arg type='a{sa{sv}}' name='interfaces'/>"
+    "    </signal>"
+    "    <signal name='InterfacesRemoved'>"
+    "      <arg type='o' name='object'/>"
+    "      <arg type='as' name='interfaces'/>"
+    "    </signal>"
+    "  </interface>"
+    "  <interface name='org.bluez.Adapter1'>"
+    "    <method name='StartDiscovery'/>"
+    "    <method name='StopDiscovery'/>"
+    "    <method name='SetDiscoveryFilter'>"
+    "      <arg type='a{sv}' name='filter' direction='in'/>"
+    "    </method>"
+    "    <property name='Address' type='s' access='read'/>"
+    "    <property name='Powered' type='b' access='read'/>"
+    "  </interface>"
+    "  <interface name='org.bluez.Device1'>"
+    "    <method name='Connect'/>"
+    "    <method name='Disconnect'/>"
+    "    <property name='Address' type='s' access='read'/>"
+    "    <property name='Name' type='s' access='read'/>"
+    "    <property name='Adapter' type='o' access='read'/>"
+    "    <property name='UUIDs' type='as' access='read'/>"
+    "    <property name='Connected' type='b' access='read'/>"
+    "  </interface>"
+    "  <interface name='org.bluez.GattCharacteristic1'>"
+    "    <method name='ReadValue'>"
+    "      <arg type='a{sv}' name='options' direction='in'/>"
+    "      <arg type='ay' name='value' direction='out'/>"
+    "    </method>"
+    "    <method name='WriteValue'>"
+    "      <arg type='ay' name='value' direction='in'/>"
+    "      <arg type='a{sv}' name='options' direction='in'/>"
+    "    </method>"
+    "    <method name='StartNotify'/>"
+    "    <method name='StopNotify'/>"
+    "    <property name='UUID' type='s' access='read'/>"
+    "    <property name='Value' type='ay' access='read'/>"
+    "    <property name='Notifying' type='b' access='read'/>"
+    "  </interface>"
+    "</node>";
+
+typedef struct _MockDevice MockDevice;
+
+typedef struct
+{
+    gchar *path;
+    const gchar *interface;
+    GHashTable *properties;
+    guint registration_id;
+
+    // The device an object belongs to, NULL for adapters
+    MockDevice *device;
+} MockObject;
+
+// One meter as seen through one adapter, with its own connection
+struct _MockDevice
+{
+    MockBluez *mock;
+    MockObject *adapter;
+    MockObject *device;
+    MockObject *serial_in;
+    MockObject *serial_out;
+
+    // Simulated meter, indexed by op code like SooshiState.op_code_map
+    GPtrArray *node_values;
+    guint8 send_sequence;
+
+    GSource *stream_source;
+    guint stream_sent;
+    guint stream_samples;
+
+    // WriteValue calls still to be failed, see mock_bluez_fail_writes()
+    guint fail_writes;
+};
+
+struct _MockBluez
+{
+    GTestDBus *bus;
+    GDBusConnection *system_bus;
+
+    GThread *thread;
+    GMainContext *context;
+    GMainLoop *loop;
+    GDBusConnection *connection;
+    GDBusNodeInfo *introspection;
+    guint manager_registration_id;
+
+    GMutex lock;
+    GCond cond;
+    gboolean ready;
+
+    GPtrArray *adapters;
+    GPtrArray *devices;
+
+    // The tree every simulated meter serves
+    GArray *node_types;
+    GHashTable *node_op_codes;
+};
+
+typedef struct
+{
+    MockBluez *mock;
+    guint rate_hz;
+    guint samples;
+} MockStream;
+
+typedef struct
+{
+    MockBluez *mock;
+    void (*func)(MockBluez *mock, gpointer data);
+    gpointer data;
+    gboolean done;
+} MockCall;
+
+typedef struct
+{
+    guint adapter;
+    guint meter;
+    guint index;
+} MockAddDevice;
+
+/* Exported objects */
+static MockObject *
+mock_object_new(MockDevice *device, const gchar *interface, const gchar *format, ...)
+{
+    MockObject *object = g_new0(MockObject, 1);
+    va_list args;
+
+    va_start(args, format);
+    object->path = g_strdup_vprintf(format, args);
+    va_end(args);
+
+    object->interface = interface;
+    object->device = device;
+    object->properties = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, (GDestroyNotify)g_variant_unref);
+
+    return object;
+}
+
+static void
+mock_object_free(MockObject *object)
+{
+    g_hash_table_unref(object->properties);
+    g_free(object->path);
+    g_free(object);
+}
+
+static GVariant *
+mock_object_get_properties(MockObject *object)
+{
+    GVariantBuilder builder;
+    GHashTableIter iter;
+    gpointer name, value;
+
+    g_variant_builder_init(&builder, G_VARIANT_TYPE("a{sv}"));
+    g_hash_table_iter_init(&iter, object->properties);
+    while (g_hash_table_iter_next(&iter, &name, &value))
+        g_variant_builder_add(&builder, "{sv}", (const gchar*)name, (GVariant*)value);
+
+    return g_variant_builder_end(&builder);
+}
+
+static void
+mock_object_set_property(MockBluez *mock, MockObject *object, const gchar *name, GVariant *value)
+{
+    g_variant_ref_sink(value);
+    g_hash_table_insert(object->properties, g_strdup(name), value);
+
+    if (object->registration_id == 0)
+        return;
+
+    GVariantBuilder changed;
+    g_variant_builder_init(&changed, G_VARIANT_TYPE("a{sv}"));
+    g_variant_builder_add(&changed, "{sv}", name, value);
+
+    g_dbus_connection_emit_signal(mock->connection,
+        NULL,
+        object->path,
+        "org.freedesktop.DBus.Properties",
+        "PropertiesChanged",
+        g_variant_new("(s@a{sv}@as)",
+            object->interface,
+            g_variant_builder_end(&changed),
+            g_variant_new_strv(NULL, 0)),
+        NULL);
+}
+
+static void mock_bluez_method_call(GDBusConnection *connection, const gchar *sender,
+        const gchar *object_path, const gchar *interface_name, const gchar *method_name,
+        GVariant *parameters, GDBusMethodInvocation *invocation, gpointer user_data);
+
+static GVariant *
+mock_bluez_get_property(GDBusConnection *connection, const gchar *sender,
+        const gchar *object_path, const gchar *interface_name, const gchar *property_name,
+        GError **error, gpointer user_data)
+{
+    MockObject *object = user_data;
+    GVariant *value = g_hash_table_lookup(object->properties, property_name);
+
+    if (value == NULL)
+    {
+        g_set_error(error, G_DBUS_ERROR, G_DBUS_ERROR_INVALID_ARGS, "No such property '%s'", property_name);
+        return NULL;
+    }
+
+    return g_variant_ref(value);
+}
+
+static const GDBusInterfaceVTable mock_bluez_vtable = {
+    mock_bluez_method_call,
+    mock_bluez_get_property,
+    NULL
+};
+
+static void
+mock_object_export(MockBluez *mock, MockObject *object)
+{
+    if (object->registration_id > 0)
+        return;
+
+    GDBusInterfaceInfo *info = g_dbus_node_info_lookup_interface(mock->introspection, object->interface);
+
+    GError *error = NULL;
+    object->registration_id = g_dbus_connection_register_object(mock->connection,
+        object->path, info, &mock_bluez_vtable, object, NULL, &error);
+    g_assert_no_error(error);
+
+    GVariantBuilder interfaces;
+    g_variant_builder_init(&interfaces, G_VARIANT_TYPE("a{sa{sv}}"));
+    g_variant_builder_add(&interfaces, "{s@a{sv}}", object->interface, mock_object_get_properties(object));
+
+    g_dbus_connection_emit_signal(mock->connection,
+        NULL,
+        "/",
+        OBJECT_MANAGER_INTERFACE,
+        "InterfacesAdded",
+        g_variant_new("(oa{sa{sv}})", object->path, &interfaces),
+        NULL);
+}
+
+static void
+mock_object_unexport(MockBluez *mock, MockObject *object)
+{
+    if (object->registration_id == 0)
+        return;
+
+    g_dbus_connection_unregister_object(mock->connection, object->registration_id);
+    object->registration_id = 0;
+
+    const gchar *interfaces[] = { object->interface, NULL };
+    g_dbus_connection_emit_signal(mock->connection,
+        NULL,
+        "/",
+        OBJECT_MANAGER_INTERFACE,
+        "InterfacesRemoved",
+        g_variant_new("(o^as)", object->path, interfaces),
+        NULL);
+}
+
+static void
+mock_bluez_add_managed_object(GVariantBuilder *builder, MockObject *object)
+{
+    if (object->registration_id == 0)
+        return;
+
+    GVariantBuilder interfaces;
+    g_variant_builder_init(&interfaces, G_VARIANT_TYPE("a{sa{sv}}"));
+    g_variant_builder_add(&interfaces, "{s@a{sv}}", object->interface, mock_object_get_properties(object));
+    g_variant_builder_add(builder, "{oa{sa{sv}}}", object->path, &interfaces);
+}
+
+static GVariant *
+mock_bluez_get_managed_objects(MockBluez *mock)
+{
+    GVariantBuilder builder;
+
+    g_variant_builder_init(&builder, G_VARIANT_TYPE("a{oa{sa{sv}}}"));
+
+    for (guint i = 0; i < mock->adapters->len; ++i)
+        mock_bluez_add_managed_object(&builder, g_ptr_array_index(mock->adapters, i));
+
+    for (guint i = 0; i < mock->devices->len; ++i)
+    {
+        MockDevice *device = g_ptr_array_index(mock->devices, i);
+
+        mock_bluez_add_managed_object(&builder, device->device);
+        mock_bluez_add_managed_object(&builder, device->serial_in);
+        mock_bluez_add_managed_object(&builder, device->serial_out);
+    }
+
+    return g_variant_new("(a{oa{sa{sv}}})", &builder);
+}
+
+/* Simulated meter */
+static void
+mock_meter_parse_node(MockBluez *mock, const guint8 **buffer, const gchar *prefix)
+{
+    gint8 type = (gint8)(*buffer)[0];
+    guint8 name_len = (*buffer)[1];
+    gchar *name = g_strndup((const gchar*)*buffer + 2, name_len);
+    guint8 num_childs = (*buffer)[2 + name_len];
+
+    *buffer += 3 + name_len;
+
+    // Same paths as sooshi_node_find(), the root itself has none
+    gchar *path;
+    if (prefix == NULL)
+        path = g_strdup("");
+    else if (prefix[0] == '\0')
+        path = g_strdup(name);
+    else
+        path = g_strconcat(prefix, ":", name, NULL);
+
+    if (type >= CHOOSER)
+    {
+        g_hash_table_insert(mock->node_op_codes, g_strdup(path), GUINT_TO_POINTER(mock->node_types->len));
+        g_array_append_val(mock->node_types, type);
+    }
+
+    for (guint i = 0; i < num_childs; ++i)
+        mock_meter_parse_node(mock, buffer, path);
+
+    g_free(path);
+    g_free(name);
+}
+
+static void
+mock_meter_load_tree(MockBluez *mock)
+{
+    // Skip op code and length, the rest is the zlib stream
+    GInputStream *in = g_memory_input_stream_new_from_data(sooshi_fixture_tree + 3, sizeof(sooshi_fixture_tree) - 3, NULL);
+    GZlibDecompressor *decompressor = g_zlib_decompressor_new(G_ZLIB_COMPRESSOR_FORMAT_ZLIB);
+    GOutputStream *out = g_memory_output_stream_new_resizable();
+    GOutputStream *z_out = g_converter_output_stream_new(out, G_CONVERTER(decompressor));
+
+    GError *error = NULL;
+    g_output_stream_splice(z_out, in,
+        G_OUTPUT_STREAM_SPLICE_CLOSE_SOURCE|G_OUTPUT_STREAM_SPLICE_CLOSE_TARGET,
+        NULL, &error);
+    g_assert_no_error(error);
+
+    const guint8 *tree = g_memory_output_stream_get_data(G_MEMORY_OUTPUT_STREAM(out));
+    mock_meter_parse_node(mock, &tree, NULL);
+
+    g_object_unref(z_out);
+    g_object_unref(out);
+    g_object_unref(decompressor);
+    g_object_unref(in);
+}
+
+static gsize
+mock_meter_value_size(gint8 type)
+{
+    switch (type)
+    {
+        case CHOOSER:
+        case VAL_U8:
+        case VAL_S8:
+            return 1;
+        case VAL_U16:
+        case VAL_S16:
+            return 2;
+        case VAL_U32:
+        case VAL_S32:
+        case VAL_FLT:
+            return 4;
+        default:
+            // Strings and binaries start out empty, that's just their length
+            return 2;
+    }
+}
+
+static void
+mock_meter_send(MockBluez *mock, MockDevice *device, const guint8 *data, gsize len)
+{
+    GVariant *v_notifying = g_hash_table_lookup(device->serial_out->properties, "Notifying");
+    if (!g_variant_get_boolean(v_notifying))
+        return;
+
+    // One notification holds the receive sequence and at most 19 bytes of payload
+    while (len > 0)
+    {
+        guint8 packet[20];
+        gsize chunk = MIN(len, sizeof(packet) - 1);
+
+        packet[0] = device->send_sequence++;
+        memcpy(packet + 1, data, chunk);
+
+        mock_object_set_property(mock, device->serial_out, "Value",
+            g_variant_new_fixed_array(G_VARIANT_TYPE_BYTE, packet, chunk + 1, 1));
+
+        data += chunk;
+        len -= chunk;
+    }
+}
+
+static void
+mock_meter_on_write(MockBluez *mock, MockDevice *device, const guint8 *data, gsize len)
+{
+    // data[0] is the host's send sequence
+    if (len < 2)
+        return;
+
+    guint8 op_code = data[1];
+    if (op_code == 1)
+    {
+        mock_meter_send(mock, device, sooshi_fixture_tree, sizeof(sooshi_fixture_tree));
+        return;
+    }
+
+    gboolean write = (op_code & 0x80) != 0;
+    op_code &= 0x7f;
+
+    if (op_code >= mock->node_types->len)
+        return;
+
+    if (write)
+    {
+        if (g_ptr_array_index(device->node_values, op_code))
+            g_bytes_unref(g_ptr_array_index(device->node_values, op_code));
+        g_ptr_array_index(device->node_values, op_code) = g_bytes_new(data + 2, len - 2);
+    }
+
+    // Writes are echoed, reads answered with whatever was written last
+    GByteArray *reply = g_byte_array_new();
+    g_byte_array_append(reply, &op_code, 1);
+
+    GBytes *value = g_ptr_array_index(device->node_values, op_code);
+    if (value)
+    {
+        gsize size;
+        gconstpointer bytes = g_bytes_get_data(value, &size);
+        g_byte_array_append(reply, bytes, size);
+    }
+    else
+    {
+        guint8 zero[4] = { 0 };
+        g_byte_array_append(reply, zero, mock_meter_value_size(g_array_index(mock->node_types, gint8, op_code)));
+    }
+
+    mock_meter_send(mock, device, reply->data, reply->len);
+    g_byte_array_unref(reply);
+}
+
+static void
+mock_meter_append_float(MockBluez *mock, GByteArray *frame, const gchar *path, float value)
+{
+    guint8 op_code = GPOINTER_TO_UINT(g_hash_table_lookup(mock->node_op_codes, path));
+
+    g_byte_array_append(frame, &op_code, 1);
+    g_byte_array_append(frame, (const guint8*)&value, sizeof(value));
+}
+
+static gboolean
+mock_meter_stream_sample(gpointer user_data)
+{
+    MockDevice *device = user_data;
+    MockBluez *mock = device->mock;
+
+    if (device->stream_sent >= device->stream_samples)
+    {
+        g_source_unref(device->stream_source);
+        device->stream_source = NULL;
+        return FALSE;
+    }
+
+    float value = ++device->stream_sent;
+
+    GByteArray *frame = g_byte_array_new();
+    mock_meter_append_float(mock, frame, "CH1:VALUE", value);
+    mock_meter_append_float(mock, frame, "CH2:VALUE", value);
+    mock_meter_send(mock, device, frame->data, frame->len);
+    g_byte_array_unref(frame);
+
+    return TRUE;
+}
+
+static void
+mock_meter_stop_stream(MockDevice *device)
+{
+    if (device->stream_source == NULL)
+        return;
+
+    g_source_destroy(device->stream_source);
+    g_source_unref(device->stream_source);
+    device->stream_source = NULL;
+}
+
+static gboolean
+mock_meter_start_stream(gpointer user_data)
+{
+    MockStream *stream = user_data;
+    MockBluez *mock = stream->mock;
+
+    // Only connected meters can stream
+    for (guint i = 0; i < mock->devices->len; ++i)
+    {
+        MockDevice *device = g_ptr_array_index(mock->devices, i);
+
+        if (device->serial_out->registration_id == 0)
+            continue;
+
+        mock_meter_stop_stream(device);
+
+        device->stream_sent = 0;
+        device->stream_samples = stream->samples;
+        device->stream_source = stream->rate_hz > 0
+            ? g_timeout_source_new(MAX(1000 / stream->rate_hz, 1))
+            : g_idle_source_new();
+
+        g_source_set_callback(device->stream_source, mock_meter_stream_sample, device, NULL);
+        g_source_attach(device->stream_source, mock->context);
+    }
+
+    return FALSE;
+}
+
+// The meter goes away, whether the host asked for it or not
+static void
+mock_meter_disconnect(MockBluez *mock, MockDevice *device)
+{
+    mock_meter_stop_stream(device);
+    mock_object_set_property(mock, device->serial_out, "Notifying", g_variant_new_boolean(FALSE));
+    mock_object_unexport(mock, device->serial_in);
+    mock_object_unexport(mock, device->serial_out);
+    mock_object_set_property(mock, device->device, "Connected", g_variant_new_boolean(FALSE));
+    device->send_sequence = 0;
+}
+
+/* org.bluez methods */
+static void
+mock_bluez_method_call(GDBusConnection *connection, const gchar *sender,
+        const gchar *object_path, const gchar *interface_name, const gchar *method_name,
+        GVariant *parameters, GDBusMethodInvocation *invocation, gpointer user_data)
+{
+    MockBluez *mock;
+    MockObject *object = NULL;
+
+    // The object manager is registered with the mock itself as user data
+    if (g_strcmp0(interface_name, OBJECT_MANAGER_INTERFACE) == 0)
+    {
+        mock = user_data;
+        g_dbus_method_invocation_return_value(invocation, mock_bluez_get_managed_objects(mock));
+        return;
+    }
+
+    object = user_data;
+    mock = g_object_get_data(G_OBJECT(connection), "mock-bluez");
+
+    MockDevice *device = object->device;
+
+    if (device == NULL && g_strcmp0(method_name, "StartDiscovery") == 0)
+    {
+        // Meters in range of this adapter show up as soon as somebody looks
+        for (guint i = 0; i < mock->devices->len; ++i)
+        {
+            MockDevice *found = g_ptr_array_index(mock->devices, i);
+
+            if (found->adapter == object)
+                mock_object_export(mock, found->device);
+        }
+    }
+    else if (device && object == device->device && g_strcmp0(method_name, "Connect") == 0)
+    {
+        mock_object_set_property(mock, device->device, "Connected", g_variant_new_boolean(TRUE));
+        mock_object_export(mock, device->serial_in);
+        mock_object_export(mock, device->serial_out);
+    }
+    else if (device && object == device->device && g_strcmp0(method_name, "Disconnect") == 0)
+    {
+        mock_meter_disconnect(mock, device);
+    }
+    else if (device && object == device->serial_out && g_strcmp0(method_name, "StartNotify") == 0)
+    {
+        mock_object_set_property(mock, object, "Notifying", g_variant_new_boolean(TRUE));
+    }
+    else if (device && object == device->serial_out && g_strcmp0(method_name, "StopNotify") == 0)
+    {
+        mock_object_set_property(mock, object, "Notifying", g_variant_new_boolean(FALSE));
+    }
+    else if (device && object == device->serial_in && g_strcmp0(method_name, "WriteValue") == 0)
+    {
+        if (device->fail_writes > 0)
+        {
+            device->fail_writes--;
+            g_dbus_method_invocation_return_dbus_error(invocation, "org.bluez.Error.Failed", "Not connected");
+            return;
+        }
+
+        GVariant *v_value = g_variant_get_child_value(parameters, 0);
+        gsize len;
+        const guint8 *data = g_variant_get_fixed_array(v_value, &len, 1);
+
+        mock_meter_on_write(mock, device, data, len);
+        g_variant_unref(v_value);
+    }
+    else if (g_strcmp0(method_name, "ReadValue") == 0)
+    {
+        GVariant *value = g_hash_table_lookup(object->properties, "Value");
+        g_dbus_method_invocation_return_value(invocation, g_variant_new("(@ay)", value));
+        return;
+    }
+
+    // Everything else, e.g. the discovery filter, is simply accepted
+    g_dbus_method_invocation_return_value(invocation, NULL);
+}
+
+static const GDBusInterfaceVTable mock_bluez_manager_vtable = {
+    mock_bluez_method_call,
+    NULL,
+    NULL
+};
+
+static MockObject *
+mock_bluez_create_adapter(MockBluez *mock)
+{
+    guint index = mock->adapters->len;
+
+    MockObject *adapter = mock_object_new(NULL, BLUEZ_ADAPTER_INTERFACE, MOCK_ADAPTER_PATH, index);
+    gchar *address = g_strdup_printf("00:00:00:00:00:%02X", index + 1);
+    mock_object_set_property(mock, adapter, "Address", g_variant_new_string(address));
+    mock_object_set_property(mock, adapter, "Powered", g_variant_new_boolean(TRUE));
+    g_free(address);
+
+    g_ptr_array_add(mock->adapters, adapter);
+
+    return adapter;
+}
+
+static MockDevice *
+mock_bluez_create_device(MockBluez *mock, MockObject *adapter, guint meter)
+{
+    const gchar *uuids[] = { "1bc5ffa0-0200-62ab-e411-f254e005dbd4", NULL };
+
+    MockDevice *device = g_new0(MockDevice, 1);
+    device->mock = mock;
+    device->adapter = adapter;
+    device->node_values = g_ptr_array_new_with_free_func((GDestroyNotify)g_bytes_unref);
+    g_ptr_array_set_size(device->node_values, mock->node_types->len);
+
+    gchar *address = g_strdup_printf(MOCK_DEVICE_ADDRESS, 0x55 + meter);
+    device->device = mock_object_new(device, BLUEZ_DEVICE_INTERFACE, "%s/" MOCK_DEVICE_NAME, adapter->path, 0x55 + meter);
+    mock_object_set_property(mock, device->device, "Address", g_variant_new_string(address));
+    mock_object_set_property(mock, device->device, "Name", g_variant_new_string("Mooshimeter V.1"));
+    mock_object_set_property(mock, device->device, "Adapter", g_variant_new_object_path(adapter->path));
+    mock_object_set_property(mock, device->device, "UUIDs", g_variant_new_strv(uuids, -1));
+    mock_object_set_property(mock, device->device, "Connected", g_variant_new_boolean(FALSE));
+    g_free(address);
+
+    device->serial_in = mock_object_new(device, BLUEZ_GATT_CHARACTERISTIC_INTERFACE, "%s/" MOCK_SERIAL_IN_NAME, device->device->path);
+    mock_object_set_property(mock, device->serial_in, "UUID", g_variant_new_string(METER_SERIAL_IN));
+    mock_object_set_property(mock, device->serial_in, "Value",
+        g_variant_new_fixed_array(G_VARIANT_TYPE_BYTE, NULL, 0, 1));
+    mock_object_set_property(mock, device->serial_in, "Notifying", g_variant_new_boolean(FALSE));
+
+    device->serial_out = mock_object_new(device, BLUEZ_GATT_CHARACTERISTIC_INTERFACE, "%s/" MOCK_SERIAL_OUT_NAME, device->device->path);
+    mock_object_set_property(mock, device->serial_out, "UUID", g_variant_new_string(METER_SERIAL_OUT));
+    mock_object_set_property(mock, device->serial_out, "Value",
+        g_variant_new_fixed_array(G_VARIANT_TYPE_BYTE, NULL, 0, 1));
+    mock_object_set_property(mock, device->serial_out, "Notifying", g_variant_new_boolean(FALSE));
+
+    g_ptr_array_add(mock->devices, device);
+
+    return device;
+}
+
+// Drops every adapter and device after the first keep_adapters/keep_devices
+static void
+mock_bluez_remove_objects(MockBluez *mock, guint keep_adapters, guint keep_devices)
+{
+    while (mock->devices->len > keep_devices)
+    {
+        MockDevice *device = g_ptr_array_index(mock->devices, mock->devices->len - 1);
+
+        mock_meter_stop_stream(device);
+        mock_object_unexport(mock, device->serial_out);
+        mock_object_unexport(mock, device->serial_in);
+        mock_object_unexport(mock, device->device);
+
+        mock_object_free(device->serial_out);
+        mock_object_free(device->serial_in);
+        mock_object_free(device->device);
+        g_ptr_array_unref(device->node_values);
+        g_free(device);
+
+        g_ptr_array_remove_index(mock->devices, mock->devices->len - 1);
+    }
+
+    while (mock->adapters->len > keep_adapters)
+    {
+        MockObject *adapter = g_ptr_array_index(mock->adapters, mock->adapters->len - 1);
+
+        mock_object_unexport(mock, adapter);
+        mock_object_free(adapter);
+
+        g_ptr_array_remove_index(mock->adapters, mock->adapters->len - 1);
+    }
+}
+
+static gboolean
+mock_bluez_call_dispatch(gpointer user_data)
+{
+    MockCall *call = user_data;
+    MockBluez *mock = call->mock;
+
+    call->func(mock, call->data);
+
+    g_mutex_lock(&mock->lock);
+    call->done = TRUE;
+    g_cond_broadcast(&mock->cond);
+    g_mutex_unlock(&mock->lock);
+
+    return FALSE;
+}
+
+// Runs func in the mock's thread and waits for it, the objects belong to that thread
+static void
+mock_bluez_call(MockBluez *mock, void (*func)(MockBluez *mock, gpointer data), gpointer data)
+{
+    MockCall call = { mock, func, data, FALSE };
+
+    GSource *source = g_idle_source_new();
+    g_source_set_callback(source, mock_bluez_call_dispatch, &call, NULL);
+    g_source_attach(source, mock->context);
+    g_source_unref(source);
+
+    g_mutex_lock(&mock->lock);
+    while (!call.done)
+        g_cond_wait(&mock->cond, &mock->lock);
+    g_mutex_unlock(&mock->lock);
+}
+
+static gpointer
+mock_bluez_thread(gpointer user_data)
+{
+    MockBluez *mock = user_data;
+    GError *error = NULL;
+
+    // Method calls are dispatched to the context the objects were registered in
+    g_main_context_push_thread_default(mock->context);
+
+    mock->connection = g_dbus_connection_new_for_address_sync(
+        g_test_dbus_get_bus_address(mock->bus),
+        G_DBUS_CONNECTION_FLAGS_AUTHENTICATION_CLIENT | G_DBUS_CONNECTION_FLAGS_MESSAGE_BUS_CONNECTION,
+        NULL, NULL, &error);
+    g_assert_no_error(error);
+    g_object_set_data(G_OBJECT(mock->connection), "mock-bluez", mock);
+
+    mock->manager_registration_id = g_dbus_connection_register_object(mock->connection, "/",
+        g_dbus_node_info_lookup_interface(mock->introspection, OBJECT_MANAGER_INTERFACE),
+        &mock_bluez_manager_vtable, mock, NULL, &error);
+    g_assert_no_error(error);
+
+    for (guint i = 0; i < mock->adapters->len; ++i)
+        mock_object_export(mock, g_ptr_array_index(mock->adapters, i));
+
+    // DBUS_NAME_FLAG_DO_NOT_QUEUE, nobody else is supposed to be on this bus
+    GVariant *result = g_dbus_connection_call_sync(mock->connection,
+        "org.freedesktop.DBus", "/org/freedesktop/DBus", "org.freedesktop.DBus",
+        "RequestName", g_variant_new("(su)", BLUEZ_NAME, 0x4), G_VARIANT_TYPE("(u)"),
+        G_DBUS_CALL_FLAGS_NONE, -1, NULL, &error);
+    g_assert_no_error(error);
+    g_variant_unref(result);
+
+    g_mutex_lock(&mock->lock);
+    mock->ready = TRUE;
+    g_cond_signal(&mock->cond);
+    g_mutex_unlock(&mock->lock);
+
+    g_main_loop_run(mock->loop);
+
+    mock_bluez_remove_objects(mock, 0, 0);
+    g_dbus_connection_unregister_object(mock->connection, mock->manager_registration_id);
+
+    g_dbus_connection_close_sync(mock->connection, NULL, NULL);
+    g_clear_object(&mock->connection);
+
+    g_main_context_pop_thread_default(mock->context);
+
+    return NULL;
+}
+
+MockBluez *
+mock_bluez_new(void)
+{
+    MockBluez *mock = g_new0(MockBluez, 1);
+    GError *error = NULL;
+
+    mock->bus = g_test_dbus_new(G_TEST_DBUS_NONE);
+    g_test_dbus_up(mock->bus);
+
+    // The library always talks to the system bus
+    g_setenv("DBUS_SYSTEM_BUS_ADDRESS", g_test_dbus_get_bus_address(mock->bus), TRUE);
+
+    // Tearing down the private daemon must not take the test process with it
+    mock->system_bus = g_bus_get_sync(G_BUS_TYPE_SYSTEM, NULL, &error);
+    g_assert_no_error(error);
+    g_dbus_connection_set_exit_on_close(mock->system_bus, FALSE);
+
+    mock->introspection = g_dbus_node_info_new_for_xml(mock_bluez_xml, &error);
+    g_assert_no_error(error);
+
+    mock->node_types = g_array_new(FALSE, FALSE, sizeof(gint8));
+    mock->node_op_codes = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+    mock_meter_load_tree(mock);
+
+    // Nothing is exported before the thread runs, so no signals go out here
+    mock->adapters = g_ptr_array_new();
+    mock->devices = g_ptr_array_new();
+    mock_bluez_create_device(mock, mock_bluez_create_adapter(mock), 0);
+
+    g_mutex_init(&mock->lock);
+    g_cond_init(&mock->cond);
+    mock->context = g_main_context_new();
+    mock->loop = g_main_loop_new(mock->context, FALSE);
+    mock->thread = g_thread_new("mock-bluez", mock_bluez_thread, mock);
+
+    g_mutex_lock(&mock->lock);
+    while (!mock->ready)
+        g_cond_wait(&mock->cond, &mock->lock);
+    g_mutex_unlock(&mock->lock);
+
+    return mock;
+}
+
+void
+mock_bluez_free(MockBluez *mock)
+{
+    g_main_loop_quit(mock->loop);
+    g_thread_join(mock->thread);
+
+    g_main_loop_unref(mock->loop);
+    g_main_context_unref(mock->context);
+    g_mutex_clear(&mock->lock);
+    g_cond_clear(&mock->cond);
+
+    g_ptr_array_unref(mock->devices);
+    g_ptr_array_unref(mock->adapters);
+
+    g_hash_table_unref(mock->node_op_codes);
+    g_array_unref(mock->node_types);
+    g_dbus_node_info_unref(mock->introspection);
+
+    g_dbus_connection_close_sync(mock->system_bus, NULL, NULL);
+    g_object_unref(mock->system_bus);
+
+    g_test_dbus_down(mock->bus);
+    g_object_unref(mock->bus);
+    g_unsetenv("DBUS_SYSTEM_BUS_ADDRESS");
+
+    g_free(mock);
+}
+
+void
+mock_bluez_stream(MockBluez *mock, guint rate_hz, guint samples)
+{
+    MockStream *stream = g_new0(MockStream, 1);
+    stream->mock = mock;
+    stream->rate_hz = rate_hz;
+    stream->samples = samples;
+
+    g_main_context_invoke_full(mock->context, G_PRIORITY_DEFAULT, mock_meter_start_stream, stream, g_free);
+}
+
+static void
+mock_bluez_do_add_adapter(MockBluez *mock, gpointer data)
+{
+    mock_object_export(mock, mock_bluez_create_adapter(mock));
+    *(guint*)data = mock->adapters->len - 1;
+}
+
+guint
+mock_bluez_add_adapter(MockBluez *mock)
+{
+    guint index;
+
+    mock_bluez_call(mock, mock_bluez_do_add_adapter, &index);
+    return index;
+}
+
+static void
+mock_bluez_do_add_device(MockBluez *mock, gpointer data)
+{
+    MockAddDevice *add = data;
+
+    g_assert_cmpuint(add->adapter, <, mock->adapters->len);
+    mock_bluez_create_device(mock, g_ptr_array_index(mock->adapters, add->adapter), add->meter);
+    add->index = mock->devices->len - 1;
+}
+
+guint
+mock_bluez_add_device(MockBluez *mock, guint adapter, guint meter)
+{
+    MockAddDevice add = { adapter, meter, 0 };
+
+    mock_bluez_call(mock, mock_bluez_do_add_device, &add);
+    return add.index;
+}
+
+static void
+mock_bluez_do_drop(MockBluez *mock, gpointer data)
+{
+    guint index = GPOINTER_TO_UINT(data);
+
+    g_assert_cmpuint(index, <, mock->devices->len);
+    mock_meter_disconnect(mock, g_ptr_array_index(mock->devices, index));
+}
+
+void
+mock_bluez_drop(MockBluez *mock, guint device)
+{
+    mock_bluez_call(mock, mock_bluez_do_drop, GUINT_TO_POINTER(device));
+}
+
+typedef struct
+{
+    guint device;
+    guint writes;
+} MockFailure;
+
+static void
+mock_bluez_do_fail_writes(MockBluez *mock, gpointer data)
+{
+    MockFailure *failure = data;
+
+    g_assert_cmpuint(failure->device, <, mock->devices->len);
+    ((MockDevice*)g_ptr_array_index(mock->devices, failure->device))->fail_writes = failure->writes;
+}
+
+void
+mock_bluez_fail_writes(MockBluez *mock, guint device, guint writes)
+{
+    MockFailure failure = { device, writes };
+    mock_bluez_call(mock, mock_bluez_do_fail_writes, &failure);
+}
+
+static void
+mock_bluez_do_reset(MockBluez *mock, gpointer data)
+{
+    mock_bluez_remove_objects(mock, 1, 1);
+
+    // The first meter is out of sight again until the next scan
+    MockDevice *device = g_ptr_array_index(mock->devices, 0);
+    mock_meter_disconnect(mock, device);
+    mock_object_unexport(mock, device->device);
+    device->fail_writes = 0;
+
+    for (guint i = 0; i < device->node_values->len; ++i)
+    {
+        if (g_ptr_array_index(device->node_values, i))
+            g_bytes_unref(g_ptr_array_index(device->node_values, i));
+        g_ptr_array_index(device->node_values, i) = NULL;
+    }
+}
+
+void
+mock_bluez_reset(MockBluez *mock)
+{
+    mock_bluez_call(mock, mock_bluez_do_reset, NULL);
+}
@@ -0,0 +1,51 @@
+#ifndef MOCK_BLUEZ_H_
+#define MOCK_BLUEZ_H_
+
+#include <glib.h>
+
+/*
+ * A fake org.bluez on a private dbus-daemon.
+ *
+ * It starts out with one powered adapter (hci0) and one Mooshimeter in its
+ * range. Meters appear once discovery is started on an adapter that can
+ * reach them and expose their serial in/out characteristics while they are
+ * connected. Writes to serial in are answered by a simulated meter that
+ * serves the recorded tree from fixtures.h, echoes writes and answers reads.
+ *
+ * Like BlueZ, every adapter has its own device object for a meter it can
+ * reach, so a meter in range of two adapters is two devices with the same
+ * address. Each device has its own connection and simulated meter.
+ *
+ * The service runs in its own thread with its own GMainContext, so the
+ * library under test can block on D-Bus calls as it does with the real BlueZ.
+ * DBUS_SYSTEM_BUS_ADDRESS points to the private bus until mock_bluez_free().
+ */
+typedef struct _MockBluez MockBluez;
+
+MockBluez *mock_bluez_new(void);
+void mock_bluez_free(MockBluez *mock);
+
+// Make every connected meter stream CH1:VALUE and CH2:VALUE, counting up from 1.
+// A rate of 0 sends the samples as fast as the bus takes them.
+void mock_bluez_stream(MockBluez *mock, guint rate_hz, guint samples);
+
+// Add another powered adapter and return its index, hci0 is adapter 0
+guint mock_bluez_add_adapter(MockBluez *mock);
+
+// Put meter number `meter` in range of `adapter` and return the index of the
+// new device, meter 0 in range of hci0 is device 0
+guint mock_bluez_add_device(MockBluez *mock, guint adapter, guint meter);
+
+// Drop the connection of a device as if the meter went out of range.
+// It can be connected again right away.
+void mock_bluez_drop(MockBluez *mock, guint device);
+
+// Fail the next `writes` WriteValue calls to a device, as BlueZ does when the
+// link went away under a write
+void mock_bluez_fail_writes(MockBluez *mock, guint device, guint writes);
+
+// Remove everything added above and disconnect device 0, which is only found
+// by scanning again. Call it once all states using the mock are gone.
+void mock_bluez_reset(MockBluez *mock);
+
+#endif // MOCK_BLUEZ_H_
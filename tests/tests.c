@@ -1,11 +1,22 @@
 #include <glib.h>
+#include <glib/gstdio.h>
+#include <math.h>
 #include <string.h>
 #include <sooshi.h>
 
+#include "fixtures.h"
+#include "mock_bluez.h"
+
+static MockBluez *mock_bluez = NULL;
+
 #ifndef g_assert_cmpmem
     #define g_assert_cmpmem(m1, l1, m2, l2) g_assert_true((l1) == (l2) && memcmp((m1), (m2), (l1)) == 0)
 #endif
 
+#ifndef g_assert_cmpfloat_with_epsilon
+    #define g_assert_cmpfloat_with_epsilon(n1, n2, epsilon) g_assert_true(fabs((n1) - (n2)) < (epsilon))
+#endif
+
 typedef struct
 {
     SooshiState *state;
@@ -17,6 +28,16 @@ state_wrapper_set_up(StateWrapper *wrapper, gconstpointer user_data)
     wrapper->state = sooshi_state_new(NULL);
 }
 
+// A state that has already received the recorded tree
+static void
+state_wrapper_set_up_tree(StateWrapper *wrapper, gconstpointer user_data)
+{
+    wrapper->state = sooshi_state_new(NULL);
+
+    wrapper->state->buffer = g_byte_array_append(wrapper->state->buffer, sooshi_fixture_tree, sizeof(sooshi_fixture_tree));
+    sooshi_parse_response(wrapper->state);
+}
+
 static void
 state_wrapper_tear_down(StateWrapper *wrapper, gconstpointer user_data)
 {
@@ -291,53 +312,1630 @@ test_parse_bin(StateWrapper *wrapper, gconstpointer user_data)
     g_free(node);
 }
 
-/*static void
-test_parse_tree(StateWrapper *wrapper, gconstpointer user_data)
+static void
+test_transaction_redundant(StateWrapper *wrapper, gconstpointer user_data)
 {
-    unsigned char ztree[] = {
-        // OP-Code for ADMIN:TREE
-        0x01, 0x74, 0x01,
-
-        // Zlib Compressed ADMIN:TREE
-        0x78, 0x9c, 0xc5, 0x92, 0x4d, 0x72, 0xab, 0x30, 0x10, 0x84, 0xdb, 0x12,
-        0x7f, 0x86, 0x54, 0x8e, 0xe2, 0x02, 0x1c, 0xbb, 0xb2, 0x15, 0x62, 0x8c,
-        0x55, 0x05, 0x82, 0x92, 0x04, 0xef, 0x65, 0xc5, 0xfd, 0x6f, 0x91, 0x11,
-        0xce, 0x26, 0x27, 0xc8, 0x66, 0xa6, 0x41, 0x68, 0xfa, 0xab, 0x1e, 0x80,
-        0x37, 0xa4, 0xaa, 0x9f, 0x8c, 0x95, 0x69, 0xaa, 0x9d, 0xbe, 0xb6, 0x28,
-        0x93, 0xe0, 0x88, 0x70, 0x2e, 0x7b, 0xa3, 0x06, 0x3b, 0xfb, 0x60, 0x34,
-        0x64, 0xb5, 0xe8, 0x6e, 0xdf, 0xc8, 0x79, 0x33, 0x5b, 0x9c, 0x13, 0xab,
-        0x26, 0x42, 0x5a, 0x04, 0x33, 0xd1, 0xbe, 0x06, 0x8d, 0x2a, 0xed, 0x54,
-        0xd8, 0x37, 0xc8, 0xf3, 0xd3, 0x74, 0xe4, 0xac, 0x0a, 0x04, 0x14, 0x5e,
-        0x4d, 0xcb, 0x68, 0xec, 0x20, 0x45, 0xe2, 0xf8, 0x4d, 0x0e, 0xd9, 0xb4,
-        0x37, 0x40, 0xb6, 0xb7, 0x9a, 0xeb, 0xad, 0xe6, 0x9a, 0x34, 0xf5, 0xd1,
-        0xda, 0x57, 0xfb, 0x78, 0xb5, 0xcf, 0xd8, 0x44, 0xda, 0xd3, 0x12, 0x9e,
-        0x09, 0x04, 0x43, 0x41, 0xdc, 0x3f, 0x10, 0xef, 0x7f, 0x1e, 0xf7, 0xef,
-        0x10, 0x79, 0x70, 0x66, 0x18, 0xc8, 0x49, 0xc8, 0xf9, 0xf1, 0x00, 0x32,
-        0xcf, 0x4e, 0x23, 0xdb, 0x96, 0x7a, 0xb6, 0xc1, 0xd8, 0x75, 0x5e, 0x3d,
-        0x7f, 0x3b, 0xce, 0x83, 0x94, 0x82, 0xa1, 0x93, 0xc2, 0xd8, 0x40, 0x6e,
-        0x53, 0x23, 0x64, 0xe6, 0x83, 0x0a, 0xc7, 0xb1, 0x7e, 0x36, 0x85, 0xc8,
-        0x27, 0xb5, 0x2c, 0x91, 0x13, 0xb9, 0x5e, 0x9d, 0x23, 0x1b, 0x4e, 0x10,
-        0x4d, 0x04, 0x09, 0x34, 0x2d, 0x27, 0xc8, 0x2b, 0x03, 0x9f, 0x32, 0xff,
-        0x54, 0x8e, 0x7a, 0xc8, 0xdc, 0x29, 0x3b, 0xd0, 0x6e, 0x20, 0x0a, 0x65,
-        0xd5, 0xf8, 0xe5, 0x8d, 0x97, 0x48, 0x26, 0x52, 0x96, 0x07, 0xba, 0x89,
-        0xc7, 0x66, 0xdd, 0xfa, 0x78, 0x90, 0xe3, 0x58, 0xd8, 0x6e, 0x25, 0x54,
-        0x19, 0x23, 0x7a, 0x0a, 0x28, 0x25, 0x9f, 0xf0, 0x04, 0xae, 0x7b, 0xb7,
-        0x78, 0x54, 0xef, 0x51, 0x8d, 0xbe, 0x6b, 0x39, 0x32, 0xb3, 0xd1, 0x41,
-        0xd4, 0xfe, 0x22, 0xda, 0xe6, 0x31, 0xa8, 0x81, 0x04, 0x27, 0x10, 0x53,
-        0xbb, 0xd7, 0x7f, 0xc2, 0x25, 0x7e, 0x5c, 0x24, 0xff, 0x2d, 0xeb, 0xff,
-        0x7d, 0xe3, 0xd4, 0xeb, 0x4b, 0x83, 0x58, 0xaf, 0x71, 0x2f, 0x17, 0x5e,
-        0x51, 0xe9, 0x88, 0x2d, 0x83, 0xb2, 0x9a, 0x52, 0x64, 0x71, 0xb1, 0x17,
-        0x66, 0xcd, 0xa3, 0x38, 0x54, 0x71, 0xa8, 0x43, 0x9e, 0x5f, 0xf2, 0xd0,
-        0xe5, 0x8f, 0x3e, 0x1e, 0xd2, 0xde, 0xcc, 0x3d, 0x9d, 0x5e, 0x13, 0xab,
-        0xc2, 0x91, 0x1a, 0xf7, 0xe5, 0x9f, 0xc3, 0x37, 0x95, 0x42, 0x79, 0x4c
-    };
+    SooshiNode *node = g_new0(SooshiNode, 1);
+    node->name = "RATE";
+    node->type = CHOOSER;
+    node->value = g_variant_new_byte(0x02);
+
+    SooshiTransaction *transaction = sooshi_transaction_begin(wrapper->state);
+    sooshi_transaction_set_value(transaction, node, g_variant_new_byte(0x05));
+    sooshi_transaction_set_value(transaction, node, g_variant_new_byte(0x02));
+
+    // The second write supersedes the first and matches the cached value,
+    // so nothing should be sent at all
+    g_assert_cmpuint(sooshi_transaction_commit(transaction, NULL, NULL), ==, 0);
+    g_assert_null(wrapper->state->transactions);
+    g_assert_cmpuint(g_variant_get_byte(node->value), ==, 0x02);
+
+    g_variant_unref(node->value);
+    g_free(node);
+}
+
+static void
+on_transaction_done(SooshiState *state, SooshiTransaction *transaction, gpointer user_data)
+{
+    *(gint*)user_data = transaction->timed_out ? SOOSHI_REQUEST_TIMED_OUT : SOOSHI_REQUEST_DONE;
+}
+
+static void
+test_transaction_timeout(StateWrapper *wrapper, gconstpointer user_data)
+{
+    SooshiState *state = wrapper->state;
+    SooshiNode *rate = sooshi_node_find(state, "SAMPLING:RATE", NULL);
+    SooshiNode *trigger = sooshi_node_find(state, "SAMPLING:TRIGGER", NULL);
+    gint status = SOOSHI_REQUEST_PENDING;
+
+    SooshiTransaction *transaction = sooshi_transaction_begin(state);
+    sooshi_transaction_choose_by_index(transaction, rate, 1);
+    sooshi_transaction_choose_by_index(transaction, trigger, 1);
+    sooshi_transaction_set_timeout(transaction, 50);
+    g_assert_cmpuint(sooshi_transaction_commit(transaction, on_transaction_done, &status), ==, 2);
+
+    // Only one of the two echoes ever arrives
+    guint8 echo[] = { rate->op_code, 0x01 };
+    state->buffer = g_byte_array_append(state->buffer, echo, sizeof(echo));
+    sooshi_parse_response(state);
+    g_assert_cmpint(status, ==, SOOSHI_REQUEST_PENDING);
+
+    while (status == SOOSHI_REQUEST_PENDING)
+        g_main_context_iteration(state->context, TRUE);
+
+    g_assert_cmpint(status, ==, SOOSHI_REQUEST_TIMED_OUT);
+    g_assert_null(state->transactions);
+}
+
+static void
+test_transaction_echo(StateWrapper *wrapper, gconstpointer user_data)
+{
+    SooshiState *state = wrapper->state;
+    SooshiNode *rate = sooshi_node_find(state, "SAMPLING:RATE", NULL);
+    gint status = SOOSHI_REQUEST_PENDING;
+
+    SooshiTransaction *transaction = sooshi_transaction_begin(state);
+    sooshi_transaction_choose_by_index(transaction, rate, 2);
+    g_assert_cmpuint(sooshi_transaction_commit(transaction, on_transaction_done, &status), ==, 1);
+
+    // Any other value for the node is not the echo of the write
+    guint8 other[] = { rate->op_code, 0x01 };
+    state->buffer = g_byte_array_append(state->buffer, other, sizeof(other));
+    sooshi_parse_response(state);
+    g_assert_cmpint(status, ==, SOOSHI_REQUEST_PENDING);
+    g_assert_nonnull(state->transactions);
+
+    guint8 echo[] = { rate->op_code, 0x02 };
+    state->buffer = g_byte_array_append(state->buffer, echo, sizeof(echo));
+    sooshi_parse_response(state);
+    g_assert_cmpint(status, ==, SOOSHI_REQUEST_DONE);
+    g_assert_null(state->transactions);
+}
+
+static void
+test_transaction_abort(StateWrapper *wrapper, gconstpointer user_data)
+{
+    SooshiState *state = wrapper->state;
+    SooshiNode *rate = sooshi_node_find(state, "SAMPLING:RATE", NULL);
+    gint status = SOOSHI_REQUEST_PENDING;
+
+    SooshiTransaction *transaction = sooshi_transaction_begin(state);
+    sooshi_transaction_choose_by_index(transaction, rate, 2);
+    g_assert_cmpuint(sooshi_transaction_commit(transaction, on_transaction_done, &status), ==, 1);
+
+    // Aborting a committed transaction stops waiting for its echo
+    sooshi_transaction_abort(transaction);
+    g_assert_null(state->transactions);
+
+    guint8 echo[] = { rate->op_code, 0x02 };
+    state->buffer = g_byte_array_append(state->buffer, echo, sizeof(echo));
+    sooshi_parse_response(state);
+    g_assert_cmpint(status, ==, SOOSHI_REQUEST_PENDING);
+}
+
+static void
+on_cached_read(SooshiState *state, SooshiRequest *request, gpointer user_data)
+{
+    (*(gint*)user_data)++;
+}
+
+static void
+test_read_cached_fresh(StateWrapper *wrapper, gconstpointer user_data)
+{
+    SooshiNode *node = g_new0(SooshiNode, 1);
+    node->name = "BAT_V";
+    node->type = VAL_FLT;
+    node->has_value = TRUE;
+
+    // As if it was just received
+    sooshi_node_set_value(wrapper->state, node, g_variant_new_double(2.9), FALSE);
+    node->last_update = g_get_monotonic_time();
+
+    gint calls = 0;
+    SooshiRequest *request = sooshi_node_read_cached(wrapper->state, node, 10000, 0, on_cached_read, &calls);
+
+    // The value was just set, so this must be answered from the cache
+    g_assert_nonnull(request);
+    g_assert_cmpint(calls, ==, 1);
+    g_assert_cmpint(request->status, ==, SOOSHI_REQUEST_DONE);
+    g_assert_null(node->requests);
+    g_assert_cmpfloat(g_variant_get_double(request->value), ==, 2.9);
+
+    sooshi_request_unref(request);
+    g_variant_unref(node->value);
+    g_free(node);
+}
+
+static void
+test_request_feed(SooshiState *state, SooshiNode *node, guint8 value)
+{
+    guint8 reply[] = { node->op_code, value };
+    state->buffer = g_byte_array_append(state->buffer, reply, sizeof(reply));
+    sooshi_parse_response(state);
+}
+
+static void
+test_request_coalesce(StateWrapper *wrapper, gconstpointer user_data)
+{
+    SooshiState *state = wrapper->state;
+    SooshiNode *rate = sooshi_node_find(state, "SAMPLING:RATE", NULL);
+    gint calls = 0;
+
+    // A cached read while one is in flight shares its frame
+    SooshiRequest *read = sooshi_node_read_async(state, rate, 0, on_cached_read, &calls);
+    SooshiRequest *merged = sooshi_node_read_cached(state, rate, 0, 0, on_cached_read, &calls);
+    g_assert_cmpuint(g_list_length(rate->replies_due), ==, 1);
+
+    SooshiRequest *write = sooshi_node_write_async(state, rate, g_variant_new_byte(0x03), 0, on_cached_read, &calls);
+    g_assert_cmpuint(g_list_length(rate->replies_due), ==, 2);
+
+    // The reply to the read completes both reads but not the write behind them
+    test_request_feed(state, rate, 0x01);
+    g_assert_cmpint(calls, ==, 2);
+    g_assert_cmpint(read->status, ==, SOOSHI_REQUEST_DONE);
+    g_assert_cmpint(merged->status, ==, SOOSHI_REQUEST_DONE);
+    g_assert_cmpuint(g_variant_get_byte(merged->value), ==, 0x01);
+    g_assert_cmpint(write->status, ==, SOOSHI_REQUEST_PENDING);
+
+    test_request_feed(state, rate, 0x03);
+    g_assert_cmpint(calls, ==, 3);
+    g_assert_cmpint(write->status, ==, SOOSHI_REQUEST_DONE);
+    g_assert_null(rate->replies_due);
+
+    sooshi_request_unref(read);
+    sooshi_request_unref(merged);
+    sooshi_request_unref(write);
+
+    // Reads sent separately are answered separately
+    SooshiRequest *first = sooshi_node_read_async(state, rate, 0, NULL, NULL);
+    SooshiRequest *second = sooshi_node_read_async(state, rate, 0, NULL, NULL);
+    g_assert_cmpuint(g_list_length(rate->replies_due), ==, 2);
+
+    test_request_feed(state, rate, 0x01);
+    g_assert_cmpint(first->status, ==, SOOSHI_REQUEST_DONE);
+    g_assert_cmpint(second->status, ==, SOOSHI_REQUEST_PENDING);
+
+    test_request_feed(state, rate, 0x02);
+    g_assert_cmpint(second->status, ==, SOOSHI_REQUEST_DONE);
+    g_assert_cmpuint(g_variant_get_byte(second->value), ==, 0x02);
+
+    sooshi_request_unref(first);
+    sooshi_request_unref(second);
+}
+
+static void
+test_request_timeout(StateWrapper *wrapper, gconstpointer user_data)
+{
+    SooshiState *state = wrapper->state;
+    SooshiNode *rate = sooshi_node_find(state, "SAMPLING:RATE", NULL);
+
+    SooshiRequest *lost = sooshi_node_read_async(state, rate, 50, NULL, NULL);
+    g_assert_false(sooshi_request_wait(lost));
+    g_assert_cmpint(lost->status, ==, SOOSHI_REQUEST_TIMED_OUT);
+    g_assert_null(rate->requests);
+
+    // Nobody waits for its reply anymore
+    g_assert_null(rate->replies_due);
+
+    // The write behind a timed out one doesn't wait for its echo either
+    SooshiRequest *write = sooshi_node_write_async(state, rate, g_variant_new_byte(0x01), 50, NULL, NULL);
+    g_assert_false(sooshi_request_wait(write));
+    g_assert_null(rate->replies_due);
+
+    SooshiRequest *next = sooshi_node_write_async(state, rate, g_variant_new_byte(0x02), 0, NULL, NULL);
+    test_request_feed(state, rate, 0x02);
+    g_assert_cmpint(next->status, ==, SOOSHI_REQUEST_DONE);
+    g_assert_null(rate->replies_due);
+
+    sooshi_request_unref(lost);
+    sooshi_request_unref(write);
+    sooshi_request_unref(next);
+}
+
+static void
+test_request_written(StateWrapper *wrapper, gconstpointer user_data)
+{
+    SooshiState *state = wrapper->state;
+    SooshiNode *rate = sooshi_node_find(state, "SAMPLING:RATE", NULL);
+
+    // A value we wrote ourselves isn't confirmed by the meter, so it isn't fresh
+    SooshiRequest *write = sooshi_node_write_async(state, rate, g_variant_new_byte(0x03), 0, NULL, NULL);
+    SooshiRequest *read = sooshi_node_read_cached(state, rate, 10000, 0, NULL, NULL);
+    g_assert_cmpint(read->status, ==, SOOSHI_REQUEST_PENDING);
+    g_assert_cmpuint(g_list_length(rate->replies_due), ==, 2);
+
+    test_request_feed(state, rate, 0x03);
+    g_assert_cmpint(write->status, ==, SOOSHI_REQUEST_DONE);
+    g_assert_cmpint(read->status, ==, SOOSHI_REQUEST_PENDING);
+
+    test_request_feed(state, rate, 0x03);
+    g_assert_cmpint(read->status, ==, SOOSHI_REQUEST_DONE);
+
+    // The echo is, though
+    SooshiRequest *cached = sooshi_node_read_cached(state, rate, 10000, 0, NULL, NULL);
+    g_assert_cmpint(cached->status, ==, SOOSHI_REQUEST_DONE);
+    g_assert_null(rate->replies_due);
+
+    sooshi_request_unref(write);
+    sooshi_request_unref(read);
+    sooshi_request_unref(cached);
+}
+
+static void
+test_request_lost(StateWrapper *wrapper, gconstpointer user_data)
+{
+    SooshiState *state = wrapper->state;
+    SooshiNode *rate = sooshi_node_find(state, "SAMPLING:RATE", NULL);
+
+    SooshiRequest *lost = sooshi_node_read_cached(state, rate, 0, 50, NULL, NULL);
+    g_assert_false(sooshi_request_wait(lost));
+    g_assert_null(rate->replies_due);
+
+    // The next cached read doesn't merge into the lost one, it sends its own frame
+    SooshiRequest *read = sooshi_node_read_cached(state, rate, 0, 0, NULL, NULL);
+    g_assert_cmpint(read->status, ==, SOOSHI_REQUEST_PENDING);
+    g_assert_cmpuint(g_list_length(rate->replies_due), ==, 1);
+
+    test_request_feed(state, rate, 0x02);
+    g_assert_cmpint(read->status, ==, SOOSHI_REQUEST_DONE);
+    g_assert_cmpuint(g_variant_get_byte(read->value), ==, 0x02);
+    g_assert_null(rate->replies_due);
+
+    sooshi_request_unref(lost);
+    sooshi_request_unref(read);
+}
+
+static void
+test_request_unsolicited(StateWrapper *wrapper, gconstpointer user_data)
+{
+    SooshiState *state = wrapper->state;
+    SooshiNode *rate = sooshi_node_find(state, "SAMPLING:RATE", NULL);
+    gint status = SOOSHI_REQUEST_PENDING;
+
+    // A value sent by the meter on its own isn't the echo of the write
+    SooshiRequest *write = sooshi_node_write_async(state, rate, g_variant_new_byte(0x03), 0, NULL, NULL);
+    test_request_feed(state, rate, 0x01);
+    g_assert_cmpint(write->status, ==, SOOSHI_REQUEST_PENDING);
+
+    test_request_feed(state, rate, 0x03);
+    g_assert_cmpint(write->status, ==, SOOSHI_REQUEST_DONE);
+    sooshi_request_unref(write);
+
+    // Neither is the echo of a transaction the reply to a read sent before it
+    SooshiRequest *read = sooshi_node_read_async(state, rate, 0, NULL, NULL);
+    SooshiTransaction *transaction = sooshi_transaction_begin(state);
+    sooshi_transaction_choose_by_index(transaction, rate, 2);
+    g_assert_cmpuint(sooshi_transaction_commit(transaction, on_transaction_done, &status), ==, 1);
+
+    test_request_feed(state, rate, 0x01);
+    g_assert_cmpint(read->status, ==, SOOSHI_REQUEST_DONE);
+    g_assert_cmpuint(g_variant_get_byte(read->value), ==, 0x01);
+    g_assert_cmpint(status, ==, SOOSHI_REQUEST_PENDING);
+
+    test_request_feed(state, rate, 0x02);
+    g_assert_cmpint(status, ==, SOOSHI_REQUEST_DONE);
+    g_assert_null(rate->replies_due);
+
+    sooshi_request_unref(read);
+}
+
+static void
+test_histogram_percentile(void)
+{
+    SooshiHistogram histogram;
+    sooshi_histogram_reset(&histogram);
+
+    for (guint i = 0; i < 99; ++i)
+        sooshi_histogram_record(&histogram, 100);
+    sooshi_histogram_record(&histogram, 5000);
+
+    g_assert_cmpuint(histogram.count, ==, 100);
+    g_assert_cmpuint(histogram.min, ==, 100);
+    g_assert_cmpuint(histogram.max, ==, 5000);
+
+    // 100 lands in [64, 128), 5000 in [4096, 8192) but is capped by the maximum
+    g_assert_cmpuint(sooshi_histogram_percentile(&histogram, 50.0), ==, 127);
+    g_assert_cmpuint(sooshi_histogram_percentile(&histogram, 99.9), ==, 5000);
+}
+
+#define E2E_SAMPLES 1000
+
+typedef struct
+{
+    SooshiState *state;
+    gint64 initialized;
+    gint64 finished;
+    guint samples;
+    gboolean timed_out;
+} EndToEnd;
+
+static void
+e2e_on_sample(SooshiState *state, SooshiNode *node, gpointer user_data)
+{
+    EndToEnd *e2e = user_data;
+
+    // The initial read of CH1:VALUE answers 0, streamed samples count from 1
+    if (g_variant_get_double(node->value) < 1.0)
+        return;
+
+    if (++e2e->samples == E2E_SAMPLES)
+    {
+        e2e->finished = g_get_monotonic_time();
+        sooshi_stop(state);
+    }
+}
+
+static void
+e2e_on_initialized(SooshiState *state, gpointer user_data)
+{
+    EndToEnd *e2e = user_data;
+    e2e->initialized = g_get_monotonic_time();
+
+    SooshiNode *node = sooshi_node_find(state, "CH1:VALUE", NULL);
+    g_assert_nonnull(node);
+
+    sooshi_node_subscribe(state, node, e2e_on_sample, e2e);
+    mock_bluez_stream(mock_bluez, 0, E2E_SAMPLES);
+}
+
+static gboolean
+e2e_timed_out(gpointer user_data)
+{
+    EndToEnd *e2e = user_data;
+
+    e2e->timed_out = TRUE;
+    sooshi_stop(e2e->state);
+
+    return FALSE;
+}
+
+static void
+test_end_to_end(void)
+{
+    EndToEnd e2e = { 0 };
+
+    g_test_timer_start();
+
+    SooshiState *state = sooshi_state_new(NULL);
+    g_assert_nonnull(state);
+    e2e.state = state;
+
+    // Scan, connect, tree download, init and streaming against the mock
+    g_assert_cmpint(sooshi_setup(state, e2e_on_initialized, &e2e, NULL, NULL), ==, SOOSHI_ERROR_SUCCESS);
+
+    sooshi_timeout_add(state, 10000, e2e_timed_out, &e2e);
+    sooshi_run(state);
+
+    g_assert_false(e2e.timed_out);
+    g_assert_cmpuint(e2e.samples, ==, E2E_SAMPLES);
+    g_assert_true(state->initialized);
+
+    g_test_minimized_result(g_test_timer_elapsed(), "startup and %u samples: %.3fs", E2E_SAMPLES, g_test_timer_last());
+
+    // The meter only shows up once we scan for it, so every phase must have been reached
+    SooshiTimeline timeline;
+    sooshi_get_timeline(state, &timeline);
+    for (guint i = 0; i < SOOSHI_PHASE_COUNT; ++i)
+    {
+        g_assert_cmpint(sooshi_timeline_elapsed(&timeline, i), >=, 0);
+        g_test_message("%s after %.1fms", SOOSHI_PHASE_TO_STR(i), sooshi_timeline_elapsed(&timeline, i) / 1000.0);
+    }
+
+    g_test_message("streaming %.1fms (%.0f samples/s)",
+            (e2e.finished - e2e.initialized) / 1000.0,
+            E2E_SAMPLES * 1e6 / (e2e.finished - e2e.initialized));
+
+    SooshiMetrics metrics;
+    sooshi_get_metrics(state, &metrics);
+
+    SooshiNode *node = sooshi_node_find(state, "CH1:VALUE", NULL);
+    g_assert_cmpuint(metrics.frames[node->op_code], >=, E2E_SAMPLES);
+    g_assert_cmpuint(metrics.unknown_frames, ==, 0);
+    g_assert_cmpuint(metrics.write_errors, ==, 0);
+    g_assert_cmpuint(metrics.parse_time.count, ==, metrics.notifications);
+
+    g_test_message("%" G_GUINT64_FORMAT " notifications, parse p99 %" G_GUINT64_FORMAT "us, write p99 %" G_GUINT64_FORMAT "us",
+            metrics.notifications,
+            sooshi_histogram_percentile(&metrics.parse_time, 99.0),
+            sooshi_histogram_percentile(&metrics.write_latency, 99.0));
+
+    sooshi_state_delete(state);
+}
+
+static gboolean
+on_idle_count(gpointer user_data)
+{
+    (*(guint*)user_data)++;
+    return TRUE;
+}
+
+static void
+test_external_loop(void)
+{
+    GMainContext *context = g_main_context_new();
+    SooshiState *first = sooshi_state_new_with_context(context, NULL);
+    SooshiState *second = sooshi_state_new_with_context(context, NULL);
+    g_assert_nonnull(first);
+    g_assert_nonnull(second);
+
+    guint calls = 0;
+    GSource *idle = g_idle_source_new();
+    g_source_set_callback(idle, on_idle_count, &calls, NULL);
+    g_source_attach(idle, context);
+
+    // Driving both states of a context runs one iteration of it, not two
+    GPollFD fds[32];
+    gint timeout;
+    gint n = sooshi_prepare(first, fds, G_N_ELEMENTS(fds), &timeout);
+    g_assert_cmpint(n, >=, 0);
+    g_assert_cmpint(n, <=, G_N_ELEMENTS(fds));
+    g_assert_cmpint(sooshi_prepare(second, fds, G_N_ELEMENTS(fds), &timeout), ==, n);
+    g_assert_cmpint(timeout, ==, 0);
+
+    sooshi_dispatch(first, fds, n);
+    sooshi_dispatch(second, fds, n);
+    g_assert_cmpuint(calls, ==, 1);
+
+    // The context is free for the next iteration again
+    n = sooshi_prepare(second, fds, G_N_ELEMENTS(fds), &timeout);
+    sooshi_dispatch(second, fds, n);
+    g_assert_cmpuint(calls, ==, 2);
+
+    g_source_destroy(idle);
+    g_source_unref(idle);
+    sooshi_state_delete(first);
+    sooshi_state_delete(second);
+    g_main_context_unref(context);
+}
+
+#define RECONNECT_SAMPLES 100
+
+typedef struct
+{
+    SooshiState *state;
+    SooshiNode *node;
+    guint initialized;
+    guint reconnected;
+    guint samples;
+    gboolean timed_out;
+} Reconnect;
+
+static void
+reconnect_on_sample(SooshiState *state, SooshiNode *node, gpointer user_data)
+{
+    Reconnect *reconnect = user_data;
+
+    if (g_variant_get_double(node->value) >= 1.0 && ++reconnect->samples == RECONNECT_SAMPLES)
+        sooshi_stop(state);
+}
+
+static void
+reconnect_on_initialized(SooshiState *state, gpointer user_data)
+{
+    Reconnect *reconnect = user_data;
+    SooshiNode *node = sooshi_node_find(state, "CH1:VALUE", NULL);
+
+    // The first time around the meter goes out of range right away
+    if (reconnect->initialized++ == 0)
+    {
+        reconnect->node = node;
+        sooshi_node_subscribe(state, node, reconnect_on_sample, reconnect);
+        sooshi_node_history_enable(state, node, 16);
+        mock_bluez_drop(mock_bluez, 0);
+        return;
+    }
+
+    // The tree was downloaded again, what the application set up is still there
+    g_assert_true(node == reconnect->node);
+    g_assert_cmpuint(g_list_length(node->subscriber), ==, 1);
+    g_assert_nonnull(node->history);
+
+    mock_bluez_stream(mock_bluez, 0, RECONNECT_SAMPLES);
+}
+
+static void
+reconnect_on_reconnected(SooshiState *state, gpointer user_data)
+{
+    Reconnect *reconnect = user_data;
+    reconnect->reconnected++;
+
+    g_assert_true(sooshi_node_find(state, "CH1:VALUE", NULL) == reconnect->node);
+    g_assert_cmpuint(g_list_length(reconnect->node->subscriber), ==, 1);
+
+    // As if the meter did not acknowledge the cached tree
+    sooshi_reload_tree(state);
+}
+
+static gboolean
+reconnect_timed_out(gpointer user_data)
+{
+    Reconnect *reconnect = user_data;
 
-    wrapper->state->buffer = g_byte_array_append(wrapper->state->buffer, ztree, sizeof(ztree));
+    reconnect->timed_out = TRUE;
+    sooshi_stop(reconnect->state);
+
+    return FALSE;
+}
+
+static void
+test_reconnect(void)
+{
+    Reconnect reconnect = { 0 };
+
+    // Start from a meter that has to be found again
+    mock_bluez_reset(mock_bluez);
+
+    SooshiState *state = sooshi_state_new(NULL);
+    g_assert_nonnull(state);
+    reconnect.state = state;
+
+    sooshi_set_auto_reconnect(state, TRUE, reconnect_on_reconnected, &reconnect);
+    g_assert_cmpint(sooshi_setup(state, reconnect_on_initialized, &reconnect, NULL, NULL), ==, SOOSHI_ERROR_SUCCESS);
+
+    sooshi_timeout_add(state, 10000, reconnect_timed_out, &reconnect);
+    sooshi_run(state);
+
+    g_assert_false(reconnect.timed_out);
+    g_assert_cmpuint(reconnect.reconnected, ==, 1);
+    g_assert_cmpuint(reconnect.initialized, ==, 2);
+    g_assert_cmpuint(reconnect.samples, ==, RECONNECT_SAMPLES);
+
+    sooshi_state_delete(state);
+    mock_bluez_reset(mock_bluez);
+}
+
+static void
+write_failure_on_initialized(SooshiState *state, gpointer user_data)
+{
+    Reconnect *reconnect = user_data;
+
+    if (reconnect->initialized++ > 0)
+    {
+        sooshi_stop(state);
+        return;
+    }
+
+    // Requesting the tree is a blocking write, BlueZ refuses it as if the link just dropped
+    mock_bluez_fail_writes(mock_bluez, 0, 1);
+    sooshi_reload_tree(state);
+    g_assert_false(state->connected);
+}
+
+static void
+test_write_failure(void)
+{
+    Reconnect reconnect = { 0 };
+
+    mock_bluez_reset(mock_bluez);
+
+    SooshiState *state = sooshi_state_new(NULL);
+    g_assert_nonnull(state);
+    reconnect.state = state;
+
+    // The failed write is left to the reconnect logic instead of aborting
+    sooshi_set_auto_reconnect(state, TRUE, NULL, NULL);
+    g_assert_cmpint(sooshi_setup(state, write_failure_on_initialized, &reconnect, NULL, NULL), ==, SOOSHI_ERROR_SUCCESS);
+
+    sooshi_timeout_add(state, 10000, reconnect_timed_out, &reconnect);
+    sooshi_run(state);
+
+    g_assert_false(reconnect.timed_out);
+    g_assert_cmpuint(reconnect.initialized, ==, 2);
+    g_assert_true(state->connected);
+
+    SooshiMetrics metrics;
+    sooshi_get_metrics(state, &metrics);
+    g_assert_cmpuint(metrics.write_errors, >=, 1);
+
+    sooshi_state_delete(state);
+    mock_bluez_reset(mock_bluez);
+}
+
+typedef struct
+{
+    SooshiManager *manager;
+    guint initialized;
+    gboolean rebalance;
+    gboolean timed_out;
+
+    // Last meter initialized
+    SooshiState *meter;
+} ManagerTest;
+
+static GSource *
+manager_test_add_timeout(SooshiManager *manager, guint interval_ms, GSourceFunc func, gpointer data)
+{
+    GSource *source = g_timeout_source_new(interval_ms);
+    g_source_set_callback(source, func, data, NULL);
+    g_source_attach(source, manager->context);
+
+    return source;
+}
+
+// Whether both meters are up, each connected through another adapter
+static gboolean
+manager_test_spread(SooshiManager *manager)
+{
+    gchar *adapters[2] = { NULL, NULL };
+    guint count = 0;
+
+    GHashTableIter iter;
+    gpointer value;
+
+    g_hash_table_iter_init(&iter, manager->meters);
+    while (g_hash_table_iter_next(&iter, NULL, &value) && count < G_N_ELEMENTS(adapters))
+    {
+        SooshiState *state = ((SooshiManagerMeter*)value)->state;
+
+        if (state == NULL || !state->initialized || !state->connected || !state->listening || state->reconnecting)
+            break;
+
+        adapters[count++] = g_path_get_dirname(state->mooshimeter_dbus_path);
+    }
+
+    gboolean spread = (count == 2 && g_strcmp0(adapters[0], adapters[1]) != 0);
+
+    g_free(adapters[0]);
+    g_free(adapters[1]);
+
+    return spread;
+}
+
+static void
+manager_test_on_meter(SooshiManager *manager, SooshiState *state, gpointer user_data)
+{
+    ManagerTest *test = user_data;
+
+    if (++test->initialized < 2 || !test->rebalance)
+        return;
+
+    // Both fit on hci0 so far, from now on the rebalance timer has to move one of them
+    g_assert_false(manager_test_spread(manager));
+    sooshi_manager_set_adapter_limits(manager, 1, 0);
+}
+
+static gboolean
+manager_test_check(gpointer user_data)
+{
+    ManagerTest *test = user_data;
+
+    if (test->initialized < 2 || !manager_test_spread(test->manager))
+        return TRUE;
+
+    sooshi_manager_stop(test->manager);
+    return FALSE;
+}
+
+static gboolean
+manager_test_timed_out(gpointer user_data)
+{
+    ManagerTest *test = user_data;
+
+    test->timed_out = TRUE;
+    sooshi_manager_stop(test->manager);
+
+    return FALSE;
+}
+
+static void
+test_manager(gconstpointer user_data)
+{
+    ManagerTest test = { 0 };
+    test.rebalance = GPOINTER_TO_INT(user_data);
+
+    // Two meters, both in range of two adapters
+    mock_bluez_reset(mock_bluez);
+    guint hci1 = mock_bluez_add_adapter(mock_bluez);
+    mock_bluez_add_device(mock_bluez, 0, 1);
+    mock_bluez_add_device(mock_bluez, hci1, 0);
+    mock_bluez_add_device(mock_bluez, hci1, 1);
+
+    SooshiManager *manager = sooshi_manager_new(NULL);
+    g_assert_nonnull(manager);
+    test.manager = manager;
+
+    // Without rebalancing both adapters have to be used right away
+    sooshi_manager_set_adapter_limits(manager, test.rebalance ? 2 : 1, 0);
+    g_assert_cmpint(sooshi_manager_start(manager, 0, manager_test_on_meter, &test), ==, SOOSHI_ERROR_SUCCESS);
+    g_assert_cmpuint(manager->adapters->len, ==, 2);
+
+    GSource *check = manager_test_add_timeout(manager, 50, manager_test_check, &test);
+    GSource *timeout = manager_test_add_timeout(manager, (SOOSHI_ADAPTER_REBALANCE_SECONDS * 2 + 10) * 1000,
+            manager_test_timed_out, &test);
+
+    sooshi_manager_run(manager);
+
+    g_assert_false(test.timed_out);
+    g_assert_cmpuint(test.initialized, ==, 2);
+    g_assert_true(manager_test_spread(manager));
+
+    g_source_destroy(check);
+    g_source_unref(check);
+    g_source_destroy(timeout);
+    g_source_unref(timeout);
+
+    sooshi_manager_delete(manager);
+    mock_bluez_reset(mock_bluez);
+}
+
+static void
+manager_reload_on_meter(SooshiManager *manager, SooshiState *state, gpointer user_data)
+{
+    ManagerTest *test = user_data;
+
+    test->initialized++;
+    test->meter = state;
+}
+
+static void
+manager_reload_on_value(SooshiState *state, SooshiNode *node, gpointer user_data)
+{
+}
+
+static gboolean
+manager_reload_check(gpointer user_data)
+{
+    ManagerTest *test = user_data;
+
+    // The tree is downloaded again once, init runs again afterwards
+    if (test->initialized == 1 && test->meter->initialized)
+        sooshi_reload_tree(test->meter);
+    else if (test->initialized == 2)
+    {
+        sooshi_manager_stop(test->manager);
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+static void
+test_manager_reload(void)
+{
+    ManagerTest test = { 0 };
+
+    mock_bluez_reset(mock_bluez);
+    mock_bluez_add_device(mock_bluez, 0, 0);
+
+    SooshiManager *manager = sooshi_manager_new(NULL);
+    g_assert_nonnull(manager);
+    test.manager = manager;
+
+    sooshi_manager_subscribe(manager, "CH1:VALUE", manager_reload_on_value, NULL);
+    g_assert_cmpint(sooshi_manager_start(manager, 0, manager_reload_on_meter, &test), ==, SOOSHI_ERROR_SUCCESS);
+
+    GSource *check = manager_test_add_timeout(manager, 50, manager_reload_check, &test);
+    GSource *timeout = manager_test_add_timeout(manager, 10000, manager_test_timed_out, &test);
+
+    sooshi_manager_run(manager);
+
+    g_assert_false(test.timed_out);
+    g_assert_cmpuint(test.initialized, ==, 2);
+
+    // Subscribed on the first init only, the reloaded tree kept the subscriber
+    SooshiNode *node = sooshi_node_find(test.meter, "CH1:VALUE", NULL);
+    g_assert_nonnull(node);
+    g_assert_cmpuint(g_list_length(node->subscriber), ==, 1);
+
+    g_source_destroy(check);
+    g_source_unref(check);
+    g_source_destroy(timeout);
+    g_source_unref(timeout);
+
+    sooshi_manager_delete(manager);
+    mock_bluez_reset(mock_bluez);
+}
+
+static void
+test_parse_tree(StateWrapper *wrapper, gconstpointer user_data)
+{
+    wrapper->state->buffer = g_byte_array_append(wrapper->state->buffer, sooshi_fixture_tree, sizeof(sooshi_fixture_tree));
 
     sooshi_parse_response(wrapper->state); 
 
     g_assert_nonnull(wrapper->state->root_node);
-}*/
+}
+
+static void
+on_value_count(SooshiState *state, SooshiNode *node, gpointer user_data)
+{
+    (*(guint*)user_data)++;
+}
+
+static void
+test_parse_tree_reload(StateWrapper *wrapper, gconstpointer user_data)
+{
+    SooshiState *state = wrapper->state;
+    SooshiNode *node = sooshi_node_find(state, "CH1:VALUE", NULL);
+    SooshiNode *root = state->root_node;
+    guint calls = 0;
+
+    sooshi_node_subscribe(state, node, on_value_count, &calls);
+    g_assert_true(sooshi_node_stats_enable(state, node, 0));
+
+    SooshiNode *rate = sooshi_node_find(state, "SAMPLING:RATE", NULL);
+    gint read_calls = 0, status = SOOSHI_REQUEST_PENDING;
+    SooshiRequest *read = sooshi_node_read_async(state, rate, 0, on_cached_read, &read_calls);
+    SooshiTransaction *transaction = sooshi_transaction_begin(state);
+    sooshi_transaction_choose_by_index(transaction, rate, 2);
+    g_assert_cmpuint(sooshi_transaction_commit(transaction, on_transaction_done, &status), ==, 1);
+
+    // The same tree again is kept as it is, with what is in flight
+    state->buffer = g_byte_array_append(state->buffer, sooshi_fixture_tree, sizeof(sooshi_fixture_tree));
+    sooshi_parse_response(state);
+    g_assert_true(state->root_node == root);
+    g_assert_cmpint(read->status, ==, SOOSHI_REQUEST_PENDING);
+    g_assert_nonnull(state->transactions);
+
+    // A different one is parsed, nodes still in it take the place of the new ones.
+    // Nothing in flight will be answered, but everybody hears about it.
+    state->tree_crc ^= 1;
+    state->buffer = g_byte_array_append(state->buffer, sooshi_fixture_tree, sizeof(sooshi_fixture_tree));
+    sooshi_parse_response(state);
+
+    g_assert_cmpint(read->status, ==, SOOSHI_REQUEST_CANCELLED);
+    g_assert_cmpint(read_calls, ==, 1);
+    g_assert_cmpint(status, ==, SOOSHI_REQUEST_TIMED_OUT);
+    g_assert_null(state->transactions);
+    g_assert_null(rate->replies_due);
+    sooshi_request_unref(read);
+
+    g_assert_true(state->root_node == root);
+    g_assert_true(sooshi_node_find(state, "CH1:VALUE", NULL) == node);
+    g_assert_true(g_ptr_array_index(state->op_code_map, node->op_code) == node);
+    g_assert_true(node->parent == sooshi_node_find(state, "CH1", NULL));
+    g_assert_nonnull(node->stats);
+
+    float value = 2.5f;
+    guint8 reply[5] = { node->op_code };
+    memcpy(reply + 1, &value, sizeof(value));
+    state->buffer = g_byte_array_append(state->buffer, reply, sizeof(reply));
+    sooshi_parse_response(state);
+    g_assert_cmpuint(calls, ==, 1);
+}
+
+static void
+test_subscribe(StateWrapper *wrapper, gconstpointer user_data)
+{
+    SooshiState *state = wrapper->state;
+
+    guint op_codes = state->op_code_map->len;
+    SooshiNode *node = sooshi_node_find(state, "CH1:VALUE", NULL);
+
+    guint first_calls = 0, second_calls = 0;
+    guint first = sooshi_node_subscribe(state, node, on_value_count, &first_calls);
+    guint second = sooshi_node_subscribe(state, node, on_value_count, &second_calls);
+    sooshi_node_unsubscribe(state, node, first);
+
+    // Ids must stay unique after an unsubscribe
+    guint third = sooshi_node_subscribe(state, node, on_value_count, &first_calls);
+    g_assert_cmpuint(third, !=, second);
+
+    sooshi_node_notify_subscribers(state, node);
+    g_assert_cmpuint(first_calls, ==, 1);
+    g_assert_cmpuint(second_calls, ==, 1);
+
+    // A tree arriving again replaces the old one instead of adding to it
+    state->buffer = g_byte_array_append(state->buffer, sooshi_fixture_tree, sizeof(sooshi_fixture_tree));
+    sooshi_parse_response(state);
+    g_assert_cmpuint(state->op_code_map->len, ==, op_codes);
+    g_assert_nonnull(sooshi_node_find(state, "CH1:VALUE", NULL));
+}
+
+typedef struct
+{
+    guint calls;
+    guint unsubscribe[2];
+} Unsubscriber;
+
+static void
+on_value_unsubscribe(SooshiState *state, SooshiNode *node, gpointer user_data)
+{
+    Unsubscriber *unsubscriber = user_data;
+
+    unsubscriber->calls++;
+    for (guint i = 0; i < G_N_ELEMENTS(unsubscriber->unsubscribe); ++i)
+        sooshi_node_unsubscribe(state, node, unsubscriber->unsubscribe[i]);
+}
+
+static void
+test_subscribe_unsubscribe(StateWrapper *wrapper, gconstpointer user_data)
+{
+    SooshiState *state = wrapper->state;
+
+    SooshiNode *node = sooshi_node_find(state, "CH1:VALUE", NULL);
+
+    Unsubscriber first = { 0 };
+    guint second_calls = 0, third_calls = 0;
+    first.unsubscribe[0] = sooshi_node_subscribe(state, node, on_value_unsubscribe, &first);
+    first.unsubscribe[1] = sooshi_node_subscribe(state, node, on_value_count, &second_calls);
+    sooshi_node_subscribe(state, node, on_value_count, &third_calls);
+
+    // The first handler removes itself and the one after it, the last one still runs
+    sooshi_node_notify_subscribers(state, node);
+    g_assert_cmpuint(first.calls, ==, 1);
+    g_assert_cmpuint(second_calls, ==, 0);
+    g_assert_cmpuint(third_calls, ==, 1);
+    g_assert_cmpuint(g_list_length(node->subscriber), ==, 1);
+
+    sooshi_node_notify_subscribers(state, node);
+    g_assert_cmpuint(first.calls, ==, 1);
+    g_assert_cmpuint(third_calls, ==, 2);
+}
+
+static void
+test_interest(StateWrapper *wrapper, gconstpointer user_data)
+{
+    SooshiState *state = wrapper->state;
+    const gchar *interest[] = { "SAMPLING", NULL };
+
+    sooshi_set_interest(state, interest);
+
+    // The meter acknowledging the tree's CRC finishes the setup
+    guint32 crc = GUINT32_TO_LE(state->tree_crc);
+    guint8 echo[5] = { 0 };
+    memcpy(echo + 1, &crc, sizeof(crc));
+    state->buffer = g_byte_array_append(state->buffer, echo, sizeof(echo));
+    sooshi_parse_response(state);
+    g_assert_true(state->initialized);
+
+    // Only the nodes below SAMPLING are fetched up front
+    SooshiNode *rate = sooshi_node_find(state, "SAMPLING:RATE", NULL);
+    SooshiNode *ch1 = sooshi_node_find(state, "CH1:VALUE", NULL);
+    g_assert_true(rate->value_requested);
+    g_assert_false(ch1->value_requested);
+    g_assert_cmpuint(state->fetches_pending, >, 0);
+}
+
+static void
+test_lazy_fetch(StateWrapper *wrapper, gconstpointer user_data)
+{
+    SooshiState *state = wrapper->state;
+    SooshiNode *node = sooshi_node_find(state, "CH1:VALUE", NULL);
+
+    // Not known yet, the first access asks the meter for it
+    g_assert_null(sooshi_node_get_value(state, node));
+    g_assert_true(node->value_requested);
+    gint64 requested = node->value_requested_at;
+
+    // Asking again while the request is on its way doesn't send another one
+    g_assert_null(sooshi_node_get_value(state, node));
+    g_assert_cmpint(node->value_requested_at, ==, requested);
+
+    // The reply got lost, a later access asks again
+    node->value_requested_at -= SOOSHI_NODE_FETCH_RETRY_MS * 1000;
+    g_assert_null(sooshi_node_get_value(state, node));
+    g_assert_cmpint(node->value_requested_at, >=, requested);
+
+    float value = 1.5f;
+    guint8 reply[5] = { node->op_code };
+    memcpy(reply + 1, &value, sizeof(value));
+    state->buffer = g_byte_array_append(state->buffer, reply, sizeof(reply));
+    sooshi_parse_response(state);
+
+    g_assert_false(node->value_requested);
+    g_assert_cmpfloat(g_variant_get_double(sooshi_node_get_value(state, node)), ==, 1.5);
+}
+
+static void
+on_aggregate(SooshiState *state, SooshiNode *node, const SooshiAggregate *aggregate, gpointer user_data)
+{
+    *(SooshiAggregate*)user_data = *aggregate;
+}
+
+static void
+test_subscribe_options(StateWrapper *wrapper, gconstpointer user_data)
+{
+    SooshiState *state = wrapper->state;
+
+    SooshiNode *node = sooshi_node_find(state, "CH1:VALUE", NULL);
+
+    guint every_calls = 0, throttled_calls = 0;
+    SooshiSubscribeOptions every = { .every = 10 };
+    SooshiSubscribeOptions throttled = { .interval_ms = 100 };
+    SooshiAggregate aggregate = { 0 };
+
+    sooshi_node_subscribe_full(state, node, &every, on_value_count, &every_calls);
+    sooshi_node_subscribe_full(state, node, &throttled, on_value_count, &throttled_calls);
+    sooshi_node_subscribe_aggregate(state, node, 1000, on_aggregate, &aggregate);
+
+    // 50 values 10ms apart
+    gint64 start = 1000000;
+    for (guint i = 0; i < 50; ++i)
+    {
+        sooshi_node_set_value(state, node, g_variant_new_double(i), FALSE);
+        node->last_update = start + i * 10000;
+        sooshi_node_notify_subscribers(state, node);
+    }
+
+    g_assert_cmpuint(every_calls, ==, 5);
+    g_assert_cmpuint(throttled_calls, ==, 5);
+    g_assert_cmpuint(aggregate.count, ==, 0);
+
+    // The first value of the next window delivers the last one
+    sooshi_node_set_value(state, node, g_variant_new_double(100), FALSE);
+    node->last_update = start + 1000000;
+    sooshi_node_notify_subscribers(state, node);
+
+    g_assert_cmpuint(aggregate.count, ==, 50);
+    g_assert_cmpfloat(aggregate.min, ==, 0.0);
+    g_assert_cmpfloat(aggregate.max, ==, 49.0);
+    g_assert_cmpfloat(aggregate.mean, ==, 24.5);
+    g_assert_cmpfloat(aggregate.last, ==, 49.0);
+    g_assert_cmpint(aggregate.last_update - aggregate.first_update, ==, 490000);
+}
+
+static void
+test_stats(StateWrapper *wrapper, gconstpointer user_data)
+{
+    SooshiState *state = wrapper->state;
+    SooshiStats stats;
+
+    // A sliding window over the last 4 values, fed through the parser. Enough
+    // of them that the window is recomputed from scratch along the way.
+    SooshiNode *ch1 = sooshi_node_find(state, "CH1:VALUE", NULL);
+    g_assert_true(sooshi_node_stats_enable(state, ch1, 4));
+
+    for (guint i = 1; i <= 100; ++i)
+    {
+        float value = i;
+        guint8 frame[5] = { ch1->op_code };
+        memcpy(frame + 1, &value, sizeof(value));
+        state->buffer = g_byte_array_append(state->buffer, frame, sizeof(frame));
+        sooshi_parse_response(state);
+    }
+
+    g_assert_true(sooshi_node_stats_get(state, ch1, &stats));
+    g_assert_cmpuint(stats.count, ==, 4);
+    g_assert_cmpfloat_with_epsilon(stats.mean, 98.5, 1e-9);
+    g_assert_cmpfloat_with_epsilon(stats.variance, 1.25, 1e-9);
+    g_assert_cmpfloat_with_epsilon(stats.rms, sqrt((97.0 * 97.0 + 98.0 * 98.0 + 99.0 * 99.0 + 100.0 * 100.0) / 4), 1e-9);
+    g_assert_cmpfloat(stats.min, ==, 97.0);
+    g_assert_cmpfloat(stats.max, ==, 100.0);
+    g_assert_cmpfloat(stats.peak_to_peak, ==, 3.0);
+    g_assert_cmpuint(ch1->stats->since_recompute, ==, (100 - 4) % (4 * 16));
+
+    // Readers only ever look at the node, not at the freed accumulator
+    sooshi_node_stats_disable(state, ch1);
+    g_assert_false(sooshi_node_stats_get(state, ch1, &stats));
+
+    // A block of 1..1001 on top of a single value of 0, accumulated until reset
+    SooshiNode *ch2 = sooshi_node_find(state, "CH2:VALUE", NULL);
+    g_assert_true(sooshi_node_stats_enable(state, ch2, 0));
+
+    gdouble zero = 0;
+    sooshi_node_stats_add_block(state, ch2, &zero, 1);
+
+    gdouble block[1001];
+    for (guint i = 0; i < G_N_ELEMENTS(block); ++i)
+        block[i] = i + 1;
+    sooshi_node_stats_add_block(state, ch2, block, G_N_ELEMENTS(block));
+
+    g_assert_true(sooshi_node_stats_get(state, ch2, &stats));
+    g_assert_cmpuint(stats.count, ==, 1002);
+    g_assert_cmpfloat_with_epsilon(stats.mean, 500.5, 1e-9);
+    g_assert_cmpfloat_with_epsilon(stats.variance, (1002.0 * 1002.0 - 1) / 12, 1e-6);
+    g_assert_cmpfloat(stats.min, ==, 0.0);
+    g_assert_cmpfloat(stats.max, ==, 1001.0);
+
+    sooshi_node_stats_reset(state, ch2);
+    sooshi_node_stats_add_block(state, ch2, block, 3);
+    g_assert_true(sooshi_node_stats_get(state, ch2, &stats));
+    g_assert_cmpuint(stats.count, ==, 3);
+    g_assert_cmpfloat_with_epsilon(stats.mean, 2.0, 1e-9);
+}
+
+static void
+test_history(StateWrapper *wrapper, gconstpointer user_data)
+{
+    SooshiState *state = wrapper->state;
+    SooshiHistoryView view;
+
+    SooshiNode *node = sooshi_node_find(state, "CH1:VALUE", NULL);
+    g_assert_true(sooshi_node_history_enable(state, node, 8));
+
+    // 10 values 1ms apart overflow the ring, it keeps 2..9
+    for (guint i = 0; i < 10; ++i)
+    {
+        sooshi_node_set_value(state, node, g_variant_new_double(i), FALSE);
+        node->last_update = 1000 * (i + 1);
+        sooshi_history_on_value(state, node);
+    }
+
+    // The last 5 values wrap around the end of the ring
+    g_assert_cmpuint(sooshi_node_history_last(state, node, 5, &view), ==, 5);
+    g_assert_cmpuint(view.first_length, ==, 3);
+    g_assert_cmpuint(view.second_length, ==, 2);
+
+    for (guint i = 0; i < 5; ++i)
+        g_assert_cmpfloat(sooshi_history_view_get(&view, i)->value, ==, 5 + i);
+    g_assert_null(sooshi_history_view_get(&view, 5));
+
+    g_assert_cmpuint(sooshi_node_history_last(state, node, 100, &view), ==, 8);
+    g_assert_cmpfloat(sooshi_history_view_get(&view, 0)->value, ==, 2.0);
+
+    // Values 3 to 6 by time, both ends included
+    g_assert_cmpuint(sooshi_node_history_between(state, node, 4000, 7000, &view), ==, 4);
+    g_assert_cmpfloat(sooshi_history_view_get(&view, 0)->value, ==, 3.0);
+    g_assert_cmpint(sooshi_history_view_get(&view, 3)->timestamp, ==, 7000);
+
+    g_assert_cmpuint(sooshi_node_history_between(state, node, 0, 2000, &view), ==, 0);
+}
+
+static void
+test_archive_remove(const gchar *path)
+{
+    GDir *dir = g_dir_open(path, 0, NULL);
+    const gchar *name;
+
+    while ((name = g_dir_read_name(dir)) != NULL)
+    {
+        gchar *file = g_build_filename(path, name, NULL);
+        g_remove(file);
+        g_free(file);
+    }
+
+    g_dir_close(dir);
+    g_rmdir(path);
+}
+
+static void
+test_archive_feed(SooshiState *state, SooshiNode *node, gdouble value, gint64 timestamp)
+{
+    sooshi_node_set_value(state, node, g_variant_new_double(value), FALSE);
+    node->last_update = timestamp;
+    sooshi_node_notify_subscribers(state, node);
+}
+
+static void
+test_archive(StateWrapper *wrapper, gconstpointer user_data)
+{
+    SooshiState *state = wrapper->state;
+    const gchar *nodes[] = { "CH1:VALUE", "CH2:VALUE", NULL };
+    sooshi_error_t error;
+
+    SooshiNode *ch1 = sooshi_node_find(state, "CH1:VALUE", NULL);
+    SooshiNode *ch2 = sooshi_node_find(state, "CH2:VALUE", NULL);
+
+    gchar *path = g_dir_make_tmp("sooshi-XXXXXX", NULL);
+    g_assert_nonnull(path);
+
+    // 1200 rows 1ms apart span three chunks of 512
+    SooshiArchiver *archiver = sooshi_archiver_new(state, path, nodes, 512, 0, &error);
+    g_assert_cmpint(error, ==, SOOSHI_ERROR_SUCCESS);
+    archiver->clock_offset = 0;
+
+    for (guint i = 0; i < 1200; ++i)
+    {
+        test_archive_feed(state, ch1, i, 1000 * (i + 1));
+        test_archive_feed(state, ch2, -(gdouble)i, 1000 * (i + 1));
+    }
+
+    sooshi_archiver_free(archiver);
+
+    SooshiArchive *archive = sooshi_archive_open(path, &error);
+    g_assert_cmpint(error, ==, SOOSHI_ERROR_SUCCESS);
+    g_assert_cmpuint(archive->columns, ==, 2);
+    g_assert_cmpstr(archive->names[1], ==, "CH2:VALUE");
+    g_assert_cmpuint(archive->rows, ==, 1200);
+    g_assert_cmpuint(archive->chunks, ==, 3);
+    g_assert_cmpfloat(archive->values[0][1000], ==, 1000.0);
+    g_assert_cmpfloat(archive->values[1][1000], ==, -1000.0);
+
+    // 100ms to 199ms, both ends included, crossing into the second chunk
+    guint64 first = 0;
+    g_assert_cmpuint(sooshi_archive_range(archive, 100000, 199000, &first), ==, 100);
+    g_assert_cmpuint(first, ==, 99);
+    g_assert_cmpint(archive->timestamps[first], ==, 100000);
+    g_assert_cmpuint(sooshi_archive_find(archive, 513500), ==, 513);
+    g_assert_cmpuint(sooshi_archive_range(archive, 2000000, 3000000, NULL), ==, 0);
+    sooshi_archive_close(archive);
+
+    // Appending picks up after the last row, a repeated value leaves a gap
+    archiver = sooshi_archiver_new(state, path, nodes, 0, 0, &error);
+    g_assert_cmpint(error, ==, SOOSHI_ERROR_SUCCESS);
+    archiver->clock_offset = 0;
+
+    test_archive_feed(state, ch1, 1.5, 2000000);
+    test_archive_feed(state, ch1, 2.5, 2001000);
+    sooshi_archiver_free(archiver);
+
+    archive = sooshi_archive_open(path, NULL);
+    g_assert_cmpuint(archive->rows, ==, 1202);
+    g_assert_cmpfloat(archive->values[0][1200], ==, 1.5);
+    g_assert_true(isnan(archive->values[1][1200]));
+    g_assert_cmpuint(sooshi_archive_find(archive, 2000500), ==, 1201);
+    sooshi_archive_close(archive);
+
+    test_archive_remove(path);
+    g_free(path);
+}
+
+static void
+test_archive_commit(StateWrapper *wrapper, gconstpointer user_data)
+{
+    SooshiState *state = wrapper->state;
+    const gchar *nodes[] = { "CH1:VALUE", "CH2:VALUE", NULL };
+    sooshi_error_t error;
+
+    SooshiNode *ch1 = sooshi_node_find(state, "CH1:VALUE", NULL);
+    SooshiNode *ch2 = sooshi_node_find(state, "CH2:VALUE", NULL);
+
+    gchar *path = g_dir_make_tmp("sooshi-XXXXXX", NULL);
+    g_assert_nonnull(path);
+
+    // Rows 508 to 519 share a timestamp, the second chunk starts in the middle of them
+    SooshiArchiver *archiver = sooshi_archiver_new(state, path, nodes, 512, 0, &error);
+    g_assert_cmpint(error, ==, SOOSHI_ERROR_SUCCESS);
+    archiver->clock_offset = 0;
+
+    for (guint i = 0; i < 600; ++i)
+    {
+        gint64 timestamp = (i >= 508 && i < 520) ? 509000 : 1000 * (i + 1);
+
+        test_archive_feed(state, ch1, i, timestamp);
+        test_archive_feed(state, ch2, i, timestamp);
+    }
+
+    sooshi_archiver_free(archiver);
+
+    SooshiArchive *archive = sooshi_archive_open(path, &error);
+    g_assert_cmpint(error, ==, SOOSHI_ERROR_SUCCESS);
+    g_assert_cmpuint(archive->rows, ==, 600);
+    g_assert_cmpint(archive->index[1], ==, 509000);
+    g_assert_cmpuint(sooshi_archive_find(archive, 509000), ==, 508);
+    g_assert_cmpuint(sooshi_archive_range(archive, 509000, 509000, NULL), ==, 12);
+    sooshi_archive_close(archive);
+
+    // Tear the newest of the two commit slots, see the format in archive.c
+    gchar *meta_path = g_build_filename(path, "meta", NULL);
+    gchar *meta = NULL;
+    gsize length = 0;
+    g_assert_true(g_file_get_contents(meta_path, &meta, &length, NULL));
+
+    guint64 slots[2][3];
+    memcpy(slots, meta + 24, sizeof(slots));
+    guint newest = slots[1][0] > slots[0][0] ? 1 : 0;
+    g_assert_cmpuint(slots[newest][1], ==, 600);
+    g_assert_cmpuint(slots[!newest][1], ==, 512);
+
+    meta[24 + newest * 24 + 8] ^= 0xff;
+    g_assert_true(g_file_set_contents(meta_path, meta, length, NULL));
+
+    // Only the older commit is left, appending continues from there
+    archive = sooshi_archive_open(path, &error);
+    g_assert_cmpint(error, ==, SOOSHI_ERROR_SUCCESS);
+    g_assert_cmpuint(archive->rows, ==, 512);
+    sooshi_archive_close(archive);
+
+    archiver = sooshi_archiver_new(state, path, nodes, 0, 0, &error);
+    g_assert_cmpint(error, ==, SOOSHI_ERROR_SUCCESS);
+    archiver->clock_offset = 0;
+
+    test_archive_feed(state, ch1, 1.5, 700000);
+    test_archive_feed(state, ch2, 2.5, 700000);
+    sooshi_archiver_free(archiver);
+
+    archive = sooshi_archive_open(path, &error);
+    g_assert_cmpint(error, ==, SOOSHI_ERROR_SUCCESS);
+    g_assert_cmpuint(archive->rows, ==, 513);
+    g_assert_cmpint(archive->timestamps[512], ==, 700000);
+    g_assert_cmpfloat(archive->values[1][512], ==, 2.5);
+    sooshi_archive_close(archive);
+
+    g_free(meta);
+    g_free(meta_path);
+    test_archive_remove(path);
+    g_free(path);
+}
+
+// Compares the envelope of column 0 with the raw rows of each pixel
+static void
+test_archive_check_envelope(const SooshiArchive *archive, gint64 from, gint64 to, guint width)
+{
+    SooshiEnvelope *envelope = g_new(SooshiEnvelope, width);
+    g_assert_cmpuint(sooshi_archive_envelope(archive, 0, from, to, width, envelope), ==, width);
+
+    gdouble span = (gdouble)to - from + 1;
+    guint64 first = sooshi_archive_find(archive, from);
+
+    for (guint pixel = 0; pixel < width; ++pixel)
+    {
+        gint64 last = pixel + 1 == width ? to : from + (gint64)(span * (pixel + 1) / width) - 1;
+        guint64 end = sooshi_archive_find(archive, last + 1);
+        gdouble min = G_MAXDOUBLE, max = -G_MAXDOUBLE, sum = 0;
+        guint64 count = 0;
+
+        for (guint64 row = first; row < end; ++row)
+        {
+            gdouble value = archive->values[0][row];
+
+            if (isnan(value))
+                continue;
+
+            min = MIN(min, value);
+            max = MAX(max, value);
+            sum += value;
+            count++;
+        }
+
+        g_assert_cmpuint(envelope[pixel].count, ==, count);
+        g_assert_cmpfloat(envelope[pixel].min, ==, min);
+        g_assert_cmpfloat(envelope[pixel].max, ==, max);
+        g_assert_cmpfloat_with_epsilon(envelope[pixel].mean, sum / count, 1e-9);
+
+        first = end;
+    }
+
+    g_free(envelope);
+}
+
+static void
+test_archive_envelope(StateWrapper *wrapper, gconstpointer user_data)
+{
+    SooshiState *state = wrapper->state;
+    const gchar *nodes[] = { "CH1:VALUE", NULL };
+    SooshiEnvelope envelope[7];
+
+    SooshiNode *node = sooshi_node_find(state, "CH1:VALUE", NULL);
+    gchar *path = g_dir_make_tmp("sooshi-XXXXXX", NULL);
+
+    SooshiArchiver *archiver = sooshi_archiver_new(state, path, nodes, 512, 0, NULL);
+    g_assert_nonnull(archiver);
+    archiver->clock_offset = 0;
+
+    // 5000 rows 1ms apart, a sawtooth with a gap every 1000 rows
+    for (guint i = 0; i < 5000; ++i)
+        test_archive_feed(state, node, i % 1000 == 500 ? NAN : i % 37, 1000 * (i + 1));
+
+    sooshi_archiver_free(archiver);
+
+    SooshiArchive *archive = sooshi_archive_open(path, NULL);
+    g_assert_cmpuint(archive->pyramid_buckets[0], ==, 312);
+    g_assert_cmpuint(archive->pyramid_buckets[1], ==, 19);
+    g_assert_cmpuint(archive->pyramid_buckets[2], ==, 1);
+    g_assert_cmpuint(archive->pyramid_buckets[3], ==, 0);
+
+    // 7 pixels over 1ms..4999ms, against the raw rows of each
+    test_archive_check_envelope(archive, 1000, 4999000, 7);
+
+    // Pixels without rows are empty
+    g_assert_cmpuint(sooshi_archive_envelope(archive, 0, 6000000, 6999999, 1, envelope), ==, 1);
+    g_assert_cmpuint(envelope[0].count, ==, 0);
+    g_assert_true(isnan(envelope[0].min));
+
+    sooshi_archive_close(archive);
+
+    test_archive_remove(path);
+    g_free(path);
+}
+
+// Archives from before the pyramid, or whose pyramid was deleted, get it
+// built again when appended to
+static void
+test_archive_backfill(StateWrapper *wrapper, gconstpointer user_data)
+{
+    SooshiState *state = wrapper->state;
+    const gchar *nodes[] = { "CH1:VALUE", NULL };
+
+    SooshiNode *node = sooshi_node_find(state, "CH1:VALUE", NULL);
+    gchar *path = g_dir_make_tmp("sooshi-XXXXXX", NULL);
+
+    SooshiArchiver *archiver = sooshi_archiver_new(state, path, nodes, 512, 0, NULL);
+    g_assert_nonnull(archiver);
+    archiver->clock_offset = 0;
+
+    for (guint i = 0; i < 5000; ++i)
+        test_archive_feed(state, node, i % 1000 == 500 ? NAN : i % 37, 1000 * (i + 1));
+
+    sooshi_archiver_free(archiver);
+
+    for (guint level = 1; level <= SOOSHI_PYRAMID_LEVELS; ++level)
+    {
+        gchar *name = g_strdup_printf("pyramid-%u", level);
+        gchar *file = g_build_filename(path, name, NULL);
+        g_assert_cmpint(g_remove(file), ==, 0);
+        g_free(file);
+        g_free(name);
+    }
+
+    archiver = sooshi_archiver_new(state, path, nodes, 512, 0, NULL);
+    g_assert_nonnull(archiver);
+    archiver->clock_offset = 0;
+
+    for (guint i = 5000; i < 6000; ++i)
+        test_archive_feed(state, node, i % 23, 1000 * (i + 1));
+
+    sooshi_archiver_free(archiver);
+
+    SooshiArchive *archive = sooshi_archive_open(path, NULL);
+    g_assert_cmpuint(archive->rows, ==, 6000);
+    g_assert_cmpuint(archive->pyramid_buckets[0], ==, 375);
+    g_assert_cmpuint(archive->pyramid_buckets[1], ==, 23);
+    g_assert_cmpuint(archive->pyramid_buckets[2], ==, 1);
+
+    // Across the old rows and the appended ones, and with one pixel mostly
+    // made of the rebuilt upper levels
+    test_archive_check_envelope(archive, 1000, 6000000, 9);
+    test_archive_check_envelope(archive, 1000, 6000000, 1);
+
+    sooshi_archive_close(archive);
+
+    test_archive_remove(path);
+    g_free(path);
+}
+
+static void
+test_archive_compress(void)
+{
+    gint64 timestamps[2500];
+    gdouble ch1[2500], ch2[2500];
+    const gdouble *values[] = { ch1, ch2 };
+    gchar *names[] = { "CH1:VALUE", "CH2:VALUE", NULL };
+
+    // A steady rate with a gap, repeated and noisy values, NaN and -0
+    for (guint i = 0; i < G_N_ELEMENTS(timestamps); ++i)
+    {
+        timestamps[i] = 1000 * (i + 1) + (i % 3) + (i >= 2000 ? 3600000000 : 0);
+        ch1[i] = (float)(1.5 + (i * 7919 % 100) * 1e-5);
+        ch2[i] = i % 100 == 0 ? NAN : i % 10 == 0 ? -0.0 : 230.0;
+    }
+
+    SooshiArchive archive = { 0 };
+    archive.columns = 2;
+    archive.names = names;
+    archive.rows = G_N_ELEMENTS(timestamps);
+    archive.timestamps = timestamps;
+    archive.values = values;
+
+    gchar *path = NULL;
+    gint fd = g_file_open_tmp("sooshi-XXXXXX.cz", &path, NULL);
+    g_assert_cmpint(fd, >=, 0);
+    g_close(fd, NULL);
+
+    g_assert_cmpint(sooshi_archive_compress(&archive, path, 1000), ==, SOOSHI_ERROR_SUCCESS);
+
+    sooshi_error_t error;
+    SooshiCompressedArchive *compressed = sooshi_compressed_archive_open(path, &error);
+    g_assert_cmpint(error, ==, SOOSHI_ERROR_SUCCESS);
+    g_assert_cmpuint(compressed->rows, ==, 2500);
+    g_assert_cmpuint(compressed->blocks, ==, 3);
+    g_assert_cmpstr(compressed->names[0], ==, "CH1:VALUE");
+
+    // Blocks decode on their own, in any order, bit for bit
+    gint64 decoded_timestamps[1000];
+    gdouble decoded_ch1[1000], decoded_ch2[1000];
+    gdouble *decoded[] = { decoded_ch1, decoded_ch2 };
+
+    for (gint block = 2; block >= 0; --block)
+    {
+        guint rows = sooshi_compressed_archive_decode(compressed, block, decoded_timestamps, decoded);
+        g_assert_cmpuint(rows, ==, block == 2 ? 500 : 1000);
+
+        g_assert_cmpmem(decoded_timestamps, rows * sizeof(gint64), timestamps + block * 1000, rows * sizeof(gint64));
+        g_assert_cmpmem(decoded_ch1, rows * sizeof(gdouble), ch1 + block * 1000, rows * sizeof(gdouble));
+        g_assert_cmpmem(decoded_ch2, rows * sizeof(gdouble), ch2 + block * 1000, rows * sizeof(gdouble));
+    }
+
+    g_assert_cmpuint(sooshi_compressed_archive_find(compressed, 1500000), ==, 1);
+    g_assert_cmpuint(sooshi_compressed_archive_find(compressed, 3000000), ==, 2);
+    g_assert_cmpuint(sooshi_compressed_archive_find(compressed, G_MAXINT64), ==, 3);
+
+    // Twice the raw size is the least to expect from this
+    g_assert_cmpuint(compressed->length * 2, <, sizeof(timestamps) + sizeof(ch1) + sizeof(ch2));
+
+    sooshi_compressed_archive_close(compressed);
+    g_remove(path);
+    g_free(path);
+}
+
+static void
+test_subscribe_compressed_handler(SooshiState *state, SooshiNode *node, const SooshiSample *point, gpointer user_data)
+{
+    g_array_append_val((GArray*)user_data, *point);
+}
+
+static void
+test_subscribe_compressed(StateWrapper *wrapper, gconstpointer user_data)
+{
+    SooshiState *state = wrapper->state;
+    GArray *points = g_array_new(FALSE, FALSE, sizeof(SooshiSample));
+    SooshiCompression compression = { 0.01, 0, 0 };
+
+    SooshiNode *node = sooshi_node_find(state, "CH1:VALUE", NULL);
+    g_assert_cmpuint(sooshi_node_subscribe_compressed(state, node, &compression, test_subscribe_compressed_handler, points), >, 0);
+
+    // A ramp, a plateau and a jump: only the corners are retained
+    gint64 timestamps[201];
+    gdouble values[201];
+    for (guint i = 0; i < G_N_ELEMENTS(values); ++i)
+    {
+        timestamps[i] = 1000 * (i + 1);
+        values[i] = i < 100 ? i : i < 200 ? 99 : 150;
+        test_archive_feed(state, node, values[i], timestamps[i]);
+    }
+
+    g_assert_cmpuint(points->len, ==, 3);
+    g_assert_cmpint(g_array_index(points, SooshiSample, 1).timestamp, ==, 100000);
+    g_assert_cmpfloat(g_array_index(points, SooshiSample, 1).value, ==, 99.0);
+    g_assert_cmpint(g_array_index(points, SooshiSample, 2).timestamp, ==, 200000);
+
+    // Up to the last retained point, interpolation gives back every value within the tolerance
+    gint64 retained_timestamps[3];
+    gdouble retained_values[3];
+    for (guint i = 0; i < points->len; ++i)
+    {
+        retained_timestamps[i] = g_array_index(points, SooshiSample, i).timestamp;
+        retained_values[i] = g_array_index(points, SooshiSample, i).value;
+    }
+
+    for (guint i = 0; i < 200; ++i)
+    {
+        gdouble value = sooshi_compression_interpolate(retained_timestamps, retained_values, 3, timestamps[i]);
+        g_assert_cmpfloat_with_epsilon(value, values[i], compression.absolute);
+    }
+
+    g_assert_true(isnan(sooshi_compression_interpolate(retained_timestamps, retained_values, 3, 0)));
+
+    g_array_unref(points);
+}
+
+static void
+test_capture_replay(StateWrapper *wrapper, gconstpointer user_data)
+{
+    SooshiState *state = wrapper->state;
+    guint8 sequence = 0;
+
+    gchar *path = NULL;
+    gint fd = g_file_open_tmp("sooshi-XXXXXX.cap", &path, NULL);
+    g_assert_cmpint(fd, >=, 0);
+    g_close(fd, NULL);
+
+    // Record a session: the tree in notification sized pieces, the CRC echo and some samples
+    g_assert_cmpint(sooshi_capture_start(state, path), ==, SOOSHI_ERROR_SUCCESS);
+
+    for (gsize offset = 0; offset < sizeof(sooshi_fixture_tree); offset += 19)
+        sooshi_receive_notification(state, sequence++, sooshi_fixture_tree + offset,
+                MIN(19, sizeof(sooshi_fixture_tree) - offset));
+
+    g_assert_nonnull(state->root_node);
+
+    guint8 echo[] = { 0x00, state->tree_crc, state->tree_crc >> 8, state->tree_crc >> 16, state->tree_crc >> 24 };
+    sooshi_receive_notification(state, sequence++, echo, sizeof(echo));
+    g_assert_true(state->initialized);
+
+    SooshiNode *node = sooshi_node_find(state, "CH1:VALUE", NULL);
+    g_assert_nonnull(node);
+
+    for (guint i = 1; i <= 100; ++i)
+    {
+        float value = i;
+        guint8 frame[5] = { node->op_code };
+        memcpy(frame + 1, &value, sizeof(value));
+        sooshi_receive_notification(state, sequence++, frame, sizeof(frame));
+    }
+
+    sooshi_capture_stop(state);
+
+    // Replaying it into a fresh state must end up in the same place
+    SooshiState *replay = sooshi_state_new(NULL);
+    guint records = 0;
+    g_assert_cmpint(sooshi_replay(replay, path, 0, &records), ==, SOOSHI_ERROR_SUCCESS);
+    g_assert_cmpuint(records, ==, sequence);
+    g_assert_true(replay->initialized);
+    g_assert_cmpuint(replay->tree_crc, ==, state->tree_crc);
+
+    SooshiNode *replayed = sooshi_node_find(replay, "CH1:VALUE", NULL);
+    g_assert_cmpfloat(g_variant_get_double(replayed->value), ==, 100.0);
+
+    SooshiMetrics metrics;
+    sooshi_get_metrics(replay, &metrics);
+    g_assert_cmpuint(metrics.frames[replayed->op_code], ==, 100);
+
+    sooshi_state_delete(replay);
+    g_remove(path);
+    g_free(path);
+}
 
 int
 main(int argc, char *argv[])
@@ -345,6 +1943,9 @@ main(int argc, char *argv[])
     g_test_init(&argc, &argv, NULL);
     g_test_bug_base("https://github.com/ghtyrant/libsooshi/issues/");
 
+    // Every state below talks to this instead of the real BlueZ
+    mock_bluez = mock_bluez_new();
+
     g_test_add("/parser/chooser", StateWrapper, NULL,
             state_wrapper_set_up, test_parse_chooser, state_wrapper_tear_down);
 
@@ -378,10 +1979,99 @@ main(int argc, char *argv[])
     g_test_add("/parser/bin", StateWrapper, NULL,
             state_wrapper_set_up, test_parse_bin, state_wrapper_tear_down);
 
-    /*
+    g_test_add("/transaction/redundant", StateWrapper, NULL,
+            state_wrapper_set_up, test_transaction_redundant, state_wrapper_tear_down);
+
+    g_test_add("/transaction/timeout", StateWrapper, NULL,
+            state_wrapper_set_up_tree, test_transaction_timeout, state_wrapper_tear_down);
+
+    g_test_add("/transaction/echo", StateWrapper, NULL,
+            state_wrapper_set_up_tree, test_transaction_echo, state_wrapper_tear_down);
+
+    g_test_add("/transaction/abort", StateWrapper, NULL,
+            state_wrapper_set_up_tree, test_transaction_abort, state_wrapper_tear_down);
+
+    g_test_add("/cache/fresh", StateWrapper, NULL,
+            state_wrapper_set_up, test_read_cached_fresh, state_wrapper_tear_down);
+
+    g_test_add("/request/coalesce", StateWrapper, NULL,
+            state_wrapper_set_up_tree, test_request_coalesce, state_wrapper_tear_down);
+
+    g_test_add("/request/timeout", StateWrapper, NULL,
+            state_wrapper_set_up_tree, test_request_timeout, state_wrapper_tear_down);
+
+    g_test_add("/request/written", StateWrapper, NULL,
+            state_wrapper_set_up_tree, test_request_written, state_wrapper_tear_down);
+
+    g_test_add("/request/lost", StateWrapper, NULL,
+            state_wrapper_set_up_tree, test_request_lost, state_wrapper_tear_down);
+
+    g_test_add("/request/unsolicited", StateWrapper, NULL,
+            state_wrapper_set_up_tree, test_request_unsolicited, state_wrapper_tear_down);
+
+    g_test_add_func("/histogram/percentile", test_histogram_percentile);
+
+    g_test_add_func("/e2e/startup", test_end_to_end);
+
+    g_test_add_func("/state/external_loop", test_external_loop);
+
+    g_test_add_func("/e2e/reconnect", test_reconnect);
+    g_test_add_func("/e2e/write_failure", test_write_failure);
+
+    g_test_add_data_func("/manager/balance", GINT_TO_POINTER(FALSE), test_manager);
+    g_test_add_data_func("/manager/rebalance", GINT_TO_POINTER(TRUE), test_manager);
+    g_test_add_func("/manager/reload", test_manager_reload);
+
     g_test_add("/parser/tree", StateWrapper, NULL,
             state_wrapper_set_up, test_parse_tree, state_wrapper_tear_down);
-    */
 
-    return g_test_run();
+    g_test_add("/parser/tree_reload", StateWrapper, NULL,
+            state_wrapper_set_up_tree, test_parse_tree_reload, state_wrapper_tear_down);
+
+    g_test_add("/node/interest", StateWrapper, NULL,
+            state_wrapper_set_up_tree, test_interest, state_wrapper_tear_down);
+
+    g_test_add("/node/lazy_fetch", StateWrapper, NULL,
+            state_wrapper_set_up_tree, test_lazy_fetch, state_wrapper_tear_down);
+
+    g_test_add("/node/subscribe", StateWrapper, NULL,
+            state_wrapper_set_up_tree, test_subscribe, state_wrapper_tear_down);
+
+    g_test_add("/node/subscribe_unsubscribe", StateWrapper, NULL,
+            state_wrapper_set_up_tree, test_subscribe_unsubscribe, state_wrapper_tear_down);
+
+    g_test_add("/node/subscribe_options", StateWrapper, NULL,
+            state_wrapper_set_up_tree, test_subscribe_options, state_wrapper_tear_down);
+
+    g_test_add("/node/stats", StateWrapper, NULL,
+            state_wrapper_set_up_tree, test_stats, state_wrapper_tear_down);
+
+    g_test_add("/node/history", StateWrapper, NULL,
+            state_wrapper_set_up_tree, test_history, state_wrapper_tear_down);
+
+    g_test_add("/archive/roundtrip", StateWrapper, NULL,
+            state_wrapper_set_up_tree, test_archive, state_wrapper_tear_down);
+
+    g_test_add("/archive/commit", StateWrapper, NULL,
+            state_wrapper_set_up_tree, test_archive_commit, state_wrapper_tear_down);
+
+    g_test_add("/archive/envelope", StateWrapper, NULL,
+            state_wrapper_set_up_tree, test_archive_envelope, state_wrapper_tear_down);
+
+    g_test_add("/archive/backfill", StateWrapper, NULL,
+            state_wrapper_set_up_tree, test_archive_backfill, state_wrapper_tear_down);
+
+    g_test_add_func("/archive/compress", test_archive_compress);
+
+    g_test_add("/node/subscribe_compressed", StateWrapper, NULL,
+            state_wrapper_set_up_tree, test_subscribe_compressed, state_wrapper_tear_down);
+
+    g_test_add("/capture/replay", StateWrapper, NULL,
+            state_wrapper_set_up, test_capture_replay, state_wrapper_tear_down);
+
+    int result = g_test_run();
+
+    mock_bluez_free(mock_bluez);
+
+    return result;
 }